@@ -0,0 +1,499 @@
+/*
+ * bench.c - Throughput and latency of bufrw against stdio, read/write and mmap
+ *
+ * Project: bufrw
+ * License: MIT
+ * Author: [reslaid32]
+ *
+ * Description:
+ * Moves the same bytes through every backend for each combination of
+ * medium (tmpfs, disk, pipe), access pattern (sequential write,
+ * sequential read, random read), buffer size and element size, and
+ * prints one CSV row per run: throughput, per-call latency percentiles
+ * and the read and write system calls the run made. Run with -h for the
+ * options; make bench runs it with BENCH_ARGS.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../include/bufrw.h"
+
+/* Most calls a single run makes, so that 1-byte elements finish. */
+#define BENCH_MAX_CALLS (1u << 22)
+
+/* Most calls of a random read run, each of which may refill a buffer. */
+#define BENCH_MAX_RAND_CALLS (1u << 14)
+
+/* Elements smaller than this are timed in groups adding up to it. */
+#define BENCH_GROUP_BYTES 4096
+
+/* Most latency samples kept per run. */
+#define BENCH_MAX_SAMPLES (1u << 20)
+
+enum { MEDIUM_TMPFS, MEDIUM_DISK, MEDIUM_PIPE };
+enum { OP_WRITE, OP_READ, OP_RANDREAD };
+enum { BE_STDIO, BE_RW, BE_MMAP, BE_BUFRW };
+
+static const char *medium_names[] = { "tmpfs", "disk", "pipe" };
+static const char *op_names[] = { "write", "read", "randread" };
+static const char *backend_names[] = { "stdio", "rw", "mmap", "bufrw" };
+
+/* Buffer sizes swept for the buffered backends; 0 is the bfbestbufsz pick. */
+static const size_t buffer_sizes[] = { 4096, 65536, 1 << 20, 0 };
+
+/* Element sizes swept, 1 B to 64 MiB. */
+static const size_t elem_sizes[] = { 1, 16, 256, 4096, 65536, 1 << 20, 16 << 20, 64 << 20 };
+
+typedef struct {
+    size_t total;           // bytes per run
+    const char *disk_dir;   // directory on a real disk
+    int media[3];           // media to run on
+    int quick;              // a reduced sweep
+} bench_opts_t;
+
+/* A stream of one backend. */
+typedef struct {
+    int backend;
+    int fd;
+    FILE *fp;
+    char *stdio_buf;
+    bufrw_t *ctx;
+    char *map;
+    size_t map_len;
+    size_t pos;
+} bench_io_t;
+
+/* Read and write calls of the helper thread of a pipe run. */
+static unsigned long long helper_syscalls;
+
+/* Read calls syscalls_now makes itself. */
+static unsigned long long probe_syscalls;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* Read and write system calls of the process so far, from /proc/self/io. */
+static void syscalls_now(unsigned long long *rd, unsigned long long *wr) {
+    *rd = *wr = 0;
+    FILE *f = fopen("/proc/self/io", "r");
+    if (!f) {
+        return;
+    }
+    char line[128];
+    while (fgets(line, sizeof(line), f)) {
+        sscanf(line, "syscr: %llu", rd);
+        sscanf(line, "syscw: %llu", wr);
+    }
+    fclose(f);
+}
+
+static int io_open(bench_io_t *io, int backend, int fd, size_t buffer_sz, int writing) {
+    memset(io, 0, sizeof(*io));
+    io->backend = backend;
+    io->fd = fd;
+    switch (backend) {
+    case BE_STDIO:
+        io->fp = fdopen(dup(fd), writing ? "w" : "r");
+        if (!io->fp) {
+            return -1;
+        }
+        io->stdio_buf = (char *)malloc(buffer_sz);
+        return io->stdio_buf && setvbuf(io->fp, io->stdio_buf, _IOFBF, buffer_sz) == 0 ? 0 : -1;
+    case BE_RW:
+        return 0;
+    case BE_MMAP: {
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            return -1;
+        }
+        io->map_len = (size_t)st.st_size;
+        io->map = (char *)mmap(NULL, io->map_len, PROT_READ, MAP_SHARED, fd, 0);
+        return io->map == MAP_FAILED ? -1 : 0;
+    }
+    default:
+        io->ctx = bfopen_fd(fd, buffer_sz, buffer_sz);
+        return io->ctx ? 0 : -1;
+    }
+}
+
+static size_t io_read(bench_io_t *io, char *buf, size_t n) {
+    switch (io->backend) {
+    case BE_STDIO:
+        return fread(buf, 1, n, io->fp);
+    case BE_RW: {
+        size_t done = 0;
+        while (done < n) {
+            ssize_t got = read(io->fd, buf + done, n - done);
+            if (got <= 0) {
+                break;
+            }
+            done += (size_t)got;
+        }
+        return done;
+    }
+    case BE_MMAP: {
+        size_t k = io->map_len - io->pos < n ? io->map_len - io->pos : n;
+        memcpy(buf, io->map + io->pos, k);
+        io->pos += k;
+        return k;
+    }
+    default:
+        return bfcread(io->ctx, buf, 1, n);
+    }
+}
+
+static size_t io_write(bench_io_t *io, const char *buf, size_t n) {
+    switch (io->backend) {
+    case BE_STDIO:
+        return fwrite(buf, 1, n, io->fp);
+    case BE_RW: {
+        size_t done = 0;
+        while (done < n) {
+            ssize_t put = write(io->fd, buf + done, n - done);
+            if (put <= 0) {
+                break;
+            }
+            done += (size_t)put;
+        }
+        return done;
+    }
+    default:
+        return bfcwrite(io->ctx, buf, 1, n);
+    }
+}
+
+static int io_seek(bench_io_t *io, size_t off) {
+    switch (io->backend) {
+    case BE_STDIO:
+        return fseek(io->fp, (long)off, SEEK_SET);
+    case BE_RW:
+        return lseek(io->fd, (off_t)off, SEEK_SET) < 0 ? -1 : 0;
+    case BE_MMAP:
+        io->pos = off;
+        return 0;
+    default:
+        return bfcseek(io->ctx, (long)off, SEEK_SET);
+    }
+}
+
+static int io_close(bench_io_t *io) {
+    int ret = 0;
+    switch (io->backend) {
+    case BE_STDIO:
+        ret = fclose(io->fp);
+        free(io->stdio_buf);
+        break;
+    case BE_RW:
+        break;
+    case BE_MMAP:
+        munmap(io->map, io->map_len);
+        break;
+    default:
+        ret = bfclose(io->ctx);
+        break;
+    }
+    return ret;
+}
+
+/* The other end of a pipe run: drains or feeds total bytes. */
+typedef struct {
+    int fd;
+    int feed;
+    size_t total;
+} pipe_peer_t;
+
+static void *pipe_peer(void *arg) {
+    pipe_peer_t *peer = (pipe_peer_t *)arg;
+    static char buf[1 << 16];
+    size_t done = 0;
+    unsigned long long calls = 0;
+    for (;;) {
+        ssize_t n;
+        if (peer->feed) {
+            if (done == peer->total) {
+                break;
+            }
+            n = write(peer->fd, buf, peer->total - done < sizeof(buf) ? peer->total - done : sizeof(buf));
+        } else {
+            n = read(peer->fd, buf, sizeof(buf));   // until the writer closes
+        }
+        calls++;
+        if (n <= 0) {
+            break;
+        }
+        done += (size_t)n;
+    }
+    close(peer->fd);
+    helper_syscalls = calls;
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Fill path with total bytes for the read runs. */
+static int make_file(const char *path, size_t total) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    static char chunk[1 << 20];
+    for (size_t i = 0; i < sizeof(chunk); i++) {
+        chunk[i] = (char)(i * 131);
+    }
+    size_t done = 0;
+    while (done < total) {
+        size_t k = total - done < sizeof(chunk) ? total - done : sizeof(chunk);
+        if (write(fd, chunk, k) != (ssize_t)k) {
+            close(fd);
+            return -1;
+        }
+        done += k;
+    }
+    fsync(fd);
+    close(fd);
+    return 0;
+}
+
+/*
+ * One run: op on medium through backend with buffers of buffer_sz bytes,
+ * elem bytes per call. path is the data file of the medium. Prints its
+ * CSV row.
+ */
+static void run(const bench_opts_t *opts, int medium, int op, int backend, size_t buffer_sz, size_t elem, const char *path, const char *wpath) {
+    size_t calls = opts->total / elem ? opts->total / elem : 1;
+    size_t max_calls = op == OP_RANDREAD ? BENCH_MAX_RAND_CALLS : BENCH_MAX_CALLS;
+    if (calls > max_calls) {
+        calls = max_calls;
+    }
+    size_t bytes = calls * elem;
+
+    int fd = -1;
+    pthread_t peer_thread;
+    pipe_peer_t peer;
+    int pfd[2];
+    if (medium == MEDIUM_PIPE) {
+        if (pipe(pfd) != 0) {
+            return;
+        }
+        peer.feed = op != OP_WRITE;
+        peer.fd = peer.feed ? pfd[1] : pfd[0];
+        peer.total = bytes;
+        fd = peer.feed ? pfd[0] : pfd[1];
+        helper_syscalls = 0;
+        pthread_create(&peer_thread, NULL, pipe_peer, &peer);
+    } else if (op == OP_WRITE) {
+        fd = open(wpath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    } else {
+        fd = open(path, O_RDONLY);
+        if (fd >= 0 && medium == MEDIUM_DISK) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);   // read from the device, not the page cache
+        }
+    }
+    if (fd < 0) {
+        return;
+    }
+
+    // bufrw is left to pick its own size, which is what bfbestbufsz_fd returns.
+    int buffered = backend == BE_STDIO || backend == BE_BUFRW;
+    size_t picked = !buffered ? 0 : buffer_sz ? buffer_sz : bfbestbufsz_fd(fd, bytes);
+    bench_io_t io;
+    char *buf = (char *)malloc(elem);
+    if (!buf || io_open(&io, backend, fd, backend == BE_BUFRW ? buffer_sz : picked, op == OP_WRITE) != 0) {
+        fprintf(stderr, "bench: cannot open %s on %s: %s\n", backend_names[backend], medium_names[medium], strerror(errno));
+        free(buf);
+        close(fd);
+        if (medium == MEDIUM_PIPE) {
+            pthread_join(peer_thread, NULL);   // our end is closed: it stops
+        }
+        return;
+    }
+    memset(buf, 'b', elem);
+
+    // Small elements are timed in groups, the per-call latency being the average.
+    size_t group = elem < BENCH_GROUP_BYTES ? BENCH_GROUP_BYTES / elem : 1;
+    size_t groups = (calls + group - 1) / group;
+    size_t stride = (groups + BENCH_MAX_SAMPLES - 1) / BENCH_MAX_SAMPLES;
+    uint64_t *samples = (uint64_t *)malloc(sizeof(uint64_t) * (groups / stride + 1));
+    size_t nsamples = 0;
+    size_t file_sz = opts->total > elem ? opts->total : elem;
+    unsigned long long rd0, wr0, rd1, wr1;
+    uint64_t seed = 0x9e3779b97f4a7c15ULL;
+    size_t moved = 0;
+
+    syscalls_now(&rd0, &wr0);
+    uint64_t start = now_ns();
+    for (size_t g = 0; g < groups; g++) {
+        uint64_t t0 = now_ns();
+        size_t n = calls - g * group < group ? calls - g * group : group;
+        for (size_t i = 0; i < n; i++) {
+            if (op == OP_RANDREAD) {
+                seed ^= seed << 13;
+                seed ^= seed >> 7;
+                seed ^= seed << 17;
+                io_seek(&io, (size_t)(seed % (file_sz / elem)) * elem);
+            }
+            moved += op == OP_WRITE ? io_write(&io, buf, elem) : io_read(&io, buf, elem);
+        }
+        if (g % stride == 0) {
+            samples[nsamples++] = (now_ns() - t0) / n;
+        }
+    }
+    int closed = io_close(&io);
+    uint64_t elapsed = now_ns() - start;
+
+    if (medium == MEDIUM_PIPE) {
+        close(fd);
+        pthread_join(peer_thread, NULL);
+        fd = -1;
+    }
+    syscalls_now(&rd1, &wr1);
+    unsigned long long syscr = rd1 - rd0 - probe_syscalls, syscw = wr1 - wr0;
+    if (medium == MEDIUM_PIPE) {
+        // Leave out the calls of the other end.
+        if (op == OP_WRITE) {
+            syscr -= helper_syscalls < syscr ? helper_syscalls : syscr;
+        } else {
+            syscw -= helper_syscalls < syscw ? helper_syscalls : syscw;
+        }
+    }
+
+    qsort(samples, nsamples, sizeof(*samples), cmp_u64);
+    double secs = (double)elapsed / 1e9;
+    printf("%s,%s,%s,%zu,%s,%zu,%zu,%.6f,%.1f,%llu,%llu,%llu,%llu%s\n",
+           medium_names[medium], op_names[op], backend_names[backend], picked,
+           !buffered ? "none" : buffer_sz ? "fixed" : "best", elem, moved, secs,
+           secs > 0 ? (double)moved / (1 << 20) / secs : 0.0,
+           (unsigned long long)samples[nsamples / 2], (unsigned long long)samples[nsamples * 99 / 100],
+           syscr, syscw, closed == 0 && moved == bytes ? "" : ",error");
+    fflush(stdout);
+    free(samples);
+    free(buf);
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-s bytes] [-d dir] [-m tmpfs,disk,pipe] [-q]\n"
+            "  -s bytes  bytes per run (default 64 MiB), suffixes k, m, g\n"
+            "  -d dir    directory on a real disk (default .)\n"
+            "  -m media  media to run on (default all)\n"
+            "  -q        quick sweep: fewer buffer and element sizes\n",
+            prog);
+}
+
+static size_t parse_size(const char *s) {
+    char *end;
+    unsigned long long v = strtoull(s, &end, 10);
+    switch (*end) {
+    case 'g': case 'G': v <<= 10; // fall through
+    case 'm': case 'M': v <<= 10; // fall through
+    case 'k': case 'K': v <<= 10; break;
+    default: break;
+    }
+    return (size_t)v;
+}
+
+int main(int argc, char **argv) {
+    bench_opts_t opts = { .total = 64 << 20, .disk_dir = ".", .media = { 1, 1, 1 } };
+    int c;
+    while ((c = getopt(argc, argv, "s:d:m:qh")) != -1) {
+        switch (c) {
+        case 's':
+            opts.total = parse_size(optarg);
+            break;
+        case 'd':
+            opts.disk_dir = optarg;
+            break;
+        case 'm':
+            for (int m = 0; m < 3; m++) {
+                opts.media[m] = strstr(optarg, medium_names[m]) != NULL;
+            }
+            break;
+        case 'q':
+            opts.quick = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return c == 'h' ? 0 : 2;
+        }
+    }
+    if (opts.total == 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    // A pipe whose reader gave up has to fail the write, not kill us.
+    signal(SIGPIPE, SIG_IGN);
+    unsigned long long rd0, wr0, rd1, wr1;
+    syscalls_now(&rd0, &wr0);
+    syscalls_now(&rd1, &wr1);
+    probe_syscalls = rd1 - rd0;
+
+    printf("medium,op,backend,buffer_sz,buffer_pick,elem_sz,bytes,seconds,mib_per_s,p50_ns,p99_ns,syscr,syscw\n");
+    for (int medium = 0; medium < 3; medium++) {
+        if (!opts.media[medium]) {
+            continue;
+        }
+        char path[4096] = "", wpath[4096] = "";
+        if (medium != MEDIUM_PIPE) {
+            const char *dir = medium == MEDIUM_TMPFS ? "/dev/shm" : opts.disk_dir;
+            snprintf(path, sizeof(path), "%s/bufrw_bench.%d", dir, (int)getpid());
+            snprintf(wpath, sizeof(wpath), "%s/bufrw_bench_w.%d", dir, (int)getpid());
+            size_t largest = elem_sizes[sizeof(elem_sizes) / sizeof(*elem_sizes) - 1];
+            if (make_file(path, opts.total > largest ? opts.total : largest) != 0) {
+                fprintf(stderr, "bench: skipping %s: %s: %s\n", medium_names[medium], path, strerror(errno));
+                continue;
+            }
+        }
+
+        for (size_t e = 0; e < sizeof(elem_sizes) / sizeof(*elem_sizes); e++) {
+            size_t elem = elem_sizes[e];
+            if (opts.quick && e % 2 == 1) {
+                continue;
+            }
+            for (int op = 0; op < 3; op++) {
+                if (medium == MEDIUM_PIPE && op == OP_RANDREAD) {
+                    continue;
+                }
+                for (int backend = 0; backend < 4; backend++) {
+                    if (backend == BE_MMAP && (op == OP_WRITE || medium == MEDIUM_PIPE)) {
+                        continue;
+                    }
+                    int buffered = backend == BE_STDIO || backend == BE_BUFRW;
+                    size_t nbuf = buffered ? sizeof(buffer_sizes) / sizeof(*buffer_sizes) : 1;
+                    for (size_t b = 0; b < nbuf; b++) {
+                        if (opts.quick && buffered && b % 2 == 0) {
+                            continue;
+                        }
+                        run(&opts, medium, op, backend, buffered ? buffer_sizes[b] : 0, elem, path, wpath);
+                    }
+                }
+            }
+        }
+        if (medium != MEDIUM_PIPE) {
+            unlink(path);
+            unlink(wpath);
+        }
+    }
+    return 0;
+}
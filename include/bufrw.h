@@ -36,6 +36,11 @@
 
 #include <stdio.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 // virtual export.h
 #if !defined(BUFRW_EXPORT_H_LOADED)
@@ -116,6 +121,8 @@
 
 #endif // BUFRW_EXPORT_H_LOADED
 
+BUFRW_EXTERN_C_BEG
+
 // virtual version.h
 #if !defined(BUFRW_VERSION_H_LOADED)
 #define BUFRW_VERSION_H_LOADED
@@ -138,6 +145,11 @@ BUFRW_PUBLIC_FUNC bufrw_ver_t bfver(void);
  *
  * Reads up to n elements of size bytes from stream into ptr using an internal buffer
  * of size buffer_sz. Returns the number of complete items read.
+ *
+ * The buffer only grows: a smaller buffer_sz than before refills less
+ * without reallocating, and pre-fetched data survives any change.
+ *
+ * The internal buffer is private to the calling thread.
  */
 BUFRW_PUBLIC_FUNC size_t bfread(void *ptr, size_t size, size_t n, size_t buffer_sz, FILE *stream);
 
@@ -146,6 +158,11 @@ BUFRW_PUBLIC_FUNC size_t bfread(void *ptr, size_t size, size_t n, size_t buffer_
  *
  * Writes n elements of size bytes from ptr into stream using an internal buffer
  * of size buffer_sz. Returns the number of complete items written.
+ *
+ * The buffer only grows: a smaller buffer_sz than before flushes sooner
+ * without reallocating.
+ *
+ * The internal buffer is private to the calling thread.
  */
 BUFRW_PUBLIC_FUNC size_t bfwrite(const void *ptr, size_t size, size_t n, size_t buffer_sz, FILE *stream);
 
@@ -160,7 +177,8 @@ BUFRW_PUBLIC_FUNC void bfflush(FILE *stream);
  * bfseek: buffered fseek.
  *
  * Before performing the actual fseek, flush any pending write data and adjust
- * the read buffer if data has been pre-fetched.
+ * the read buffer if data has been pre-fetched. Targets within the pre-fetched
+ * data are reached without an fseek.
  *
  * Returns 0 on success, or -1 on error.
  */
@@ -175,6 +193,747 @@ BUFRW_PUBLIC_FUNC int bfseek(FILE *stream, long offset, int whence);
  */
 BUFRW_PUBLIC_FUNC long bftell(FILE *stream);
 
+/*
+ * bufrw_t: buffered stream context.
+ *
+ * An opaque handle owning the read and write buffers of one stream, so that
+ * any number of streams can be buffered at the same time.
+ */
+typedef struct _s_bufrw bufrw_t;
+
+/*
+ * bufrw_head_t: buffer window of a context.
+ *
+ * Every bufrw_t starts with one, so the inline accessors (bfread_u32le and
+ * friends) can move bytes in and out of the buffers without calling into
+ * the library. Read access hits while the read buffer holds enough
+ * unread bytes, write access while data is already pending in the write
+ * buffer; everything else takes the regular calls. Not to be modified
+ * outside of those accessors.
+ */
+typedef struct _s_bufrw_head {
+    char *read_buffer;
+    size_t read_buffer_pos;     // current position in read_buffer
+    size_t read_buffer_len;     // number of valid bytes in read_buffer
+    char *write_buffer;
+    size_t write_buffer_pos;    // current position in write_buffer
+    size_t write_buffer_sz;     // bytes buffered before a flush
+    int shared;                 // shared-stream mode, never hits (see bfshare)
+} bufrw_head_t;
+
+/*
+ * bfopen: open a buffered stream context.
+ *
+ * Wraps stream in a new context owning a read buffer of rd_sz bytes and a
+ * write buffer of wr_sz bytes. A size of 0 picks that buffer's size with
+ * bfbestbufsz_fd and lets it adapt (see bfsetadaptive). Buffers are
+ * allocated on first use. The stream itself stays owned by
+ * the caller. Returns NULL on error.
+ */
+BUFRW_PUBLIC_FUNC bufrw_t *bfopen(FILE *stream, size_t rd_sz, size_t wr_sz);
+
+/*
+ * bfopen_fd: open a buffered context on a file descriptor.
+ *
+ * Like bfopen, but refills and flushes are plain read(2) and write(2)
+ * calls on fd, so the context's buffers are the only ones involved. The
+ * descriptor stays owned by the caller. Returns NULL on error.
+ */
+BUFRW_PUBLIC_FUNC bufrw_t *bfopen_fd(int fd, size_t rd_sz, size_t wr_sz);
+
+/*
+ * bfopen_fd_at: open a positional buffered context on a file descriptor.
+ *
+ * Like bfopen_fd, but the context keeps its own file offset, starting at
+ * offset, and transfers with pread(2) and pwrite(2). The descriptor's own
+ * offset is never moved, so several contexts can share one descriptor.
+ * Returns NULL on error.
+ */
+BUFRW_PUBLIC_FUNC bufrw_t *bfopen_fd_at(int fd, long offset, size_t rd_sz, size_t wr_sz);
+
+/*
+ * bfopen_map: open a memory-mapped read-only context on a file descriptor.
+ *
+ * Maps the regular file behind fd and reads out of the mapping: bfcread
+ * copies straight from the page cache and bfview hands out pointers into
+ * it. Reading starts at the descriptor's current offset, which is never
+ * moved. bfcseek and bfctell work within the file as it was when opened;
+ * the kernel is advised of sequential or random access as the seeks
+ * suggest. Writing fails with EBADF. The descriptor stays owned by the
+ * caller and must be open for reading. Returns NULL on error.
+ */
+BUFRW_PUBLIC_FUNC bufrw_t *bfopen_map(int fd);
+
+/*
+ * bfsplit: split a file into contexts reading disjoint ranges.
+ *
+ * Opens nparts positional contexts (see bfopen_fd_at) on the regular file
+ * fd into parts, reading consecutive ranges of about equal size that
+ * together cover the file, each with a read buffer of buffer_sz bytes, 0
+ * to pick one. A context reports the end of the stream at the end of its
+ * range; bfctell gives offsets in the file and SEEK_END is the end of the
+ * range. With a delim from 0 to 255, every range but the last ends just
+ * past the first delim byte at or after its nominal end, found with the
+ * scanner of bfreaduntil, so that no record is split between ranges; a
+ * range can then come out empty. A delim of -1 splits at plain offsets.
+ * The contexts share nothing, so each can be used by a thread of its own,
+ * and are meant for reading: bfpread and writes are not confined to the
+ * range. Not available with bfseturing, bfsetcache or bfsetodirect, nor
+ * on descriptors opened with O_DIRECT. Each is closed with bfclose; fd
+ * stays owned by the caller.
+ *
+ * Returns 0 on success, or -1 on error, leaving no context open.
+ */
+BUFRW_PUBLIC_FUNC int bfsplit(int fd, size_t nparts, int delim, size_t buffer_sz, bufrw_t **parts);
+
+/*
+ * bfclose: close a buffered stream context.
+ *
+ * Flushes pending write data, moves the stream back over any unread
+ * pre-fetched bytes and frees the context. The stream is not closed.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfclose(bufrw_t *ctx);
+
+/*
+ * bfshare: switch a context to shared-stream append mode.
+ *
+ * Afterwards any number of threads may bfcwrite to ctx concurrently. Each
+ * call is appended as one contiguous record, space in the write buffer is
+ * reserved with atomic operations and no lock is taken. Reading is not
+ * supported in this mode; bfcseek, bfctell and bfclose must not race with
+ * producers, while bfcflush may be called by any of them to push out what
+ * it has written. Must be called before ctx is used.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfshare(bufrw_t *ctx);
+
+/*
+ * bfsetdirect: set the direct transfer threshold of a context.
+ *
+ * Reads and writes of at least threshold bytes bypass the internal buffer
+ * once it has been drained or flushed; only their tail is buffered. A
+ * threshold of 0 restores the default, the buffer size. SIZE_MAX disables
+ * the direct path.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfsetdirect(bufrw_t *ctx, size_t threshold);
+
+/*
+ * bfsetrecord: make a context a stream of fixed-size records.
+ *
+ * Sizes the buffers of ctx to whole records of rec_sz bytes, and from then
+ * on refills keep reading until they end on a record boundary, so that a
+ * record never straddles two buffers: as long as the stream position is
+ * a multiple of rec_sz, a record read is served in one piece from the
+ * buffer. Pending data is settled first. A rec_sz of 0 reverts to plain
+ * buffers. Engines (bfsetasync, bfsetreadahead, bfseturing) must be
+ * enabled afterwards; not available with bfsetodirect or in shared mode.
+ * See BUFRW_DEFINE_RECORD_STREAM for typed readers and writers.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfsetrecord(bufrw_t *ctx, size_t rec_sz);
+
+/*
+ * bfsetnonblock: switch a context to non-blocking mode.
+ *
+ * Puts the descriptor of ctx, which must be a bfopen_fd context on a
+ * socket, pipe or terminal, in O_NONBLOCK mode for use in an event loop.
+ * Reads then return what has arrived, with errno set to EAGAIN when they
+ * come up short for lack of data, and bfreaduntil and bfgetline return 0
+ * until a whole record has arrived, keeping the partial one buffered.
+ * Writes never block: bfcwrite and bfwritev queue everything, growing the
+ * write buffer as needed, and push out what the stream takes once more
+ * than the write buffer size is pending; bfcflush sends what it can and
+ * fails with EAGAIN while bytes remain. Reads and writes are independent,
+ * as on a socket: reading does not flush and writing does not give back
+ * read-ahead. Element reads should use a size of 1, as a partial element
+ * is consumed. See bfpollfd for the events to wait for. Turning the mode
+ * off, which bfclose does, restores the descriptor flags. Not available
+ * with engines, stages, adaptive buffers, records or in shared mode.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfsetnonblock(bufrw_t *ctx, int on);
+
+/*
+ * bfpollfd: get what a context waits for.
+ *
+ * Returns the descriptor of ctx, or -1 if it has none, and sets *events
+ * to the poll(2) events it waits for: POLLIN once a read has come up
+ * short for lack of data, POLLOUT while writes are pending in its write
+ * buffer. An event loop waits for them and then reads again or calls
+ * bfcflush; the values match EPOLLIN and EPOLLOUT.
+ */
+BUFRW_PUBLIC_FUNC int bfpollfd(bufrw_t *ctx, int *events);
+
+/*
+ * bfsetadaptive: let a context resize its buffers on the fly.
+ *
+ * From now on, a buffer that keeps being filled or drained completely
+ * doubles while that raises the measured throughput per refill or flush,
+ * and one that keeps moving only a fraction of its size halves, always
+ * staying within min_sz and max_sz. A limit of 0 takes the process-wide
+ * one (see bfsetbufszlimits); equal limits pin both buffers at that size.
+ * Contexts opened with a buffer size of 0 adapt from the start. Engines
+ * (bfsetasync, bfsetreadahead, bfseturing) keep the sizes fixed while on.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfsetadaptive(bufrw_t *ctx, size_t min_sz, size_t max_sz);
+
+/*
+ * Placement flags of the built-in allocator (bufrw_allocator_t.flags).
+ *
+ * BUFRW_ALLOC_HUGEPAGE backs buffers of 1 MiB and more with 2 MiB huge
+ * pages, reserved ones if there are any and transparent ones otherwise.
+ * BUFRW_ALLOC_NUMA_LOCAL places buffers on the NUMA node of the thread
+ * allocating them, which is the first one to read or write the context.
+ */
+#define BUFRW_ALLOC_HUGEPAGE    0x1U
+#define BUFRW_ALLOC_NUMA_LOCAL  0x2U
+
+/*
+ * bufrw_allocator_t: buffer allocator.
+ *
+ * alloc returns size bytes or NULL; free releases a block alloc returned,
+ * given back with its size. arg is passed to both, so a pool or arena can
+ * hand out and take back blocks without a lookup. With both callbacks
+ * NULL the built-in allocator is used, aligning every buffer to align (a
+ * power of two, 0 for malloc's) and placing it as flags ask; custom
+ * callbacks are expected to honour align themselves.
+ */
+typedef struct _s_bufrw_allocator {
+    void *(*alloc)(void *arg, size_t size);
+    void (*free)(void *arg, void *ptr, size_t size);
+    void *arg;
+    size_t align;               // buffer alignment, 0 for malloc's
+    unsigned flags;             // BUFRW_ALLOC_* for the built-in allocator
+} bufrw_allocator_t;
+
+/*
+ * bfsetallocator: set the allocator for buffers.
+ *
+ * Contexts opened afterwards, and the legacy buffers of threads holding
+ * none yet, take their read and write buffers, including the spare ones
+ * of bfsetasync, bfsetreadahead and bfseturing, from allocator; buffers
+ * allocated before keep going back to the allocator they came from. A
+ * NULL allocator restores malloc and free.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfsetallocator(const bufrw_allocator_t *allocator);
+
+/*
+ * bfcsetallocator: set the allocator for the buffers of a context.
+ *
+ * Buffers ctx already has are moved to allocator along with their data,
+ * later ones come from it. Not possible while an engine (bfsetasync,
+ * bfsetreadahead, bfseturing) is on or in shared mode, nor with less
+ * alignment than direct I/O needs (see bfsetodirect). A NULL allocator
+ * restores malloc and free.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfcsetallocator(bufrw_t *ctx, const bufrw_allocator_t *allocator);
+
+/*
+ * bufrw_async_stats_t: asynchronous writer statistics.
+ */
+typedef struct _s_bufrw_async_stats {
+    size_t nbufs;                   // write buffers in rotation
+    size_t depth;                   // buffers queued or being written now
+    size_t max_depth;               // highest depth seen
+    size_t submitted;               // buffers handed to the flusher
+    size_t stalls;                  // submits that waited for a free buffer
+    unsigned long long stall_ns;    // total time spent in those waits
+} bufrw_async_stats_t;
+
+/*
+ * bfsetasync: switch a context to asynchronous write-behind.
+ *
+ * The context gets nbufs write buffers of its write buffer size. A full
+ * buffer is handed to a background flusher thread while the caller keeps
+ * filling the next one; it only stalls when all buffers are in flight.
+ * bfcflush, bfcseek, bfctell and any read wait for the queued buffers, so
+ * bfcflush acts as a barrier. Write errors are reported by the next call
+ * that waits or submits. An nbufs of 0 drains and returns to synchronous
+ * writes.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfsetasync(bufrw_t *ctx, int nbufs);
+
+/*
+ * bfasyncstats: asynchronous writer statistics of a context.
+ *
+ * Fills st with the queue depth and stall counters of ctx.
+ *
+ * Returns 0 on success, or -1 if ctx is not in asynchronous mode.
+ */
+BUFRW_PUBLIC_FUNC int bfasyncstats(bufrw_t *ctx, bufrw_async_stats_t *st);
+
+/*
+ * bfsetreadahead: enable read-ahead prefetching on a context.
+ *
+ * Once ctx has been refilled a couple of times in a row without a seek, a
+ * background thread starts reading the following nbufs blocks of the read
+ * buffer size ahead of the consumer, so reading and I/O overlap; on file
+ * descriptors the kernel is advised of sequential access as well. A seek
+ * stops the thread until access is sequential again. Large requests are
+ * served from the ring too instead of taking the direct path. An nbufs of
+ * 0 disables read-ahead.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfsetreadahead(bufrw_t *ctx, int nbufs);
+
+/*
+ * bfseturing: run the refills and flushes of a context on io_uring.
+ *
+ * ctx must be a seekable file descriptor context. Reads keep depth blocks
+ * of the read buffer size in flight ahead of the consumer, and up to
+ * depth - 1 full write buffers are written while the caller keeps
+ * filling; SQEs are submitted in batches from buffers registered with the
+ * ring. The calls on ctx keep their synchronous semantics, bfcflush waits
+ * for all writes. Large requests go through the ring buffers instead of
+ * the direct path. A depth of 0 drains and returns to plain system calls.
+ *
+ * Returns 0 on success, or -1 on error; errno is ENOSYS when io_uring, or
+ * its plain read and write operations, are not available.
+ */
+BUFRW_PUBLIC_FUNC int bfseturing(bufrw_t *ctx, unsigned depth);
+
+/*
+ * bfsetodirect: switch a file descriptor context to direct I/O.
+ *
+ * Sets O_DIRECT on the descriptor, so refills and flushes bypass the page
+ * cache: they move whole blocks, at block-aligned offsets, from buffers
+ * aligned as the file system requires (see bfcsetallocator; a custom
+ * allocator has to provide this alignment). A flush of a full buffer
+ * keeps a trailing partial block for the next one; what is still not
+ * aligned, such as the head after a seek or the tail at bfcflush and
+ * bfclose, is written through the page cache, so the file never grows
+ * past what was written and bfcseek and bfctell stay exact. Contexts on
+ * descriptors opened with O_DIRECT start in this mode. Buffer sizes are
+ * rounded up to whole blocks and no longer adapt, large requests are
+ * buffered too and bfseturing is not available. An on of 0 clears
+ * O_DIRECT and returns to buffered I/O; otherwise bfclose restores the
+ * status flags the descriptor had.
+ *
+ * Returns 0 on success, or -1 on error; errno is EINVAL when the file
+ * system does not support direct I/O.
+ */
+BUFRW_PUBLIC_FUNC int bfsetodirect(bufrw_t *ctx, int on);
+
+/*
+ * bufrw_cache_t: shared block cache.
+ *
+ * Keeps blocks of files read through it (see bfsetcache) for any number
+ * of contexts and threads.
+ */
+typedef struct _s_bufrw_cache bufrw_cache_t;
+
+/*
+ * bufrw_cache_stats_t: block cache counters (see bfcache_stats).
+ */
+typedef struct _s_bufrw_cache_stats {
+    unsigned long long hits;        // lookups served from the cache
+    unsigned long long misses;      // lookups that read a block
+    unsigned long long evictions;   // blocks replaced
+} bufrw_cache_stats_t;
+
+/*
+ * bfcache_new: create a block cache.
+ *
+ * The cache holds up to nblocks blocks of block_sz bytes, 64 KiB if 0,
+ * of the files of the contexts attached to it with bfsetcache, and
+ * replaces them in CLOCK order. It can be shared by any number of
+ * contexts and threads. Returns NULL on error.
+ */
+BUFRW_PUBLIC_FUNC bufrw_cache_t *bfcache_new(size_t block_sz, size_t nblocks);
+
+/*
+ * bfcache_free: release a block cache.
+ *
+ * The cache goes away once the last context attached to it is closed or
+ * detached; until then they keep using it.
+ */
+BUFRW_PUBLIC_FUNC void bfcache_free(bufrw_cache_t *cache);
+
+/*
+ * bfcache_stats: get the counters of a block cache.
+ *
+ * Fills stats with the lookups served from the cache, those that had to
+ * read a block and the blocks replaced so far.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfcache_stats(bufrw_cache_t *cache, bufrw_cache_stats_t *stats);
+
+/*
+ * bfsetcache: read a file descriptor context through a block cache.
+ *
+ * Refills of ctx and bfpread are served from cache, reading missing
+ * blocks with pread(2); bfcseek and bfctell work as before and the
+ * descriptor's offset is restored when ctx is detached or closed. The
+ * file must not change while cached, and ctx becomes read-only: writing
+ * fails with EBADF. Not available with bfsetodirect, bfseturing,
+ * bfsetcodec or in shared mode. A NULL cache detaches ctx.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfsetcache(bufrw_t *ctx, bufrw_cache_t *cache);
+
+/*
+ * bufrw_codec_t: block codec (see bfsetcodec).
+ *
+ * bound is the most bytes encode may produce for n bytes. encode
+ * compresses the n bytes at src into dst, which has room for cap bytes,
+ * and decode reverses it; both return the length of the result, or -1 on
+ * error. They are called by one thread of a context at a time and get
+ * arg, which may be shared by several contexts.
+ */
+typedef struct _s_bufrw_codec {
+    size_t (*bound)(void *arg, size_t n);
+    ssize_t (*encode)(void *arg, void *dst, size_t cap, const void *src, size_t n);
+    ssize_t (*decode)(void *arg, void *dst, size_t cap, const void *src, size_t n);
+    void *arg;
+} bufrw_codec_t;
+
+/*
+ * bfsetcodec: compress a context's stream.
+ *
+ * Everything written to ctx afterwards is encoded with codec where the
+ * write buffer is flushed, a block at a time, and what is read is decoded
+ * where the read buffer is refilled, straight into it; with bfsetasync or
+ * bfsetreadahead, which must be turned on afterwards, this happens on
+ * their threads. Each block is framed with its raw and encoded length, so
+ * any codec works; blocks that would not shrink are stored. The stream
+ * is meant to be read or written from start to end: bfcseek only moves
+ * within the read buffer, bfctell counts raw bytes and decoded bytes not
+ * read yet are dropped when writing follows or ctx is closed. Not
+ * available with bfopen_map, bfseturing, bfsetodirect, bfsetcache or in
+ * shared mode. A NULL codec ends the stage; the codec is copied.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfsetcodec(bufrw_t *ctx, const bufrw_codec_t *codec);
+
+/*
+ * bfcodec_zstd: the zstd codec.
+ *
+ * Fills codec with a zstd codec compressing at level for bfsetcodec.
+ * Returns 0 on success, or -1 with errno ENOSYS if the library was built
+ * without zstd (make WITH_ZSTD=1).
+ */
+BUFRW_PUBLIC_FUNC int bfcodec_zstd(bufrw_codec_t *codec, int level);
+
+/*
+ * bfcodec_lz4: the LZ4 codec.
+ *
+ * Fills codec with an LZ4 block codec for bfsetcodec. Returns 0 on
+ * success, or -1 with errno ENOSYS if the library was built without LZ4
+ * (make WITH_LZ4=1).
+ */
+BUFRW_PUBLIC_FUNC int bfcodec_lz4(bufrw_codec_t *codec);
+
+/*
+ * Digest algorithms for bfsetdigest.
+ */
+#define BUFRW_DIGEST_NONE   0   // no digest
+#define BUFRW_DIGEST_CRC32C 1   // CRC-32C (Castagnoli)
+#define BUFRW_DIGEST_XXH64  2   // XXH64, seed 0
+
+/*
+ * bfsetdigest: checksum the bytes a context moves.
+ *
+ * Starts a running digest, BUFRW_DIGEST_CRC32C or BUFRW_DIGEST_XXH64,
+ * over every byte ctx reads from its stream or writes to it from then on,
+ * computed on the buffer path while the bytes are still in cache: the
+ * CRC with the CPU's crc32 instructions where available. Reading a
+ * stream to its end, or writing it from start to end, so digests exactly
+ * its contents. Calling it again restarts the digest; BUFRW_DIGEST_NONE
+ * stops it. Has to be the last of bfsetcodec, bfsetcache and
+ * bfsetodirect, and is not available with bfopen_map, bfsetreadahead,
+ * bfseturing or in shared mode.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfsetdigest(bufrw_t *ctx, int algo);
+
+/*
+ * bfdigest: read out the digest of a context.
+ *
+ * Flushes pending writes, so that they are covered, and stores the digest
+ * of everything moved since bfsetdigest in *out: a CRC32C in the low 32
+ * bits, or an XXH64 with seed 0. The digest keeps running.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfdigest(bufrw_t *ctx, uint64_t *out);
+
+/* Buckets of the latency histograms of bufrw_stats_t. */
+#define BUFRW_STATS_BUCKETS 32
+
+/*
+ * bufrw_stats_t: I/O counters of a context (see bfstats).
+ *
+ * Bucket i of a histogram counts transfers that took from 2^i up to
+ * 2^(i+1) nanoseconds, the last one everything longer. The histograms are
+ * only kept when the library is built with make WITH_HISTOGRAMS=1 and
+ * stay zero otherwise.
+ */
+typedef struct _s_bufrw_stats {
+    unsigned long long reads;           // bfcread, bfreaduntil and bfgetline calls
+    unsigned long long writes;          // bfcwrite and bfwritev calls
+    unsigned long long bytes_read;      // bytes handed to callers
+    unsigned long long bytes_written;   // bytes taken from callers
+    unsigned long long bytes_copied;    // bytes copied through the buffers
+    unsigned long long refills;         // read buffer refills
+    unsigned long long flushes;         // write buffer flushes
+    unsigned long long direct_reads;    // reads bypassing the read buffer
+    unsigned long long direct_writes;   // writes bypassing the write buffer
+    unsigned long long short_reads;     // refills and direct reads short of what they asked
+    unsigned long long stream_read;     // bytes read from the stream
+    unsigned long long stream_written;  // bytes written to the stream
+    unsigned long long seeks;           // bfcseek calls
+    unsigned long long seeks_in_buffer; // of those, served within the read buffer
+    unsigned long long reallocs;        // buffer reallocations
+    unsigned long long read_ns;         // time blocked in refills and direct reads
+    unsigned long long write_ns;        // time blocked in flushes and direct writes
+    unsigned long long syncs;           // fdatasync calls (see bfsetdurability)
+    unsigned long long refill_hist[BUFRW_STATS_BUCKETS]; // refill latencies
+    unsigned long long flush_hist[BUFRW_STATS_BUCKETS];  // flush latencies
+} bufrw_stats_t;
+
+/*
+ * bfstats: get the I/O counters of a context.
+ *
+ * Fills stats with what ctx has done since it was opened. Buffer hits
+ * served inline by the header (bfcread_inline, bfcwrite_inline and the
+ * integer accessors) never reach the library and are not counted. With
+ * an engine (bfsetasync, bfsetreadahead, bfseturing) refills and flushes
+ * are timed as the caller waits for them, not as the engine runs them.
+ * Must not race with other use of ctx.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfstats(bufrw_t *ctx, bufrw_stats_t *stats);
+
+/*
+ * bfstats_global: get the I/O counters of all closed contexts.
+ *
+ * Fills stats with the sums of the counters of every context closed so
+ * far by any thread.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfstats_global(bufrw_stats_t *stats);
+
+/*
+ * bfcread: buffered fread on a context.
+ *
+ * Reads up to n elements of size bytes from ctx into ptr.
+ * Returns the number of complete items read.
+ */
+BUFRW_PUBLIC_FUNC size_t bfcread(bufrw_t *ctx, void *ptr, size_t size, size_t n);
+
+/*
+ * bfpread: positional read on a context.
+ *
+ * Reads up to n bytes at offset off of the file of ctx into buf, without
+ * moving the position of ctx or touching its read buffer. Contexts with a
+ * block cache (see bfsetcache) are served from it, mapped ones from the
+ * mapping; pending writes are flushed first. Not available with
+ * bfsetodirect, bfsetcodec or in shared mode. Returns the number of bytes read, less
+ * than n only at the end of the file or on error.
+ */
+BUFRW_PUBLIC_FUNC size_t bfpread(bufrw_t *ctx, void *buf, size_t n, long off);
+
+/*
+ * bfview: zero-copy read on a context.
+ *
+ * Consumes up to n bytes of ctx and points *out at them, without copying:
+ * into the mapping for bfopen_map contexts, into the read buffer
+ * otherwise, where a view is limited to the buffer size. The bytes stay
+ * valid until the next call on ctx. Returns the number of bytes viewed,
+ * less than n only at the end of the stream or on error.
+ */
+BUFRW_PUBLIC_FUNC size_t bfview(bufrw_t *ctx, size_t n, const void **out);
+
+/*
+ * bfpeek: zero-copy look ahead on a context.
+ *
+ * Like bfview, but the bytes are not consumed: the next read or view on
+ * ctx starts with them again.
+ */
+BUFRW_PUBLIC_FUNC size_t bfpeek(bufrw_t *ctx, size_t n, const void **out);
+
+/*
+ * bfreaduntil: zero-copy delimited read on a context.
+ *
+ * Consumes the next record of ctx, up to and including the first delim
+ * byte, and points *out at it; the last record of the stream may lack
+ * the delimiter. The read buffer is searched in place with a vector
+ * kernel picked for the CPU at run time. A record that fits in the read
+ * buffer is viewed where it lies, a longer one, or one straddling a
+ * refill while an engine owns the stream, is assembled in a buffer of the
+ * context. The bytes stay valid until the next call on ctx. Returns the
+ * length of the record, or 0 at the end of the stream or on error.
+ */
+BUFRW_PUBLIC_FUNC size_t bfreaduntil(bufrw_t *ctx, int delim, const void **out);
+
+/*
+ * bfgetline: zero-copy line read on a context.
+ *
+ * Like bfreaduntil with a newline delimiter: points *line at the next
+ * line of ctx, newline included, and returns its length.
+ */
+BUFRW_PUBLIC_FUNC size_t bfgetline(bufrw_t *ctx, const char **line);
+
+/*
+ * bfcwrite: buffered fwrite on a context.
+ *
+ * Writes n elements of size bytes from ptr into ctx.
+ * Returns the number of complete items written.
+ */
+BUFRW_PUBLIC_FUNC size_t bfcwrite(bufrw_t *ctx, const void *ptr, size_t size, size_t n);
+
+/*
+ * bfwritev: buffered writev on a context.
+ *
+ * Writes the iovcnt segments of iov into ctx in order. Segments below the
+ * direct threshold (see bfsetdirect) are coalesced into the write buffer;
+ * segments up to the last large one are written together with the pending
+ * buffer contents in a single writev, without copying them. In shared mode
+ * the segments form one record. Returns the number of bytes written.
+ */
+BUFRW_PUBLIC_FUNC size_t bfwritev(bufrw_t *ctx, const struct iovec *iov, int iovcnt);
+
+/*
+ * bfcopy: copy bytes from one context to another.
+ *
+ * Moves up to n bytes from src to dst, SIZE_MAX for all up to the end of
+ * src. The bytes already in the read buffer of src go first; when both
+ * contexts then transfer on plain descriptors (bfopen_fd, bfopen_fd_at,
+ * without an engine or a stage in between), the rest is copied by the
+ * kernel with copy_file_range(2), sendfile(2) or splice(2), whichever
+ * applies, without passing through user space. Anything else, and
+ * whatever the kernel cannot do, goes through the read buffer of src.
+ * Pending writes of dst stay ahead of the copied bytes.
+ *
+ * Returns the number of bytes copied, less than n only at the end of src
+ * or on error.
+ */
+BUFRW_PUBLIC_FUNC size_t bfcopy(bufrw_t *dst, bufrw_t *src, size_t n);
+
+/*
+ * bfcflush: flush the write buffer of a context.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfcflush(bufrw_t *ctx);
+
+/* bfflush_batch and bfflushall flag: also fdatasync(2) each descriptor. */
+#define BUFRW_FLUSH_DATASYNC 1
+
+/*
+ * bfflush_batch: flush several contexts at once.
+ *
+ * Flushes the write buffers of the n contexts in ctxs, and the stdio
+ * buffers of those opened with bfopen, on up to 8 threads, the caller's
+ * included, so that their transfers and syncs overlap instead of running
+ * one after another. With BUFRW_FLUSH_DATASYNC in flags each descriptor
+ * is also fdatasync(2)ed. Every context is flushed even if others fail.
+ * None of them may be in use by other threads meanwhile.
+ *
+ * Returns 0 on success, or -1 with errno of the first failure.
+ */
+BUFRW_PUBLIC_FUNC int bfflush_batch(bufrw_t **ctxs, size_t n, int flags);
+
+/*
+ * bfflushall: flush every open context.
+ *
+ * Like bfflush_batch on all contexts opened and not yet closed by any
+ * thread. Contexts cannot be opened or closed until it returns, and none
+ * may be in use by other threads meanwhile.
+ *
+ * Returns 0 on success, or -1 with errno of the first failure.
+ */
+BUFRW_PUBLIC_FUNC int bfflushall(int flags);
+
+/* Durability modes for bfsetdurability. */
+#define BUFRW_DURABLE_NONE     0  // hand data to the backend
+#define BUFRW_DURABLE_FLUSH    1  // and flush stdio buffers to the kernel
+#define BUFRW_DURABLE_DATASYNC 2  // and fdatasync on every flush
+#define BUFRW_DURABLE_GROUP    3  // and share fdatasync among committers
+
+/*
+ * bfsetdurability: choose how far bfcflush pushes data.
+ *
+ * With BUFRW_DURABLE_NONE, the default, bfcflush hands the write buffer to
+ * the backend, which for bfopen is the stdio buffer of the stream.
+ * BUFRW_DURABLE_FLUSH also flushes that buffer to the kernel, and
+ * BUFRW_DURABLE_DATASYNC then fdatasync(2)s the descriptor, so that
+ * bfcflush returns once the data is on the device. BUFRW_DURABLE_GROUP
+ * gives the same guarantee but lets concurrent committers share a sync:
+ * the first waits up to window_us microseconds for others to join, then
+ * syncs once for all of them. Concurrent committers on one context need
+ * shared mode (see bfshare), where producers may call bfcflush at any
+ * time. A sync that fails makes every later commit fail. bfclose commits
+ * once more before returning. Must not race with other use of ctx.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfsetdurability(bufrw_t *ctx, int mode, unsigned window_us);
+
+/*
+ * bfsetwriteback: absorb scattered writes in a write-back window.
+ *
+ * Writes to ctx, which must be a bfopen_fd or bfopen_fd_at context on a
+ * seekable file, then go to a window of window_sz bytes of the file,
+ * rounded up to whole pages, instead of the write buffer: they may land
+ * anywhere in it, and bfcseek moves the position without flushing them.
+ * Only the pages written to are buffered, each with the range of its
+ * bytes that is dirty; a write that leaves a gap in the range of a page
+ * fills it from the file. bfcflush, and a write outside the window, which
+ * moves it there, write the dirty ranges out in order of offset, one
+ * pwritev(2) for each run of them that is contiguous in the file. Reads,
+ * bfpread and SEEK_END see the pending bytes. The descriptor's own offset
+ * is left alone until the mode ends. A window_sz of 0 ends it after
+ * flushing, as bfclose does. Not available with engines, stages, records,
+ * non-blocking mode, split parts or in shared mode.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfsetwriteback(bufrw_t *ctx, size_t window_sz);
+
+/*
+ * bfcseek: buffered fseek on a context.
+ *
+ * Flushes pending write data before seeking, except what a write-back
+ * window holds (see bfsetwriteback). A target within the bytes already in
+ * the read buffer only moves the position in it; otherwise the read
+ * buffer is dropped and the stream repositioned. SEEK_CUR is relative to
+ * the caller's position, not the stream's.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfcseek(bufrw_t *ctx, long offset, int whence);
+
+/*
+ * bfctell: buffered ftell on a context.
+ *
+ * Returns the caller's position in the stream, accounting for unread
+ * pre-fetched bytes and unwritten buffered bytes, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC long bfctell(bufrw_t *ctx);
+
 /*
  * bfbestbufsz - Choose an optimal buffer size based on the total size.
  *
@@ -192,13 +951,311 @@ BUFRW_PUBLIC_FUNC long bftell(FILE *stream);
  */
 BUFRW_PUBLIC_FUNC size_t bfbestbufsz(size_t fullsz);
 
+/*
+ * bfbestbufsz_fd: choose a buffer size for a file descriptor.
+ *
+ * Unlike bfbestbufsz, looks at what fd is: pipes and sockets start small
+ * since a refill only gets what the writer has produced, files and block
+ * devices get a multiple of the larger of st_blksize and the device's
+ * optimal I/O size. The size never exceeds what fullsz, or a file's size,
+ * needs and stays within the limits of bfsetbufszlimits.
+ */
+BUFRW_PUBLIC_FUNC size_t bfbestbufsz_fd(int fd, size_t fullsz);
+
+/*
+ * bfsetbufszlimits: set the process-wide buffer size limits.
+ *
+ * bfbestbufsz_fd never suggests a size outside min_sz and max_sz, and
+ * contexts opened afterwards with a buffer size of 0 adapt within them.
+ * A limit of 0 restores its built-in default, 4 KiB and 4 MiB.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfsetbufszlimits(size_t min_sz, size_t max_sz);
+
 /*
  * bfcleanup: free the internal buffers.
  *
  * This should be called when you are done using the buffered I/O functions to
- * avoid memory leaks.
+ * avoid memory leaks. Only the calling thread's buffers are released; other
+ * threads release theirs when they exit.
  */
 BUFRW_DESTRUCTOR
 BUFRW_PUBLIC_FUNC void bfcleanup(void);
 
+/*
+ * Byte orders of bfcread_ints and bfcwrite_ints.
+ */
+#define BUFRW_LE 0
+#define BUFRW_BE 1
+
+/*
+ * bfcread_ints: read fixed-width integers in a byte order.
+ *
+ * Reads up to n integers of width bytes (2, 4 or 8) stored in order
+ * (BUFRW_LE or BUFRW_BE) from ctx into ptr, converting them to host order
+ * with a vector kernel picked for the CPU at run time. Returns the number
+ * of complete integers read.
+ */
+BUFRW_PUBLIC_FUNC size_t bfcread_ints(bufrw_t *ctx, void *ptr, size_t width, size_t n, int order);
+
+/*
+ * bfcwrite_ints: write fixed-width integers in a byte order.
+ *
+ * Like bfcread_ints the other way around: writes n host order integers of
+ * width bytes from ptr into ctx, stored in order. Returns the number of
+ * complete integers written.
+ */
+BUFRW_PUBLIC_FUNC size_t bfcwrite_ints(bufrw_t *ctx, const void *ptr, size_t width, size_t n, int order);
+
+/* Whether integers of byte order ord have to be swapped on this host. */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define BUFRW_SWAPS(ord) ((ord) == BUFRW_LE)
+#else
+#define BUFRW_SWAPS(ord) ((ord) == BUFRW_BE)
+#endif
+
+/*
+ * Take n bytes off the read buffer of ctx if it holds them, or reserve
+ * them at the end of pending data in its write buffer. Returns where they
+ * are, or NULL if the regular calls have to do it.
+ */
+BUFRW_PUBLIC_HO_FUNC const char *bfhead_take(bufrw_t *ctx, size_t n) {
+    bufrw_head_t *h = (bufrw_head_t *)ctx;
+    if (h->read_buffer_len - h->read_buffer_pos < n) {
+        return NULL;
+    }
+    h->read_buffer_pos += n;
+    return h->read_buffer + h->read_buffer_pos - n;
+}
+
+BUFRW_PUBLIC_HO_FUNC char *bfhead_put(bufrw_t *ctx, size_t n) {
+    bufrw_head_t *h = (bufrw_head_t *)ctx;
+    if (h->shared || h->write_buffer_pos == 0 || h->write_buffer_sz - h->write_buffer_pos <= n) {
+        return NULL;
+    }
+    h->write_buffer_pos += n;
+    return h->write_buffer + h->write_buffer_pos - n;
+}
+
+/*
+ * bfread_u16le, bfread_u32le, bfread_u64le, bfread_u16be, ...: read an
+ * integer.
+ *
+ * Reads one unsigned integer of the given width and byte order from ctx
+ * into *v, straight out of the read buffer when it holds enough bytes.
+ * Returns 0 on success, or -1 at the end of the stream or on error.
+ *
+ * bfwrite_u16le, ...: write an integer.
+ *
+ * Writes v to ctx in the given width and byte order. Returns 0 on success,
+ * or -1 on error.
+ *
+ * bfread_u16le_n, ..., bfwrite_u16le_n, ...: read or write arrays.
+ *
+ * Like bfcread_ints and bfcwrite_ints for n integers at v. Return the
+ * number of complete integers transferred.
+ */
+#define BUFRW_DEFINE_INT_ACCESSORS(bits, suffix, ord)                                   \
+    BUFRW_PUBLIC_HO_FUNC int bfread_u##bits##suffix(bufrw_t *ctx, uint##bits##_t *v) {  \
+        uint##bits##_t x;                                                               \
+        const char *p = bfhead_take(ctx, sizeof(x));                                    \
+        if (p) {                                                                        \
+            memcpy(&x, p, sizeof(x));                                                   \
+        } else if (bfcread(ctx, &x, sizeof(x), 1) != 1) {                               \
+            return -1;                                                                  \
+        }                                                                               \
+        *v = BUFRW_SWAPS(ord) ? (uint##bits##_t)__builtin_bswap##bits(x) : x;           \
+        return 0;                                                                       \
+    }                                                                                   \
+    BUFRW_PUBLIC_HO_FUNC int bfwrite_u##bits##suffix(bufrw_t *ctx, uint##bits##_t v) {  \
+        uint##bits##_t x = BUFRW_SWAPS(ord) ? (uint##bits##_t)__builtin_bswap##bits(v) : v; \
+        char *p = bfhead_put(ctx, sizeof(x));                                           \
+        if (p) {                                                                        \
+            memcpy(p, &x, sizeof(x));                                                   \
+            return 0;                                                                   \
+        }                                                                               \
+        return bfcwrite(ctx, &x, sizeof(x), 1) == 1 ? 0 : -1;                           \
+    }                                                                                   \
+    BUFRW_PUBLIC_HO_FUNC size_t bfread_u##bits##suffix##_n(bufrw_t *ctx, uint##bits##_t *v, size_t n) { \
+        return bfcread_ints(ctx, v, sizeof(*v), n, ord);                                \
+    }                                                                                   \
+    BUFRW_PUBLIC_HO_FUNC size_t bfwrite_u##bits##suffix##_n(bufrw_t *ctx, const uint##bits##_t *v, size_t n) { \
+        return bfcwrite_ints(ctx, v, sizeof(*v), n, ord);                               \
+    }
+
+BUFRW_DEFINE_INT_ACCESSORS(16, le, BUFRW_LE)
+BUFRW_DEFINE_INT_ACCESSORS(32, le, BUFRW_LE)
+BUFRW_DEFINE_INT_ACCESSORS(64, le, BUFRW_LE)
+BUFRW_DEFINE_INT_ACCESSORS(16, be, BUFRW_BE)
+BUFRW_DEFINE_INT_ACCESSORS(32, be, BUFRW_BE)
+BUFRW_DEFINE_INT_ACCESSORS(64, be, BUFRW_BE)
+
+/* Longest LEB128 encoding of a 64-bit integer. */
+#define BUFRW_VARINT_MAX 10
+
+/*
+ * bfread_varint: read a LEB128 varint.
+ *
+ * Decodes one unsigned LEB128 integer of up to 64 bits from ctx into *v,
+ * straight out of the read buffer unless it straddles a refill. Returns 0
+ * on success, or -1 at the end of the stream or on error; an encoding
+ * longer than 64 bits fails with EILSEQ.
+ */
+BUFRW_PUBLIC_HO_FUNC int bfread_varint(bufrw_t *ctx, uint64_t *v) {
+    bufrw_head_t *h = (bufrw_head_t *)ctx;
+    const unsigned char *p = (const unsigned char *)h->read_buffer + h->read_buffer_pos;
+    size_t avail = h->read_buffer_len - h->read_buffer_pos;
+    uint64_t x = 0;
+
+    for (unsigned i = 0; i < BUFRW_VARINT_MAX; i++) {
+        unsigned char b;
+        if (p && i < avail) {
+            b = p[i];
+        } else {
+            // Out of buffered bytes: consume what was decoded, go byte by byte.
+            if (p) {
+                h->read_buffer_pos += i;
+                p = NULL;
+            }
+            if (bfcread(ctx, &b, 1, 1) != 1) {
+                return -1;
+            }
+        }
+        if (i == BUFRW_VARINT_MAX - 1 && b > 1) {
+            break;
+        }
+        x |= (uint64_t)(b & 0x7f) << (7 * i);
+        if (!(b & 0x80)) {
+            if (p) {
+                h->read_buffer_pos += i + 1;
+            }
+            *v = x;
+            return 0;
+        }
+    }
+    if (p) {
+        h->read_buffer_pos += BUFRW_VARINT_MAX;
+    }
+    errno = EILSEQ;
+    return -1;
+}
+
+/*
+ * bfwrite_varint: write a LEB128 varint.
+ *
+ * Encodes v as an unsigned LEB128 integer into ctx. Returns 0 on
+ * success, or -1 on error.
+ */
+BUFRW_PUBLIC_HO_FUNC int bfwrite_varint(bufrw_t *ctx, uint64_t v) {
+    unsigned char enc[BUFRW_VARINT_MAX];
+    size_t n = 0;
+    do {
+        enc[n] = (unsigned char)(v & 0x7f);
+        v >>= 7;
+        enc[n++] |= v ? 0x80 : 0;
+    } while (v);
+
+    char *p = bfhead_put(ctx, n);
+    if (p) {
+        memcpy(p, enc, n);
+        return 0;
+    }
+    return bfcwrite(ctx, enc, 1, n) == n ? 0 : -1;
+}
+
+/*
+ * bfcread_inline, bfcwrite_inline: the buffer-hit path of bfcread and
+ * bfcwrite.
+ *
+ * A request the buffer of ctx satisfies is a bounds check and a memcpy in
+ * the caller; anything else, a refill, a flush or an error, goes to the
+ * library. Outside the library, calls to bfcread and bfcwrite expand to
+ * these unless BUFRW_NO_INLINE is defined; the library functions
+ * themselves stay available, by address or as (bfcread)(...).
+ */
+BUFRW_PUBLIC_HO_FUNC size_t bfcread_inline(bufrw_t *ctx, void *ptr, size_t size, size_t n) {
+    size_t bytes;
+    const char *p;
+    if (ctx && size != 0 && !__builtin_mul_overflow(size, n, &bytes) && (p = bfhead_take(ctx, bytes)) != NULL) {
+        memcpy(ptr, p, bytes);
+        return n;
+    }
+    return (bfcread)(ctx, ptr, size, n);
+}
+
+BUFRW_PUBLIC_HO_FUNC size_t bfcwrite_inline(bufrw_t *ctx, const void *ptr, size_t size, size_t n) {
+    size_t bytes;
+    char *p;
+    if (ctx && size != 0 && !__builtin_mul_overflow(size, n, &bytes) && (p = bfhead_put(ctx, bytes)) != NULL) {
+        memcpy(p, ptr, bytes);
+        return n;
+    }
+    return (bfcwrite)(ctx, ptr, size, n);
+}
+
+/*
+ * BUFRW_DEFINE_RECORD_STREAM(type): typed readers and writers of fixed
+ * records.
+ *
+ * For a record type named by a single identifier, defines
+ *
+ *   int bfsetrecord_type(bufrw_t *ctx)
+ *       bfsetrecord(ctx, sizeof(type)).
+ *   int bfread_type(bufrw_t *ctx, type *rec)
+ *   int bfwrite_type(bufrw_t *ctx, const type *rec)
+ *       Move one record. Return 0 on success, or -1 at the end of the
+ *       stream or on error.
+ *   size_t bfread_type_n(bufrw_t *ctx, type *recs, size_t n)
+ *   size_t bfwrite_type_n(bufrw_t *ctx, const type *recs, size_t n)
+ *       Move up to n records. Return the number of complete records moved.
+ *
+ * Records are copied with moves of constant size out of and into the
+ * buffers, which bfsetrecord keeps to whole records, and only a refill or
+ * a flush calls into the library.
+ */
+#define BUFRW_DEFINE_RECORD_STREAM(type)                                                \
+    BUFRW_PUBLIC_HO_FUNC int bfsetrecord_##type(bufrw_t *ctx) {                         \
+        return bfsetrecord(ctx, sizeof(type));                                          \
+    }                                                                                   \
+    BUFRW_PUBLIC_HO_FUNC int bfread_##type(bufrw_t *ctx, type *rec) {                   \
+        const char *p = bfhead_take(ctx, sizeof(type));                                 \
+        if (p) {                                                                        \
+            memcpy(rec, p, sizeof(type));                                               \
+            return 0;                                                                   \
+        }                                                                               \
+        return (bfcread)(ctx, rec, sizeof(type), 1) == 1 ? 0 : -1;                      \
+    }                                                                                   \
+    BUFRW_PUBLIC_HO_FUNC int bfwrite_##type(bufrw_t *ctx, const type *rec) {            \
+        char *p = bfhead_put(ctx, sizeof(type));                                        \
+        if (p) {                                                                        \
+            memcpy(p, rec, sizeof(type));                                               \
+            return 0;                                                                   \
+        }                                                                               \
+        return (bfcwrite)(ctx, rec, sizeof(type), 1) == 1 ? 0 : -1;                     \
+    }                                                                                   \
+    BUFRW_PUBLIC_HO_FUNC size_t bfread_##type##_n(bufrw_t *ctx, type *recs, size_t n) { \
+        size_t done = 0;                                                                \
+        const char *p;                                                                  \
+        while (done < n && (p = bfhead_take(ctx, sizeof(type))) != NULL) {              \
+            memcpy(&recs[done++], p, sizeof(type));                                     \
+        }                                                                               \
+        return done < n ? done + (bfcread)(ctx, recs + done, sizeof(type), n - done) : n; \
+    }                                                                                   \
+    BUFRW_PUBLIC_HO_FUNC size_t bfwrite_##type##_n(bufrw_t *ctx, const type *recs, size_t n) { \
+        size_t done = 0;                                                                \
+        char *p;                                                                        \
+        while (done < n && (p = bfhead_put(ctx, sizeof(type))) != NULL) {               \
+            memcpy(p, &recs[done++], sizeof(type));                                     \
+        }                                                                               \
+        return done < n ? done + (bfcwrite)(ctx, recs + done, sizeof(type), n - done) : n; \
+    }
+
+#if !defined(BUFRW_LIBRARY_BUILD) && !defined(BUFRW_NO_INLINE)
+#define bfcread(ctx, ptr, size, n) bfcread_inline(ctx, ptr, size, n)
+#define bfcwrite(ctx, ptr, size, n) bfcwrite_inline(ctx, ptr, size, n)
+#endif
+
+BUFRW_EXTERN_C_END
+
 #endif // BUFRW_H
\ No newline at end of file
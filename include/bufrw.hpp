@@ -0,0 +1,316 @@
+/*
+ * bufrw.hpp - C++20 coroutine interface to bufrw contexts
+ *
+ * Project: bufrw
+ * License: MIT
+ * Author: [reslaid32]
+ *
+ * Description:
+ * Awaitable reads, writes and flushes on non-blocking bufrw contexts
+ * (see bfsetnonblock), for coroutines driven by an event loop. Operations
+ * the buffers can serve complete without suspending; only those that
+ * have to wait for the descriptor park the coroutine with a reactor.
+ *
+ * License:
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef BUFRW_HPP
+#define BUFRW_HPP
+
+#include "bufrw.h"
+
+#include <poll.h>
+
+#include <cerrno>
+#include <coroutine>
+#include <cstddef>
+#include <span>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+namespace bufrw {
+
+/*
+ * waiter: something parked until a descriptor is ready.
+ */
+class waiter {
+public:
+    virtual void ready() = 0;
+
+protected:
+    ~waiter() = default;
+};
+
+/*
+ * reactor: where awaitables park.
+ *
+ * wait must call w->ready() once, after fd has become ready for any of
+ * the poll(2) events, or has hung up or failed. Plug an existing event
+ * loop in by implementing it, or use poll_reactor.
+ */
+class reactor {
+public:
+    virtual void wait(int fd, int events, waiter *w) = 0;
+
+protected:
+    ~reactor() = default;
+};
+
+/*
+ * poll_reactor: a reactor over poll(2).
+ *
+ * run_once waits up to timeout_ms for any parked descriptor and wakes its
+ * waiters, returning false on error; run does so until nothing is parked.
+ */
+class poll_reactor : public reactor {
+public:
+    void wait(int fd, int events, waiter *w) override {
+        parked_.push_back({fd, events, w});
+    }
+
+    bool empty() const noexcept {
+        return parked_.empty();
+    }
+
+    bool run_once(int timeout_ms = -1) {
+        std::vector<pollfd> fds;
+        fds.reserve(parked_.size());
+        for (const entry &e : parked_) {
+            fds.push_back({e.fd, static_cast<short>(e.events), 0});
+        }
+        if (::poll(fds.data(), fds.size(), timeout_ms) < 0) {
+            return errno == EINTR;
+        }
+
+        // Waiters may park again while being woken.
+        std::vector<entry> woken, rest;
+        for (size_t i = 0; i < fds.size(); i++) {
+            (fds[i].revents ? woken : rest).push_back(parked_[i]);
+        }
+        parked_ = std::move(rest);
+        for (const entry &e : woken) {
+            e.w->ready();
+        }
+        return true;
+    }
+
+    void run() {
+        while (!empty() && run_once()) {
+        }
+    }
+
+private:
+    struct entry {
+        int fd;
+        int events;
+        waiter *w;
+    };
+    std::vector<entry> parked_;
+};
+
+namespace detail {
+
+/*
+ * An operation on a context that completes now or names the events to
+ * wait for. op(ctx, out) returns 0 once done with its result in out, the
+ * poll(2) events it needs to make progress, or -1 with errno on error.
+ */
+template <class Op>
+class io_awaitable : private waiter {
+public:
+    io_awaitable(bufrw_t *ctx, reactor *r, Op op) : ctx_(ctx), reactor_(r), op_(std::move(op)) {}
+
+    bool await_ready() {
+        return attempt();
+    }
+
+    void await_suspend(std::coroutine_handle<> h) {
+        handle_ = h;
+        reactor_->wait(fd(), events_, this);
+    }
+
+    size_t await_resume() const {
+        if (err_) {
+            throw std::system_error(err_, std::generic_category());
+        }
+        return result_;
+    }
+
+private:
+    int fd() const {
+        int events;
+        return bfpollfd(ctx_, &events);
+    }
+
+    // Runs the operation; returns true once it has finished either way.
+    bool attempt() {
+        errno = 0;
+        int ret = op_(ctx_, result_);
+        if (ret < 0) {
+            err_ = errno ? errno : EIO;
+            return true;
+        }
+        events_ = ret;
+        return ret == 0;
+    }
+
+    void ready() override {
+        if (attempt()) {
+            handle_.resume();  // May destroy *this.
+        } else {
+            reactor_->wait(fd(), events_, this);
+        }
+    }
+
+    bufrw_t *ctx_;
+    reactor *reactor_;
+    Op op_;
+    size_t result_ = 0;
+    int events_ = 0;
+    int err_ = 0;
+    std::coroutine_handle<> handle_;
+};
+
+} // namespace detail
+
+/*
+ * stream: a non-blocking bufrw context with awaitable operations.
+ *
+ * Opens a context on fd, a socket, pipe or terminal that stays owned by
+ * the caller, switches it to non-blocking mode and parks coroutines with
+ * r, which must outlive the stream. Throws std::system_error if that
+ * fails, and operations throw it when theirs fail. The two directions
+ * are independent: one read or getline and one write or flush may be
+ * pending at a time.
+ */
+class stream {
+public:
+    stream(int fd, reactor &r, size_t rd_sz = 0, size_t wr_sz = 0)
+        : ctx_(bfopen_fd(fd, rd_sz, wr_sz)), reactor_(&r) {
+        if (!ctx_ || bfsetnonblock(ctx_, 1) != 0) {
+            int err = errno;
+            bfclose(ctx_);
+            throw std::system_error(err, std::generic_category(), "bufrw::stream");
+        }
+    }
+
+    stream(const stream &) = delete;
+    stream &operator=(const stream &) = delete;
+
+    stream(stream &&other) noexcept
+        : ctx_(std::exchange(other.ctx_, nullptr)), reactor_(other.reactor_) {}
+
+    stream &operator=(stream &&other) noexcept {
+        if (this != &other) {
+            bfclose(ctx_);
+            ctx_ = std::exchange(other.ctx_, nullptr);
+            reactor_ = other.reactor_;
+        }
+        return *this;
+    }
+
+    // Queued writes are drained, blocking, as the context is closed.
+    ~stream() {
+        bfclose(ctx_);
+    }
+
+    bufrw_t *get() const noexcept {
+        return ctx_;
+    }
+
+    /*
+     * read: co_await read(buf) reads up to buf.size() bytes and yields
+     * how many, at least one unless the stream has ended. Suspends only
+     * when the read buffer is empty and nothing has arrived.
+     */
+    auto read(std::span<std::byte> buf) {
+        return detail::io_awaitable(ctx_, reactor_, [buf](bufrw_t *ctx, size_t &out) -> int {
+            if (buf.empty()) {
+                out = 0;
+                return 0;
+            }
+            out = bfcread(ctx, buf.data(), 1, buf.size());
+            if (out > 0) {
+                return 0;
+            }
+            int events;
+            bfpollfd(ctx, &events);
+            return events & POLLIN ? POLLIN : errno ? -1 : 0;
+        });
+    }
+
+    /*
+     * getline: co_await getline(line) points line at the next line,
+     * newline included, valid until the next operation, and yields its
+     * length, or 0 at the end of the stream. Suspends until a whole line
+     * has arrived.
+     */
+    auto getline(std::string_view &line) {
+        return detail::io_awaitable(ctx_, reactor_, [&line](bufrw_t *ctx, size_t &out) -> int {
+            const char *p;
+            out = bfgetline(ctx, &p);
+            if (out > 0) {
+                line = std::string_view(p, out);
+                return 0;
+            }
+            line = {};
+            int events;
+            bfpollfd(ctx, &events);
+            return events & POLLIN ? POLLIN : errno ? -1 : 0;
+        });
+    }
+
+    /*
+     * write: co_await write(buf) queues all of buf and yields its size.
+     * Never suspends; what the descriptor does not take yet waits for
+     * flush.
+     */
+    auto write(std::span<const std::byte> buf) {
+        return detail::io_awaitable(ctx_, reactor_, [buf](bufrw_t *ctx, size_t &out) -> int {
+            out = buf.empty() ? 0 : bfcwrite(ctx, buf.data(), 1, buf.size());
+            return out == buf.size() ? 0 : -1;
+        });
+    }
+
+    /*
+     * flush: co_await flush() sends everything queued, suspending while
+     * the descriptor cannot take more.
+     */
+    auto flush() {
+        return detail::io_awaitable(ctx_, reactor_, [](bufrw_t *ctx, size_t &out) -> int {
+            out = 0;
+            if (bfcflush(ctx) == 0) {
+                return 0;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? POLLOUT : -1;
+        });
+    }
+
+private:
+    bufrw_t *ctx_;
+    reactor *reactor_;
+};
+
+} // namespace bufrw
+
+#endif // BUFRW_HPP
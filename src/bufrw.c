@@ -1,34 +1,1721 @@
 #define BUFRW_LIBRARY_BUILD
 
-#include "../include/bufrw.h"
+#include "bufrw_internal.h"
 
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
 
-/* 
-   Global static buffers for read and write.
-   These buffers will be (re)allocated to the requested size if needed.
+static ssize_t stdio_read(bufrw_t *ctx, void *buf, size_t n) {
+    size_t got = fread(buf, 1, n, ctx->stream);
+    if (got == 0 && ferror(ctx->stream)) {
+        return -1;
+    }
+    return (ssize_t)got;
+}
+
+static ssize_t stdio_write(bufrw_t *ctx, const void *buf, size_t n) {
+    size_t put = fwrite(buf, 1, n, ctx->stream);
+    if (put == 0 && n > 0) {
+        return -1;
+    }
+    return (ssize_t)put;
+}
+
+static ssize_t stdio_writev(bufrw_t *ctx, const struct iovec *iov, int iovcnt) {
+    ssize_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        size_t put = fwrite(iov[i].iov_base, 1, iov[i].iov_len, ctx->stream);
+        total += (ssize_t)put;
+        if (put < iov[i].iov_len) {
+            break;
+        }
+    }
+    return total == 0 && ferror(ctx->stream) ? -1 : total;
+}
+
+static int stdio_seek(bufrw_t *ctx, long offset, int whence) {
+    return fseek(ctx->stream, offset, whence);
+}
+
+static long stdio_tell(bufrw_t *ctx) {
+    return ftell(ctx->stream);
+}
+
+static const bufrw_ops_t stdio_ops = {
+    .read = stdio_read,
+    .write = stdio_write,
+    .writev = stdio_writev,
+    .seek = stdio_seek,
+    .tell = stdio_tell,
+};
+
+static ssize_t fd_read(bufrw_t *ctx, void *buf, size_t n) {
+    if (ctx->limit >= 0) {
+        // A part of a split file ends at its limit.
+        if (ctx->offset >= ctx->limit) {
+            return 0;
+        }
+        if (n > (size_t)(ctx->limit - ctx->offset)) {
+            n = (size_t)(ctx->limit - ctx->offset);
+        }
+    }
+    ssize_t got;
+    do {
+        got = ctx->positional ? pread(ctx->fd, buf, n, ctx->offset) : read(ctx->fd, buf, n);
+    } while (got < 0 && errno == EINTR);
+    ctx->want_read = got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    if (ctx->wb) {
+        // Pending writes in the write-back window are what the file holds.
+        got = bufrw_wb_overlay(ctx, buf, n, ctx->offset, got);
+    }
+
+    if (got > 0 && ctx->offset >= 0) {
+        ctx->offset += got;
+    }
+    return got;
+}
+
+static ssize_t fd_write(bufrw_t *ctx, const void *buf, size_t n) {
+    ssize_t put;
+    do {
+        put = ctx->positional ? pwrite(ctx->fd, buf, n, ctx->offset) : write(ctx->fd, buf, n);
+    } while (put < 0 && errno == EINTR);
+
+    if (put > 0 && ctx->offset >= 0) {
+        ctx->offset += put;
+    }
+    return put;
+}
+
+static ssize_t fd_writev(bufrw_t *ctx, const struct iovec *iov, int iovcnt) {
+    ssize_t put;
+    do {
+        put = ctx->positional ? pwritev(ctx->fd, iov, iovcnt, ctx->offset) : writev(ctx->fd, iov, iovcnt);
+    } while (put < 0 && errno == EINTR);
+
+    if (put > 0 && ctx->offset >= 0) {
+        ctx->offset += put;
+    }
+    return put;
+}
+
+static int fd_seek(bufrw_t *ctx, long offset, int whence) {
+    if (!ctx->positional) {
+        off_t pos = lseek(ctx->fd, offset, whence);
+        if (pos < 0) {
+            return -1;
+        }
+        ctx->offset = (long)pos;
+        return 0;
+    }
+
+    // Positional streams never move the descriptor's own offset.
+    long base = 0;
+    if (whence == SEEK_CUR) {
+        base = ctx->offset;
+    } else if (whence == SEEK_END && ctx->limit >= 0) {
+        base = ctx->limit;
+    } else if (whence == SEEK_END) {
+        struct stat st;
+        if (fstat(ctx->fd, &st) != 0) {
+            return -1;
+        }
+        base = (long)st.st_size;
+        if (ctx->wb && bufrw_wb_end(ctx) > base) {
+            base = bufrw_wb_end(ctx);
+        }
+    } else if (whence != SEEK_SET) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (base + offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    ctx->offset = base + offset;
+    return 0;
+}
+
+static long fd_tell(bufrw_t *ctx) {
+    if (ctx->offset < 0) {
+        errno = ESPIPE;
+    }
+    return ctx->offset;
+}
+
+static const bufrw_ops_t fd_ops = {
+    .read = fd_read,
+    .write = fd_write,
+    .writev = fd_writev,
+    .seek = fd_seek,
+    .tell = fd_tell,
+};
+
+/*
+ * Read into buf until n bytes have arrived, the stream ends or an error
+ * occurs. Returns the number of bytes read.
+ */
+BUFRW_INTERNAL_FUNC size_t bufrw_io_read_full(bufrw_t *restrict ctx, char *restrict buf, size_t n) {
+    size_t done = 0;
+    while (done < n) {
+        ssize_t got = ctx->ops->read(ctx, buf + done, n - done);
+        if (got <= 0) {
+            break;
+        }
+        done += (size_t)got;
+    }
+    return done;
+}
+
+/*
+ * Write all n bytes of buf unless an error occurs.
+ * Returns the number of bytes written.
+ */
+BUFRW_INTERNAL_FUNC size_t bufrw_io_write_full(bufrw_t *restrict ctx, const char *restrict buf, size_t n) {
+    size_t done = 0;
+    while (done < n) {
+        ssize_t put = ctx->ops->write(ctx, buf + done, n - done);
+        if (put <= 0) {
+            break;
+        }
+        done += (size_t)put;
+    }
+    return done;
+}
+
+/*
+ * File descriptor underneath ctx, or -1 if there is none.
+ */
+BUFRW_INTERNAL_FUNC int bufrw_ctx_fd(const bufrw_t *ctx) {
+    if (ctx->fd >= 0) {
+        return ctx->fd;
+    }
+    return ctx->stream ? fileno(ctx->stream) : -1;
+}
+
+/*
+ * File descriptor ctx transfers on with nothing but plain read(2) and
+ * write(2) calls or their positional forms, or -1 if its data passes
+ * through anything else or it is confined to a range of the file.
+ */
+BUFRW_INTERNAL_FUNC int bufrw_ctx_plain_fd(const bufrw_t *ctx) {
+    if (ctx->ops != &fd_ops || ctx->async || ctx->readahead || ctx->uring || ctx->shared || ctx->wb || ctx->limit >= 0) {
+        return -1;
+    }
+    return ctx->fd;
+}
+
+/* Upper bound on the segments handed to a single writev call. */
+#define BUFRW_IOV_BATCH 64
+
+/*
+ * Copy the segments of iov back to back into dst.
+ * Returns the number of bytes copied.
+ */
+static size_t iov_gather(char *restrict dst, const struct iovec *restrict iov, int iovcnt) {
+    size_t off = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(dst + off, iov[i].iov_base, iov[i].iov_len);
+        off += iov[i].iov_len;
+    }
+    return off;
+}
+
+/*
+ * Write the pending contents of the write buffer of ctx followed by the
+ * segments of iov, coalescing them into as few writev calls as possible.
+ *
+ * Pending bytes that could not be written stay in the buffer. Returns the
+ * number of bytes of iov written.
+ */
+static size_t ctx_writev_through(bufrw_t *ctx, const struct iovec *iov, int iovcnt) {
+    uint64_t start = bufrw_stats_clock();
+    size_t pending = ctx->write_buffer_pos;
+    size_t written = 0;
+    int seg = 0;
+    size_t seg_off = 0;
+
+    for (;;) {
+        while (seg < iovcnt && seg_off == iov[seg].iov_len) {
+            seg++;
+            seg_off = 0;
+        }
+        if (pending == 0 && seg == iovcnt) {
+            break;
+        }
+
+        struct iovec vec[BUFRW_IOV_BATCH];
+        int cnt = 0;
+        if (pending > 0) {
+            vec[cnt].iov_base = ctx->write_buffer + ctx->write_buffer_pos - pending;
+            vec[cnt++].iov_len = pending;
+        }
+        for (int i = seg; i < iovcnt && cnt < BUFRW_IOV_BATCH; i++) {
+            size_t skip = i == seg ? seg_off : 0;
+            if (iov[i].iov_len > skip) {
+                vec[cnt].iov_base = (char *)iov[i].iov_base + skip;
+                vec[cnt++].iov_len = iov[i].iov_len - skip;
+            }
+        }
+
+        ssize_t put = ctx->ops->writev(ctx, vec, cnt);
+        if (put <= 0) {
+            break;
+        }
+
+        // The pending bytes go out first, then the caller's segments.
+        size_t n = (size_t)put;
+        size_t from_pending = n < pending ? n : pending;
+        pending -= from_pending;
+        n -= from_pending;
+        written += n;
+        while (n > 0) {
+            size_t left = iov[seg].iov_len - seg_off;
+            if (n < left) {
+                seg_off += n;
+                break;
+            }
+            n -= left;
+            seg++;
+            seg_off = 0;
+        }
+    }
+
+    if (pending > 0) {
+        memmove(ctx->write_buffer, ctx->write_buffer + ctx->write_buffer_pos - pending, pending);
+    }
+    bufrw_stats_io(ctx, BUFRW_IO_DIRECT_WRITE, start, 0, (ssize_t)(ctx->write_buffer_pos - pending + written));
+    ctx->write_buffer_pos = pending;
+    return written;
+}
+
+/*
+   Context backing the legacy FILE* based API.
+   It is bound to whichever stream was passed last; switching streams
+   flushes the previous one first. Every thread gets its own context
+   unless the library is built with BUFRW_NO_THREAD_LOCAL.
 */
-static char *read_buffer = NULL;
-static int read_buffer_allocated = 0;
-static size_t read_buffer_sz = 0;
-static size_t read_buffer_pos = 0;   // current position in read_buffer
-static size_t read_buffer_len = 0;   // number of valid bytes in read_buffer
+#if defined(BUFRW_NO_THREAD_LOCAL)
+static bufrw_t legacy_ctx;
+#else
+static _Thread_local bufrw_t legacy_ctx;
+
+/* Releases the buffers of a thread's legacy context when the thread exits. */
+static pthread_key_t legacy_key;
+static pthread_once_t legacy_key_once = PTHREAD_ONCE_INIT;
+#endif
+
+static bufrw_ver_t bufrwv = { .major=1, .minor=0, .patch=1 };
+
+/*
+ * bfver: bufrw version.
+ * 
+ * Get a current version of libbufrw.
+ */
+BUFRW_PUBLIC_FUNC bufrw_ver_t bfver() { 
+    return bufrwv;
+}
+
+/*
+ * Move the read buffer of ctx to a new allocation of cap bytes, keeping
+ * its unread bytes, which must fit. Returns 0 on success, or -1 on error.
+ */
+static int ctx_realloc_read(bufrw_t *ctx, size_t cap) {
+    char *buf = (char *)bufrw_buf_alloc(ctx, cap);
+    if (!buf) {
+        return -1;  // Allocation failed.
+    }
+
+    size_t unread = ctx->read_buffer_len - ctx->read_buffer_pos;
+    if (unread > 0) {
+        memcpy(buf, ctx->read_buffer + ctx->read_buffer_pos, unread);
+    }
+    if (ctx->read_buffer) {
+        bufrw_buf_free(ctx, ctx->read_buffer, ctx->read_buffer_cap);
+        ctx->stats.reallocs++;
+    }
+    ctx->read_buffer = buf;
+    ctx->read_buffer_cap = cap;
+    ctx->read_buffer_pos = 0;
+    ctx->read_buffer_len = unread;
+    return 0;
+}
+
+/*
+ * Move the write buffer of ctx to a new allocation of cap bytes, keeping
+ * its pending bytes, which must fit. Returns 0 on success, or -1 on error.
+ */
+static int ctx_realloc_write(bufrw_t *ctx, size_t cap) {
+    char *buf = (char *)bufrw_buf_alloc(ctx, cap);
+    if (!buf) {
+        return -1;  // Allocation failed.
+    }
+
+    if (ctx->write_buffer_pos > 0) {
+        memcpy(buf, ctx->write_buffer, ctx->write_buffer_pos);
+    }
+    if (ctx->write_buffer) {
+        bufrw_buf_free(ctx, ctx->write_buffer, ctx->write_buffer_cap);
+        ctx->stats.reallocs++;
+    }
+    ctx->write_buffer = buf;
+    ctx->write_buffer_cap = cap;
+    return 0;
+}
+
+/*
+ * Round buffer_sz down to whole records of ctx, but at least one.
+ */
+static size_t ctx_round_records(const bufrw_t *ctx, size_t buffer_sz) {
+    if (ctx->rec_sz == 0) {
+        return buffer_sz;
+    }
+    return buffer_sz < ctx->rec_sz ? ctx->rec_sz : buffer_sz - buffer_sz % ctx->rec_sz;
+}
+
+/*
+ * Size the read buffer of ctx so that refills ask for buffer_sz bytes,
+ * rounded to whole records.
+ *
+ * The buffer is only reallocated when it has to grow, keeping its unread
+ * bytes; on failure it is left as it was.
+ */
+BUFRW_INTERNAL_FUNC int bufrw_ctx_alloc_read(bufrw_t *ctx, size_t buffer_sz) {
+    buffer_sz = ctx_round_records(ctx, buffer_sz);
+    if ((!ctx->read_buffer || ctx->read_buffer_cap < buffer_sz) && ctx_realloc_read(ctx, buffer_sz) != 0) {
+        return -1;
+    }
+    ctx->read_buffer_sz = buffer_sz;
+    return 0;
+}
+
+/*
+ * Size the write buffer of ctx so that it flushes at buffer_sz bytes.
+ *
+ * Like bufrw_ctx_alloc_read, keeping the pending bytes, of which there
+ * must not be more than buffer_sz.
+ */
+BUFRW_INTERNAL_FUNC int bufrw_ctx_alloc_write(bufrw_t *ctx, size_t buffer_sz) {
+    buffer_sz = ctx_round_records(ctx, buffer_sz);
+    if ((!ctx->write_buffer || ctx->write_buffer_cap < buffer_sz) && ctx_realloc_write(ctx, buffer_sz) != 0) {
+        return -1;
+    }
+    ctx->write_buffer_sz = buffer_sz;
+    return 0;
+}
+
+/*
+ * Reallocate the buffers of ctx whose capacity exceeds their size, so
+ * that they can be swapped with the spare buffers of an engine.
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_INTERNAL_FUNC int bufrw_ctx_fit(bufrw_t *ctx) {
+    if (ctx->read_buffer && ctx->read_buffer_cap != ctx->read_buffer_sz) {
+        size_t unread = ctx->read_buffer_len - ctx->read_buffer_pos;
+        if (unread > ctx->read_buffer_sz) {
+            ctx->read_buffer_sz = unread;
+        }
+        if (ctx_realloc_read(ctx, ctx->read_buffer_sz) != 0) {
+            return -1;
+        }
+    }
+    if (ctx->write_buffer && ctx->write_buffer_cap != ctx->write_buffer_sz) {
+        if (ctx_realloc_write(ctx, ctx->write_buffer_sz) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Spin until the shared write buffer of ctx is open for reservations.
+ */
+static void shared_wait(bufrw_t *ctx) {
+    while (atomic_load_explicit(&ctx->shared_tail, memory_order_acquire) > ctx->write_buffer_sz) {
+        sched_yield();
+    }
+}
+
+/*
+ * Drain the shared write buffer of ctx, which holds off reserved bytes.
+ *
+ * Only the producer whose reservation crossed the end of the buffer gets
+ * here, so it has the stream to itself until it reopens the buffer. The
+ * len bytes of iov are appended after the drained data; a record that
+ * fits is copied into the fresh buffer, a larger one goes out together
+ * with the drained data in one writev. Returns the number of bytes of iov
+ * accepted.
+ */
+static size_t shared_drain(bufrw_t *ctx, size_t off, const struct iovec *iov, int iovcnt, size_t len) {
+    // Wait for the producers that reserved space before us to finish copying.
+    while (atomic_load_explicit(&ctx->shared_done, memory_order_acquire) != off) {
+        sched_yield();
+    }
+
+    int failed;
+    size_t kept = 0;
+    ctx->write_buffer_pos = off;
+    if (len > ctx->write_buffer_sz) {
+        failed = ctx_writev_through(ctx, iov, iovcnt) != len;
+    } else {
+        uint64_t start = bufrw_stats_clock();
+        size_t put = bufrw_io_write_full(ctx, ctx->write_buffer, off);
+        bufrw_stats_io(ctx, BUFRW_IO_FLUSH, start, off, (ssize_t)put);
+        failed = put != off;
+        if (!failed) {
+            kept = iov_gather(ctx->write_buffer, iov, iovcnt);
+        }
+    }
+    ctx->write_buffer_pos = 0;
+    if (failed) {
+        atomic_store_explicit(&ctx->shared_err, 1, memory_order_relaxed);
+    }
+
+    // Reopen the buffer; done must be reset before tail is published.
+    atomic_store_explicit(&ctx->shared_done, kept, memory_order_relaxed);
+    atomic_store_explicit(&ctx->shared_tail, kept, memory_order_release);
+    return failed ? 0 : len;
+}
+
+/*
+ * Append the len bytes of iov to the shared write buffer of ctx as one
+ * record, without locking. Returns the number of bytes accepted.
+ */
+static size_t shared_write(bufrw_t *ctx, const struct iovec *iov, int iovcnt, size_t len) {
+    size_t cap = ctx->write_buffer_sz;
+
+    for (;;) {
+        size_t off = atomic_fetch_add_explicit(&ctx->shared_tail, len, memory_order_acq_rel);
+        if (off + len <= cap) {
+            iov_gather(ctx->write_buffer + off, iov, iovcnt);
+            atomic_fetch_add_explicit(&ctx->shared_done, len, memory_order_release);
+            return len;
+        }
+        if (off <= cap) {
+            // Our reservation crossed the end: we own the drain.
+            return shared_drain(ctx, off, iov, iovcnt, len);
+        }
+        // Another producer is draining; retry once it reopens the buffer.
+        shared_wait(ctx);
+    }
+}
+
+/*
+ * Flush the shared write buffer of ctx. Returns 0 on success, or -1 if
+ * any drain so far has failed.
+ */
+static int shared_flush(bufrw_t *ctx) {
+    size_t cap = ctx->write_buffer_sz;
+
+    // Reserving more than the whole buffer forces a drain of what is there.
+    size_t off = atomic_fetch_add_explicit(&ctx->shared_tail, cap + 1, memory_order_acq_rel);
+    if (off <= cap) {
+        shared_drain(ctx, off, NULL, 0, 0);
+    } else {
+        // A drain already in progress covers everything we have written.
+        shared_wait(ctx);
+    }
+
+    return atomic_load_explicit(&ctx->shared_err, memory_order_relaxed) ? -1 : 0;
+}
+
+/*
+ * Write out everything pending in the write buffer of ctx.
+ *
+ * Bytes that could not be written stay in the buffer so that a later
+ * flush can retry them. Returns 0 on success, or -1 on error.
+ */
+static int ctx_flush(bufrw_t *ctx) {
+    if (ctx->shared) {
+        return shared_flush(ctx);
+    }
+    size_t pending = ctx->write_buffer_pos;
+    if (pending == 0 && !ctx->async && !ctx->uring) {
+        return 0;
+    }
+
+    uint64_t start = bufrw_stats_clock();
+    int ret = ctx->async ? bufrw_async_barrier(ctx)
+            : ctx->uring ? bufrw_uring_flush(ctx)
+            : ctx->adapt ? bufrw_adapt_drain(ctx)
+            : bufrw_ctx_drain(ctx);
+    if (pending > 0) {
+        bufrw_stats_io(ctx, BUFRW_IO_FLUSH, start, pending, (ssize_t)(pending - ctx->write_buffer_pos));
+    }
+    return ret;
+}
+
+/*
+ * Write out the write buffer of ctx with plain backend calls. Bytes that
+ * could not be written stay in the buffer. Returns 0 on success, or -1 on
+ * error.
+ */
+BUFRW_INTERNAL_FUNC int bufrw_ctx_drain(bufrw_t *ctx) {
+    size_t written = bufrw_io_write_full(ctx, ctx->write_buffer, ctx->write_buffer_pos);
+    if (written != ctx->write_buffer_pos) {
+        memmove(ctx->write_buffer, ctx->write_buffer + written, ctx->write_buffer_pos - written);
+        ctx->write_buffer_pos -= written;
+        return -1;
+    }
+    ctx->write_buffer_pos = 0;
+    return 0;
+}
+
+/*
+ * Stop any engine reading ahead on ctx before its stream is repositioned.
+ * Returns the number of bytes the stream is ahead of the read buffer.
+ */
+static size_t ctx_pause_reads(bufrw_t *ctx) {
+    if (ctx->readahead) {
+        return bufrw_ra_pause(ctx);
+    }
+    if (ctx->uring) {
+        return bufrw_uring_pause(ctx);
+    }
+    return 0;
+}
+
+/*
+ * Give back any pre-fetched but unread bytes of ctx.
+ *
+ * The stream is moved back by the number of unread bytes, including any
+ * blocks read ahead, so that its position matches what the caller has
+ * consumed. Returns 0 on success, or -1 on error.
+ */
+static int ctx_unread(bufrw_t *ctx) {
+    if (ctx->map) {
+        return 0;  // The mapping is the buffer; there is nothing to give back.
+    }
+    if (ctx->coder) {
+        // Decoded bytes cannot be pushed back into their frame.
+        ctx_pause_reads(ctx);
+        ctx->read_buffer_pos = 0;
+        ctx->read_buffer_len = 0;
+        return 0;
+    }
+    size_t unread = ctx->read_buffer_len - ctx->read_buffer_pos + ctx_pause_reads(ctx);
+    ctx->read_buffer_pos = 0;
+    ctx->read_buffer_len = 0;
+    if (unread > 0 && ctx->ops->seek(ctx, -(long)unread, SEEK_CUR) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Smallest transfer that bypasses a buffer of buffer_sz bytes of ctx.
+ */
+BUFRW_PRIVATE_FUNC size_t ctx_direct_min(const bufrw_t *ctx, size_t buffer_sz) {
+    return ctx->direct_min ? ctx->direct_min : buffer_sz;
+}
+
+/*
+ * Flush pending writes of ctx and give back its unread bytes, leaving the
+ * stream at the caller's position. Returns 0 on success, or -1 on error.
+ */
+BUFRW_INTERNAL_FUNC int bufrw_ctx_settle(bufrw_t *ctx) {
+    int ret = ctx_flush(ctx);
+    if (ctx_unread(ctx) != 0) {
+        ret = -1;
+    }
+    return ret;
+}
+
+/*
+ * Number of bytes of a remaining transfer to move directly between the
+ * caller and the stream, skipping a buffer of buffer_sz bytes.
+ *
+ * Transfers below the threshold of ctx stay buffered. Larger ones go
+ * direct except for a tail shorter than the buffer, which is left to the
+ * buffer so that the next small request still hits it.
+ */
+BUFRW_PRIVATE_FUNC size_t ctx_direct_len(const bufrw_t *ctx, size_t remaining, size_t buffer_sz) {
+    if (buffer_sz == 0 || remaining < ctx_direct_min(ctx, buffer_sz)) {
+        return 0;
+    }
+
+    size_t direct = remaining - remaining % buffer_sz;
+    return direct ? direct : remaining;
+}
+
+/*
+ * Replace the drained read buffer of ctx with the next block of the
+ * stream, through whichever engine owns it. Returns the number of bytes
+ * read, 0 at end of file or -1 on error.
+ */
+static ssize_t ctx_refill(bufrw_t *ctx) {
+    uint64_t start = bufrw_stats_clock();
+    ssize_t got = ctx->readahead ? bufrw_ra_refill(ctx)
+                : ctx->uring ? bufrw_uring_refill(ctx)
+                : ctx->adapt ? bufrw_adapt_refill(ctx)
+                : ctx->ops->read(ctx, ctx->read_buffer, ctx->read_buffer_sz);
+
+    // A record stream never ends a refill in the middle of a record. The
+    // engines own the stream; a block of theirs is only short at its end.
+    if (ctx->rec_sz && got > 0 && !ctx->readahead && !ctx->uring) {
+        while ((size_t)got % ctx->rec_sz != 0) {
+            ssize_t more = ctx->ops->read(ctx, ctx->read_buffer + got, ctx->read_buffer_sz - (size_t)got);
+            if (more <= 0) {
+                break;
+            }
+            got += more;
+        }
+    }
+    ctx->read_buffer_pos = 0;
+    ctx->read_buffer_len = got > 0 ? (size_t)got : 0;
+    bufrw_stats_io(ctx, BUFRW_IO_REFILL, start, ctx->read_buffer_sz, got);
+    return got;
+}
+
+/*
+ * Copy total bytes out of the read buffer of ctx, refilling it from the
+ * stream whenever it runs empty. Returns the number of bytes copied.
+ */
+static size_t ctx_read(bufrw_t *restrict ctx, char *restrict out_ptr, size_t total_bytes) {
+    size_t bytes_read = 0;
+
+    while (bytes_read < total_bytes) {
+        if (ctx->read_buffer_pos >= ctx->read_buffer_len) {
+            // Large requests skip the buffer once it is drained, unless an
+            // engine reading ahead owns the stream, buffers must be aligned
+            // or the buffer is a mapping with no stream behind it.
+            size_t direct = ctx->readahead || ctx->uring || ctx->dio || ctx->map ? 0 : ctx_direct_len(ctx, total_bytes - bytes_read, ctx->read_buffer_sz);
+            if (direct > 0) {
+                uint64_t start = bufrw_stats_clock();
+                size_t got = bufrw_io_read_full(ctx, out_ptr + bytes_read, direct);
+                bufrw_stats_io(ctx, BUFRW_IO_DIRECT_READ, start, direct, (ssize_t)got);
+                bytes_read += got;
+                if (got < direct) {
+                    break;  // EOF or read error.
+                }
+                continue;
+            }
+
+            // If our buffer is empty, refill it.
+            if (ctx_refill(ctx) <= 0) {
+                break;  // EOF or read error.
+            }
+        }
+
+        // Determine how many bytes to copy from our internal buffer.
+        size_t available = ctx->read_buffer_len - ctx->read_buffer_pos;
+        size_t to_copy = total_bytes - bytes_read;
+        if (to_copy > available) {
+            to_copy = available;
+        }
+
+        memcpy(out_ptr + bytes_read, ctx->read_buffer + ctx->read_buffer_pos, to_copy);
+        ctx->read_buffer_pos += to_copy;
+        ctx->stats.bytes_copied += to_copy;
+        bytes_read += to_copy;
+    }
+
+    return bytes_read;
+}
+
+/*
+ * Get ctx ready for reading: flush pending writes, which must reach the
+ * stream before reading past them, and allocate the read buffer.
+ * Returns 0 on success, or -1 on error.
+ */
+static int ctx_begin_read(bufrw_t *ctx) {
+    if (ctx->shared) {
+        errno = EBADF;
+        return -1;
+    }
+    // The two directions of a non-blocking stream are independent.
+    if (!ctx->nonblock && ctx_flush(ctx) != 0) {
+        return -1;
+    }
+    if (!ctx->read_buffer && bufrw_ctx_alloc_read(ctx, ctx->rd_sz) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Make up to n bytes at the caller's position contiguous in the read
+ * buffer of ctx, refilling it as needed, but never more than the buffer
+ * holds. Returns the number of bytes available there.
+ */
+static size_t ctx_window(bufrw_t *ctx, size_t n) {
+    size_t available = ctx->read_buffer_len - ctx->read_buffer_pos;
+    if (ctx->map) {
+        bufrw_map_willneed(ctx, n < available ? n : available);
+        return n < available ? n : available;
+    }
+    if (n > ctx->read_buffer_sz) {
+        n = ctx->read_buffer_sz;
+    }
+    if (available >= n) {
+        return n;
+    }
+
+    // The engines swap buffers on refill; take the stream back from them
+    // and top up the current buffer in place.
+    size_t ahead = ctx_pause_reads(ctx);
+    if (ahead > 0 && ctx->ops->seek(ctx, -(long)ahead, SEEK_CUR) != 0) {
+        return available;
+    }
+
+    memmove(ctx->read_buffer, ctx->read_buffer + ctx->read_buffer_pos, available);
+    ctx->read_buffer_pos = 0;
+    ctx->read_buffer_len = available;
+    while (ctx->read_buffer_len < n) {
+        uint64_t start = bufrw_stats_clock();
+        size_t want = ctx->read_buffer_sz - ctx->read_buffer_len;
+        ssize_t got = ctx->ops->read(ctx, ctx->read_buffer + ctx->read_buffer_len, want);
+        bufrw_stats_io(ctx, BUFRW_IO_REFILL, start, want, got);
+        if (got <= 0) {
+            break;  // EOF or read error.
+        }
+        ctx->read_buffer_len += (size_t)got;
+    }
+
+    return ctx->read_buffer_len < n ? ctx->read_buffer_len : n;
+}
+
+/*
+ * Flush the full write buffer of ctx, or hand it to the engine writing
+ * behind. Returns 0 on success, or -1 on error.
+ */
+static int ctx_flush_full(bufrw_t *ctx) {
+    if (!ctx->async && !ctx->uring && !ctx->dio) {
+        return ctx_flush(ctx);
+    }
+
+    size_t pending = ctx->write_buffer_pos;
+    uint64_t start = bufrw_stats_clock();
+    int ret = ctx->async ? bufrw_async_submit(ctx)
+            : ctx->uring ? bufrw_uring_submit(ctx)
+            : bufrw_dio_drain(ctx);
+    bufrw_stats_io(ctx, BUFRW_IO_FLUSH, start, pending, ret == 0 ? (ssize_t)(pending - ctx->write_buffer_pos) : -1);
+    return ret;
+}
+
+/*
+ * Queue the len bytes of iov in the write buffer of non-blocking ctx,
+ * growing it as needed, and push out what the stream takes once more
+ * than the requested buffer size is pending. Returns the number of bytes
+ * queued.
+ */
+static size_t nonblock_write(bufrw_t *ctx, const struct iovec *iov, int iovcnt, size_t len) {
+    size_t pos = ctx->write_buffer_pos;
+    if (len > SIZE_MAX - pos) {
+        errno = ENOMEM;
+        return 0;
+    }
+    size_t need = pos + len > ctx->wr_sz ? pos + len : ctx->wr_sz;
+    if ((!ctx->write_buffer || need > ctx->write_buffer_sz) && bufrw_ctx_alloc_write(ctx, need) != 0) {
+        return 0;
+    }
+
+    iov_gather(ctx->write_buffer + pos, iov, iovcnt);
+    ctx->write_buffer_pos = pos + len;
+    ctx->stats.bytes_copied += len;
+    // Whatever the stream does not take now, or an error, waits for bfcflush.
+    if (ctx->write_buffer_pos >= ctx->wr_sz) {
+        int saved = errno;
+        ctx_flush(ctx);
+        errno = saved;
+    }
+    return len;
+}
+
+/*
+ * Copy total bytes into the write buffer of ctx, flushing it to the
+ * stream whenever it fills up. Returns the number of bytes accepted.
+ */
+static size_t ctx_write(bufrw_t *restrict ctx, const char *restrict in_ptr, size_t total_bytes) {
+    size_t bytes_written = 0;
+
+    while (bytes_written < total_bytes) {
+        // Large requests go straight to the stream along with the pending data,
+        // unless an engine writing behind owns the stream or buffers must be
+        // aligned.
+        size_t direct = ctx->async || ctx->uring || ctx->dio ? 0 : ctx_direct_len(ctx, total_bytes - bytes_written, ctx->write_buffer_sz);
+        if (direct > 0) {
+            struct iovec seg = { .iov_base = (void *)(in_ptr + bytes_written), .iov_len = direct };
+            size_t put = ctx_writev_through(ctx, &seg, 1);
+            bytes_written += put;
+            if (put < direct) {
+                break;
+            }
+            continue;
+        }
+
+        size_t available = ctx->write_buffer_sz - ctx->write_buffer_pos;
+        size_t to_copy = total_bytes - bytes_written;
+        if (to_copy > available) {
+            to_copy = available;
+        }
+
+        memcpy(ctx->write_buffer + ctx->write_buffer_pos, in_ptr + bytes_written, to_copy);
+        ctx->write_buffer_pos += to_copy;
+        ctx->stats.bytes_copied += to_copy;
+        bytes_written += to_copy;
+
+        // If the buffer is full, flush it or hand it to the engine.
+        if (ctx->write_buffer_pos == ctx->write_buffer_sz && ctx_flush_full(ctx) != 0) {
+            break;
+        }
+    }
+
+    return bytes_written;
+}
+
+/*
+ * Allocate a context on backend ops. Buffers are allocated on first use.
+ */
+BUFRW_INTERNAL_FUNC bufrw_t *bufrw_ctx_new(const bufrw_ops_t *ops, size_t rd_sz, size_t wr_sz) {
+    bufrw_t *ctx = (bufrw_t *)calloc(1, sizeof(*ctx));
+    if (!ctx) {
+        return NULL;
+    }
+    ctx->ops = ops;
+    bufrw_allocator_get(&ctx->alloc);
+    ctx->fd = -1;
+    ctx->offset = -1L;
+    ctx->limit = -1L;
+    ctx->rd_sz = rd_sz ? rd_sz : bfbestbufsz(SIZE_MAX);
+    ctx->wr_sz = wr_sz ? wr_sz : bfbestbufsz(SIZE_MAX);
+    return ctx;
+}
+
+/*
+ * bfopen: open a buffered stream context.
+ *
+ * Wraps stream in a new context owning a read buffer of rd_sz bytes and a
+ * write buffer of wr_sz bytes. A size of 0 picks that buffer's size with
+ * bfbestbufsz_fd and lets it adapt (see bfsetadaptive). Buffers are
+ * allocated on first use. The stream itself stays owned by
+ * the caller. Returns NULL on error.
+ */
+BUFRW_PUBLIC_FUNC bufrw_t *bfopen(FILE *stream, size_t rd_sz, size_t wr_sz) {
+    if (!stream) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    bufrw_t *ctx = bufrw_ctx_new(&stdio_ops, rd_sz, wr_sz);
+    if (!ctx) {
+        return NULL;
+    }
+    ctx->stream = stream;
+    bufrw_adapt_auto(ctx, fileno(stream), rd_sz == 0, wr_sz == 0);
+    return bufrw_registry_add(ctx);
+}
+
+/*
+ * bfopen_fd: open a buffered context on a file descriptor.
+ *
+ * Like bfopen, but refills and flushes are plain read(2) and write(2)
+ * calls on fd, so the context's buffers are the only ones involved. The
+ * descriptor stays owned by the caller. Returns NULL on error.
+ */
+BUFRW_PUBLIC_FUNC bufrw_t *bfopen_fd(int fd, size_t rd_sz, size_t wr_sz) {
+    if (fd < 0) {
+        errno = EBADF;
+        return NULL;
+    }
+
+    bufrw_t *ctx = bufrw_ctx_new(&fd_ops, rd_sz, wr_sz);
+    if (!ctx) {
+        return NULL;
+    }
+    ctx->fd = fd;
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    ctx->offset = pos < 0 ? -1L : (long)pos;
+    bufrw_adapt_auto(ctx, fd, rd_sz == 0, wr_sz == 0);
+    bufrw_dio_auto(ctx);
+    return bufrw_registry_add(ctx);
+}
+
+/*
+ * bfopen_fd_at: open a positional buffered context on a file descriptor.
+ *
+ * Like bfopen_fd, but the context keeps its own file offset, starting at
+ * offset, and transfers with pread(2) and pwrite(2). The descriptor's own
+ * offset is never moved, so several contexts can share one descriptor.
+ * Returns NULL on error.
+ */
+BUFRW_PUBLIC_FUNC bufrw_t *bfopen_fd_at(int fd, long offset, size_t rd_sz, size_t wr_sz) {
+    if (fd < 0 || offset < 0) {
+        errno = fd < 0 ? EBADF : EINVAL;
+        return NULL;
+    }
+
+    bufrw_t *ctx = bufrw_ctx_new(&fd_ops, rd_sz, wr_sz);
+    if (!ctx) {
+        return NULL;
+    }
+    ctx->fd = fd;
+    ctx->positional = 1;
+    ctx->offset = offset;
+    bufrw_adapt_auto(ctx, fd, rd_sz == 0, wr_sz == 0);
+    bufrw_dio_auto(ctx);
+    return bufrw_registry_add(ctx);
+}
+
+/*
+ * bfclose: close a buffered stream context.
+ *
+ * Flushes pending write data, moves the stream back over any unread
+ * pre-fetched bytes and frees the context. The stream is not closed.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfclose(bufrw_t *ctx) {
+    if (!ctx) {
+        return 0;
+    }
+
+    bufrw_registry_remove(ctx);
+    int ret = 0;
+    if (ctx->nonblock) {
+        // Drain what is queued with the descriptor's own flags; what was
+        // read ahead cannot be given back to a socket or pipe.
+        ctx->read_buffer_pos = ctx->read_buffer_len;
+        if (bfsetnonblock(ctx, 0) != 0) {
+            ret = -1;
+        }
+    }
+    if (ctx->async) {
+        ret = bufrw_async_teardown(ctx);
+    }
+    if (ctx_flush(ctx) != 0) {
+        ret = -1;
+    }
+    if (ctx_unread(ctx) != 0) {
+        ret = -1;
+    }
+    if (ctx->wb && bufrw_wb_teardown(ctx) != 0) {
+        ret = -1;
+    }
+    if (ctx->readahead) {
+        bufrw_ra_teardown(ctx);
+    }
+    if (ctx->uring && bufrw_uring_teardown(ctx) != 0) {
+        ret = -1;
+    }
+    if (ctx->map && bufrw_map_teardown(ctx) != 0) {
+        ret = -1;
+    }
+    if (ctx->digest) {
+        bufrw_digest_teardown(ctx);
+    }
+    if (ctx->dio && bufrw_dio_teardown(ctx) != 0) {
+        ret = -1;
+    }
+    if (ctx->cache && bufrw_cache_teardown(ctx) != 0) {
+        ret = -1;
+    }
+    if (ctx->coder) {
+        bufrw_codec_teardown(ctx);
+    }
+    if (ctx->durable && bufrw_durable_teardown(ctx) != 0) {
+        ret = -1;
+    }
+
+    bufrw_stats_fold(ctx);
+    bufrw_buf_free(ctx, ctx->read_buffer, ctx->read_buffer_cap);
+    bufrw_buf_free(ctx, ctx->write_buffer, ctx->write_buffer_cap);
+    free(ctx->record);
+    free(ctx->adapt);
+    free(ctx);
+    return ret;
+}
+
+/*
+ * bfshare: switch a context to shared-stream append mode.
+ *
+ * Afterwards any number of threads may bfcwrite to ctx concurrently. Each
+ * call is appended as one contiguous record, space in the write buffer is
+ * reserved with atomic operations and no lock is taken. Reading is not
+ * supported in this mode; bfcseek, bfctell and bfclose must not race with
+ * producers, while bfcflush may be called by any of them to push out what
+ * it has written. Must be called before ctx is used.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfshare(bufrw_t *ctx) {
+    if (!ctx || ctx->async || ctx->readahead || ctx->uring || ctx->map || ctx->dio || ctx->cache || ctx->coder || ctx->digest || ctx->nonblock || ctx->wb || ctx->read_buffer_len > 0 || ctx->write_buffer_pos > 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (bufrw_ctx_alloc_write(ctx, ctx->wr_sz) != 0) {
+        return -1;
+    }
+
+    atomic_init(&ctx->shared_tail, 0);
+    atomic_init(&ctx->shared_done, 0);
+    atomic_init(&ctx->shared_err, 0);
+    ctx->shared = 1;
+    return 0;
+}
+
+/*
+ * bfsetdirect: set the direct transfer threshold of a context.
+ *
+ * Reads and writes of at least threshold bytes bypass the internal buffer
+ * once it has been drained or flushed; only their tail is buffered. A
+ * threshold of 0 restores the default, the buffer size. SIZE_MAX disables
+ * the direct path.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfsetdirect(bufrw_t *ctx, size_t threshold) {
+    if (!ctx) {
+        errno = EINVAL;
+        return -1;
+    }
+    ctx->direct_min = threshold;
+    return 0;
+}
+
+/*
+ * bfsetrecord: make a context a stream of fixed-size records.
+ *
+ * Sizes the buffers of ctx to whole records of rec_sz bytes, and from then
+ * on refills keep reading until they end on a record boundary, so that a
+ * record never straddles two buffers: as long as the stream position is
+ * a multiple of rec_sz, a record read is served in one piece from the
+ * buffer. Pending data is settled first. A rec_sz of 0 reverts to plain
+ * buffers. Engines (bfsetasync, bfsetreadahead, bfseturing) must be
+ * enabled afterwards; not available with bfsetodirect or in shared mode.
+ * See BUFRW_DEFINE_RECORD_STREAM for typed readers and writers.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfsetrecord(bufrw_t *ctx, size_t rec_sz) {
+    if (!ctx || ctx->shared || ctx->async || ctx->readahead || ctx->uring || ctx->dio || ctx->nonblock || ctx->wb) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (bufrw_ctx_settle(ctx) != 0) {
+        return -1;
+    }
+
+    ctx->rec_sz = rec_sz;
+    if (ctx->read_buffer && !ctx->map && bufrw_ctx_alloc_read(ctx, ctx->read_buffer_sz) != 0) {
+        return -1;
+    }
+    if (ctx->write_buffer && bufrw_ctx_alloc_write(ctx, ctx->write_buffer_sz) != 0) {
+        return -1;
+    }
+    return 0;
+}
 
-static char *write_buffer = NULL;
-static int write_buffer_allocated = 0;
-static size_t write_buffer_sz = 0;
-static size_t write_buffer_pos = 0;  // current position in write_buffer
+/*
+ * bfsetnonblock: switch a context to non-blocking mode.
+ *
+ * Puts the descriptor of ctx, which must be a bfopen_fd context on a
+ * socket, pipe or terminal, in O_NONBLOCK mode for use in an event loop.
+ * Reads then return what has arrived, with errno set to EAGAIN when they
+ * come up short for lack of data, and bfreaduntil and bfgetline return 0
+ * until a whole record has arrived, keeping the partial one buffered.
+ * Writes never block: bfcwrite and bfwritev queue everything, growing the
+ * write buffer as needed, and push out what the stream takes once more
+ * than the write buffer size is pending; bfcflush sends what it can and
+ * fails with EAGAIN while bytes remain. Reads and writes are independent,
+ * as on a socket: reading does not flush and writing does not give back
+ * read-ahead. Element reads should use a size of 1, as a partial element
+ * is consumed. See bfpollfd for the events to wait for. Turning the mode
+ * off, which bfclose does, restores the descriptor flags. Not available
+ * with engines, stages, adaptive buffers, records or in shared mode.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfsetnonblock(bufrw_t *ctx, int on) {
+    if (!ctx || (on && (bufrw_ctx_plain_fd(ctx) < 0 || ctx->positional || ctx->rec_sz))) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!on == !ctx->nonblock) {
+        return 0;
+    }
 
-static bufrw_ver_t bufrwv = { .major=1, .minor=0, .patch=1 };
+    if (!on) {
+        ctx->nonblock = 0;
+        ctx->want_read = 0;
+        return fcntl(ctx->fd, F_SETFL, ctx->nonblock_fl) == 0 ? 0 : -1;
+    }
+    int fl = fcntl(ctx->fd, F_GETFL);
+    if (fl < 0 || ctx_flush(ctx) != 0 || fcntl(ctx->fd, F_SETFL, fl | O_NONBLOCK) != 0) {
+        return -1;
+    }
+    // Buffer sizes stay put; queued writes grow the write buffer instead.
+    free(ctx->adapt);
+    ctx->adapt = NULL;
+    ctx->nonblock_fl = fl;
+    ctx->nonblock = 1;
+    return 0;
+}
 
 /*
- * bfver: bufrw version.
- * 
- * Get a current version of libbufrw.
+ * bfpollfd: get what a context waits for.
+ *
+ * Returns the descriptor of ctx, or -1 if it has none, and sets *events
+ * to the poll(2) events it waits for: POLLIN once a read has come up
+ * short for lack of data, POLLOUT while writes are pending in its write
+ * buffer. An event loop waits for them and then reads again or calls
+ * bfcflush; the values match EPOLLIN and EPOLLOUT.
  */
-BUFRW_PUBLIC_FUNC bufrw_ver_t bfver() { 
-    return bufrwv;
+BUFRW_PUBLIC_FUNC int bfpollfd(bufrw_t *ctx, int *events) {
+    if (!ctx || !events) {
+        errno = EINVAL;
+        return -1;
+    }
+    *events = (ctx->want_read ? POLLIN : 0) | (ctx->write_buffer_pos > 0 ? POLLOUT : 0);
+    return bufrw_ctx_fd(ctx);
+}
+
+/*
+ * bfcread: buffered fread on a context.
+ *
+ * Reads up to n elements of size bytes from ctx into ptr.
+ * Returns the number of complete items read.
+ */
+BUFRW_PUBLIC_FUNC size_t bfcread(bufrw_t *restrict ctx, void *restrict ptr, size_t size, size_t n) {
+    if (!ctx || size == 0) {
+        return 0;
+    }
+    if (ctx_begin_read(ctx) != 0) {
+        return 0;
+    }
+
+    size_t got = ctx_read(ctx, (char *)ptr, size * n);
+    ctx->stats.reads++;
+    ctx->stats.bytes_read += got;
+    return got / size;  // Return the number of complete items read.
+}
+
+/*
+ * bfpread: positional read on a context.
+ *
+ * Reads up to n bytes at offset off of the file of ctx into buf, without
+ * moving the position of ctx or touching its read buffer. Contexts with a
+ * block cache (see bfsetcache) are served from it, mapped ones from the
+ * mapping; pending writes are flushed first. Not available with
+ * bfsetodirect, bfsetcodec or in shared mode. Returns the number of bytes read, less
+ * than n only at the end of the file or on error.
+ */
+BUFRW_PUBLIC_FUNC size_t bfpread(bufrw_t *restrict ctx, void *restrict buf, size_t n, long off) {
+    if (!ctx || !buf || off < 0 || ctx->dio || ctx->coder) {
+        errno = EINVAL;
+        return 0;
+    }
+    if (ctx->shared) {
+        errno = EBADF;
+        return 0;
+    }
+    if (ctx->map) {
+        size_t size = ctx->read_buffer_len;
+        if ((size_t)off >= size) {
+            return 0;
+        }
+        size_t got = size - (size_t)off < n ? size - (size_t)off : n;
+        memcpy(buf, ctx->read_buffer + off, got);
+        return got;
+    }
+    if (ctx_flush(ctx) != 0 || (ctx->stream && fflush(ctx->stream) != 0)) {
+        return 0;
+    }
+    if (ctx->cache) {
+        return bufrw_cache_pread(ctx, buf, n, off);
+    }
+
+    int fd = bufrw_ctx_fd(ctx);
+    size_t done = 0;
+    while (done < n) {
+        ssize_t got = pread(fd, (char *)buf + done, n - done, (off_t)off + (off_t)done);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            break;  // EOF or read error.
+        }
+        done += (size_t)got;
+    }
+    if (ctx->wb) {
+        done = (size_t)bufrw_wb_overlay(ctx, buf, n, off, (ssize_t)done);
+    }
+    return done;
+}
+
+/*
+ * bfview: zero-copy read on a context.
+ *
+ * Consumes up to n bytes of ctx and points *out at them, without copying:
+ * into the mapping for bfopen_map contexts, into the read buffer
+ * otherwise, where a view is limited to the buffer size. The bytes stay
+ * valid until the next call on ctx. Returns the number of bytes viewed,
+ * less than n only at the end of the stream or on error.
+ */
+BUFRW_PUBLIC_FUNC size_t bfview(bufrw_t *ctx, size_t n, const void **out) {
+    if (!ctx || !out) {
+        errno = EINVAL;
+        return 0;
+    }
+    if (ctx_begin_read(ctx) != 0) {
+        return 0;
+    }
+
+    size_t got = ctx_window(ctx, n);
+    *out = ctx->read_buffer + ctx->read_buffer_pos;
+    ctx->read_buffer_pos += got;
+    return got;
+}
+
+/*
+ * bfpeek: zero-copy look ahead on a context.
+ *
+ * Like bfview, but the bytes are not consumed: the next read or view on
+ * ctx starts with them again.
+ */
+BUFRW_PUBLIC_FUNC size_t bfpeek(bufrw_t *ctx, size_t n, const void **out) {
+    if (!ctx || !out) {
+        errno = EINVAL;
+        return 0;
+    }
+    if (ctx_begin_read(ctx) != 0) {
+        return 0;
+    }
+
+    size_t got = ctx_window(ctx, n);
+    *out = ctx->read_buffer + ctx->read_buffer_pos;
+    return got;
+}
+
+/*
+ * Append the n bytes at p to the record buffer of ctx, which holds rec
+ * bytes so far. Returns 0 on success, or -1 on error.
+ */
+static int ctx_record_append(bufrw_t *restrict ctx, size_t rec, const char *restrict p, size_t n) {
+    if (rec + n > ctx->record_cap) {
+        size_t cap = ctx->record_cap ? ctx->record_cap : ctx->read_buffer_sz;
+        while (cap < rec + n) {
+            cap *= 2;
+        }
+        char *grown = (char *)realloc(ctx->record, cap);
+        if (!grown) {
+            return -1;
+        }
+        ctx->record = grown;
+        ctx->record_cap = cap;
+    }
+    memcpy(ctx->record + rec, p, n);
+    ctx->stats.bytes_copied += n;
+    return 0;
+}
+
+/*
+ * Body of bfreaduntil on a context ready for reading.
+ */
+static size_t ctx_readuntil(bufrw_t *ctx, int delim, const void **out) {
+    size_t scanned = 0;
+    for (;;) {
+        const char *start = ctx->read_buffer + ctx->read_buffer_pos;
+        size_t available = ctx->read_buffer_len - ctx->read_buffer_pos;
+        const char *hit = bufrw_scan(start + scanned, delim, available - scanned);
+        if (hit || ctx->map) {
+            size_t len = hit ? (size_t)(hit - start) + 1 : available;
+            *out = start;
+            ctx->read_buffer_pos += len;
+            return len;
+        }
+        scanned = available;
+
+        if (available == 0) {
+            if (ctx_refill(ctx) <= 0) {
+                return 0;  // EOF or read error.
+            }
+            scanned = 0;
+            continue;
+        }
+        if (available < ctx->read_buffer_sz && !ctx->readahead && !ctx->uring) {
+            // Pull the rest of the record in behind the part we have.
+            if (ctx_window(ctx, available + 1) > available) {
+                continue;
+            }
+            if (ctx->want_read) {
+                return 0;  // The rest has yet to arrive; keep what we have.
+            }
+            *out = ctx->read_buffer + ctx->read_buffer_pos;
+            ctx->read_buffer_pos += available;
+            return available;  // The stream ends without a delimiter.
+        }
+        if (ctx->nonblock) {
+            // A partial record has to stay put until the rest arrives.
+            if (bufrw_ctx_alloc_read(ctx, ctx->read_buffer_sz * 2) != 0) {
+                return 0;
+            }
+            continue;
+        }
+        break;
+    }
+
+    // The record does not fit in place: gather it block by block.
+    size_t rec = 0;
+    for (;;) {
+        const char *start = ctx->read_buffer + ctx->read_buffer_pos;
+        size_t available = ctx->read_buffer_len - ctx->read_buffer_pos;
+        const char *hit = bufrw_scan(start + scanned, delim, available - scanned);
+        size_t take = hit ? (size_t)(hit - start) + 1 : available;
+        if (ctx_record_append(ctx, rec, start, take) != 0) {
+            return 0;
+        }
+        ctx->read_buffer_pos += take;
+        rec += take;
+        scanned = 0;
+        if (hit || ctx_refill(ctx) <= 0) {
+            break;
+        }
+    }
+
+    *out = ctx->record;
+    return rec;
+}
+
+/*
+ * bfreaduntil: zero-copy delimited read on a context.
+ *
+ * Consumes the next record of ctx, up to and including the first delim
+ * byte, and points *out at it; the last record of the stream may lack
+ * the delimiter. The read buffer is searched in place with a vector
+ * kernel picked for the CPU at run time. A record that fits in the read
+ * buffer is viewed where it lies, a longer one, or one straddling a
+ * refill while an engine owns the stream, is assembled in a buffer of the
+ * context. The bytes stay valid until the next call on ctx. Returns the
+ * length of the record, or 0 at the end of the stream or on error.
+ */
+BUFRW_PUBLIC_FUNC size_t bfreaduntil(bufrw_t *ctx, int delim, const void **out) {
+    if (!ctx || !out) {
+        errno = EINVAL;
+        return 0;
+    }
+    if (ctx_begin_read(ctx) != 0) {
+        return 0;
+    }
+
+    size_t len = ctx_readuntil(ctx, delim, out);
+    ctx->stats.reads++;
+    ctx->stats.bytes_read += len;
+    return len;
+}
+
+/*
+ * bfgetline: zero-copy line read on a context.
+ *
+ * Like bfreaduntil with a newline delimiter: points *line at the next
+ * line of ctx, newline included, and returns its length.
+ */
+BUFRW_PUBLIC_FUNC size_t bfgetline(bufrw_t *ctx, const char **line) {
+    const void *rec = NULL;
+    size_t len = bfreaduntil(ctx, '\n', line ? &rec : NULL);
+    if (line) {
+        *line = (const char *)rec;
+    }
+    return len;
+}
+
+/*
+ * Count a write call of ctx that took n bytes, which producers in shared
+ * mode do concurrently. Returns n.
+ */
+static size_t ctx_count_write(bufrw_t *ctx, size_t n) {
+    if (ctx->shared) {
+        __atomic_fetch_add(&ctx->stats.writes, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&ctx->stats.bytes_written, n, __ATOMIC_RELAXED);
+    } else {
+        ctx->stats.writes++;
+        ctx->stats.bytes_written += n;
+    }
+    return n;
+}
+
+/*
+ * bfcwrite: buffered fwrite on a context.
+ *
+ * Writes n elements of size bytes from ptr into ctx.
+ * Returns the number of complete items written.
+ */
+BUFRW_PUBLIC_FUNC size_t bfcwrite(bufrw_t *restrict ctx, const void *restrict ptr, size_t size, size_t n) {
+    if (!ctx || size == 0) {
+        return 0;
+    }
+    if (ctx->shared) {
+        struct iovec seg = { .iov_base = (void *)ptr, .iov_len = size * n };
+        return ctx_count_write(ctx, shared_write(ctx, &seg, 1, seg.iov_len)) / size;
+    }
+
+    if (ctx->map || ctx->cache) {
+        errno = EBADF;
+        return 0;
+    }
+
+    if (ctx->nonblock) {
+        struct iovec seg = { .iov_base = (void *)ptr, .iov_len = size * n };
+        return ctx_count_write(ctx, nonblock_write(ctx, &seg, 1, seg.iov_len)) / size;
+    }
+
+    // Writing starts at the caller's position, not past the pre-fetched data.
+    if (ctx_unread(ctx) != 0) {
+        return 0;
+    }
+    if (ctx->wb) {
+        struct iovec seg = { .iov_base = (void *)ptr, .iov_len = size * n };
+        return ctx_count_write(ctx, bufrw_wb_write(ctx, &seg, 1)) / size;
+    }
+    if (!ctx->write_buffer && bufrw_ctx_alloc_write(ctx, ctx->wr_sz) != 0) {
+        return 0;
+    }
+
+    return ctx_count_write(ctx, ctx_write(ctx, (const char *)ptr, size * n)) / size;
+}
+
+/*
+ * bfwritev: buffered writev on a context.
+ *
+ * Writes the iovcnt segments of iov into ctx in order. Segments below the
+ * direct threshold (see bfsetdirect) are coalesced into the write buffer;
+ * segments up to the last large one are written together with the pending
+ * buffer contents in a single writev, without copying them. In shared mode
+ * the segments form one record. Returns the number of bytes written.
+ */
+BUFRW_PUBLIC_FUNC size_t bfwritev(bufrw_t *ctx, const struct iovec *iov, int iovcnt) {
+    if (!ctx || (!iov && iovcnt > 0) || iovcnt < 0) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        total += iov[i].iov_len;
+    }
+    if (ctx->shared) {
+        return ctx_count_write(ctx, shared_write(ctx, iov, iovcnt, total));
+    }
+    if (ctx->map || ctx->cache) {
+        errno = EBADF;
+        return 0;
+    }
+    if (ctx->nonblock) {
+        return ctx_count_write(ctx, nonblock_write(ctx, iov, iovcnt, total));
+    }
+
+    if (ctx_unread(ctx) != 0) {
+        return 0;
+    }
+    if (ctx->wb) {
+        return ctx_count_write(ctx, bufrw_wb_write(ctx, iov, iovcnt));
+    }
+    if (!ctx->write_buffer && bufrw_ctx_alloc_write(ctx, ctx->wr_sz) != 0) {
+        return 0;
+    }
+
+    size_t threshold = ctx->async || ctx->uring || ctx->dio ? SIZE_MAX : ctx_direct_min(ctx, ctx->write_buffer_sz);
+    int last = -1;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len >= threshold) {
+            last = i;
+        }
+    }
+
+    size_t written = 0;
+    if (last >= 0) {
+        size_t head = 0;
+        for (int i = 0; i <= last; i++) {
+            head += iov[i].iov_len;
+        }
+        written = ctx_writev_through(ctx, iov, last + 1);
+        if (written < head) {
+            return ctx_count_write(ctx, written);
+        }
+    }
+
+    for (int i = last + 1; i < iovcnt; i++) {
+        size_t put = ctx_write(ctx, (const char *)iov[i].iov_base, iov[i].iov_len);
+        written += put;
+        if (put < iov[i].iov_len) {
+            break;
+        }
+    }
+    return ctx_count_write(ctx, written);
+}
+
+/*
+ * bfcflush: flush the write buffer of a context.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfcflush(bufrw_t *ctx) {
+    if (!ctx) {
+        return -1;
+    }
+    if (ctx_flush(ctx) != 0) {
+        return -1;
+    }
+    if (ctx->wb && bufrw_wb_flush(ctx) != 0) {
+        return -1;
+    }
+    return ctx->durable ? bufrw_durable_commit(ctx) : 0;
+}
+
+/*
+ * Move the caller's position of ctx to offset from whence without
+ * touching the stream, if the target lies within the bytes in the read
+ * buffer. Returns 1 if it did, 0 if the stream has to be repositioned.
+ */
+static int ctx_seek_window(bufrw_t *ctx, long offset, int whence) {
+    if (ctx->read_buffer_len == 0 || (whence != SEEK_SET && whence != SEEK_CUR)) {
+        return 0;
+    }
+
+    // The window ends where the stream is, as seen by the read buffer.
+    long end = ctx->readahead ? bufrw_ra_tell(ctx) : ctx->ops->tell(ctx);
+    if (end < 0) {
+        return 0;
+    }
+    long start = end - (long)ctx->read_buffer_len;
+    long target = whence == SEEK_SET ? offset : start + (long)ctx->read_buffer_pos + offset;
+    if (target < start || target > end) {
+        return 0;
+    }
+
+    ctx->read_buffer_pos = (size_t)(target - start);
+    return 1;
+}
+
+/*
+ * bfcseek: buffered fseek on a context.
+ *
+ * Flushes pending write data before seeking, except what a write-back
+ * window holds (see bfsetwriteback). A target within the bytes already in
+ * the read buffer only moves the position in it; otherwise the read
+ * buffer is dropped and the stream repositioned. SEEK_CUR is relative to
+ * the caller's position, not the stream's.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfcseek(bufrw_t *ctx, long offset, int whence) {
+    if (!ctx) {
+        return -1;
+    }
+
+    ctx->stats.seeks++;
+
+    /* If there is any pending write data, flush it first. */
+    if (ctx_flush(ctx) != 0) {
+        return -1;
+    }
+
+    /* Short hops stay within the buffered window. */
+    if (!ctx->map && ctx_seek_window(ctx, offset, whence)) {
+        ctx->stats.seeks_in_buffer++;
+        return 0;
+    }
+
+    /* Stop reading ahead; the blocks it fetched are dropped with the buffer. */
+    size_t ahead = ctx_pause_reads(ctx);
+
+    /* The underlying file position is already advanced by the buffered data. */
+    if (whence == SEEK_CUR) {
+        offset -= (long)(ctx->read_buffer_len - ctx->read_buffer_pos + ahead);
+    }
+
+    /* Invalidate the read buffer, unless it is the mapped file itself. */
+    if (!ctx->map) {
+        ctx->read_buffer_pos = 0;
+        ctx->read_buffer_len = 0;
+    }
+
+    return ctx->ops->seek(ctx, offset, whence);
+}
+
+/*
+ * bfctell: buffered ftell on a context.
+ *
+ * Returns the caller's position in the stream, accounting for unread
+ * pre-fetched bytes and unwritten buffered bytes, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC long bfctell(bufrw_t *ctx) {
+    if (!ctx) {
+        return -1L;
+    }
+
+    // Let the flusher thread finish with the stream first.
+    if (ctx->async && bufrw_async_wait(ctx) != 0) {
+        return -1L;
+    }
+
+    long pos = ctx->readahead ? bufrw_ra_tell(ctx) : ctx->ops->tell(ctx);
+    if (pos == -1L) {
+        return -1L;
+    }
+
+    if (ctx->shared) {
+        pos += (long)atomic_load_explicit(&ctx->shared_done, memory_order_acquire);
+    }
+    pos += (long)ctx->write_buffer_pos;
+    pos -= (long)(ctx->read_buffer_len - ctx->read_buffer_pos);
+    return pos;
+}
+
+#if !defined(BUFRW_NO_THREAD_LOCAL)
+/* Thread exit hook releasing the buffers of a thread's legacy context. */
+static void legacy_release(void *arg) {
+    bufrw_t *ctx = (bufrw_t *)arg;
+    bufrw_buf_free(ctx, ctx->read_buffer, ctx->read_buffer_cap);
+    bufrw_buf_free(ctx, ctx->write_buffer, ctx->write_buffer_cap);
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+static void legacy_key_init(void) {
+    pthread_key_create(&legacy_key, legacy_release);
+}
+#endif
+
+/*
+ * Bind the legacy context to stream.
+ *
+ * Pending writes are flushed to the stream they were made for. Pre-fetched
+ * data of the previous stream is dropped: it must never be handed to a
+ * different stream, and the previous stream may already be closed.
+ */
+static void legacy_bind(FILE *stream) {
+    if (legacy_ctx.stream == stream) {
+        return;
+    }
+
+#if !defined(BUFRW_NO_THREAD_LOCAL)
+    pthread_once(&legacy_key_once, legacy_key_init);
+    if (pthread_getspecific(legacy_key) == NULL) {
+        pthread_setspecific(legacy_key, &legacy_ctx);
+    }
+#endif
+
+    if (legacy_ctx.stream) {
+        ctx_flush(&legacy_ctx);
+    }
+    legacy_ctx.write_buffer_pos = 0;
+    legacy_ctx.read_buffer_pos = 0;
+    legacy_ctx.read_buffer_len = 0;
+    if (!legacy_ctx.read_buffer && !legacy_ctx.write_buffer) {
+        bufrw_allocator_get(&legacy_ctx.alloc);
+    }
+    legacy_ctx.ops = &stdio_ops;
+    legacy_ctx.stream = stream;
+    legacy_ctx.fd = -1;
+    legacy_ctx.offset = -1L;
 }
 
 /*
@@ -36,48 +1723,21 @@ BUFRW_PUBLIC_FUNC bufrw_ver_t bfver() {
  *
  * Reads up to n elements of size bytes from stream into ptr using an internal buffer
  * of size buffer_sz. Returns the number of complete items read.
+ *
+ * The buffer only grows: a smaller buffer_sz than before refills less
+ * without reallocating, and pre-fetched data survives any change.
+ *
+ * The internal buffer is private to the calling thread.
  */
 BUFRW_PUBLIC_FUNC size_t bfread(void * restrict ptr, size_t size, size_t n, size_t buffer_sz, FILE *restrict stream) {
-    // (Re)allocate the read buffer if needed.
-    if (read_buffer == NULL || read_buffer_sz != buffer_sz) {
-        free(read_buffer);
-        read_buffer = (char*)malloc(buffer_sz);
-        if (!read_buffer) {
-            return 0; // Allocation failed.
-        }
-        read_buffer_allocated = 1;
-        read_buffer_sz = buffer_sz;
-        read_buffer_pos = 0;
-        read_buffer_len = 0;
-    }
-    
-    size_t total_bytes = size * n;
-    size_t bytes_read = 0;
-    char *out_ptr = (char *)ptr;
-    
-    while (bytes_read < total_bytes) {
-        // If our buffer is empty, refill it.
-        if (read_buffer_pos >= read_buffer_len) {
-            read_buffer_len = fread(read_buffer, 1, read_buffer_sz, stream);
-            read_buffer_pos = 0;
-            if (read_buffer_len == 0) {
-                break;  // EOF or read error.
-            }
-        }
-        
-        // Determine how many bytes to copy from our internal buffer.
-        size_t available = read_buffer_len - read_buffer_pos;
-        size_t to_copy = total_bytes - bytes_read;
-        if (to_copy > available) {
-            to_copy = available;
-        }
-        
-        memcpy(out_ptr + bytes_read, read_buffer + read_buffer_pos, to_copy);
-        read_buffer_pos += to_copy;
-        bytes_read += to_copy;
+    legacy_bind(stream);
+
+    // Grow the read buffer if needed; unread bytes are kept.
+    if (bufrw_ctx_alloc_read(&legacy_ctx, buffer_sz) != 0) {
+        return 0;
     }
-    
-    return bytes_read / size;  // Return the number of complete items read.
+
+    return bfcread(&legacy_ctx, ptr, size, n);
 }
 
 /*
@@ -85,46 +1745,25 @@ BUFRW_PUBLIC_FUNC size_t bfread(void * restrict ptr, size_t size, size_t n, size
  *
  * Writes n elements of size bytes from ptr into stream using an internal buffer
  * of size buffer_sz. Returns the number of complete items written.
+ *
+ * The buffer only grows: a smaller buffer_sz than before flushes sooner
+ * without reallocating.
+ *
+ * The internal buffer is private to the calling thread.
  */
 BUFRW_PUBLIC_FUNC size_t bfwrite(const void * restrict ptr, size_t size, size_t n, size_t buffer_sz, FILE *restrict stream) {
-    // (Re)allocate the write buffer if needed.
-    if (write_buffer == NULL || write_buffer_sz != buffer_sz) {
-        free(write_buffer);
-        write_buffer = malloc(buffer_sz);
-        if (!write_buffer) {
-            return 0;  // Allocation failed.
-        }
-        write_buffer_allocated = 1;
-        write_buffer_sz = buffer_sz;
-        write_buffer_pos = 0;
-    }
-    
-    size_t total_bytes = size * n;
-    size_t bytes_written = 0;
-    const char *in_ptr = (const char *)ptr;
-    
-    while (bytes_written < total_bytes) {
-        size_t available = write_buffer_sz - write_buffer_pos;
-        size_t to_copy = total_bytes - bytes_written;
-        if (to_copy > available) {
-            to_copy = available;
-        }
-        
-        memcpy(write_buffer + write_buffer_pos, in_ptr + bytes_written, to_copy);
-        write_buffer_pos += to_copy;
-        bytes_written += to_copy;
-        
-        // If the buffer is full, flush it.
-        if (write_buffer_pos == write_buffer_sz) {
-            size_t written = fwrite(write_buffer, 1, write_buffer_sz, stream);
-            if (written != write_buffer_sz) {
-                break;
-            }
-            write_buffer_pos = 0;
-        }
+    legacy_bind(stream);
+
+    // Grow the write buffer if needed; a smaller size first flushes what
+    // no longer fits under it.
+    if (buffer_sz < legacy_ctx.write_buffer_pos && ctx_flush(&legacy_ctx) != 0) {
+        return 0;
     }
-    
-    return bytes_written / size;
+    if (bufrw_ctx_alloc_write(&legacy_ctx, buffer_sz) != 0) {
+        return 0;
+    }
+
+    return bfcwrite(&legacy_ctx, ptr, size, n);
 }
 
 /*
@@ -133,9 +1772,8 @@ BUFRW_PUBLIC_FUNC size_t bfwrite(const void * restrict ptr, size_t size, size_t
  * This function writes any data remaining in the internal write buffer to stream.
  */
 BUFRW_PUBLIC_FUNC void bfflush(FILE *stream) {
-    if (write_buffer && write_buffer_pos > 0) {
-        fwrite(write_buffer, 1, write_buffer_pos, stream);
-        write_buffer_pos = 0;
+    if (legacy_ctx.stream == stream) {
+        ctx_flush(&legacy_ctx);
     }
 }
 
@@ -143,31 +1781,16 @@ BUFRW_PUBLIC_FUNC void bfflush(FILE *stream) {
  * bfseek: buffered fseek.
  *
  * Before performing the actual fseek, flush any pending write data and adjust
- * the read buffer if data has been pre-fetched.
+ * the read buffer if data has been pre-fetched. Targets within the pre-fetched
+ * data are reached without an fseek.
  *
  * Returns 0 on success, or -1 on error.
  */
 BUFRW_PUBLIC_FUNC int bfseek(FILE *stream, long offset, int whence) {
-    /* If there is any pending write data, flush it first. */
-    if (write_buffer && write_buffer_pos > 0) {
-        if (fwrite(write_buffer, 1, write_buffer_pos, stream) != write_buffer_pos) {
-            return -1;
-        }
-        write_buffer_pos = 0;
-    }
-    
-    /* If we are reading and the seek is relative to the current position,
-       adjust the offset to account for unread bytes in the read buffer.
-       (Because the underlying file position is already advanced by the buffered data.) */
-    if (read_buffer && whence == SEEK_CUR) {
-        offset -= (read_buffer_len - read_buffer_pos);
+    if (legacy_ctx.stream != stream) {
+        return fseek(stream, offset, whence);
     }
-    
-    /* Invalidate the read buffer. */
-    read_buffer_pos = 0;
-    read_buffer_len = 0;
-    
-    return fseek(stream, offset, whence);
+    return bfcseek(&legacy_ctx, offset, whence);
 }
 
 /*
@@ -178,22 +1801,10 @@ BUFRW_PUBLIC_FUNC int bfseek(FILE *stream, long offset, int whence) {
  * unwritten data in the write buffer.
  */
 BUFRW_PUBLIC_FUNC long bftell(FILE *stream) {
-    long pos = ftell(stream);
-    if (pos == -1L) {
-        return -1L;
+    if (legacy_ctx.stream != stream) {
+        return ftell(stream);
     }
-    
-    if (write_buffer && write_buffer_pos > 0) {
-        /* If there is pending write data, the effective position is ahead
-           of the underlying file position by write_buffer_pos bytes. */
-        pos += write_buffer_pos;
-    } else if (read_buffer) {
-        /* For reads, the underlying file position is ahead of the user’s
-           view by the number of unread bytes in the buffer. */
-        pos -= (read_buffer_len - read_buffer_pos);
-    }
-    
-    return pos;
+    return bfctell(&legacy_ctx);
 }
 
 /*
@@ -231,19 +1842,12 @@ BUFRW_PUBLIC_FUNC size_t bfbestbufsz(size_t fullsz) {
  * bfcleanup: free the internal buffers.
  *
  * This should be called when you are done using the buffered I/O functions to
- * avoid memory leaks.
+ * avoid memory leaks. Only the calling thread's buffers are released; other
+ * threads release theirs when they exit.
  */
 BUFRW_DESTRUCTOR
 BUFRW_PUBLIC_FUNC void bfcleanup(void) {
-    if (read_buffer_allocated  && read_buffer) {
-        free(read_buffer);
-        read_buffer_allocated = 0;
-    }
-    read_buffer_sz = read_buffer_pos = 0;
-
-    if (write_buffer_allocated && write_buffer) {
-        free(write_buffer);
-        write_buffer_allocated = 0;
-    }
-    write_buffer_sz = write_buffer_pos = 0;
+    bufrw_buf_free(&legacy_ctx, legacy_ctx.read_buffer, legacy_ctx.read_buffer_cap);
+    bufrw_buf_free(&legacy_ctx, legacy_ctx.write_buffer, legacy_ctx.write_buffer_cap);
+    memset(&legacy_ctx, 0, sizeof(legacy_ctx));
 }
\ No newline at end of file
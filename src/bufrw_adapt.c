@@ -0,0 +1,341 @@
+#define BUFRW_LIBRARY_BUILD
+
+#include "bufrw_internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#if !defined(BUFRW_ADAPT_MIN)
+#define BUFRW_ADAPT_MIN 4096
+#endif // BUFRW_ADAPT_MIN
+
+#if !defined(BUFRW_ADAPT_MAX)
+#define BUFRW_ADAPT_MAX (4U << 20)
+#endif // BUFRW_ADAPT_MAX
+
+/* Starting sizes for pipes and sockets, which hand over what is there. */
+#define BUFRW_ADAPT_PIPE_SZ 4096
+#define BUFRW_ADAPT_SOCK_SZ 16384
+
+/* Device I/O units per buffer on files and block devices. */
+#define BUFRW_ADAPT_IO_UNITS 16
+
+/* Transfers observed at one size before deciding to resize. */
+#define BUFRW_ADAPT_SAMPLES 4
+
+/* Throughput gain, in percent, a doubling must bring to keep growing. */
+#define BUFRW_ADAPT_GAIN 10
+
+static atomic_size_t adapt_min = BUFRW_ADAPT_MIN;
+static atomic_size_t adapt_max = BUFRW_ADAPT_MAX;
+
+/*
+ * Sizing state of one buffer.
+ *
+ * A buffer that keeps being filled or drained completely doubles as long
+ * as each doubling improves the measured throughput; one that keeps
+ * moving only a fraction of its size halves.
+ */
+typedef struct _s_bufrw_adapt_dir {
+    int on;
+    size_t next;                // size to switch to at the next chance, 0 for none
+    unsigned full;              // complete transfers in a row at this size
+    unsigned partial;           // small transfers in a row
+    uint64_t bytes;             // sampled complete transfers at this size
+    uint64_t ns;
+    double prev_rate;           // bytes per ns before the last doubling
+    size_t ceiling;             // growing past this stopped paying off
+} bufrw_adapt_dir_t;
+
+struct _s_bufrw_adapt {
+    size_t min_sz;
+    size_t max_sz;
+    bufrw_adapt_dir_t rd;
+    bufrw_adapt_dir_t wr;
+};
+
+static uint64_t adapt_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static size_t adapt_clamp(size_t n, size_t lo, size_t hi) {
+    return n < lo ? lo : n > hi ? hi : n;
+}
+
+static size_t adapt_pow2(size_t n) {
+    size_t p = 1;
+    while (p < n && p <= SIZE_MAX / 2) {
+        p <<= 1;
+    }
+    return p;
+}
+
+/*
+ * Optimal I/O size the block device dev reports, or 0 if it does not.
+ * Partitions inherit the queue limits of their disk.
+ */
+static size_t adapt_optimal_io(dev_t dev) {
+    static const char *const paths[] = {
+        "/sys/dev/block/%u:%u/queue/optimal_io_size",
+        "/sys/dev/block/%u:%u/../queue/optimal_io_size",
+    };
+
+    for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+        char path[96];
+        snprintf(path, sizeof(path), paths[i], major(dev), minor(dev));
+        FILE *f = fopen(path, "r");
+        if (!f) {
+            continue;
+        }
+        unsigned long v = 0;
+        int ok = fscanf(f, "%lu", &v) == 1;
+        fclose(f);
+        if (ok && v > 0) {
+            return (size_t)v;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Account for one transfer of n bytes out of a buffer of cur bytes that
+ * took ns nanoseconds, and plan a resize when the pattern calls for one.
+ */
+static void adapt_note(bufrw_adapt_t *ad, bufrw_adapt_dir_t *dir, size_t cur, size_t n, uint64_t ns) {
+    if (n == cur) {
+        dir->partial = 0;
+        dir->bytes += n;
+        dir->ns += ns;
+        if (++dir->full < BUFRW_ADAPT_SAMPLES) {
+            return;
+        }
+
+        double rate = (double)dir->bytes / (double)(dir->ns ? dir->ns : 1);
+        if (dir->prev_rate > 0 && rate * 100 < dir->prev_rate * (100 + BUFRW_ADAPT_GAIN)) {
+            dir->ceiling = cur;  // The last doubling did not pay off.
+        }
+        if (cur <= ad->max_sz / 2 && (!dir->ceiling || cur < dir->ceiling)) {
+            dir->next = cur * 2;
+            dir->prev_rate = rate;
+        }
+        dir->full = 0;
+        dir->bytes = 0;
+        dir->ns = 0;
+    } else if (n < cur / 4) {
+        dir->full = 0;
+        if (++dir->partial >= BUFRW_ADAPT_SAMPLES && cur / 2 >= ad->min_sz) {
+            dir->next = cur / 2;
+            dir->partial = 0;
+            dir->prev_rate = 0;
+            dir->ceiling = 0;
+        }
+    } else {
+        dir->full = 0;
+        dir->partial = 0;
+    }
+}
+
+/* Start sampling afresh once a buffer has taken its new size. */
+static void adapt_resized(bufrw_adapt_dir_t *dir) {
+    dir->next = 0;
+    dir->full = 0;
+    dir->partial = 0;
+    dir->bytes = 0;
+    dir->ns = 0;
+}
+
+/*
+ * Refill the read buffer of ctx from its stream, resizing the drained
+ * buffer first if that has been planned. Returns the length read, 0 at
+ * end of file or -1 on error.
+ */
+BUFRW_INTERNAL_FUNC ssize_t bufrw_adapt_refill(bufrw_t *ctx) {
+    bufrw_adapt_t *ad = ctx->adapt;
+
+    if (ad->rd.on && ad->rd.next && ad->rd.next != ctx->read_buffer_sz) {
+        // A failed resize keeps the old buffer.
+        if (bufrw_ctx_alloc_read(ctx, ad->rd.next) == 0) {
+            ctx->rd_sz = ad->rd.next;
+        }
+        adapt_resized(&ad->rd);
+    }
+
+    uint64_t start = adapt_now();
+    ssize_t got = ctx->ops->read(ctx, ctx->read_buffer, ctx->read_buffer_sz);
+    if (ad->rd.on && got > 0) {
+        adapt_note(ad, &ad->rd, ctx->read_buffer_sz, (size_t)got, adapt_now() - start);
+    }
+    return got;
+}
+
+/*
+ * Write out the write buffer of ctx, then resize the emptied buffer if
+ * that has been planned. Returns 0 on success, or -1 on error.
+ */
+BUFRW_INTERNAL_FUNC int bufrw_adapt_drain(bufrw_t *ctx) {
+    bufrw_adapt_t *ad = ctx->adapt;
+    size_t n = ctx->write_buffer_pos;
+
+    uint64_t start = adapt_now();
+    if (bufrw_ctx_drain(ctx) != 0) {
+        return -1;
+    }
+    if (!ad->wr.on) {
+        return 0;
+    }
+    adapt_note(ad, &ad->wr, ctx->write_buffer_sz, n, adapt_now() - start);
+
+    if (ad->wr.next && ad->wr.next != ctx->write_buffer_sz) {
+        if (bufrw_ctx_alloc_write(ctx, ad->wr.next) == 0) {
+            ctx->wr_sz = ad->wr.next;
+        }
+        adapt_resized(&ad->wr);
+    }
+    return 0;
+}
+
+/*
+ * Turn on adaptive sizing for the buffers of ctx on fd for which the
+ * caller asked for size 0, starting from what bfbestbufsz_fd suggests.
+ */
+BUFRW_INTERNAL_FUNC void bufrw_adapt_auto(bufrw_t *ctx, int fd, int rd, int wr) {
+    if (!rd && !wr) {
+        return;
+    }
+
+    bufrw_adapt_t *ad = (bufrw_adapt_t *)calloc(1, sizeof(*ad));
+    if (!ad) {
+        return;  // Keep the static sizes.
+    }
+    ad->min_sz = atomic_load_explicit(&adapt_min, memory_order_relaxed);
+    ad->max_sz = atomic_load_explicit(&adapt_max, memory_order_relaxed);
+
+    size_t sz = bfbestbufsz_fd(fd, SIZE_MAX);
+    if (rd) {
+        ctx->rd_sz = sz;
+        ad->rd.on = 1;
+    }
+    if (wr) {
+        ctx->wr_sz = sz;
+        ad->wr.on = 1;
+    }
+    ctx->adapt = ad;
+}
+
+/*
+ * bfsetbufszlimits: set the process-wide buffer size limits.
+ *
+ * bfbestbufsz_fd never suggests a size outside min_sz and max_sz, and
+ * contexts opened afterwards with a buffer size of 0 adapt within them.
+ * A limit of 0 restores its built-in default, 4 KiB and 4 MiB.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfsetbufszlimits(size_t min_sz, size_t max_sz) {
+    min_sz = min_sz ? min_sz : BUFRW_ADAPT_MIN;
+    max_sz = max_sz ? max_sz : BUFRW_ADAPT_MAX;
+    if (min_sz > max_sz) {
+        errno = EINVAL;
+        return -1;
+    }
+    atomic_store_explicit(&adapt_min, min_sz, memory_order_relaxed);
+    atomic_store_explicit(&adapt_max, max_sz, memory_order_relaxed);
+    return 0;
+}
+
+/*
+ * bfbestbufsz_fd: choose a buffer size for a file descriptor.
+ *
+ * Unlike bfbestbufsz, looks at what fd is: pipes and sockets start small
+ * since a refill only gets what the writer has produced, files and block
+ * devices get a multiple of the larger of st_blksize and the device's
+ * optimal I/O size. The size never exceeds what fullsz, or a file's size,
+ * needs and stays within the limits of bfsetbufszlimits.
+ */
+BUFRW_PUBLIC_FUNC size_t bfbestbufsz_fd(int fd, size_t fullsz) {
+    size_t lo = atomic_load_explicit(&adapt_min, memory_order_relaxed);
+    size_t hi = atomic_load_explicit(&adapt_max, memory_order_relaxed);
+    struct stat st;
+    size_t sz;
+
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        sz = bfbestbufsz(fullsz);
+    } else if (S_ISFIFO(st.st_mode)) {
+        sz = BUFRW_ADAPT_PIPE_SZ;
+    } else if (S_ISSOCK(st.st_mode)) {
+        sz = BUFRW_ADAPT_SOCK_SZ;
+    } else if (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode)) {
+        size_t io = st.st_blksize > 0 ? (size_t)st.st_blksize : BUFRW_ADAPT_MIN;
+        size_t opt = adapt_optimal_io(S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev);
+        if (opt > io) {
+            io = opt;
+        }
+        sz = io * BUFRW_ADAPT_IO_UNITS;
+        if (S_ISREG(st.st_mode) && (size_t)st.st_size < fullsz) {
+            fullsz = st.st_size > 0 ? (size_t)st.st_size : 1;
+        }
+    } else {
+        sz = lo;  // Terminals and other character devices.
+    }
+
+    // A small transfer fits in one buffer rounded up to a power of two.
+    if (fullsz < sz) {
+        sz = adapt_pow2(fullsz ? fullsz : 1);
+    }
+    return adapt_clamp(sz, lo, hi);
+}
+
+/*
+ * bfsetadaptive: let a context resize its buffers on the fly.
+ *
+ * From now on, a buffer that keeps being filled or drained completely
+ * doubles while that raises the measured throughput per refill or flush,
+ * and one that keeps moving only a fraction of its size halves, always
+ * staying within min_sz and max_sz. A limit of 0 takes the process-wide
+ * one (see bfsetbufszlimits); equal limits pin both buffers at that size.
+ * Contexts opened with a buffer size of 0 adapt from the start. Engines
+ * (bfsetasync, bfsetreadahead, bfseturing) keep the sizes fixed while on.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfsetadaptive(bufrw_t *ctx, size_t min_sz, size_t max_sz) {
+    min_sz = min_sz ? min_sz : atomic_load_explicit(&adapt_min, memory_order_relaxed);
+    max_sz = max_sz ? max_sz : atomic_load_explicit(&adapt_max, memory_order_relaxed);
+    if (!ctx || ctx->map || ctx->shared || ctx->nonblock || min_sz > max_sz) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    bufrw_adapt_t *ad = ctx->adapt;
+    if (!ad) {
+        ad = (bufrw_adapt_t *)calloc(1, sizeof(*ad));
+        if (!ad) {
+            return -1;
+        }
+        ctx->adapt = ad;
+    }
+    ad->min_sz = min_sz;
+    ad->max_sz = max_sz;
+
+    bufrw_adapt_dir_t *dirs[2] = { &ad->rd, &ad->wr };
+    size_t *want[2] = { &ctx->rd_sz, &ctx->wr_sz };
+    size_t have[2] = { ctx->read_buffer_sz, ctx->write_buffer_sz };
+    for (int i = 0; i < 2; i++) {
+        adapt_resized(dirs[i]);
+        dirs[i]->on = 1;
+        dirs[i]->prev_rate = 0;
+        dirs[i]->ceiling = 0;
+        *want[i] = adapt_clamp(*want[i], min_sz, max_sz);
+        if (have[i] && have[i] != *want[i]) {
+            dirs[i]->next = *want[i];  // Resized at the next refill or flush.
+        }
+    }
+    return 0;
+}
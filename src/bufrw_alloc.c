@@ -0,0 +1,240 @@
+#define BUFRW_LIBRARY_BUILD
+
+#include "bufrw_internal.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+
+/* Huge page size buffers are rounded up to with BUFRW_ALLOC_HUGEPAGE. */
+#define BUFRW_HUGEPAGE_SZ (2U << 20)
+
+/* Process-wide allocator new contexts start with, malloc when unset. */
+static bufrw_allocator_t buf_allocator;
+static pthread_mutex_t buf_allocator_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Length of the anonymous mapping the built-in allocator a uses for n
+ * bytes, or 0 if it takes them from the heap.
+ */
+static size_t builtin_map_len(const bufrw_allocator_t *a, size_t n) {
+    size_t unit;
+    if ((a->flags & BUFRW_ALLOC_HUGEPAGE) && n >= BUFRW_HUGEPAGE_SZ / 2) {
+        unit = BUFRW_HUGEPAGE_SZ;
+    } else if (a->flags & (BUFRW_ALLOC_HUGEPAGE | BUFRW_ALLOC_NUMA_LOCAL)) {
+        unit = (size_t)sysconf(_SC_PAGESIZE);
+    } else {
+        return 0;
+    }
+    return (n + unit - 1) / unit * unit;
+}
+
+/*
+ * Map len bytes aligned to align, which is at least the page size.
+ */
+static void *builtin_map(size_t len, size_t align) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t slack = align > page ? align : 0;
+
+    char *p = (char *)mmap(NULL, len + slack, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+    if (slack) {
+        // Trim the mapping down to an aligned window.
+        char *q = (char *)(((uintptr_t)p + align - 1) & ~(uintptr_t)(align - 1));
+        if (q > p) {
+            munmap(p, (size_t)(q - p));
+        }
+        if (q + len < p + len + slack) {
+            munmap(q + len, (size_t)(p + len + slack - (q + len)));
+        }
+        p = q;
+    }
+    return p;
+}
+
+static void *builtin_alloc(const bufrw_allocator_t *a, size_t n) {
+    size_t len = builtin_map_len(a, n);
+    if (!len) {
+        void *p = NULL;
+        if (a->align <= sizeof(void *)) {
+            return malloc(n);
+        }
+        errno = posix_memalign(&p, a->align, n);
+        return errno ? NULL : p;
+    }
+
+    char *p = NULL;
+#if defined(__linux__)
+    int huge = len % BUFRW_HUGEPAGE_SZ == 0 && (a->flags & BUFRW_ALLOC_HUGEPAGE);
+#if defined(MAP_HUGETLB)
+    // Reserved huge pages first, transparent ones otherwise.
+    if (huge && a->align <= BUFRW_HUGEPAGE_SZ) {
+        p = (char *)mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p == MAP_FAILED) {
+            p = NULL;
+        }
+    }
+#endif
+    if (!p) {
+        p = (char *)builtin_map(len, huge && a->align < BUFRW_HUGEPAGE_SZ ? BUFRW_HUGEPAGE_SZ : a->align);
+#if defined(MADV_HUGEPAGE)
+        if (p && huge) {
+            madvise(p, len, MADV_HUGEPAGE);
+        }
+#endif
+    }
+    if (p && (a->flags & BUFRW_ALLOC_NUMA_LOCAL)) {
+        // Pages are placed on first touch; ask for the allocating thread's
+        // node no matter which thread touches them first.
+        unsigned cpu, node;
+        if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0 && node < 8 * sizeof(unsigned long)) {
+            unsigned long mask = 1UL << node;
+            syscall(SYS_mbind, p, len, MPOL_PREFERRED, &mask, 8 * sizeof(mask), 0);
+        }
+    }
+#else
+    p = (char *)builtin_map(len, a->align);
+#endif
+    return p;
+}
+
+static void builtin_free(const bufrw_allocator_t *a, void *ptr, size_t n) {
+    size_t len = builtin_map_len(a, n);
+    if (len) {
+        munmap(ptr, len);
+    } else {
+        free(ptr);
+    }
+}
+
+static void *alloc_with(const bufrw_allocator_t *a, size_t n) {
+    return a->alloc ? a->alloc(a->arg, n) : builtin_alloc(a, n);
+}
+
+static void free_with(const bufrw_allocator_t *a, void *ptr, size_t n) {
+    if (!ptr) {
+        return;
+    }
+    if (a->free) {
+        a->free(a->arg, ptr, n);
+    } else {
+        builtin_free(a, ptr, n);
+    }
+}
+
+static int allocator_valid(const bufrw_allocator_t *a) {
+    if (!a->alloc != !a->free || (a->align & (a->align - 1)) != 0) {
+        errno = EINVAL;
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Copy the process-wide allocator into out.
+ */
+BUFRW_INTERNAL_FUNC void bufrw_allocator_get(bufrw_allocator_t *out) {
+    pthread_mutex_lock(&buf_allocator_lock);
+    *out = buf_allocator;
+    pthread_mutex_unlock(&buf_allocator_lock);
+}
+
+/*
+ * Allocate a data buffer of n bytes for ctx with its allocator.
+ */
+BUFRW_INTERNAL_FUNC void *bufrw_buf_alloc(const bufrw_t *ctx, size_t n) {
+    return alloc_with(&ctx->alloc, n);
+}
+
+/*
+ * Release a data buffer of n bytes that bufrw_buf_alloc returned for ctx.
+ */
+BUFRW_INTERNAL_FUNC void bufrw_buf_free(const bufrw_t *ctx, void *ptr, size_t n) {
+    free_with(&ctx->alloc, ptr, n);
+}
+
+/*
+ * bfsetallocator: set the allocator for buffers.
+ *
+ * Contexts opened afterwards, and the legacy buffers of threads holding
+ * none yet, take their read and write buffers, including the spare ones
+ * of bfsetasync, bfsetreadahead and bfseturing, from allocator; buffers
+ * allocated before keep going back to the allocator they came from. A
+ * NULL allocator restores malloc and free.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfsetallocator(const bufrw_allocator_t *allocator) {
+    if (allocator && !allocator_valid(allocator)) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&buf_allocator_lock);
+    if (allocator) {
+        buf_allocator = *allocator;
+    } else {
+        buf_allocator = (bufrw_allocator_t){ 0 };
+    }
+    pthread_mutex_unlock(&buf_allocator_lock);
+    return 0;
+}
+
+/*
+ * bfcsetallocator: set the allocator for the buffers of a context.
+ *
+ * Buffers ctx already has are moved to allocator along with their data,
+ * later ones come from it. Not possible while an engine (bfsetasync,
+ * bfsetreadahead, bfseturing) is on or in shared mode, nor with less
+ * alignment than direct I/O needs (see bfsetodirect). A NULL allocator
+ * restores malloc and free.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfcsetallocator(bufrw_t *ctx, const bufrw_allocator_t *allocator) {
+    bufrw_allocator_t next = allocator ? *allocator : (bufrw_allocator_t){ 0 };
+    if (!ctx || ctx->async || ctx->readahead || ctx->uring || ctx->shared) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!allocator_valid(&next)) {
+        return -1;
+    }
+    if (next.align < bufrw_dio_align(ctx)) {
+        errno = EINVAL;  // Direct I/O needs aligned buffers.
+        return -1;
+    }
+
+    char *rb = NULL, *wb = NULL;
+    int move_rb = ctx->read_buffer && !ctx->map;
+    if (move_rb && !(rb = (char *)alloc_with(&next, ctx->read_buffer_cap))) {
+        return -1;
+    }
+    if (ctx->write_buffer && !(wb = (char *)alloc_with(&next, ctx->write_buffer_cap))) {
+        free_with(&next, rb, ctx->read_buffer_cap);
+        return -1;
+    }
+
+    if (move_rb) {
+        memcpy(rb, ctx->read_buffer, ctx->read_buffer_len);
+        free_with(&ctx->alloc, ctx->read_buffer, ctx->read_buffer_cap);
+        ctx->read_buffer = rb;
+    }
+    if (wb) {
+        memcpy(wb, ctx->write_buffer, ctx->write_buffer_pos);
+        free_with(&ctx->alloc, ctx->write_buffer, ctx->write_buffer_cap);
+        ctx->write_buffer = wb;
+    }
+    ctx->alloc = next;
+    return 0;
+}
@@ -0,0 +1,287 @@
+#define BUFRW_LIBRARY_BUILD
+
+#include "bufrw_internal.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+/*
+ * Asynchronous write-behind state of a context.
+ *
+ * The context fills write_buffer as usual. A full buffer is queued for the
+ * flusher thread and the caller immediately continues in a free one; it
+ * only waits when every buffer is queued or being written.
+ */
+struct _s_bufrw_async {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t work;            // signalled when a buffer is queued
+    pthread_cond_t idle;            // signalled when a buffer is released
+
+    int nbufs;
+    char **free_bufs;               // buffers ready to be filled
+    int nfree;
+
+    char **queue;                   // ring of full buffers, oldest first
+    size_t *queue_len;
+    int queue_head;
+    int queue_count;
+    int busy;                       // flusher is writing a buffer
+
+    int stop;
+    int err;                        // sticky write error
+
+    bufrw_async_stats_t stats;
+};
+
+static unsigned long long async_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + (unsigned long long)ts.tv_nsec;
+}
+
+/*
+ * Flusher thread: write queued buffers in order and hand them back.
+ */
+static void *async_flusher(void *arg) {
+    bufrw_t *ctx = (bufrw_t *)arg;
+    bufrw_async_t *as = ctx->async;
+
+    pthread_mutex_lock(&as->lock);
+    for (;;) {
+        while (as->queue_count == 0 && !as->stop) {
+            pthread_cond_wait(&as->work, &as->lock);
+        }
+        if (as->queue_count == 0) {
+            break;  // Stopped and drained.
+        }
+
+        char *buf = as->queue[as->queue_head];
+        size_t len = as->queue_len[as->queue_head];
+        as->busy = 1;
+        pthread_mutex_unlock(&as->lock);
+
+        // The stream belongs to this thread while buffers are in flight.
+        int failed = bufrw_io_write_full(ctx, buf, len) != len;
+
+        pthread_mutex_lock(&as->lock);
+        as->queue_head = (as->queue_head + 1) % as->nbufs;
+        as->queue_count--;
+        as->busy = 0;
+        as->free_bufs[as->nfree++] = buf;
+        if (failed) {
+            as->err = 1;
+        }
+        as->stats.depth = (size_t)as->queue_count;
+        pthread_cond_broadcast(&as->idle);
+    }
+    pthread_mutex_unlock(&as->lock);
+    return NULL;
+}
+
+/*
+ * Queue the filled part of the write buffer of ctx and continue in a free
+ * buffer, waiting for one if all are in flight.
+ *
+ * Returns 0 on success, or -1 if an earlier write has failed.
+ */
+BUFRW_INTERNAL_FUNC int bufrw_async_submit(bufrw_t *ctx) {
+    bufrw_async_t *as = ctx->async;
+
+    pthread_mutex_lock(&as->lock);
+    if (as->err) {
+        pthread_mutex_unlock(&as->lock);
+        return -1;
+    }
+
+    int tail = (as->queue_head + as->queue_count) % as->nbufs;
+    as->queue[tail] = ctx->write_buffer;
+    as->queue_len[tail] = ctx->write_buffer_pos;
+    as->queue_count++;
+    as->stats.submitted++;
+    as->stats.depth = (size_t)as->queue_count;
+    if (as->stats.depth > as->stats.max_depth) {
+        as->stats.max_depth = as->stats.depth;
+    }
+    pthread_cond_signal(&as->work);
+
+    if (as->nfree == 0) {
+        unsigned long long start = async_now_ns();
+        as->stats.stalls++;
+        while (as->nfree == 0) {
+            pthread_cond_wait(&as->idle, &as->lock);
+        }
+        as->stats.stall_ns += async_now_ns() - start;
+    }
+
+    ctx->write_buffer = as->free_bufs[--as->nfree];
+    ctx->write_buffer_pos = 0;
+    int ret = as->err ? -1 : 0;
+    pthread_mutex_unlock(&as->lock);
+    return ret;
+}
+
+/*
+ * Wait until no buffer of ctx is queued or being written.
+ *
+ * Returns 0 on success, or -1 if any write has failed.
+ */
+BUFRW_INTERNAL_FUNC int bufrw_async_wait(bufrw_t *ctx) {
+    bufrw_async_t *as = ctx->async;
+
+    pthread_mutex_lock(&as->lock);
+    while (as->queue_count > 0) {
+        pthread_cond_wait(&as->idle, &as->lock);
+    }
+    int ret = as->err ? -1 : 0;
+    pthread_mutex_unlock(&as->lock);
+    return ret;
+}
+
+/*
+ * Queue whatever is pending in the write buffer of ctx and wait for all
+ * buffers to reach the stream.
+ *
+ * Returns 0 on success, or -1 if any write has failed.
+ */
+BUFRW_INTERNAL_FUNC int bufrw_async_barrier(bufrw_t *ctx) {
+    if (ctx->write_buffer_pos > 0 && bufrw_async_submit(ctx) != 0) {
+        return -1;
+    }
+    return bufrw_async_wait(ctx);
+}
+
+/*
+ * Drain and stop the flusher of ctx and free every buffer except the
+ * current write buffer, which stays with the context.
+ *
+ * Returns the result of the final barrier.
+ */
+BUFRW_INTERNAL_FUNC int bufrw_async_teardown(bufrw_t *ctx) {
+    bufrw_async_t *as = ctx->async;
+    int ret = bufrw_async_barrier(ctx);
+
+    pthread_mutex_lock(&as->lock);
+    as->stop = 1;
+    pthread_cond_signal(&as->work);
+    pthread_mutex_unlock(&as->lock);
+    pthread_join(as->thread, NULL);
+
+    for (int i = 0; i < as->nfree; i++) {
+        bufrw_buf_free(ctx, as->free_bufs[i], ctx->write_buffer_sz);
+    }
+    pthread_cond_destroy(&as->idle);
+    pthread_cond_destroy(&as->work);
+    pthread_mutex_destroy(&as->lock);
+    free(as->queue_len);
+    free(as->queue);
+    free(as->free_bufs);
+    free(as);
+    ctx->async = NULL;
+    return ret;
+}
+
+/*
+ * bfsetasync: switch a context to asynchronous write-behind.
+ *
+ * The context gets nbufs write buffers of its write buffer size. A full
+ * buffer is handed to a background flusher thread while the caller keeps
+ * filling the next one; it only stalls when all buffers are in flight.
+ * bfcflush, bfcseek, bfctell and any read wait for the queued buffers, so
+ * bfcflush acts as a barrier. Write errors are reported by the next call
+ * that waits or submits. An nbufs of 0 drains and returns to synchronous
+ * writes.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfsetasync(bufrw_t *ctx, int nbufs) {
+    if (!ctx || ctx->shared || ctx->uring || ctx->map || ctx->nonblock || ctx->wb || nbufs < 0 || nbufs == 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (ctx->async) {
+        if (bufrw_async_teardown(ctx) != 0) {
+            return -1;
+        }
+    }
+    if (nbufs == 0) {
+        return 0;
+    }
+
+    if (!ctx->write_buffer && bufrw_ctx_alloc_write(ctx, ctx->wr_sz) != 0) {
+        return -1;
+    }
+    // Buffers are swapped with the flusher, so they all have one size.
+    if (bufrw_ctx_fit(ctx) != 0) {
+        return -1;
+    }
+
+    bufrw_async_t *as = (bufrw_async_t *)calloc(1, sizeof(*as));
+    if (!as) {
+        return -1;
+    }
+    as->nbufs = nbufs;
+    as->free_bufs = (char **)calloc((size_t)nbufs, sizeof(char *));
+    as->queue = (char **)calloc((size_t)nbufs, sizeof(char *));
+    as->queue_len = (size_t *)calloc((size_t)nbufs, sizeof(size_t));
+    if (!as->free_bufs || !as->queue || !as->queue_len) {
+        goto fail;
+    }
+
+    // The current write buffer is one of the nbufs.
+    for (int i = 1; i < nbufs; i++) {
+        char *buf = (char *)bufrw_buf_alloc(ctx, ctx->write_buffer_sz);
+        if (!buf) {
+            goto fail;
+        }
+        as->free_bufs[as->nfree++] = buf;
+    }
+    as->stats.nbufs = (size_t)nbufs;
+
+    pthread_mutex_init(&as->lock, NULL);
+    pthread_cond_init(&as->work, NULL);
+    pthread_cond_init(&as->idle, NULL);
+    ctx->async = as;
+    if (pthread_create(&as->thread, NULL, async_flusher, ctx) != 0) {
+        ctx->async = NULL;
+        pthread_cond_destroy(&as->idle);
+        pthread_cond_destroy(&as->work);
+        pthread_mutex_destroy(&as->lock);
+        goto fail;
+    }
+    return 0;
+
+fail:
+    for (int i = 0; i < as->nfree; i++) {
+        bufrw_buf_free(ctx, as->free_bufs[i], ctx->write_buffer_sz);
+    }
+    free(as->queue_len);
+    free(as->queue);
+    free(as->free_bufs);
+    free(as);
+    errno = ENOMEM;
+    return -1;
+}
+
+/*
+ * bfasyncstats: asynchronous writer statistics of a context.
+ *
+ * Fills st with the queue depth and stall counters of ctx.
+ *
+ * Returns 0 on success, or -1 if ctx is not in asynchronous mode.
+ */
+BUFRW_PUBLIC_FUNC int bfasyncstats(bufrw_t *ctx, bufrw_async_stats_t *st) {
+    if (!ctx || !ctx->async || !st) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&ctx->async->lock);
+    *st = ctx->async->stats;
+    pthread_mutex_unlock(&ctx->async->lock);
+    return 0;
+}
@@ -0,0 +1,167 @@
+#define BUFRW_LIBRARY_BUILD
+
+#include "bufrw_internal.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+/* Most threads a batch flush runs on, the caller's included. */
+#define BATCH_THREADS 8
+
+/* Open contexts, linked through reg_prev and reg_next. */
+static bufrw_t *registry_head;
+static size_t registry_len;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Add ctx, which has just been opened, to the registry. Returns ctx.
+ */
+BUFRW_INTERNAL_FUNC bufrw_t *bufrw_registry_add(bufrw_t *ctx) {
+    pthread_mutex_lock(&registry_lock);
+    ctx->reg_prev = NULL;
+    ctx->reg_next = registry_head;
+    if (registry_head) {
+        registry_head->reg_prev = ctx;
+    }
+    registry_head = ctx;
+    registry_len++;
+    pthread_mutex_unlock(&registry_lock);
+    return ctx;
+}
+
+/*
+ * Remove ctx, which is being closed, from the registry.
+ */
+BUFRW_INTERNAL_FUNC void bufrw_registry_remove(bufrw_t *ctx) {
+    pthread_mutex_lock(&registry_lock);
+    if (ctx->reg_prev) {
+        ctx->reg_prev->reg_next = ctx->reg_next;
+    } else {
+        registry_head = ctx->reg_next;
+    }
+    if (ctx->reg_next) {
+        ctx->reg_next->reg_prev = ctx->reg_prev;
+    }
+    ctx->reg_prev = ctx->reg_next = NULL;
+    registry_len--;
+    pthread_mutex_unlock(&registry_lock);
+}
+
+/* A batch flush shared by its threads. */
+typedef struct {
+    bufrw_t **ctxs;
+    size_t n;
+    int flags;
+    atomic_size_t next;  // index of the next context to flush
+    atomic_int err;      // errno of the first failure, 0 for none
+} batch_t;
+
+/*
+ * Flush ctx down to its file descriptor, and to the device with
+ * BUFRW_FLUSH_DATASYNC. Returns 0 on success, or -1 on error.
+ */
+static int batch_flush_one(bufrw_t *ctx, int flags) {
+    if (bfcflush(ctx) != 0) {
+        return -1;
+    }
+    if (ctx->stream && fflush(ctx->stream) != 0) {
+        return -1;
+    }
+    if ((flags & BUFRW_FLUSH_DATASYNC) && bufrw_ctx_datasync(ctx) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Flush contexts of the batch until none is left. */
+static void *batch_worker(void *arg) {
+    batch_t *b = (batch_t *)arg;
+    size_t i;
+    while ((i = atomic_fetch_add(&b->next, 1)) < b->n) {
+        if (batch_flush_one(b->ctxs[i], b->flags) != 0) {
+            int none = 0;
+            atomic_compare_exchange_strong(&b->err, &none, errno ? errno : EIO);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * bfflush_batch: flush several contexts at once.
+ *
+ * Flushes the write buffers of the n contexts in ctxs, and the stdio
+ * buffers of those opened with bfopen, on up to 8 threads, the caller's
+ * included, so that their transfers and syncs overlap instead of running
+ * one after another. With BUFRW_FLUSH_DATASYNC in flags each descriptor
+ * is also fdatasync(2)ed. Every context is flushed even if others fail.
+ * None of them may be in use by other threads meanwhile.
+ *
+ * Returns 0 on success, or -1 with errno of the first failure.
+ */
+BUFRW_PUBLIC_FUNC int bfflush_batch(bufrw_t **ctxs, size_t n, int flags) {
+    if ((!ctxs && n) || (flags & ~BUFRW_FLUSH_DATASYNC)) {
+        errno = EINVAL;
+        return -1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (!ctxs[i]) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    batch_t b = {.ctxs = ctxs, .n = n, .flags = flags};
+    atomic_init(&b.next, 0);
+    atomic_init(&b.err, 0);
+
+    // A single context or a failed thread start just means fewer helpers.
+    pthread_t threads[BATCH_THREADS - 1];
+    size_t started = 0;
+    size_t want = n < BATCH_THREADS ? n : BATCH_THREADS;
+    while (started + 1 < want && pthread_create(&threads[started], NULL, batch_worker, &b) == 0) {
+        started++;
+    }
+    batch_worker(&b);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    int err = atomic_load(&b.err);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * bfflushall: flush every open context.
+ *
+ * Like bfflush_batch on all contexts opened and not yet closed by any
+ * thread. Contexts cannot be opened or closed until it returns, and none
+ * may be in use by other threads meanwhile.
+ *
+ * Returns 0 on success, or -1 with errno of the first failure.
+ */
+BUFRW_PUBLIC_FUNC int bfflushall(int flags) {
+    pthread_mutex_lock(&registry_lock);
+    bufrw_t **ctxs = NULL;
+    if (registry_len) {
+        ctxs = (bufrw_t **)malloc(registry_len * sizeof(*ctxs));
+        if (!ctxs) {
+            pthread_mutex_unlock(&registry_lock);
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    size_t n = 0;
+    for (bufrw_t *ctx = registry_head; ctx; ctx = ctx->reg_next) {
+        ctxs[n++] = ctx;
+    }
+    int ret = bfflush_batch(ctxs, n, flags);
+    pthread_mutex_unlock(&registry_lock);
+    free(ctxs);
+    return ret;
+}
@@ -0,0 +1,460 @@
+#define BUFRW_LIBRARY_BUILD
+
+#include "bufrw_internal.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* Block size bfcache_new picks when given 0. */
+#define BUFRW_CACHE_BLOCK (64U << 10)
+
+/* End of a hash chain. */
+#define BUFRW_CACHE_NONE SIZE_MAX
+
+enum { SLOT_FREE, SLOT_LOADING, SLOT_READY };
+
+/*
+ * One cached block: block blkno of the file (dev, ino). pins counts the
+ * readers copying out of data; it is raised under the cache lock only, so
+ * a slot seen unpinned there can be reused.
+ */
+typedef struct cache_slot {
+    dev_t dev;
+    ino_t ino;
+    uint64_t blkno;
+    char *data;
+    size_t len;                 // bytes of the block in the file
+    int state;
+    int ref;                    // CLOCK reference bit
+    atomic_int pins;
+    size_t next;                // hash chain
+} cache_slot_t;
+
+/*
+ * Block cache.
+ *
+ * A fixed number of slots, found through a chained hash table on the file
+ * and block number and replaced in CLOCK order. Blocks are loaded with
+ * pread outside the lock; readers of a block still loading wait for it.
+ */
+struct _s_bufrw_cache {
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;
+    size_t block_sz;
+    size_t nslots;
+    cache_slot_t *slots;
+    size_t *buckets;
+    size_t nbuckets;            // power of two
+    size_t hand;                // CLOCK hand
+    atomic_int refs;            // bfcache_new plus one per attached context
+    atomic_ullong hits;
+    atomic_ullong misses;
+    atomic_ullong evictions;
+};
+
+/*
+ * Attachment of a context to a cache. The file is identified by device
+ * and inode, so contexts on different descriptors of one file share its
+ * blocks.
+ */
+struct _s_bufrw_cache_link {
+    bufrw_cache_t *cache;
+    const bufrw_ops_t *base;    // fd backend underneath
+    dev_t dev;
+    ino_t ino;
+    int was_positional;
+};
+
+static size_t cache_hash(const bufrw_cache_t *c, dev_t dev, ino_t ino, uint64_t blkno) {
+    uint64_t h = ((uint64_t)dev * 0x9e3779b97f4a7c15ULL) ^ ((uint64_t)ino * 0xc2b2ae3d27d4eb4fULL) ^ blkno;
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 32;
+    return (size_t)h & (c->nbuckets - 1);
+}
+
+static cache_slot_t *cache_lookup(bufrw_cache_t *c, dev_t dev, ino_t ino, uint64_t blkno) {
+    for (size_t i = c->buckets[cache_hash(c, dev, ino, blkno)]; i != BUFRW_CACHE_NONE; i = c->slots[i].next) {
+        cache_slot_t *s = &c->slots[i];
+        if (s->blkno == blkno && s->ino == ino && s->dev == dev) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+static void cache_unhash(bufrw_cache_t *c, cache_slot_t *s) {
+    size_t *link = &c->buckets[cache_hash(c, s->dev, s->ino, s->blkno)];
+    size_t idx = (size_t)(s - c->slots);
+    while (*link != idx) {
+        link = &c->slots[*link].next;
+    }
+    *link = s->next;
+}
+
+static void cache_hash_in(bufrw_cache_t *c, cache_slot_t *s) {
+    size_t *head = &c->buckets[cache_hash(c, s->dev, s->ino, s->blkno)];
+    s->next = *head;
+    *head = (size_t)(s - c->slots);
+}
+
+/*
+ * Pick a slot to reuse in CLOCK order, skipping pinned ones and giving
+ * recently used ones a second chance. Returns NULL if every slot is
+ * pinned.
+ */
+static cache_slot_t *cache_victim(bufrw_cache_t *c) {
+    for (size_t scanned = 0; scanned < 2 * c->nslots; scanned++) {
+        cache_slot_t *s = &c->slots[c->hand];
+        c->hand = (c->hand + 1) % c->nslots;
+        if (atomic_load_explicit(&s->pins, memory_order_acquire) > 0 || s->state == SLOT_LOADING) {
+            continue;
+        }
+        if (s->ref) {
+            s->ref = 0;
+            continue;
+        }
+        return s;
+    }
+    return NULL;
+}
+
+static ssize_t cache_fill(bufrw_cache_t *c, cache_slot_t *s, int fd) {
+    size_t got = 0;
+    off_t at = (off_t)(s->blkno * c->block_sz);
+    while (got < c->block_sz) {
+        ssize_t r = pread(fd, s->data + got, c->block_sz - got, at + (off_t)got);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r < 0) {
+            return -1;
+        }
+        if (r == 0) {
+            break;  // Last block of the file.
+        }
+        got += (size_t)r;
+    }
+    return (ssize_t)got;
+}
+
+/*
+ * Find block blkno of the file of link in the cache, loading it through
+ * fd if it is not there, and pin it. Returns the slot, or NULL with errno
+ * set on a read error or EBUSY if every slot is pinned.
+ */
+static cache_slot_t *cache_pin(bufrw_cache_t *c, const bufrw_cache_link_t *link, int fd, uint64_t blkno) {
+    pthread_mutex_lock(&c->lock);
+    for (;;) {
+        cache_slot_t *s = cache_lookup(c, link->dev, link->ino, blkno);
+        if (s) {
+            atomic_fetch_add_explicit(&s->pins, 1, memory_order_relaxed);
+            s->ref = 1;
+            while (s->state == SLOT_LOADING) {
+                pthread_cond_wait(&c->loaded, &c->lock);
+            }
+            if (s->state == SLOT_READY) {
+                pthread_mutex_unlock(&c->lock);
+                atomic_fetch_add_explicit(&c->hits, 1, memory_order_relaxed);
+                return s;
+            }
+            // Its load failed; try it ourselves.
+            atomic_fetch_sub_explicit(&s->pins, 1, memory_order_release);
+            continue;
+        }
+
+        s = cache_victim(c);
+        if (!s || (!s->data && !(s->data = (char *)malloc(c->block_sz)))) {
+            pthread_mutex_unlock(&c->lock);
+            errno = s ? ENOMEM : EBUSY;
+            return NULL;
+        }
+        if (s->state == SLOT_READY) {
+            cache_unhash(c, s);
+            atomic_fetch_add_explicit(&c->evictions, 1, memory_order_relaxed);
+        }
+        s->dev = link->dev;
+        s->ino = link->ino;
+        s->blkno = blkno;
+        s->state = SLOT_LOADING;
+        s->ref = 1;
+        atomic_store_explicit(&s->pins, 1, memory_order_relaxed);
+        cache_hash_in(c, s);
+        pthread_mutex_unlock(&c->lock);
+        atomic_fetch_add_explicit(&c->misses, 1, memory_order_relaxed);
+
+        ssize_t got = cache_fill(c, s, fd);
+        int saved = errno;
+
+        pthread_mutex_lock(&c->lock);
+        if (got < 0) {
+            cache_unhash(c, s);
+            s->state = SLOT_FREE;
+            atomic_fetch_sub_explicit(&s->pins, 1, memory_order_release);
+        } else {
+            s->len = (size_t)got;
+            s->state = SLOT_READY;
+        }
+        pthread_cond_broadcast(&c->loaded);
+        pthread_mutex_unlock(&c->lock);
+        if (got < 0) {
+            errno = saved;
+            return NULL;
+        }
+        return s;
+    }
+}
+
+static void cache_unpin(cache_slot_t *s) {
+    atomic_fetch_sub_explicit(&s->pins, 1, memory_order_release);
+}
+
+/*
+ * Copy n bytes at off of the file of ctx out of the cache into buf,
+ * loading missing blocks. With every slot pinned the bytes are read
+ * around the cache. Returns the number of bytes copied, short at the end
+ * of the file, or -1 if nothing could be read.
+ */
+static ssize_t cache_copy(bufrw_t *ctx, char *buf, size_t n, long off) {
+    const bufrw_cache_link_t *link = ctx->cache;
+    bufrw_cache_t *c = link->cache;
+    size_t done = 0;
+
+    while (done < n) {
+        uint64_t pos = (uint64_t)off + done;
+        size_t in = (size_t)(pos % c->block_sz);
+        size_t want = c->block_sz - in < n - done ? c->block_sz - in : n - done;
+        size_t got;
+
+        cache_slot_t *s = cache_pin(c, link, ctx->fd, pos / c->block_sz);
+        if (s) {
+            got = s->len > in ? s->len - in : 0;
+            got = got < want ? got : want;
+            memcpy(buf + done, s->data + in, got);
+            cache_unpin(s);
+        } else {
+            ssize_t r = errno == EBUSY ? pread(ctx->fd, buf + done, want, (off_t)pos) : -1;
+            if (r < 0) {
+                return done ? (ssize_t)done : -1;
+            }
+            got = (size_t)r;
+        }
+        done += got;
+        if (got < want) {
+            break;  // End of file.
+        }
+    }
+    return (ssize_t)done;
+}
+
+static ssize_t cache_read(bufrw_t *ctx, void *buf, size_t n) {
+    ssize_t got = cache_copy(ctx, (char *)buf, n, ctx->offset);
+    if (got > 0) {
+        ctx->offset += got;
+    }
+    return got;
+}
+
+static ssize_t cache_write(bufrw_t *ctx, const void *buf, size_t n) {
+    (void)ctx; (void)buf; (void)n;
+    errno = EBADF;
+    return -1;
+}
+
+static ssize_t cache_writev(bufrw_t *ctx, const struct iovec *iov, int iovcnt) {
+    (void)ctx; (void)iov; (void)iovcnt;
+    errno = EBADF;
+    return -1;
+}
+
+static int cache_seek(bufrw_t *ctx, long offset, int whence) {
+    return ctx->cache->base->seek(ctx, offset, whence);
+}
+
+static long cache_tell(bufrw_t *ctx) {
+    return ctx->cache->base->tell(ctx);
+}
+
+static const bufrw_ops_t cache_ops = {
+    .read = cache_read,
+    .write = cache_write,
+    .writev = cache_writev,
+    .seek = cache_seek,
+    .tell = cache_tell,
+};
+
+static void cache_release(bufrw_cache_t *c) {
+    if (atomic_fetch_sub_explicit(&c->refs, 1, memory_order_acq_rel) != 1) {
+        return;
+    }
+    for (size_t i = 0; i < c->nslots; i++) {
+        free(c->slots[i].data);
+    }
+    pthread_cond_destroy(&c->loaded);
+    pthread_mutex_destroy(&c->lock);
+    free(c->buckets);
+    free(c->slots);
+    free(c);
+}
+
+/*
+ * Copy n bytes at off of the file of ctx out of its cache into buf.
+ * Returns the number of bytes copied.
+ */
+BUFRW_INTERNAL_FUNC size_t bufrw_cache_pread(bufrw_t *ctx, void *buf, size_t n, long off) {
+    ssize_t got = cache_copy(ctx, (char *)buf, n, off);
+    return got > 0 ? (size_t)got : 0;
+}
+
+/*
+ * Detach ctx, whose buffers must have settled, from its cache: restore
+ * the backend and the descriptor's offset.
+ */
+BUFRW_INTERNAL_FUNC int bufrw_cache_teardown(bufrw_t *ctx) {
+    bufrw_cache_link_t *link = ctx->cache;
+    int ret = 0;
+
+    ctx->ops = link->base;
+    if (!link->was_positional) {
+        ctx->positional = 0;
+        if (lseek(ctx->fd, ctx->offset, SEEK_SET) < 0) {
+            ret = -1;
+        }
+    }
+    cache_release(link->cache);
+    ctx->cache = NULL;
+    free(link);
+    return ret;
+}
+
+/*
+ * bfcache_new: create a block cache.
+ *
+ * The cache holds up to nblocks blocks of block_sz bytes, 64 KiB if 0,
+ * of the files of the contexts attached to it with bfsetcache, and
+ * replaces them in CLOCK order. It can be shared by any number of
+ * contexts and threads. Returns NULL on error.
+ */
+BUFRW_PUBLIC_FUNC bufrw_cache_t *bfcache_new(size_t block_sz, size_t nblocks) {
+    if (nblocks == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    bufrw_cache_t *c = (bufrw_cache_t *)calloc(1, sizeof(*c));
+    if (!c) {
+        return NULL;
+    }
+    c->block_sz = block_sz ? block_sz : BUFRW_CACHE_BLOCK;
+    c->nslots = nblocks;
+    c->nbuckets = 1;
+    while (c->nbuckets < 2 * nblocks) {
+        c->nbuckets *= 2;
+    }
+    c->slots = (cache_slot_t *)calloc(c->nslots, sizeof(*c->slots));
+    c->buckets = (size_t *)malloc(c->nbuckets * sizeof(*c->buckets));
+    if (!c->slots || !c->buckets) {
+        free(c->slots);
+        free(c->buckets);
+        free(c);
+        return NULL;
+    }
+    for (size_t i = 0; i < c->nbuckets; i++) {
+        c->buckets[i] = BUFRW_CACHE_NONE;
+    }
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->loaded, NULL);
+    atomic_init(&c->refs, 1);
+    return c;
+}
+
+/*
+ * bfcache_free: release a block cache.
+ *
+ * The cache goes away once the last context attached to it is closed or
+ * detached; until then they keep using it.
+ */
+BUFRW_PUBLIC_FUNC void bfcache_free(bufrw_cache_t *cache) {
+    if (cache) {
+        cache_release(cache);
+    }
+}
+
+/*
+ * bfcache_stats: get the counters of a block cache.
+ *
+ * Fills stats with the lookups served from the cache, those that had to
+ * read a block and the blocks replaced so far.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfcache_stats(bufrw_cache_t *cache, bufrw_cache_stats_t *stats) {
+    if (!cache || !stats) {
+        errno = EINVAL;
+        return -1;
+    }
+    stats->hits = atomic_load_explicit(&cache->hits, memory_order_relaxed);
+    stats->misses = atomic_load_explicit(&cache->misses, memory_order_relaxed);
+    stats->evictions = atomic_load_explicit(&cache->evictions, memory_order_relaxed);
+    return 0;
+}
+
+/*
+ * bfsetcache: read a file descriptor context through a block cache.
+ *
+ * Refills of ctx and bfpread are served from cache, reading missing
+ * blocks with pread(2); bfcseek and bfctell work as before and the
+ * descriptor's offset is restored when ctx is detached or closed. The
+ * file must not change while cached, and ctx becomes read-only: writing
+ * fails with EBADF. Not available with bfsetodirect, bfseturing,
+ * bfsetcodec or in shared mode. A NULL cache detaches ctx.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfsetcache(bufrw_t *ctx, bufrw_cache_t *cache) {
+    if (!ctx || ctx->fd < 0 || ctx->stream || ctx->map || ctx->dio || ctx->uring || ctx->shared || ctx->coder || ctx->digest || ctx->nonblock || ctx->wb || ctx->limit >= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (ctx->cache && ctx->cache->cache == cache) {
+        return 0;
+    }
+    if (bufrw_ctx_settle(ctx) != 0) {
+        return -1;
+    }
+    if (ctx->cache && bufrw_cache_teardown(ctx) != 0) {
+        return -1;
+    }
+    if (!cache) {
+        return 0;
+    }
+    if (ctx->offset < 0) {
+        errno = ESPIPE;
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(ctx->fd, &st) != 0) {
+        return -1;
+    }
+    bufrw_cache_link_t *link = (bufrw_cache_link_t *)calloc(1, sizeof(*link));
+    if (!link) {
+        return -1;
+    }
+    link->cache = cache;
+    link->base = ctx->ops;
+    link->dev = st.st_dev;
+    link->ino = st.st_ino;
+    link->was_positional = ctx->positional;
+    atomic_fetch_add_explicit(&cache->refs, 1, memory_order_relaxed);
+
+    ctx->positional = 1;
+    ctx->ops = &cache_ops;
+    ctx->cache = link;
+    return 0;
+}
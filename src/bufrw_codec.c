@@ -0,0 +1,392 @@
+#define BUFRW_LIBRARY_BUILD
+
+#include "bufrw_internal.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(BUFRW_WITH_ZSTD)
+#include <zstd.h>
+#endif
+#if defined(BUFRW_WITH_LZ4)
+#include <lz4.h>
+#endif
+
+/* Bytes of the header in front of every frame. */
+#define BUFRW_FRAME_HDR 8
+
+/* Largest number of bytes a frame holds before encoding. */
+#define BUFRW_FRAME_MAX (1U << 30)
+
+/* Length bit marking a frame stored as is because it did not shrink. */
+#define BUFRW_FRAME_STORED (1U << 31)
+
+/*
+ * Codec stage of a context.
+ *
+ * Every write the backend underneath gets, a flushed write buffer or a
+ * large direct transfer, becomes one or more frames: the raw length and
+ * the encoded length, both 32-bit little endian, then the encoded bytes.
+ * Refills decode one frame at a time straight into the buffer asking for
+ * it; only a frame larger than that is decoded aside and handed out in
+ * pieces. Positions are counted in raw bytes.
+ */
+struct _s_bufrw_coder {
+    bufrw_codec_t codec;
+    const bufrw_ops_t *base;    // backend underneath
+    char *enc;                  // encoded frame
+    size_t enc_cap;
+    char *spill;                // decoded frame not handed out yet
+    size_t spill_cap;
+    size_t spill_pos;
+    size_t spill_len;
+    long pos;                   // raw bytes read or written
+};
+
+static void frame_put32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+static uint32_t frame_get32(const unsigned char *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static int coder_reserve(char **buf, size_t *cap, size_t n) {
+    if (n <= *cap) {
+        return 0;
+    }
+    char *grown = (char *)realloc(*buf, n);
+    if (!grown) {
+        return -1;
+    }
+    *buf = grown;
+    *cap = n;
+    return 0;
+}
+
+/*
+ * Read exactly n bytes from the backend underneath ctx. Returns n, 0 at
+ * end of file before the first byte, or -1 on error or a truncated frame.
+ */
+static ssize_t coder_take(bufrw_t *ctx, char *buf, size_t n) {
+    size_t done = 0;
+    while (done < n) {
+        ssize_t got = ctx->coder->base->read(ctx, buf + done, n - done);
+        if (got < 0) {
+            return -1;
+        }
+        if (got == 0) {
+            if (done == 0) {
+                return 0;
+            }
+            errno = EIO;  // Truncated frame.
+            return -1;
+        }
+        done += (size_t)got;
+    }
+    return (ssize_t)n;
+}
+
+/*
+ * Write a frame, the iovcnt segments of iov, to the backend underneath
+ * ctx in full. Returns 0 on success, or -1 on error.
+ */
+static int coder_put(bufrw_t *ctx, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t put = ctx->coder->base->writev(ctx, iov, iovcnt);
+        if (put <= 0) {
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)put >= iov->iov_len) {
+            put -= (ssize_t)iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + put;
+            iov->iov_len -= (size_t)put;
+        }
+    }
+    return 0;
+}
+
+static ssize_t coder_read(bufrw_t *ctx, void *buf, size_t n) {
+    bufrw_coder_t *cd = ctx->coder;
+    size_t got;
+
+    if (cd->spill_pos == cd->spill_len) {
+        unsigned char hdr[BUFRW_FRAME_HDR];
+        ssize_t r = coder_take(ctx, (char *)hdr, sizeof(hdr));
+        if (r <= 0) {
+            return r;
+        }
+        size_t raw = frame_get32(hdr);
+        uint32_t enc = frame_get32(hdr + 4);
+        int stored = (enc & BUFRW_FRAME_STORED) != 0;
+        size_t len = enc & ~BUFRW_FRAME_STORED;
+        if (raw > BUFRW_FRAME_MAX || (stored ? len != raw : len > cd->codec.bound(cd->codec.arg, raw))) {
+            errno = EIO;
+            return -1;
+        }
+
+        // Decode in place when the caller has room for the whole frame.
+        int direct = n >= raw;
+        if (!direct && coder_reserve(&cd->spill, &cd->spill_cap, raw) != 0) {
+            return -1;
+        }
+        char *out = direct ? (char *)buf : cd->spill;
+        if (stored) {
+            if (coder_take(ctx, out, len) != (ssize_t)len) {
+                return -1;
+            }
+        } else {
+            if (coder_reserve(&cd->enc, &cd->enc_cap, len) != 0 ||
+                coder_take(ctx, cd->enc, len) != (ssize_t)len) {
+                return -1;
+            }
+            ssize_t dec = cd->codec.decode(cd->codec.arg, out, raw, cd->enc, len);
+            if (dec != (ssize_t)raw) {
+                errno = EIO;
+                return -1;
+            }
+        }
+        if (direct) {
+            cd->pos += (long)raw;
+            return (ssize_t)raw;
+        }
+        cd->spill_pos = 0;
+        cd->spill_len = raw;
+    }
+
+    got = cd->spill_len - cd->spill_pos;
+    got = got < n ? got : n;
+    memcpy(buf, cd->spill + cd->spill_pos, got);
+    cd->spill_pos += got;
+    cd->pos += (long)got;
+    return (ssize_t)got;
+}
+
+static ssize_t coder_write(bufrw_t *ctx, const void *buf, size_t n) {
+    bufrw_coder_t *cd = ctx->coder;
+    const char *src = (const char *)buf;
+    size_t done = 0;
+
+    while (done < n) {
+        size_t raw = n - done < BUFRW_FRAME_MAX ? n - done : BUFRW_FRAME_MAX;
+        size_t cap = cd->codec.bound(cd->codec.arg, raw);
+        if (coder_reserve(&cd->enc, &cd->enc_cap, cap) != 0) {
+            return done ? (ssize_t)done : -1;
+        }
+
+        // Frames that do not shrink are stored as they are.
+        ssize_t enc = cd->codec.encode(cd->codec.arg, cd->enc, cap, src + done, raw);
+        int stored = enc < 0 || (size_t)enc >= raw;
+        unsigned char hdr[BUFRW_FRAME_HDR];
+        frame_put32(hdr, (uint32_t)raw);
+        frame_put32(hdr + 4, stored ? (uint32_t)raw | BUFRW_FRAME_STORED : (uint32_t)enc);
+        struct iovec frame[2] = {
+            { .iov_base = hdr, .iov_len = sizeof(hdr) },
+            { .iov_base = stored ? (void *)(src + done) : cd->enc, .iov_len = stored ? raw : (size_t)enc },
+        };
+        if (coder_put(ctx, frame, 2) != 0) {
+            return done ? (ssize_t)done : -1;
+        }
+        done += raw;
+        cd->pos += (long)raw;
+    }
+    return (ssize_t)done;
+}
+
+static ssize_t coder_writev(bufrw_t *ctx, const struct iovec *iov, int iovcnt) {
+    ssize_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        ssize_t put = coder_write(ctx, iov[i].iov_base, iov[i].iov_len);
+        if (put < 0) {
+            return total ? total : -1;
+        }
+        total += put;
+        if ((size_t)put < iov[i].iov_len) {
+            break;
+        }
+    }
+    return total;
+}
+
+/*
+ * Frames cannot be entered in the middle: only a seek to where the stream
+ * already is succeeds.
+ */
+static int coder_seek(bufrw_t *ctx, long offset, int whence) {
+    long pos = ctx->coder->pos;
+    if ((whence == SEEK_CUR && offset == 0) || (whence == SEEK_SET && offset == pos)) {
+        return 0;
+    }
+    errno = ESPIPE;
+    return -1;
+}
+
+static long coder_tell(bufrw_t *ctx) {
+    return ctx->coder->pos;
+}
+
+static const bufrw_ops_t coder_ops = {
+    .read = coder_read,
+    .write = coder_write,
+    .writev = coder_writev,
+    .seek = coder_seek,
+    .tell = coder_tell,
+};
+
+/*
+ * Leave the codec stage of ctx, whose buffers must have settled: restore
+ * the backend and drop what was decoded but not read.
+ */
+BUFRW_INTERNAL_FUNC void bufrw_codec_teardown(bufrw_t *ctx) {
+    bufrw_coder_t *cd = ctx->coder;
+    ctx->ops = cd->base;
+    ctx->coder = NULL;
+    free(cd->enc);
+    free(cd->spill);
+    free(cd);
+}
+
+/*
+ * bfsetcodec: compress a context's stream.
+ *
+ * Everything written to ctx afterwards is encoded with codec where the
+ * write buffer is flushed, a block at a time, and what is read is decoded
+ * where the read buffer is refilled, straight into it; with bfsetasync or
+ * bfsetreadahead, which must be turned on afterwards, this happens on
+ * their threads. Each block is framed with its raw and encoded length, so
+ * any codec works; blocks that would not shrink are stored. The stream
+ * is meant to be read or written from start to end: bfcseek only moves
+ * within the read buffer, bfctell counts raw bytes and decoded bytes not
+ * read yet are dropped when writing follows or ctx is closed. Not
+ * available with bfopen_map, bfseturing, bfsetodirect, bfsetcache or in
+ * shared mode. A NULL codec ends the stage; the codec is copied.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfsetcodec(bufrw_t *ctx, const bufrw_codec_t *codec) {
+    if (!ctx || ctx->map || ctx->uring || ctx->dio || ctx->cache || ctx->shared || ctx->async || ctx->readahead || ctx->digest || ctx->nonblock || ctx->wb) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (codec && (!codec->bound || !codec->encode || !codec->decode)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (bufrw_ctx_settle(ctx) != 0) {
+        return -1;
+    }
+    if (ctx->coder) {
+        bufrw_codec_teardown(ctx);
+    }
+    if (!codec) {
+        return 0;
+    }
+
+    bufrw_coder_t *cd = (bufrw_coder_t *)calloc(1, sizeof(*cd));
+    if (!cd) {
+        return -1;
+    }
+    cd->codec = *codec;
+    cd->base = ctx->ops;
+    ctx->ops = &coder_ops;
+    ctx->coder = cd;
+    return 0;
+}
+
+#if defined(BUFRW_WITH_ZSTD)
+static size_t zstd_bound(void *arg, size_t n) {
+    (void)arg;
+    return ZSTD_compressBound(n);
+}
+
+static ssize_t zstd_encode(void *arg, void *dst, size_t cap, const void *src, size_t n) {
+    size_t r = ZSTD_compress(dst, cap, src, n, (int)(intptr_t)arg);
+    return ZSTD_isError(r) ? -1 : (ssize_t)r;
+}
+
+static ssize_t zstd_decode(void *arg, void *dst, size_t cap, const void *src, size_t n) {
+    (void)arg;
+    size_t r = ZSTD_decompress(dst, cap, src, n);
+    return ZSTD_isError(r) ? -1 : (ssize_t)r;
+}
+#endif
+
+#if defined(BUFRW_WITH_LZ4)
+static size_t lz4_bound(void *arg, size_t n) {
+    (void)arg;
+    return n > LZ4_MAX_INPUT_SIZE ? n : (size_t)LZ4_compressBound((int)n);
+}
+
+static ssize_t lz4_encode(void *arg, void *dst, size_t cap, const void *src, size_t n) {
+    (void)arg;
+    if (n > LZ4_MAX_INPUT_SIZE) {
+        return -1;  // Stored as is.
+    }
+    int r = LZ4_compress_default((const char *)src, (char *)dst, (int)n, (int)cap);
+    return r > 0 ? r : -1;
+}
+
+static ssize_t lz4_decode(void *arg, void *dst, size_t cap, const void *src, size_t n) {
+    (void)arg;
+    int r = LZ4_decompress_safe((const char *)src, (char *)dst, (int)n, (int)cap);
+    return r >= 0 ? r : -1;
+}
+#endif
+
+/*
+ * bfcodec_zstd: the zstd codec.
+ *
+ * Fills codec with a zstd codec compressing at level for bfsetcodec.
+ * Returns 0 on success, or -1 with errno ENOSYS if the library was built
+ * without zstd (make WITH_ZSTD=1).
+ */
+BUFRW_PUBLIC_FUNC int bfcodec_zstd(bufrw_codec_t *codec, int level) {
+    if (!codec) {
+        errno = EINVAL;
+        return -1;
+    }
+#if defined(BUFRW_WITH_ZSTD)
+    codec->bound = zstd_bound;
+    codec->encode = zstd_encode;
+    codec->decode = zstd_decode;
+    codec->arg = (void *)(intptr_t)level;
+    return 0;
+#else
+    (void)level;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/*
+ * bfcodec_lz4: the LZ4 codec.
+ *
+ * Fills codec with an LZ4 block codec for bfsetcodec. Returns 0 on
+ * success, or -1 with errno ENOSYS if the library was built without LZ4
+ * (make WITH_LZ4=1).
+ */
+BUFRW_PUBLIC_FUNC int bfcodec_lz4(bufrw_codec_t *codec) {
+    if (!codec) {
+        errno = EINVAL;
+        return -1;
+    }
+#if defined(BUFRW_WITH_LZ4)
+    codec->bound = lz4_bound;
+    codec->encode = lz4_encode;
+    codec->decode = lz4_decode;
+    codec->arg = NULL;
+    return 0;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
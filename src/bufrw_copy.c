@@ -0,0 +1,155 @@
+#define BUFRW_LIBRARY_BUILD
+#define _GNU_SOURCE
+
+#include "bufrw_internal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Most bytes handed to a single kernel copy call. */
+#define COPY_CHUNK ((size_t)1 << 30)
+
+/* Kernel copy paths, in the order they are tried. */
+enum {
+    COPY_RANGE,     // copy_file_range(2), file to file
+    COPY_SENDFILE,  // sendfile(2), file to anything at its own offset
+    COPY_SPLICE,    // splice(2), to or from a pipe
+    COPY_NONE,
+};
+
+static int fd_is_pipe(int fd) {
+    struct stat st;
+    return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+/*
+ * Move up to len bytes from src to dst in the kernel with path, from and
+ * to their current positions, which follow. Returns the number of bytes
+ * moved, 0 at the end of src or -1 if path failed or does not apply.
+ */
+static ssize_t copy_kernel(int path, bufrw_t *dst, int dfd, bufrw_t *src, int sfd, size_t len) {
+    off_t soff = src->offset, doff = dst->offset;
+    off_t *sp = src->positional ? &soff : NULL;
+    off_t *dp = dst->positional ? &doff : NULL;
+    if (len > COPY_CHUNK) {
+        len = COPY_CHUNK;
+    }
+
+    ssize_t moved;
+    do {
+        switch (path) {
+        case COPY_RANGE:
+            moved = copy_file_range(sfd, sp, dfd, dp, len, 0);
+            break;
+        case COPY_SENDFILE:
+            // sendfile always writes at the descriptor's own offset.
+            moved = dp ? -1 : sendfile(dfd, sfd, sp, len);
+            break;
+        default:
+            if (!fd_is_pipe(sfd) && !fd_is_pipe(dfd)) {
+                return -1;
+            }
+            moved = splice(sfd, sp, dfd, dp, len, SPLICE_F_MOVE);
+            break;
+        }
+    } while (moved < 0 && errno == EINTR);
+
+    if (moved > 0) {
+        if (src->offset >= 0) {
+            src->offset += moved;
+        }
+        if (dst->offset >= 0) {
+            dst->offset += moved;
+        }
+        src->stats.stream_read += (size_t)moved;
+        dst->stats.stream_written += (size_t)moved;
+    }
+    return moved;
+}
+
+/*
+ * Copy up to n bytes between the plain descriptors of src and dst, whose
+ * buffers have settled, with the first kernel path that works. Returns
+ * the number of bytes copied, which is short if no path applies, one
+ * stops working or src ends.
+ */
+static size_t copy_fds(bufrw_t *dst, int dfd, bufrw_t *src, int sfd, size_t n) {
+    size_t done = 0;
+    int path = COPY_RANGE;
+    while (done < n && path < COPY_NONE) {
+        ssize_t moved = copy_kernel(path, dst, dfd, src, sfd, n - done);
+        if (moved == 0) {
+            break;
+        }
+        if (moved < 0) {
+            path++;
+            continue;
+        }
+        done += (size_t)moved;
+    }
+    return done;
+}
+
+/*
+ * bfcopy: copy bytes from one context to another.
+ *
+ * Moves up to n bytes from src to dst, SIZE_MAX for all up to the end of
+ * src. The bytes already in the read buffer of src go first; when both
+ * contexts then transfer on plain descriptors (bfopen_fd, bfopen_fd_at,
+ * without an engine or a stage in between), the rest is copied by the
+ * kernel with copy_file_range(2), sendfile(2) or splice(2), whichever
+ * applies, without passing through user space. Anything else, and
+ * whatever the kernel cannot do, goes through the read buffer of src.
+ * Pending writes of dst stay ahead of the copied bytes.
+ *
+ * Returns the number of bytes copied, less than n only at the end of src
+ * or on error.
+ */
+BUFRW_PUBLIC_FUNC size_t bfcopy(bufrw_t *dst, bufrw_t *src, size_t n) {
+    if (!dst || !src || dst == src || src->shared) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    size_t done = 0;
+    const void *p;
+
+    // What src has buffered already is written from where it lies.
+    size_t held = src->read_buffer_len - src->read_buffer_pos;
+    if (held > n) {
+        held = n;
+    }
+    if (held > 0) {
+        size_t got = bfview(src, held, &p);
+        done = bfcwrite(dst, p, 1, got);
+        if (done < held) {
+            return done;
+        }
+    }
+
+    int sfd = bufrw_ctx_plain_fd(src);
+    int dfd = bufrw_ctx_plain_fd(dst);
+    if (done < n && sfd >= 0 && dfd >= 0) {
+        if (bufrw_ctx_settle(src) != 0 || bufrw_ctx_settle(dst) != 0) {
+            return done;
+        }
+        done += copy_fds(dst, dfd, src, sfd, n - done);
+    }
+
+    // The rest goes through the read buffer of src, one refill at a time.
+    while (done < n) {
+        size_t got = bfview(src, n - done, &p);
+        if (got == 0) {
+            break;
+        }
+        size_t put = bfcwrite(dst, p, 1, got);
+        done += put;
+        if (put < got) {
+            break;
+        }
+    }
+    return done;
+}
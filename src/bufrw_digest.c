@@ -0,0 +1,376 @@
+#define BUFRW_LIBRARY_BUILD
+
+#include "bufrw_internal.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#define BUFRW_CRC_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__linux__)
+#define BUFRW_CRC_ARM 1
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#endif
+
+/* Reflected CRC32C (Castagnoli) polynomial. */
+#define BUFRW_CRC32C_POLY 0x82f63b78U
+
+/* XXH64 primes. */
+#define XXH_P1 0x9e3779b185ebca87ULL
+#define XXH_P2 0xc2b2ae3d27d4eb4fULL
+#define XXH_P3 0x165667b19e3779f9ULL
+#define XXH_P4 0x85ebca77c2b2ae63ULL
+#define XXH_P5 0x27d4eb2f165667c5ULL
+
+/*
+ * Running digest of a context: the bytes its backend reads and writes,
+ * hashed on their way through, while they are still in cache.
+ */
+struct _s_bufrw_digest {
+    const bufrw_ops_t *base;    // backend underneath
+    int algo;
+    uint32_t crc;               // CRC32C, not inverted
+    uint64_t v[4];              // XXH64 lanes
+    unsigned char tail[32];     // XXH64 bytes short of a stripe
+    size_t tail_len;
+    uint64_t total;
+};
+
+/*
+ * CRC32C kernels: update crc, kept inverted, with the n bytes at p. The
+ * hardware ones are picked at run time.
+ */
+typedef uint32_t (*crc_fn)(uint32_t crc, const unsigned char *p, size_t n);
+
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+static void crc_table_init(void) {
+    for (unsigned i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = c & 1 ? (c >> 1) ^ BUFRW_CRC32C_POLY : c >> 1;
+        }
+        crc_table[0][i] = c;
+    }
+    for (unsigned i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            crc_table[t][i] = (crc_table[t - 1][i] >> 8) ^ crc_table[0][crc_table[t - 1][i] & 0xff];
+        }
+    }
+}
+
+/* Table-driven, eight bytes at a time. */
+static uint32_t crc_sw(uint32_t crc, const unsigned char *p, size_t n) {
+    pthread_once(&crc_table_once, crc_table_init);
+    for (; n >= 8; p += 8, n -= 8) {
+        uint32_t lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+        crc = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^
+              crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+              crc_table[3][p[4]] ^ crc_table[2][p[5]] ^ crc_table[1][p[6]] ^ crc_table[0][p[7]];
+    }
+    for (; n > 0; p++, n--) {
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ *p) & 0xff];
+    }
+    return crc;
+}
+
+#if defined(BUFRW_CRC_X86)
+__attribute__((target("sse4.2")))
+static uint32_t crc_sse42(uint32_t crc, const unsigned char *p, size_t n) {
+    uint64_t c = crc;
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        c = _mm_crc32_u64(c, w);
+    }
+    uint32_t c32 = (uint32_t)c;
+    for (; n > 0; p++, n--) {
+        c32 = _mm_crc32_u8(c32, *p);
+    }
+    return c32;
+}
+#endif
+
+#if defined(BUFRW_CRC_ARM)
+__attribute__((target("+crc")))
+static uint32_t crc_arm(uint32_t crc, const unsigned char *p, size_t n) {
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        crc = __crc32cd(crc, w);
+    }
+    for (; n > 0; p++, n--) {
+        crc = __crc32cb(crc, *p);
+    }
+    return crc;
+}
+#endif
+
+static crc_fn crc_resolve(void) {
+#if defined(BUFRW_CRC_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        return crc_sse42;
+    }
+#elif defined(BUFRW_CRC_ARM) && defined(HWCAP_CRC32)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+        return crc_arm;
+    }
+#endif
+    return crc_sw;
+}
+
+static uint32_t crc_first(uint32_t crc, const unsigned char *p, size_t n);
+
+/* Kernel in use, resolved on the first update. */
+static _Atomic(crc_fn) crc_impl = crc_first;
+
+static uint32_t crc_first(uint32_t crc, const unsigned char *p, size_t n) {
+    crc_fn fn = crc_resolve();
+    atomic_store_explicit(&crc_impl, fn, memory_order_relaxed);
+    return fn(crc, p, n);
+}
+
+static uint64_t xxh_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t xxh_read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static uint32_t xxh_read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_P2;
+    acc = xxh_rotl(acc, 31);
+    return acc * XXH_P1;
+}
+
+static uint64_t xxh_merge(uint64_t acc, uint64_t v) {
+    acc ^= xxh_round(0, v);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+static void xxh_stripes(uint64_t *v, const unsigned char *p, size_t n) {
+    for (; n >= 32; p += 32, n -= 32) {
+        v[0] = xxh_round(v[0], xxh_read64(p));
+        v[1] = xxh_round(v[1], xxh_read64(p + 8));
+        v[2] = xxh_round(v[2], xxh_read64(p + 16));
+        v[3] = xxh_round(v[3], xxh_read64(p + 24));
+    }
+}
+
+static void digest_reset(bufrw_digest_t *dg) {
+    dg->crc = 0xffffffffU;
+    dg->v[0] = XXH_P1 + XXH_P2;
+    dg->v[1] = XXH_P2;
+    dg->v[2] = 0;
+    dg->v[3] = 0 - XXH_P1;
+    dg->tail_len = 0;
+    dg->total = 0;
+}
+
+static void digest_update(bufrw_digest_t *dg, const void *buf, size_t n) {
+    const unsigned char *p = (const unsigned char *)buf;
+    dg->total += n;
+    if (dg->algo == BUFRW_DIGEST_CRC32C) {
+        dg->crc = atomic_load_explicit(&crc_impl, memory_order_relaxed)(dg->crc, p, n);
+        return;
+    }
+
+    if (dg->tail_len > 0) {
+        size_t fill = 32 - dg->tail_len < n ? 32 - dg->tail_len : n;
+        memcpy(dg->tail + dg->tail_len, p, fill);
+        dg->tail_len += fill;
+        p += fill;
+        n -= fill;
+        if (dg->tail_len < 32) {
+            return;
+        }
+        xxh_stripes(dg->v, dg->tail, 32);
+        dg->tail_len = 0;
+    }
+    xxh_stripes(dg->v, p, n - n % 32);
+    memcpy(dg->tail, p + n - n % 32, n % 32);
+    dg->tail_len = n % 32;
+}
+
+static uint64_t digest_value(const bufrw_digest_t *dg) {
+    if (dg->algo == BUFRW_DIGEST_CRC32C) {
+        return dg->crc ^ 0xffffffffU;
+    }
+
+    uint64_t h;
+    if (dg->total >= 32) {
+        const uint64_t *v = dg->v;
+        h = xxh_rotl(v[0], 1) + xxh_rotl(v[1], 7) + xxh_rotl(v[2], 12) + xxh_rotl(v[3], 18);
+        for (int i = 0; i < 4; i++) {
+            h = xxh_merge(h, v[i]);
+        }
+    } else {
+        h = XXH_P5;
+    }
+    h += dg->total;
+
+    const unsigned char *p = dg->tail;
+    size_t n = dg->tail_len;
+    for (; n >= 8; p += 8, n -= 8) {
+        h ^= xxh_round(0, xxh_read64(p));
+        h = xxh_rotl(h, 27) * XXH_P1 + XXH_P4;
+    }
+    if (n >= 4) {
+        h ^= (uint64_t)xxh_read32(p) * XXH_P1;
+        h = xxh_rotl(h, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+        n -= 4;
+    }
+    for (; n > 0; p++, n--) {
+        h ^= *p * XXH_P5;
+        h = xxh_rotl(h, 11) * XXH_P1;
+    }
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+static ssize_t digest_read(bufrw_t *ctx, void *buf, size_t n) {
+    ssize_t got = ctx->digest->base->read(ctx, buf, n);
+    if (got > 0) {
+        digest_update(ctx->digest, buf, (size_t)got);
+    }
+    return got;
+}
+
+static ssize_t digest_write(bufrw_t *ctx, const void *buf, size_t n) {
+    ssize_t put = ctx->digest->base->write(ctx, buf, n);
+    if (put > 0) {
+        digest_update(ctx->digest, buf, (size_t)put);
+    }
+    return put;
+}
+
+static ssize_t digest_writev(bufrw_t *ctx, const struct iovec *iov, int iovcnt) {
+    ssize_t put = ctx->digest->base->writev(ctx, iov, iovcnt);
+    size_t left = put > 0 ? (size_t)put : 0;
+    for (int i = 0; i < iovcnt && left > 0; i++) {
+        size_t n = iov[i].iov_len < left ? iov[i].iov_len : left;
+        digest_update(ctx->digest, iov[i].iov_base, n);
+        left -= n;
+    }
+    return put;
+}
+
+static int digest_seek(bufrw_t *ctx, long offset, int whence) {
+    return ctx->digest->base->seek(ctx, offset, whence);
+}
+
+static long digest_tell(bufrw_t *ctx) {
+    return ctx->digest->base->tell(ctx);
+}
+
+static const bufrw_ops_t digest_ops = {
+    .read = digest_read,
+    .write = digest_write,
+    .writev = digest_writev,
+    .seek = digest_seek,
+    .tell = digest_tell,
+};
+
+/*
+ * Stop the digest of ctx and restore the backend underneath it.
+ */
+BUFRW_INTERNAL_FUNC void bufrw_digest_teardown(bufrw_t *ctx) {
+    ctx->ops = ctx->digest->base;
+    free(ctx->digest);
+    ctx->digest = NULL;
+}
+
+/*
+ * bfsetdigest: checksum the bytes a context moves.
+ *
+ * Starts a running digest, BUFRW_DIGEST_CRC32C or BUFRW_DIGEST_XXH64,
+ * over every byte ctx reads from its stream or writes to it from then on,
+ * computed on the buffer path while the bytes are still in cache: the
+ * CRC with the CPU's crc32 instructions where available. Reading a
+ * stream to its end, or writing it from start to end, so digests exactly
+ * its contents. Calling it again restarts the digest; BUFRW_DIGEST_NONE
+ * stops it. Has to be the last of bfsetcodec, bfsetcache and
+ * bfsetodirect, and is not available with bfopen_map, bfsetreadahead,
+ * bfseturing or in shared mode.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfsetdigest(bufrw_t *ctx, int algo) {
+    if (!ctx || ctx->map || ctx->readahead || ctx->uring || ctx->shared || ctx->nonblock || ctx->wb ||
+        (algo != BUFRW_DIGEST_NONE && algo != BUFRW_DIGEST_CRC32C && algo != BUFRW_DIGEST_XXH64)) {
+        errno = EINVAL;
+        return -1;
+    }
+    // Buffered bytes were moved before the digest started: drop them.
+    if (bufrw_ctx_settle(ctx) != 0) {
+        return -1;
+    }
+    if (algo == BUFRW_DIGEST_NONE) {
+        if (ctx->digest) {
+            bufrw_digest_teardown(ctx);
+        }
+        return 0;
+    }
+
+    bufrw_digest_t *dg = ctx->digest;
+    if (!dg) {
+        dg = (bufrw_digest_t *)calloc(1, sizeof(*dg));
+        if (!dg) {
+            return -1;
+        }
+        dg->base = ctx->ops;
+        ctx->ops = &digest_ops;
+        ctx->digest = dg;
+    }
+    dg->algo = algo;
+    digest_reset(dg);
+    return 0;
+}
+
+/*
+ * bfdigest: read out the digest of a context.
+ *
+ * Flushes pending writes, so that they are covered, and stores the digest
+ * of everything moved since bfsetdigest in *out: a CRC32C in the low 32
+ * bits, or an XXH64 with seed 0. The digest keeps running.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfdigest(bufrw_t *ctx, uint64_t *out) {
+    if (!ctx || !ctx->digest || !out) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (bfcflush(ctx) != 0) {
+        return -1;
+    }
+    *out = digest_value(ctx->digest);
+    return 0;
+}
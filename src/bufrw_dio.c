@@ -0,0 +1,361 @@
+#define BUFRW_LIBRARY_BUILD
+#define _GNU_SOURCE
+
+#include "bufrw_internal.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#if defined(O_DIRECT)
+
+/* Alignment assumed when the kernel does not report one. */
+#define BUFRW_DIO_FALLBACK_ALIGN 4096
+
+/*
+ * Direct I/O state of a context.
+ *
+ * Transfers that start on a block boundary, from a suitably aligned
+ * buffer, go to the device in whole blocks. Whatever does not line up,
+ * a misaligned head after a seek or the tail of the last block, goes
+ * through the page cache with O_DIRECT briefly cleared, so positions and
+ * the file size are never padded.
+ */
+struct _s_bufrw_dio {
+    const bufrw_ops_t *base;    // fd backend underneath
+    size_t blk;                 // file offset and length alignment
+    size_t mem;                 // buffer address alignment
+    int flags;                  // file status flags, O_DIRECT included
+    int orig_flags;             // file status flags before
+    int was_positional;
+};
+
+/*
+ * Bytes of an n byte transfer at buf that can go direct at the context's
+ * offset, a whole number of blocks, or 0 if it does not line up.
+ */
+static size_t dio_direct_len(const bufrw_t *ctx, const void *buf, size_t n) {
+    const bufrw_dio_t *dio = ctx->dio;
+    if ((uintptr_t)buf % dio->mem != 0 || (size_t)ctx->offset % dio->blk != 0) {
+        return 0;
+    }
+    return n - n % dio->blk;
+}
+
+/*
+ * Bytes of an n byte transfer that does not line up to move through the
+ * page cache: up to the next block boundary, or all of it if it starts on
+ * one.
+ */
+static size_t dio_buffered_len(const bufrw_t *ctx, size_t n) {
+    size_t head = (size_t)ctx->offset % ctx->dio->blk;
+    if (head == 0) {
+        return n;
+    }
+    head = ctx->dio->blk - head;
+    return n < head ? n : head;
+}
+
+/*
+ * pread or pwrite n bytes at the context's offset, through the page cache
+ * if buffered is set.
+ */
+static ssize_t dio_transfer(bufrw_t *ctx, void *buf, size_t n, int write, int buffered) {
+    bufrw_dio_t *dio = ctx->dio;
+    if (buffered && fcntl(ctx->fd, F_SETFL, dio->flags & ~O_DIRECT) != 0) {
+        return -1;
+    }
+
+    ssize_t r;
+    do {
+        r = write ? pwrite(ctx->fd, buf, n, ctx->offset) : pread(ctx->fd, buf, n, ctx->offset);
+    } while (r < 0 && errno == EINTR);
+
+    if (buffered) {
+        int saved = errno;
+        fcntl(ctx->fd, F_SETFL, dio->flags);
+        errno = saved;
+    }
+    if (r > 0) {
+        ctx->offset += r;
+    }
+    return r;
+}
+
+static ssize_t dio_read(bufrw_t *ctx, void *buf, size_t n) {
+    size_t direct = dio_direct_len(ctx, buf, n);
+    if (direct > 0) {
+        return dio_transfer(ctx, buf, direct, 0, 0);
+    }
+    return dio_transfer(ctx, buf, dio_buffered_len(ctx, n), 0, 1);
+}
+
+static ssize_t dio_write(bufrw_t *ctx, const void *buf, size_t n) {
+    size_t direct = dio_direct_len(ctx, buf, n);
+    if (direct > 0) {
+        return dio_transfer(ctx, (void *)buf, direct, 1, 0);
+    }
+    return dio_transfer(ctx, (void *)buf, dio_buffered_len(ctx, n), 1, 1);
+}
+
+static ssize_t dio_writev(bufrw_t *ctx, const struct iovec *iov, int iovcnt) {
+    // Segments are taken one at a time; callers retry short writes.
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len > 0) {
+            return dio_write(ctx, iov[i].iov_base, iov[i].iov_len);
+        }
+    }
+    return 0;
+}
+
+static int dio_seek(bufrw_t *ctx, long offset, int whence) {
+    return ctx->dio->base->seek(ctx, offset, whence);
+}
+
+static long dio_tell(bufrw_t *ctx) {
+    return ctx->dio->base->tell(ctx);
+}
+
+static const bufrw_ops_t dio_ops = {
+    .read = dio_read,
+    .write = dio_write,
+    .writev = dio_writev,
+    .seek = dio_seek,
+    .tell = dio_tell,
+};
+
+/*
+ * Direct I/O alignment of fd: offsets and lengths in *blk, buffer
+ * addresses in *mem. Returns 0 on success, or -1 if fd does not support
+ * direct I/O.
+ */
+static int dio_probe(int fd, size_t *blk, size_t *mem) {
+#if defined(STATX_DIOALIGN)
+    struct statx sx;
+    if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &sx) == 0 && (sx.stx_mask & STATX_DIOALIGN)) {
+        if (sx.stx_dio_offset_align == 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        *blk = sx.stx_dio_offset_align;
+        *mem = sx.stx_dio_mem_align;
+        return 0;
+    }
+#endif
+
+    // The preferred I/O size is a multiple of the logical block size.
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return -1;
+    }
+    *blk = st.st_blksize > 0 ? (size_t)st.st_blksize : BUFRW_DIO_FALLBACK_ALIGN;
+    *mem = *blk;
+    return 0;
+}
+
+static size_t dio_round(size_t n, size_t blk) {
+    return n < blk ? blk : (n + blk - 1) / blk * blk;
+}
+
+/*
+ * Write out the full write buffer of ctx up to the last block boundary,
+ * keeping the rest for the next flush so that every later buffer starts
+ * on a boundary. Returns 0 on success, or -1 on error.
+ */
+BUFRW_INTERNAL_FUNC int bufrw_dio_drain(bufrw_t *ctx) {
+    size_t pos = ctx->write_buffer_pos;
+    size_t keep = (size_t)(ctx->offset + (long)pos) % ctx->dio->blk;
+    size_t n = keep < pos ? pos - keep : pos;
+
+    size_t put = bufrw_io_write_full(ctx, ctx->write_buffer, n);
+    memmove(ctx->write_buffer, ctx->write_buffer + put, pos - put);
+    ctx->write_buffer_pos = pos - put;
+    return put == n ? 0 : -1;
+}
+
+/*
+ * Buffer alignment direct I/O on ctx needs, or 0 when it is off.
+ */
+BUFRW_INTERNAL_FUNC size_t bufrw_dio_align(const bufrw_t *ctx) {
+    return ctx->dio ? ctx->dio->mem : 0;
+}
+
+/*
+ * Leave direct I/O on ctx, whose buffers must have settled: restore the
+ * backend, the descriptor's offset and the status flags it had before.
+ */
+BUFRW_INTERNAL_FUNC int bufrw_dio_teardown(bufrw_t *ctx) {
+    bufrw_dio_t *dio = ctx->dio;
+    int ret = 0;
+
+    ctx->ops = dio->base;
+    if (!dio->was_positional) {
+        ctx->positional = 0;
+        if (lseek(ctx->fd, ctx->offset, SEEK_SET) < 0) {
+            ret = -1;
+        }
+    }
+    if (dio->orig_flags != dio->flags && fcntl(ctx->fd, F_SETFL, dio->orig_flags) != 0) {
+        ret = -1;
+    }
+    ctx->dio = NULL;
+    free(dio);
+    return ret;
+}
+
+/*
+ * Switch a new context on fd to direct I/O if fd was opened with
+ * O_DIRECT.
+ */
+BUFRW_INTERNAL_FUNC void bufrw_dio_auto(bufrw_t *ctx) {
+    int fl = fcntl(ctx->fd, F_GETFL);
+    if (fl >= 0 && (fl & O_DIRECT)) {
+        bfsetodirect(ctx, 1);
+    }
+}
+
+/*
+ * bfsetodirect: switch a file descriptor context to direct I/O.
+ *
+ * Sets O_DIRECT on the descriptor, so refills and flushes bypass the page
+ * cache: they move whole blocks, at block-aligned offsets, from buffers
+ * aligned as the file system requires (see bfcsetallocator; a custom
+ * allocator has to provide this alignment). A flush of a full buffer
+ * keeps a trailing partial block for the next one; what is still not
+ * aligned, such as the head after a seek or the tail at bfcflush and
+ * bfclose, is written through the page cache, so the file never grows
+ * past what was written and bfcseek and bfctell stay exact. Contexts on
+ * descriptors opened with O_DIRECT start in this mode. Buffer sizes are
+ * rounded up to whole blocks and no longer adapt, large requests are
+ * buffered too and bfseturing is not available. An on of 0 clears
+ * O_DIRECT and returns to buffered I/O; otherwise bfclose restores the
+ * status flags the descriptor had.
+ *
+ * Returns 0 on success, or -1 on error; errno is EINVAL when the file
+ * system does not support direct I/O.
+ */
+BUFRW_PUBLIC_FUNC int bfsetodirect(bufrw_t *ctx, int on) {
+    if (!ctx || ctx->fd < 0 || ctx->map || ctx->shared || ctx->async || ctx->readahead || ctx->uring || ctx->cache || ctx->coder || ctx->digest || ctx->rec_sz || ctx->nonblock || ctx->wb || ctx->limit >= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!on) {
+        if (!ctx->dio) {
+            return 0;
+        }
+        int ret = bufrw_ctx_settle(ctx);
+        ctx->dio->orig_flags &= ~O_DIRECT;
+        if (bufrw_dio_teardown(ctx) != 0) {
+            ret = -1;
+        }
+        return ret;
+    }
+    if (ctx->dio) {
+        return 0;
+    }
+    if (ctx->offset < 0) {
+        errno = ESPIPE;
+        return -1;
+    }
+
+    size_t blk, mem;
+    if (dio_probe(ctx->fd, &blk, &mem) != 0) {
+        return -1;
+    }
+    if (mem == 0) {
+        mem = 1;
+    }
+    // A buffer not aligned for the device has to be refused by the
+    // allocator now rather than by every transfer later.
+    if (ctx->alloc.alloc && ctx->alloc.align < mem) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (bufrw_ctx_settle(ctx) != 0) {
+        return -1;
+    }
+
+    int fl = fcntl(ctx->fd, F_GETFL);
+    if (fl < 0) {
+        return -1;
+    }
+    bufrw_dio_t *dio = (bufrw_dio_t *)calloc(1, sizeof(*dio));
+    if (!dio) {
+        return -1;
+    }
+    dio->blk = blk;
+    dio->mem = mem;
+    dio->flags = fl | O_DIRECT;
+    dio->orig_flags = fl;
+    if (fl != dio->flags && fcntl(ctx->fd, F_SETFL, dio->flags) != 0) {
+        free(dio);
+        return -1;
+    }
+
+    if (ctx->alloc.align < mem) {
+        bufrw_allocator_t aligned = ctx->alloc;
+        aligned.align = mem;
+        if (bfcsetallocator(ctx, &aligned) != 0) {
+            goto fail;
+        }
+    }
+    ctx->rd_sz = dio_round(ctx->rd_sz, blk);
+    ctx->wr_sz = dio_round(ctx->wr_sz, blk);
+    if ((ctx->read_buffer && bufrw_ctx_alloc_read(ctx, ctx->rd_sz) != 0) ||
+        (ctx->write_buffer && bufrw_ctx_alloc_write(ctx, ctx->wr_sz) != 0)) {
+        goto fail;
+    }
+    free(ctx->adapt);
+    ctx->adapt = NULL;
+
+    dio->base = ctx->ops;
+    dio->was_positional = ctx->positional;
+    ctx->positional = 1;
+    ctx->ops = &dio_ops;
+    ctx->dio = dio;
+    return 0;
+
+fail:
+    if (fl != dio->flags) {
+        fcntl(ctx->fd, F_SETFL, fl);
+    }
+    free(dio);
+    return -1;
+}
+
+#else // O_DIRECT
+
+BUFRW_INTERNAL_FUNC int bufrw_dio_drain(bufrw_t *ctx) {
+    (void)ctx;
+    errno = ENOSYS;
+    return -1;
+}
+
+BUFRW_INTERNAL_FUNC size_t bufrw_dio_align(const bufrw_t *ctx) {
+    (void)ctx;
+    return 0;
+}
+
+BUFRW_INTERNAL_FUNC int bufrw_dio_teardown(bufrw_t *ctx) {
+    (void)ctx;
+    return 0;
+}
+
+BUFRW_INTERNAL_FUNC void bufrw_dio_auto(bufrw_t *ctx) {
+    (void)ctx;
+}
+
+BUFRW_PUBLIC_FUNC int bfsetodirect(bufrw_t *ctx, int on) {
+    (void)ctx;
+    if (!on) {
+        return 0;
+    }
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif // O_DIRECT
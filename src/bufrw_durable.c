@@ -0,0 +1,180 @@
+#define BUFRW_LIBRARY_BUILD
+
+#include "bufrw_internal.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+struct _s_bufrw_durable {
+    int mode;                   // BUFRW_DURABLE_FLUSH, _DATASYNC or _GROUP
+    uint64_t window_ns;         // how long a group leader waits for others
+    pthread_mutex_t lock;       // guards the group commit state below
+    pthread_cond_t cond;        // signalled when a group sync completes
+    uint64_t requested;         // commits whose data has reached the kernel
+    uint64_t synced;            // commits covered by a completed sync
+    int syncing;                // a leader is collecting or syncing
+    int err;                    // errno of a failed sync, sticky
+};
+
+/*
+ * fdatasync the file descriptor underneath ctx. Descriptors that cannot
+ * be synced, like pipes and sockets, count as done. Returns 0 on success,
+ * or -1 on error.
+ */
+BUFRW_INTERNAL_FUNC int bufrw_ctx_datasync(bufrw_t *ctx) {
+    int fd = bufrw_ctx_fd(ctx);
+    if (fd < 0) {
+        return 0;
+    }
+    __atomic_fetch_add(&ctx->stats.syncs, 1, __ATOMIC_RELAXED);
+    if (fdatasync(fd) != 0 && errno != EINVAL && errno != EROFS) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Sleep for ns nanoseconds. */
+static void durable_nap(uint64_t ns) {
+    struct timespec ts = {.tv_sec = (time_t)(ns / 1000000000u), .tv_nsec = (long)(ns % 1000000000u)};
+    while (clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, &ts) == EINTR) {
+    }
+}
+
+/*
+ * Wait until a sync covers the data ctx has handed to the kernel so far.
+ *
+ * Each committer takes a ticket once its data is written. The first one
+ * to find no sync under way leads: it waits out the window so that others
+ * can join, then syncs on behalf of every ticket issued by then. The rest
+ * sleep until a sync covers their ticket or, if theirs was issued too
+ * late, lead the next one. A failed sync fails every later commit, as the
+ * kernel may have dropped the pages it could not write.
+ */
+static int durable_group(bufrw_t *ctx) {
+    bufrw_durable_t *d = ctx->durable;
+
+    pthread_mutex_lock(&d->lock);
+    uint64_t ticket = ++d->requested;
+    while (d->synced < ticket && !d->err) {
+        if (d->syncing) {
+            pthread_cond_wait(&d->cond, &d->lock);
+            continue;
+        }
+
+        d->syncing = 1;
+        if (d->window_ns) {
+            pthread_mutex_unlock(&d->lock);
+            durable_nap(d->window_ns);
+            pthread_mutex_lock(&d->lock);
+        }
+        uint64_t upto = d->requested;
+        pthread_mutex_unlock(&d->lock);
+        int ret = bufrw_ctx_datasync(ctx);
+        int err = errno;
+        pthread_mutex_lock(&d->lock);
+        if (ret != 0) {
+            d->err = err;
+        } else {
+            d->synced = upto;
+        }
+        d->syncing = 0;
+        pthread_cond_broadcast(&d->cond);
+    }
+    int err = d->synced >= ticket ? 0 : d->err;
+    pthread_mutex_unlock(&d->lock);
+
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Make the data ctx has just flushed as durable as its mode asks for.
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_INTERNAL_FUNC int bufrw_durable_commit(bufrw_t *ctx) {
+    if (ctx->stream && fflush(ctx->stream) != 0) {
+        return -1;
+    }
+    switch (ctx->durable->mode) {
+    case BUFRW_DURABLE_DATASYNC:
+        return bufrw_ctx_datasync(ctx);
+    case BUFRW_DURABLE_GROUP:
+        return durable_group(ctx);
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Drop the durability state of ctx, which no thread may be committing on.
+ */
+static void durable_free(bufrw_t *ctx) {
+    pthread_cond_destroy(&ctx->durable->cond);
+    pthread_mutex_destroy(&ctx->durable->lock);
+    free(ctx->durable);
+    ctx->durable = NULL;
+}
+
+/*
+ * Commit what the closing ctx has written one last time and drop its
+ * durability state. Returns 0 on success, or -1 on error.
+ */
+BUFRW_INTERNAL_FUNC int bufrw_durable_teardown(bufrw_t *ctx) {
+    int ret = bufrw_durable_commit(ctx);
+    durable_free(ctx);
+    return ret;
+}
+
+/*
+ * bfsetdurability: choose how far bfcflush pushes data.
+ *
+ * With BUFRW_DURABLE_NONE, the default, bfcflush hands the write buffer to
+ * the backend, which for bfopen is the stdio buffer of the stream.
+ * BUFRW_DURABLE_FLUSH also flushes that buffer to the kernel, and
+ * BUFRW_DURABLE_DATASYNC then fdatasync(2)s the descriptor, so that
+ * bfcflush returns once the data is on the device. BUFRW_DURABLE_GROUP
+ * gives the same guarantee but lets concurrent committers share a sync:
+ * the first waits up to window_us microseconds for others to join, then
+ * syncs once for all of them. Concurrent committers on one context need
+ * shared mode (see bfshare), where producers may call bfcflush at any
+ * time. A sync that fails makes every later commit fail. bfclose commits
+ * once more before returning. Must not race with other use of ctx.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfsetdurability(bufrw_t *ctx, int mode, unsigned window_us) {
+    if (!ctx || mode < BUFRW_DURABLE_NONE || mode > BUFRW_DURABLE_GROUP) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (mode == BUFRW_DURABLE_NONE) {
+        if (ctx->durable) {
+            durable_free(ctx);
+        }
+        return 0;
+    }
+    if (mode >= BUFRW_DURABLE_DATASYNC && bufrw_ctx_fd(ctx) < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!ctx->durable) {
+        bufrw_durable_t *d = (bufrw_durable_t *)calloc(1, sizeof(*d));
+        if (!d) {
+            return -1;
+        }
+        pthread_mutex_init(&d->lock, NULL);
+        pthread_cond_init(&d->cond, NULL);
+        ctx->durable = d;
+    }
+    ctx->durable->mode = mode;
+    ctx->durable->window_ns = (uint64_t)window_us * 1000u;
+    return 0;
+}
@@ -0,0 +1,187 @@
+#define BUFRW_LIBRARY_BUILD
+
+#include "bufrw_internal.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BUFRW_SWAP_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define BUFRW_SWAP_NEON 1
+#include <arm_neon.h>
+#endif
+
+/* Bytes of integers bfcwrite_ints converts at a time. */
+#define BUFRW_INTS_CHUNK 4096
+
+/*
+ * Byte swap kernels behind bfcread_ints and bfcwrite_ints. Each reverses
+ * the bytes of the n integers of width bytes at src into dst, which may be
+ * src itself. Picked at run time like the search kernels of bufrw_scan.c.
+ */
+typedef void (*swap_fn)(char *dst, const char *src, size_t width, size_t n);
+
+static void swap_generic(char *dst, const char *src, size_t width, size_t n) {
+    for (size_t i = 0; i < n; i++, dst += width, src += width) {
+        if (width == 2) {
+            uint16_t x;
+            memcpy(&x, src, 2);
+            x = __builtin_bswap16(x);
+            memcpy(dst, &x, 2);
+        } else if (width == 4) {
+            uint32_t x;
+            memcpy(&x, src, 4);
+            x = __builtin_bswap32(x);
+            memcpy(dst, &x, 4);
+        } else {
+            uint64_t x;
+            memcpy(&x, src, 8);
+            x = __builtin_bswap64(x);
+            memcpy(dst, &x, 8);
+        }
+    }
+}
+
+#if defined(BUFRW_SWAP_X86)
+/* Shuffle reversing every integer of width bytes within 16 bytes. */
+static const unsigned char swap_masks[3][16] = {
+    { 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14 },
+    { 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12 },
+    { 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8 },
+};
+
+static const unsigned char *swap_mask(size_t width) {
+    return swap_masks[width == 2 ? 0 : width == 4 ? 1 : 2];
+}
+
+__attribute__((target("ssse3")))
+static void swap_ssse3(char *dst, const char *src, size_t width, size_t n) {
+    const __m128i mask = _mm_loadu_si128((const __m128i *)swap_mask(width));
+    size_t bytes = width * n, i = 0;
+
+    for (; bytes - i >= 16; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_shuffle_epi8(v, mask));
+    }
+    swap_generic(dst + i, src + i, width, (bytes - i) / width);
+}
+
+__attribute__((target("avx2")))
+static void swap_avx2(char *dst, const char *src, size_t width, size_t n) {
+    // vpshufb shuffles within each 128-bit lane, so the mask is just doubled.
+    const __m256i mask = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)swap_mask(width)));
+    size_t bytes = width * n, i = 0;
+
+    for (; bytes - i >= 32; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_shuffle_epi8(v, mask));
+    }
+    swap_ssse3(dst + i, src + i, width, (bytes - i) / width);
+}
+#endif
+
+#if defined(BUFRW_SWAP_NEON)
+static void swap_neon(char *dst, const char *src, size_t width, size_t n) {
+    size_t bytes = width * n, i = 0;
+
+    for (; bytes - i >= 16; i += 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t *)(src + i));
+        v = width == 2 ? vrev16q_u8(v) : width == 4 ? vrev32q_u8(v) : vrev64q_u8(v);
+        vst1q_u8((uint8_t *)(dst + i), v);
+    }
+    swap_generic(dst + i, src + i, width, (bytes - i) / width);
+}
+#endif
+
+static swap_fn swap_resolve(void) {
+#if defined(BUFRW_SWAP_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return swap_avx2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        return swap_ssse3;
+    }
+#elif defined(BUFRW_SWAP_NEON)
+    return swap_neon;
+#endif
+    return swap_generic;
+}
+
+static void swap_first(char *dst, const char *src, size_t width, size_t n);
+
+/* Kernel in use, resolved on the first swap. */
+static _Atomic(swap_fn) swap_impl = swap_first;
+
+static void swap_first(char *dst, const char *src, size_t width, size_t n) {
+    swap_fn fn = swap_resolve();
+    atomic_store_explicit(&swap_impl, fn, memory_order_relaxed);
+    fn(dst, src, width, n);
+}
+
+static void swap(char *dst, const char *src, size_t width, size_t n) {
+    atomic_load_explicit(&swap_impl, memory_order_relaxed)(dst, src, width, n);
+}
+
+static int ints_valid(const bufrw_t *ctx, size_t width, int order) {
+    if (!ctx || (width != 2 && width != 4 && width != 8) || (order != BUFRW_LE && order != BUFRW_BE)) {
+        errno = EINVAL;
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * bfcread_ints: read fixed-width integers in a byte order.
+ *
+ * Reads up to n integers of width bytes (2, 4 or 8) stored in order
+ * (BUFRW_LE or BUFRW_BE) from ctx into ptr, converting them to host order
+ * with a vector kernel picked for the CPU at run time. Returns the number
+ * of complete integers read.
+ */
+BUFRW_PUBLIC_FUNC size_t bfcread_ints(bufrw_t *ctx, void *ptr, size_t width, size_t n, int order) {
+    if (!ints_valid(ctx, width, order)) {
+        return 0;
+    }
+
+    // Read in place, through the direct path for large arrays, then convert.
+    size_t got = bfcread(ctx, ptr, width, n);
+    if (BUFRW_SWAPS(order)) {
+        swap((char *)ptr, (const char *)ptr, width, got);
+    }
+    return got;
+}
+
+/*
+ * bfcwrite_ints: write fixed-width integers in a byte order.
+ *
+ * Like bfcread_ints the other way around: writes n host order integers of
+ * width bytes from ptr into ctx, stored in order. Returns the number of
+ * complete integers written.
+ */
+BUFRW_PUBLIC_FUNC size_t bfcwrite_ints(bufrw_t *ctx, const void *ptr, size_t width, size_t n, int order) {
+    if (!ints_valid(ctx, width, order)) {
+        return 0;
+    }
+    if (!BUFRW_SWAPS(order)) {
+        return bfcwrite(ctx, ptr, width, n);
+    }
+
+    // The caller's array is left alone: convert a chunk at a time.
+    _Alignas(32) char chunk[BUFRW_INTS_CHUNK];
+    const char *src = (const char *)ptr;
+    size_t per = sizeof(chunk) / width, done = 0;
+    while (done < n) {
+        size_t k = n - done < per ? n - done : per;
+        swap(chunk, src + done * width, width, k);
+        size_t put = bfcwrite(ctx, chunk, width, k);
+        done += put;
+        if (put < k) {
+            break;
+        }
+    }
+    return done;
+}
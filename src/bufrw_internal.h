@@ -0,0 +1,361 @@
+/*
+ * bufrw_internal.h - Internal definitions shared by the bufrw sources
+ *
+ * Project: bufrw
+ * License: MIT
+ * Author: [reslaid32]
+ *
+ * Description:
+ * The layout of the per-stream context and the helpers the library
+ * sources use on each other. Nothing in here is part of the public API.
+ */
+
+#ifndef BUFRW_INTERNAL_H
+#define BUFRW_INTERNAL_H
+
+#include "../include/bufrw.h"
+
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#if !defined(BUFRW_INTERNAL_FUNC)
+#define BUFRW_INTERNAL_FUNC __attribute__((visibility("hidden")))
+#endif // BUFRW_INTERNAL_FUNC
+
+typedef struct _s_bufrw_ops bufrw_ops_t;
+typedef struct _s_bufrw_async bufrw_async_t;
+typedef struct _s_bufrw_readahead bufrw_readahead_t;
+typedef struct _s_bufrw_uring bufrw_uring_t;
+typedef struct _s_bufrw_map bufrw_map_t;
+typedef struct _s_bufrw_adapt bufrw_adapt_t;
+typedef struct _s_bufrw_dio bufrw_dio_t;
+typedef struct _s_bufrw_cache_link bufrw_cache_link_t;
+typedef struct _s_bufrw_coder bufrw_coder_t;
+typedef struct _s_bufrw_digest bufrw_digest_t;
+typedef struct _s_bufrw_durable bufrw_durable_t;
+typedef struct _s_bufrw_wb bufrw_wb_t;
+
+/*
+ * Per-stream buffer context.
+ *
+ * Every bufrw_t owns its own read and write buffers, so any number of
+ * streams can be buffered at once without handing one stream's prefetched
+ * bytes to another.
+ */
+struct _s_bufrw {
+    /*
+       Buffer window, first so that the inline accessors of bufrw.h see it
+       through bufrw_head_t; the members below are the same fields.
+    */
+    union {
+        bufrw_head_t head;
+        struct {
+            char *read_buffer;
+            size_t read_buffer_pos;     // current position in read_buffer
+            size_t read_buffer_len;     // number of valid bytes in read_buffer
+            char *write_buffer;
+            size_t write_buffer_pos;    // current position in write_buffer
+            size_t write_buffer_sz;     // bytes buffered before a flush, at most the capacity
+            int shared;                 // shared-stream append mode (see bfshare)
+        };
+    };
+
+    const bufrw_ops_t *ops;     // backend moving bytes to and from the stream
+    FILE *stream;               // stdio backend
+    int fd;                     // fd backend
+    int positional;             // fd backend uses pread/pwrite at offset
+    long offset;                // fd backend file offset, -1 if unseekable
+
+    size_t rd_sz;               // requested read buffer size
+    size_t wr_sz;               // requested write buffer size
+    size_t direct_min;          // bypass threshold, 0 for the buffer size
+    size_t rec_sz;              // fixed record size, 0 for none (see bfsetrecord)
+    int nonblock;               // non-blocking mode (see bfsetnonblock)
+    int nonblock_fl;            // descriptor flags from before it
+    int want_read;              // the last read found nothing to read
+    long limit;                 // end of the readable range, -1 for none (see bfsplit)
+
+    bufrw_allocator_t alloc;    // where the data buffers come from
+
+    size_t read_buffer_cap;     // allocated size of read_buffer
+    size_t read_buffer_sz;      // bytes a refill asks for, at most the capacity
+    size_t write_buffer_cap;    // allocated size of write_buffer
+
+    char *record;               // records straddling refills (see bfreaduntil)
+    size_t record_cap;          // allocated size of record
+
+    /*
+       Shared-stream append mode (see bfshare). Producers reserve space in
+       write_buffer by bumping shared_tail and publish the copied bytes in
+       shared_done; the producer whose reservation crosses the end drains.
+    */
+    atomic_size_t shared_tail;  // bytes reserved in write_buffer
+    atomic_size_t shared_done;  // reserved bytes already copied in
+    atomic_int shared_err;      // sticky drain error
+
+    bufrw_async_t *async;       // write-behind flusher (see bfsetasync)
+    bufrw_readahead_t *readahead; // read-ahead filler (see bfsetreadahead)
+    bufrw_uring_t *uring;       // io_uring engine (see bfseturing)
+    bufrw_map_t *map;           // file mapping serving as read buffer (see bfopen_map)
+    bufrw_adapt_t *adapt;       // buffer sizer (see bfsetadaptive)
+    bufrw_dio_t *dio;           // direct I/O state (see bfsetodirect)
+    bufrw_cache_link_t *cache;  // block cache serving reads (see bfsetcache)
+    bufrw_coder_t *coder;       // codec stage (see bfsetcodec)
+    bufrw_digest_t *digest;     // running checksum (see bfsetdigest)
+    bufrw_durable_t *durable;   // durability mode (see bfsetdurability)
+    bufrw_wb_t *wb;             // write-back window (see bfsetwriteback)
+
+    bufrw_stats_t stats;        // I/O counters (see bfstats)
+
+    bufrw_t *reg_prev;          // neighbours among the open contexts
+    bufrw_t *reg_next;          // (see bfflushall)
+};
+
+/*
+ * Stream backend.
+ *
+ * read returns the bytes of a single transfer, 0 at end of file or -1 on
+ * error; write and writev may write less than asked. seek and tell act on the
+ * underlying position, not on the caller's buffered view of it.
+ */
+struct _s_bufrw_ops {
+    ssize_t (*read)(bufrw_t *ctx, void *buf, size_t n);
+    ssize_t (*write)(bufrw_t *ctx, const void *buf, size_t n);
+    ssize_t (*writev)(bufrw_t *ctx, const struct iovec *iov, int iovcnt);
+    int (*seek)(bufrw_t *ctx, long offset, int whence);
+    long (*tell)(bufrw_t *ctx);
+};
+
+/*
+ * Read into buf until n bytes have arrived, the stream ends or an error
+ * occurs. Returns the number of bytes read.
+ */
+BUFRW_INTERNAL_FUNC size_t bufrw_io_read_full(bufrw_t *restrict ctx, char *restrict buf, size_t n);
+
+/*
+ * Write all n bytes of buf unless an error occurs.
+ * Returns the number of bytes written.
+ */
+BUFRW_INTERNAL_FUNC size_t bufrw_io_write_full(bufrw_t *restrict ctx, const char *restrict buf, size_t n);
+
+/*
+ * Allocate a context on backend ops. Buffers are allocated on first use.
+ */
+BUFRW_INTERNAL_FUNC bufrw_t *bufrw_ctx_new(const bufrw_ops_t *ops, size_t rd_sz, size_t wr_sz);
+
+/*
+ * File descriptor underneath ctx, or -1 if there is none.
+ */
+BUFRW_INTERNAL_FUNC int bufrw_ctx_fd(const bufrw_t *ctx);
+
+/*
+ * File descriptor ctx transfers on with plain read(2) and write(2) calls
+ * at ctx->offset, or -1 if its data passes through anything else or it is
+ * confined to a range of the file (see bfsplit).
+ */
+BUFRW_INTERNAL_FUNC int bufrw_ctx_plain_fd(const bufrw_t *ctx);
+
+/*
+ * Size the read buffer of ctx so that refills ask for buffer_sz bytes.
+ *
+ * The buffer is only reallocated when it has to grow, keeping its unread
+ * bytes; on failure it is left as it was.
+ */
+BUFRW_INTERNAL_FUNC int bufrw_ctx_alloc_read(bufrw_t *ctx, size_t buffer_sz);
+
+/*
+ * Size the write buffer of ctx so that it flushes at buffer_sz bytes.
+ *
+ * Like bufrw_ctx_alloc_read, keeping the pending bytes, of which there
+ * must not be more than buffer_sz.
+ */
+BUFRW_INTERNAL_FUNC int bufrw_ctx_alloc_write(bufrw_t *ctx, size_t buffer_sz);
+
+/*
+ * Reallocate the buffers of ctx whose capacity exceeds their size, so
+ * that they can be swapped with the spare buffers of an engine.
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_INTERNAL_FUNC int bufrw_ctx_fit(bufrw_t *ctx);
+
+/*
+ * Find the first byte c in the n bytes at p with the fastest search kernel
+ * the CPU supports (bufrw_scan.c). Returns a pointer to it, or NULL if
+ * there is none.
+ */
+BUFRW_INTERNAL_FUNC const char *bufrw_scan(const char *p, int c, size_t n);
+
+/*
+ * Buffer allocation (bufrw_alloc.c).
+ *
+ * buf_alloc and buf_free get and release data buffers of n bytes with the
+ * allocator of ctx; allocator_get copies the process-wide allocator that
+ * new contexts start with.
+ */
+BUFRW_INTERNAL_FUNC void *bufrw_buf_alloc(const bufrw_t *ctx, size_t n);
+BUFRW_INTERNAL_FUNC void bufrw_buf_free(const bufrw_t *ctx, void *ptr, size_t n);
+BUFRW_INTERNAL_FUNC void bufrw_allocator_get(bufrw_allocator_t *out);
+
+/*
+ * Write out the write buffer of ctx with plain backend calls. Bytes that
+ * could not be written stay in the buffer. Returns 0 on success, or -1 on
+ * error.
+ */
+BUFRW_INTERNAL_FUNC int bufrw_ctx_drain(bufrw_t *ctx);
+
+/*
+ * Flush pending writes of ctx and give back its unread bytes, leaving the
+ * stream at the caller's position. Returns 0 on success, or -1 on error.
+ */
+BUFRW_INTERNAL_FUNC int bufrw_ctx_settle(bufrw_t *ctx);
+
+/*
+ * Asynchronous writer hooks (bufrw_async.c).
+ *
+ * submit queues the filled write buffer and continues in a free one, wait
+ * blocks until nothing is in flight, barrier queues what is pending and
+ * waits, teardown drains and stops the flusher. All return 0 on success,
+ * or -1 if a write has failed.
+ */
+BUFRW_INTERNAL_FUNC int bufrw_async_submit(bufrw_t *ctx);
+BUFRW_INTERNAL_FUNC int bufrw_async_wait(bufrw_t *ctx);
+BUFRW_INTERNAL_FUNC int bufrw_async_barrier(bufrw_t *ctx);
+BUFRW_INTERNAL_FUNC int bufrw_async_teardown(bufrw_t *ctx);
+
+/*
+ * Read-ahead hooks (bufrw_readahead.c).
+ *
+ * refill brings the next block into the read buffer and returns its
+ * length, 0 at end of file or -1 on error. pause stops the filler and
+ * returns how many bytes it had read ahead; teardown does the same and
+ * frees the ring. tell is the stream position as seen by the read buffer.
+ */
+BUFRW_INTERNAL_FUNC ssize_t bufrw_ra_refill(bufrw_t *ctx);
+BUFRW_INTERNAL_FUNC size_t bufrw_ra_pause(bufrw_t *ctx);
+BUFRW_INTERNAL_FUNC size_t bufrw_ra_teardown(bufrw_t *ctx);
+BUFRW_INTERNAL_FUNC long bufrw_ra_tell(bufrw_t *ctx);
+
+/*
+ * io_uring engine hooks (bufrw_uring.c).
+ *
+ * refill and submit take the places of a read buffer refill and a full
+ * write buffer flush, flush waits for every write, pause drops the reads
+ * in flight before a reposition and teardown releases the ring.
+ */
+BUFRW_INTERNAL_FUNC ssize_t bufrw_uring_refill(bufrw_t *ctx);
+BUFRW_INTERNAL_FUNC int bufrw_uring_submit(bufrw_t *ctx);
+BUFRW_INTERNAL_FUNC int bufrw_uring_flush(bufrw_t *ctx);
+BUFRW_INTERNAL_FUNC size_t bufrw_uring_pause(bufrw_t *ctx);
+BUFRW_INTERNAL_FUNC int bufrw_uring_teardown(bufrw_t *ctx);
+
+/*
+ * Memory-mapped mode hooks (bufrw_mmap.c).
+ *
+ * willneed prefetches the n bytes at the caller's position when access has
+ * turned random, teardown unmaps the file and detaches it from the read
+ * buffer.
+ */
+BUFRW_INTERNAL_FUNC void bufrw_map_willneed(bufrw_t *ctx, size_t n);
+BUFRW_INTERNAL_FUNC int bufrw_map_teardown(bufrw_t *ctx);
+
+/*
+ * Adaptive sizing hooks (bufrw_adapt.c).
+ *
+ * refill and drain take the places of a plain refill and flush, timing
+ * them and resizing the buffer in between when the observed pattern calls
+ * for it. auto turns sizing on for the buffers opened with size 0.
+ */
+BUFRW_INTERNAL_FUNC ssize_t bufrw_adapt_refill(bufrw_t *ctx);
+BUFRW_INTERNAL_FUNC int bufrw_adapt_drain(bufrw_t *ctx);
+BUFRW_INTERNAL_FUNC void bufrw_adapt_auto(bufrw_t *ctx, int fd, int rd, int wr);
+
+/*
+ * Direct I/O hooks (bufrw_dio.c).
+ *
+ * drain takes the place of the flush of a full write buffer, align is the
+ * buffer alignment direct I/O needs, teardown returns to buffered I/O
+ * once the buffers have settled and auto turns direct I/O on for
+ * descriptors opened with O_DIRECT.
+ */
+BUFRW_INTERNAL_FUNC int bufrw_dio_drain(bufrw_t *ctx);
+BUFRW_INTERNAL_FUNC size_t bufrw_dio_align(const bufrw_t *ctx);
+BUFRW_INTERNAL_FUNC int bufrw_dio_teardown(bufrw_t *ctx);
+BUFRW_INTERNAL_FUNC void bufrw_dio_auto(bufrw_t *ctx);
+
+/*
+ * Block cache hooks (bufrw_cache.c).
+ *
+ * pread copies n bytes at off of the file of ctx out of its cache and
+ * returns how many it copied; teardown detaches ctx, whose buffers must
+ * have settled, and restores its backend.
+ */
+BUFRW_INTERNAL_FUNC size_t bufrw_cache_pread(bufrw_t *ctx, void *buf, size_t n, long off);
+BUFRW_INTERNAL_FUNC int bufrw_cache_teardown(bufrw_t *ctx);
+
+/*
+ * Codec stage hook (bufrw_codec.c): teardown restores the backend of
+ * ctx, whose buffers must have settled.
+ */
+BUFRW_INTERNAL_FUNC void bufrw_codec_teardown(bufrw_t *ctx);
+
+/*
+ * Digest hook (bufrw_digest.c): teardown stops the digest of ctx and
+ * restores the backend underneath, which must be done before any other
+ * stage is torn down.
+ */
+BUFRW_INTERNAL_FUNC void bufrw_digest_teardown(bufrw_t *ctx);
+
+/*
+ * Statistics hooks (bufrw_stats.c).
+ *
+ * Transfers between the buffers of ctx and its stream are timed from a
+ * bufrw_stats_clock reading taken before them and recorded with
+ * bufrw_stats_io as one of the kinds below, with the bytes asked for and
+ * the bytes moved, or -1 on error. fold adds the counters of a context
+ * being closed to the global totals.
+ */
+enum {
+    BUFRW_IO_REFILL,        // read buffer refill
+    BUFRW_IO_FLUSH,         // write buffer flush
+    BUFRW_IO_DIRECT_READ,   // read bypassing the read buffer
+    BUFRW_IO_DIRECT_WRITE,  // write bypassing the write buffer
+};
+
+BUFRW_INTERNAL_FUNC uint64_t bufrw_stats_clock(void);
+BUFRW_INTERNAL_FUNC void bufrw_stats_io(bufrw_t *ctx, int kind, uint64_t start, size_t want, ssize_t got);
+BUFRW_INTERNAL_FUNC void bufrw_stats_fold(const bufrw_t *ctx);
+
+/*
+ * Registry hooks (bufrw_batch.c): every opener returns its new context
+ * through add, and bfclose removes it before tearing anything down.
+ */
+BUFRW_INTERNAL_FUNC bufrw_t *bufrw_registry_add(bufrw_t *ctx);
+BUFRW_INTERNAL_FUNC void bufrw_registry_remove(bufrw_t *ctx);
+
+/*
+ * Durability hooks (bufrw_durable.c): datasync fdatasyncs the descriptor
+ * underneath ctx, commit makes what a flush of ctx has written durable as
+ * its mode asks, and teardown commits one last time as ctx is closed.
+ */
+BUFRW_INTERNAL_FUNC int bufrw_ctx_datasync(bufrw_t *ctx);
+BUFRW_INTERNAL_FUNC int bufrw_durable_commit(bufrw_t *ctx);
+BUFRW_INTERNAL_FUNC int bufrw_durable_teardown(bufrw_t *ctx);
+
+/*
+ * Write-back hooks (bufrw_writeback.c).
+ *
+ * write absorbs the iovcnt segments of iov at the position of ctx and
+ * returns how many bytes it took, flush writes out the dirty ranges and
+ * teardown does the same and ends the mode. overlay lays the pending bytes
+ * over the got bytes read into buf at off, which it extends with those
+ * past the end of the file up to n, and returns the new count; end is the
+ * offset past the last pending byte, or -1 if none is pending.
+ */
+BUFRW_INTERNAL_FUNC size_t bufrw_wb_write(bufrw_t *ctx, const struct iovec *iov, int iovcnt);
+BUFRW_INTERNAL_FUNC int bufrw_wb_flush(bufrw_t *ctx);
+BUFRW_INTERNAL_FUNC int bufrw_wb_teardown(bufrw_t *ctx);
+BUFRW_INTERNAL_FUNC ssize_t bufrw_wb_overlay(bufrw_t *ctx, void *buf, size_t n, long off, ssize_t got);
+BUFRW_INTERNAL_FUNC long bufrw_wb_end(const bufrw_t *ctx);
+
+#endif // BUFRW_INTERNAL_H
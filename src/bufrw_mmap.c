@@ -0,0 +1,211 @@
+#define BUFRW_LIBRARY_BUILD
+
+#include "bufrw_internal.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Jumps shorter than this count as sequential access. */
+#define BUFRW_MAP_NEAR (1L << 20)
+
+/* Consecutive far seeks before the kernel is told access is random. */
+#define BUFRW_MAP_RANDOM_TRIGGER 2
+
+/*
+ * Mapping state of a context.
+ *
+ * The whole file is mapped read-only and serves as the read buffer of the
+ * context: read_buffer points at the mapping, read_buffer_len is the file
+ * size and read_buffer_pos the caller's position, so reads copy straight
+ * out of the page cache and never refill.
+ */
+struct _s_bufrw_map {
+    void *base;                 // mapping, NULL for an empty file
+    size_t size;
+    int advice;                 // current madvise hint
+    int far;                    // far seeks in a row
+    size_t last_seek;           // position the last seek landed on
+};
+
+/* Stand-in read buffer for an empty file, which cannot be mapped. */
+static char map_empty[1];
+
+static void map_advise(bufrw_t *ctx, int advice) {
+    bufrw_map_t *map = ctx->map;
+    if (map->advice == advice || !map->base) {
+        return;
+    }
+    madvise(map->base, map->size, advice);
+    map->advice = advice;
+}
+
+static ssize_t map_read(bufrw_t *ctx, void *buf, size_t n) {
+    (void)ctx; (void)buf; (void)n;
+    return 0;  // Everything is in the read buffer already.
+}
+
+static ssize_t map_write(bufrw_t *ctx, const void *buf, size_t n) {
+    (void)ctx; (void)buf; (void)n;
+    errno = EBADF;
+    return -1;
+}
+
+static ssize_t map_writev(bufrw_t *ctx, const struct iovec *iov, int iovcnt) {
+    (void)ctx; (void)iov; (void)iovcnt;
+    errno = EBADF;
+    return -1;
+}
+
+/*
+ * Reposition within the mapping. The underlying position is the end of the
+ * mapping, so SEEK_CUR is taken relative to it like on any other backend;
+ * the read buffer is kept and only its position moves.
+ */
+static int map_seek(bufrw_t *ctx, long offset, int whence) {
+    bufrw_map_t *map = ctx->map;
+    long base;
+
+    switch (whence) {
+    case SEEK_SET: base = 0; break;
+    case SEEK_CUR:
+    case SEEK_END: base = (long)map->size; break;
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+    if ((offset < 0 && -offset > base) || (offset > 0 && (size_t)(base + offset) > map->size)) {
+        errno = EINVAL;
+        return -1;
+    }
+    size_t target = (size_t)(base + offset);
+    size_t from = ctx->read_buffer_pos;
+
+    // Follow the access pattern: short forward jumps or long runs of
+    // reading are sequential, repeated far jumps are random.
+    if (target != from) {
+        int near = target >= from && (long)(target - from) <= BUFRW_MAP_NEAR;
+        int streamed = from >= map->last_seek && (long)(from - map->last_seek) >= BUFRW_MAP_NEAR;
+        map->far = near || streamed ? 0 : map->far + 1;
+        map->last_seek = target;
+        map_advise(ctx, map->far >= BUFRW_MAP_RANDOM_TRIGGER ? MADV_RANDOM : MADV_SEQUENTIAL);
+    }
+
+    ctx->read_buffer_len = map->size;
+    ctx->read_buffer_pos = target;
+    return 0;
+}
+
+static long map_tell(bufrw_t *ctx) {
+    return ctx->offset;
+}
+
+static const bufrw_ops_t map_ops = {
+    .read = map_read,
+    .write = map_write,
+    .writev = map_writev,
+    .seek = map_seek,
+    .tell = map_tell,
+};
+
+/*
+ * Tell the kernel the n bytes at the caller's position of ctx are about to
+ * be looked at. Only needed once access is random: sequential access is
+ * covered by the kernel's own read-ahead.
+ */
+BUFRW_INTERNAL_FUNC void bufrw_map_willneed(bufrw_t *ctx, size_t n) {
+    bufrw_map_t *map = ctx->map;
+    if (map->advice != MADV_RANDOM || n == 0) {
+        return;
+    }
+
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = ctx->read_buffer_pos - ctx->read_buffer_pos % page;
+    madvise((char *)map->base + start, ctx->read_buffer_pos + n - start, MADV_WILLNEED);
+}
+
+/*
+ * Unmap the file of ctx and detach the mapping from its read buffer.
+ */
+BUFRW_INTERNAL_FUNC int bufrw_map_teardown(bufrw_t *ctx) {
+    bufrw_map_t *map = ctx->map;
+    int ret = 0;
+
+    if (map->base && munmap(map->base, map->size) != 0) {
+        ret = -1;
+    }
+    ctx->read_buffer = NULL;
+    ctx->read_buffer_sz = 0;
+    ctx->read_buffer_pos = 0;
+    ctx->read_buffer_len = 0;
+    ctx->map = NULL;
+    free(map);
+    return ret;
+}
+
+/*
+ * bfopen_map: open a memory-mapped read-only context on a file descriptor.
+ *
+ * Maps the regular file behind fd and reads out of the mapping: bfcread
+ * copies straight from the page cache and bfview hands out pointers into
+ * it. Reading starts at the descriptor's current offset, which is never
+ * moved. bfcseek and bfctell work within the file as it was when opened;
+ * the kernel is advised of sequential or random access as the seeks
+ * suggest. Writing fails with EBADF. The descriptor stays owned by the
+ * caller and must be open for reading. Returns NULL on error.
+ */
+BUFRW_PUBLIC_FUNC bufrw_t *bfopen_map(int fd) {
+    struct stat st;
+
+    if (fd < 0) {
+        errno = EBADF;
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0) {
+        return NULL;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        errno = ENODEV;
+        return NULL;
+    }
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    if (pos < 0) {
+        return NULL;
+    }
+
+    bufrw_map_t *map = (bufrw_map_t *)calloc(1, sizeof(*map));
+    if (!map) {
+        return NULL;
+    }
+    map->size = (size_t)st.st_size;
+    if (map->size > 0) {
+        map->base = mmap(NULL, map->size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map->base == MAP_FAILED) {
+            free(map);
+            return NULL;
+        }
+    }
+
+    bufrw_t *ctx = bufrw_ctx_new(&map_ops, 0, 0);
+    if (!ctx) {
+        if (map->base) {
+            munmap(map->base, map->size);
+        }
+        free(map);
+        return NULL;
+    }
+    ctx->fd = fd;
+    ctx->positional = 1;
+    ctx->offset = (long)map->size;
+    ctx->map = map;
+    ctx->read_buffer = map->base ? (char *)map->base : map_empty;
+    ctx->read_buffer_sz = map->size;
+    ctx->read_buffer_len = map->size;
+    ctx->read_buffer_pos = (size_t)pos < map->size ? (size_t)pos : map->size;
+    map->last_seek = ctx->read_buffer_pos;
+    map->advice = MADV_NORMAL;
+    map_advise(ctx, MADV_SEQUENTIAL);
+    return bufrw_registry_add(ctx);
+}
@@ -0,0 +1,286 @@
+#define BUFRW_LIBRARY_BUILD
+
+#include "bufrw_internal.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+/* Consecutive refills without a seek before the filler thread starts. */
+#define BUFRW_RA_TRIGGER 2
+
+/*
+ * Read-ahead state of a context.
+ *
+ * Once the consumer has refilled its read buffer a few times in a row
+ * without seeking, a filler thread keeps reading the following blocks
+ * into a ring of spare buffers. A refill then just swaps the drained read
+ * buffer for the oldest filled one.
+ */
+struct _s_bufrw_readahead {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t filled;          // signalled when a slot is filled
+    pthread_cond_t space;           // signalled when a slot is consumed
+
+    int nbufs;
+    char **slot;                    // ring of buffers, oldest first
+    ssize_t *slot_len;              // bytes in each slot, 0 at EOF, -1 on error
+    int head;
+    int count;                      // filled slots
+    int done;                       // filler hit EOF or an error and exited
+
+    int running;
+    int stop;
+    int sequential;                 // refills since the last seek
+    long start_pos;                 // stream position when the filler started
+    long delivered;                 // bytes swapped in since then
+};
+
+/*
+ * Filler thread: read ahead into free slots until stopped or the stream ends.
+ */
+static void *ra_filler(void *arg) {
+    bufrw_t *ctx = (bufrw_t *)arg;
+    bufrw_readahead_t *ra = ctx->readahead;
+
+    pthread_mutex_lock(&ra->lock);
+    while (!ra->stop) {
+        if (ra->count == ra->nbufs) {
+            pthread_cond_wait(&ra->space, &ra->lock);
+            continue;
+        }
+
+        int tail = (ra->head + ra->count) % ra->nbufs;
+        char *buf = ra->slot[tail];
+        pthread_mutex_unlock(&ra->lock);
+
+        // The stream belongs to this thread while it is running.
+        ssize_t got = ctx->ops->read(ctx, buf, ctx->read_buffer_sz);
+
+        pthread_mutex_lock(&ra->lock);
+        ra->slot_len[tail] = got;
+        ra->count++;
+        pthread_cond_signal(&ra->filled);
+        if (got <= 0) {
+            ra->done = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ra->lock);
+    return NULL;
+}
+
+static int ra_start(bufrw_t *ctx) {
+    bufrw_readahead_t *ra = ctx->readahead;
+
+    ra->start_pos = ctx->ops->tell(ctx);
+    ra->delivered = 0;
+    ra->head = 0;
+    ra->count = 0;
+    ra->done = 0;
+    ra->stop = 0;
+    if (pthread_create(&ra->thread, NULL, ra_filler, ctx) != 0) {
+        return -1;
+    }
+    ra->running = 1;
+
+#if defined(POSIX_FADV_SEQUENTIAL)
+    int fd = bufrw_ctx_fd(ctx);
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+#endif
+    return 0;
+}
+
+/*
+ * Stop the filler of ctx and drop the blocks it has read ahead.
+ *
+ * Returns the number of bytes the stream position is ahead of what has
+ * been swapped into the read buffer, so the caller can move back over
+ * them. Resets the sequential access detection.
+ */
+BUFRW_INTERNAL_FUNC size_t bufrw_ra_pause(bufrw_t *ctx) {
+    bufrw_readahead_t *ra = ctx->readahead;
+    size_t ahead = 0;
+
+    ra->sequential = 0;
+    if (!ra->running) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&ra->lock);
+    ra->stop = 1;
+    pthread_cond_signal(&ra->space);
+    pthread_mutex_unlock(&ra->lock);
+    pthread_join(ra->thread, NULL);
+    ra->running = 0;
+
+    for (int i = 0; i < ra->count; i++) {
+        ssize_t len = ra->slot_len[(ra->head + i) % ra->nbufs];
+        if (len > 0) {
+            ahead += (size_t)len;
+        }
+    }
+    ra->count = 0;
+    return ahead;
+}
+
+/*
+ * Refill the read buffer of ctx, from the read-ahead ring once access has
+ * turned out to be sequential and straight from the stream before that.
+ *
+ * Returns the number of bytes now in the read buffer, 0 at end of file
+ * or -1 on error.
+ */
+BUFRW_INTERNAL_FUNC ssize_t bufrw_ra_refill(bufrw_t *ctx) {
+    bufrw_readahead_t *ra = ctx->readahead;
+
+    if (!ra->running) {
+        if (++ra->sequential < BUFRW_RA_TRIGGER || ra_start(ctx) != 0) {
+            return ctx->ops->read(ctx, ctx->read_buffer, ctx->read_buffer_sz);
+        }
+    }
+
+    pthread_mutex_lock(&ra->lock);
+    while (ra->count == 0) {
+        pthread_cond_wait(&ra->filled, &ra->lock);
+    }
+
+    // Swap the drained read buffer for the oldest filled slot.
+    char *buf = ra->slot[ra->head];
+    ssize_t got = ra->slot_len[ra->head];
+    ra->slot[ra->head] = ctx->read_buffer;
+    ctx->read_buffer = buf;
+    ra->head = (ra->head + 1) % ra->nbufs;
+    ra->count--;
+    if (got > 0) {
+        ra->delivered += got;
+    }
+    int finished = ra->done && ra->count == 0;
+    pthread_cond_signal(&ra->space);
+    pthread_mutex_unlock(&ra->lock);
+
+    // The filler has exited; later refills read synchronously again so a
+    // growing file or a transient error is not sticky.
+    if (finished) {
+        pthread_join(ra->thread, NULL);
+        ra->running = 0;
+        ra->sequential = 0;
+    }
+    return got;
+}
+
+/*
+ * Position of the stream as seen by the read buffer of ctx: the position
+ * the filler started at plus everything swapped in since, or the stream's
+ * own position when the filler is not running.
+ */
+BUFRW_INTERNAL_FUNC long bufrw_ra_tell(bufrw_t *ctx) {
+    bufrw_readahead_t *ra = ctx->readahead;
+
+    if (!ra->running) {
+        return ctx->ops->tell(ctx);
+    }
+    if (ra->start_pos < 0) {
+        errno = ESPIPE;
+        return -1L;
+    }
+    return ra->start_pos + ra->delivered;
+}
+
+/*
+ * Stop the filler of ctx and free the read-ahead ring.
+ *
+ * Returns the number of bytes read ahead, as bufrw_ra_pause does.
+ */
+BUFRW_INTERNAL_FUNC size_t bufrw_ra_teardown(bufrw_t *ctx) {
+    bufrw_readahead_t *ra = ctx->readahead;
+    size_t ahead = bufrw_ra_pause(ctx);
+
+    for (int i = 0; i < ra->nbufs; i++) {
+        bufrw_buf_free(ctx, ra->slot[i], ctx->read_buffer_sz);
+    }
+    pthread_cond_destroy(&ra->space);
+    pthread_cond_destroy(&ra->filled);
+    pthread_mutex_destroy(&ra->lock);
+    free(ra->slot_len);
+    free(ra->slot);
+    free(ra);
+    ctx->readahead = NULL;
+    return ahead;
+}
+
+/*
+ * bfsetreadahead: enable read-ahead prefetching on a context.
+ *
+ * Once ctx has been refilled a couple of times in a row without a seek, a
+ * background thread starts reading the following nbufs blocks of the read
+ * buffer size ahead of the consumer, so reading and I/O overlap; on file
+ * descriptors the kernel is advised of sequential access as well. A seek
+ * stops the thread until access is sequential again. Large requests are
+ * served from the ring too instead of taking the direct path. An nbufs of
+ * 0 disables read-ahead.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfsetreadahead(bufrw_t *ctx, int nbufs) {
+    if (!ctx || ctx->shared || ctx->uring || ctx->map || ctx->digest || ctx->nonblock || ctx->wb || nbufs < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (ctx->readahead) {
+        size_t ahead = bufrw_ra_teardown(ctx);
+        if (ahead > 0 && ctx->ops->seek(ctx, -(long)ahead, SEEK_CUR) != 0) {
+            return -1;
+        }
+    }
+    if (nbufs == 0) {
+        return 0;
+    }
+
+    if (!ctx->read_buffer && bufrw_ctx_alloc_read(ctx, ctx->rd_sz) != 0) {
+        return -1;
+    }
+    // Buffers are swapped with the ring, so they all have one size.
+    if (bufrw_ctx_fit(ctx) != 0) {
+        return -1;
+    }
+
+    bufrw_readahead_t *ra = (bufrw_readahead_t *)calloc(1, sizeof(*ra));
+    if (!ra) {
+        return -1;
+    }
+    ra->nbufs = nbufs;
+    ra->slot = (char **)calloc((size_t)nbufs, sizeof(char *));
+    ra->slot_len = (ssize_t *)calloc((size_t)nbufs, sizeof(ssize_t));
+    if (!ra->slot || !ra->slot_len) {
+        goto fail;
+    }
+    for (int i = 0; i < nbufs; i++) {
+        if (!(ra->slot[i] = (char *)bufrw_buf_alloc(ctx, ctx->read_buffer_sz))) {
+            goto fail;
+        }
+    }
+
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->filled, NULL);
+    pthread_cond_init(&ra->space, NULL);
+    ctx->readahead = ra;
+    return 0;
+
+fail:
+    if (ra->slot) {
+        for (int i = 0; i < nbufs; i++) {
+            bufrw_buf_free(ctx, ra->slot[i], ctx->read_buffer_sz);
+        }
+    }
+    free(ra->slot_len);
+    free(ra->slot);
+    free(ra);
+    errno = ENOMEM;
+    return -1;
+}
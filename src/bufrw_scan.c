@@ -0,0 +1,118 @@
+#define BUFRW_LIBRARY_BUILD
+
+#include "bufrw_internal.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BUFRW_SCAN_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define BUFRW_SCAN_NEON 1
+#include <arm_neon.h>
+#endif
+
+/*
+ * Byte search kernels behind bufrw_scan. Each finds the first c in the n
+ * bytes at p like memchr. The vector ones are compiled with their own
+ * target attributes, so the library does not need -march to carry them,
+ * and are picked at run time by what the CPU supports.
+ */
+typedef const char *(*scan_fn)(const char *p, int c, size_t n);
+
+static const char *scan_generic(const char *p, int c, size_t n) {
+    return (const char *)memchr(p, c, n);
+}
+
+#if defined(BUFRW_SCAN_X86)
+__attribute__((target("sse2")))
+static const char *scan_sse2(const char *p, int c, size_t n) {
+    const __m128i key = _mm_set1_epi8((char)c);
+    const char *end = p + n;
+
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, key));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+    return scan_generic(p, c, (size_t)(end - p));
+}
+
+__attribute__((target("avx2")))
+static const char *scan_avx2(const char *p, int c, size_t n) {
+    const __m256i key = _mm256_set1_epi8((char)c);
+    const char *end = p + n;
+
+    // Two vectors per round keep the loads ahead of the compares.
+    for (; end - p >= 64; p += 64) {
+        __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), key);
+        __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 32)), key);
+        if (!_mm256_testz_si256(_mm256_or_si256(a, b), _mm256_or_si256(a, b))) {
+            unsigned lo = (unsigned)_mm256_movemask_epi8(a);
+            unsigned hi = (unsigned)_mm256_movemask_epi8(b);
+            return lo ? p + __builtin_ctz(lo) : p + 32 + __builtin_ctz(hi);
+        }
+    }
+    for (; end - p >= 32; p += 32) {
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), key));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+    return scan_sse2(p, c, (size_t)(end - p));
+}
+#endif
+
+#if defined(BUFRW_SCAN_NEON)
+static const char *scan_neon(const char *p, int c, size_t n) {
+    const uint8x16_t key = vdupq_n_u8((uint8_t)c);
+    const char *end = p + n;
+
+    for (; end - p >= 16; p += 16) {
+        uint8x16_t eq = vceqq_u8(vld1q_u8((const uint8_t *)p), key);
+        // Narrow each byte of the compare to a nibble of a 64-bit mask.
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+        if (mask) {
+            return p + (__builtin_ctzll(mask) >> 2);
+        }
+    }
+    return scan_generic(p, c, (size_t)(end - p));
+}
+#endif
+
+static scan_fn scan_resolve(void) {
+#if defined(BUFRW_SCAN_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return scan_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return scan_sse2;
+    }
+#elif defined(BUFRW_SCAN_NEON)
+    return scan_neon;
+#endif
+    return scan_generic;
+}
+
+static const char *scan_first(const char *p, int c, size_t n);
+
+/* Kernel in use, resolved on the first search. */
+static _Atomic(scan_fn) scan_impl = scan_first;
+
+static const char *scan_first(const char *p, int c, size_t n) {
+    scan_fn fn = scan_resolve();
+    atomic_store_explicit(&scan_impl, fn, memory_order_relaxed);
+    return fn(p, c, n);
+}
+
+/*
+ * Find the first byte c in the n bytes at p with the fastest search kernel
+ * the CPU supports. Returns a pointer to it, or NULL if there is none.
+ */
+BUFRW_INTERNAL_FUNC const char *bufrw_scan(const char *p, int c, size_t n) {
+    return atomic_load_explicit(&scan_impl, memory_order_relaxed)(p, c, n);
+}
@@ -0,0 +1,132 @@
+#define BUFRW_LIBRARY_BUILD
+#define _GNU_SOURCE
+
+#include "bufrw_internal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ * Offset just past the first delim byte of fd at or after from, or size
+ * if there is none before it. Scans blocks of scan_sz bytes read with
+ * pread. Returns -1 on error.
+ */
+static long split_align(int fd, long from, long size, int delim, size_t scan_sz) {
+    char *buf = (char *)malloc(scan_sz);
+    if (!buf) {
+        return -1;
+    }
+
+    long at = from;
+    while (at < size) {
+        size_t want = (size_t)(size - at) < scan_sz ? (size_t)(size - at) : scan_sz;
+        ssize_t got = pread(fd, buf, want, (off_t)at);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got < 0) {
+            free(buf);
+            return -1;
+        }
+        if (got == 0) {
+            break;  // The file shrank under us.
+        }
+        const char *hit = bufrw_scan(buf, delim, (size_t)got);
+        if (hit) {
+            at += (long)(hit - buf) + 1;
+            free(buf);
+            return at;
+        }
+        at += got;
+    }
+    free(buf);
+    return size;
+}
+
+/*
+ * bfsplit: split a file into contexts reading disjoint ranges.
+ *
+ * Opens nparts positional contexts (see bfopen_fd_at) on the regular file
+ * fd into parts, reading consecutive ranges of about equal size that
+ * together cover the file, each with a read buffer of buffer_sz bytes, 0
+ * to pick one. A context reports the end of the stream at the end of its
+ * range; bfctell gives offsets in the file and SEEK_END is the end of the
+ * range. With a delim from 0 to 255, every range but the last ends just
+ * past the first delim byte at or after its nominal end, found with the
+ * scanner of bfreaduntil, so that no record is split between ranges; a
+ * range can then come out empty. A delim of -1 splits at plain offsets.
+ * The contexts share nothing, so each can be used by a thread of its own,
+ * and are meant for reading: bfpread and writes are not confined to the
+ * range. Not available with bfseturing, bfsetcache or bfsetodirect, nor
+ * on descriptors opened with O_DIRECT. Each is closed with bfclose; fd
+ * stays owned by the caller.
+ *
+ * Returns 0 on success, or -1 on error, leaving no context open.
+ */
+BUFRW_PUBLIC_FUNC int bfsplit(int fd, size_t nparts, int delim, size_t buffer_sz, bufrw_t **parts) {
+    if (fd < 0 || nparts == 0 || !parts || delim < -1 || delim > 255) {
+        errno = fd < 0 ? EBADF : EINVAL;
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return -1;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        errno = EINVAL;
+        return -1;
+    }
+#if defined(O_DIRECT)
+    // Parts would start in direct I/O mode, whose block reads ignore the range.
+    int fl = fcntl(fd, F_GETFL);
+    if (fl < 0) {
+        return -1;
+    }
+    if (fl & O_DIRECT) {
+        errno = EINVAL;
+        return -1;
+    }
+#endif
+
+    long size = (long)st.st_size;
+    size_t scan_sz = buffer_sz ? buffer_sz : bfbestbufsz_fd(fd, (size_t)size);
+    long start = 0;
+    size_t i;
+    for (i = 0; i < nparts; i++) {
+        long end = size;
+        if (i + 1 < nparts) {
+            // size * (i + 1) / nparts without overflowing.
+            end = size / (long)nparts * (long)(i + 1) + size % (long)nparts * (long)(i + 1) / (long)nparts;
+            if (end < start) {
+                end = start;
+            } else if (delim >= 0 && end > start) {
+                // The record holding the last byte of the range ends it.
+                end = split_align(fd, end - 1, size, delim, scan_sz);
+                if (end < 0) {
+                    break;
+                }
+            }
+        }
+
+        parts[i] = bfopen_fd_at(fd, start, buffer_sz, 0);
+        if (!parts[i]) {
+            break;
+        }
+        parts[i]->limit = end;
+        start = end;
+    }
+    if (i == nparts) {
+        return 0;
+    }
+
+    int err = errno;
+    while (i-- > 0) {
+        bfclose(parts[i]);
+        parts[i] = NULL;
+    }
+    errno = err;
+    return -1;
+}
@@ -0,0 +1,128 @@
+#define BUFRW_LIBRARY_BUILD
+
+#include "bufrw_internal.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Counters of the contexts closed so far. */
+static bufrw_stats_t global_stats;
+static pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Monotonic time in nanoseconds, the start of a transfer for
+ * bufrw_stats_io.
+ */
+BUFRW_INTERNAL_FUNC uint64_t bufrw_stats_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+#if defined(BUFRW_WITH_HISTOGRAMS)
+/* Count a transfer of ns nanoseconds in its log2 bucket of hist. */
+static void stats_bucket(unsigned long long *hist, uint64_t ns) {
+    int b = 63 - __builtin_clzll(ns | 1);
+    hist[b < BUFRW_STATS_BUCKETS ? b : BUFRW_STATS_BUCKETS - 1]++;
+}
+#endif
+
+/*
+ * Record a transfer of kind between ctx and its stream that started at
+ * start, asked for want bytes and moved got, or failed with -1.
+ */
+BUFRW_INTERNAL_FUNC void bufrw_stats_io(bufrw_t *ctx, int kind, uint64_t start, size_t want, ssize_t got) {
+    bufrw_stats_t *st = &ctx->stats;
+    uint64_t ns = bufrw_stats_clock() - start;
+    size_t moved = got > 0 ? (size_t)got : 0;
+
+    switch (kind) {
+    case BUFRW_IO_REFILL:
+    case BUFRW_IO_DIRECT_READ:
+        if (kind == BUFRW_IO_REFILL) {
+            st->refills++;
+#if defined(BUFRW_WITH_HISTOGRAMS)
+            stats_bucket(st->refill_hist, ns);
+#endif
+        } else {
+            st->direct_reads++;
+        }
+        st->short_reads += moved < want;
+        st->stream_read += moved;
+        st->read_ns += ns;
+        break;
+    default:
+        if (kind == BUFRW_IO_FLUSH) {
+            st->flushes++;
+#if defined(BUFRW_WITH_HISTOGRAMS)
+            stats_bucket(st->flush_hist, ns);
+#endif
+        } else {
+            st->direct_writes++;
+        }
+        st->stream_written += moved;
+        st->write_ns += ns;
+        break;
+    }
+}
+
+/* Add the counters of src to dst. */
+static void stats_add(bufrw_stats_t *restrict dst, const bufrw_stats_t *restrict src) {
+    // The structure is nothing but counters.
+    unsigned long long *d = (unsigned long long *)dst;
+    const unsigned long long *s = (const unsigned long long *)src;
+    for (size_t i = 0; i < sizeof(*dst) / sizeof(*d); i++) {
+        d[i] += s[i];
+    }
+}
+
+/*
+ * Add the counters of ctx, which is being closed, to the global totals.
+ */
+BUFRW_INTERNAL_FUNC void bufrw_stats_fold(const bufrw_t *ctx) {
+    pthread_mutex_lock(&global_lock);
+    stats_add(&global_stats, &ctx->stats);
+    pthread_mutex_unlock(&global_lock);
+}
+
+/*
+ * bfstats: get the I/O counters of a context.
+ *
+ * Fills stats with what ctx has done since it was opened. Buffer hits
+ * served inline by the header (bfcread_inline, bfcwrite_inline and the
+ * integer accessors) never reach the library and are not counted. With
+ * an engine (bfsetasync, bfsetreadahead, bfseturing) refills and flushes
+ * are timed as the caller waits for them, not as the engine runs them.
+ * Must not race with other use of ctx.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfstats(bufrw_t *ctx, bufrw_stats_t *stats) {
+    if (!ctx || !stats) {
+        errno = EINVAL;
+        return -1;
+    }
+    *stats = ctx->stats;
+    return 0;
+}
+
+/*
+ * bfstats_global: get the I/O counters of all closed contexts.
+ *
+ * Fills stats with the sums of the counters of every context closed so
+ * far by any thread.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfstats_global(bufrw_stats_t *stats) {
+    if (!stats) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&global_lock);
+    *stats = global_stats;
+    pthread_mutex_unlock(&global_lock);
+    return 0;
+}
@@ -0,0 +1,640 @@
+#define BUFRW_LIBRARY_BUILD
+
+#include "bufrw_internal.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+
+#if defined(__linux__) && !defined(BUFRW_NO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define BUFRW_HAVE_URING 1
+#endif
+#endif
+
+#if defined(BUFRW_HAVE_URING)
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* Slot states. */
+#define URING_IDLE      0
+#define URING_INFLIGHT  1
+#define URING_DONE      2
+
+/* user_data encoding: slot index plus a write flag. */
+#define URING_WRITE_TAG (1ull << 32)
+
+typedef struct _s_uring_slot {
+    char *buf;
+    long off;                       // file offset of the transfer
+    size_t len;                     // bytes requested
+    int res;                        // completion result
+    int state;
+} uring_slot_t;
+
+/*
+ * io_uring engine state of a context.
+ *
+ * Reads keep up to depth blocks in flight ahead of the consumer, a refill
+ * waits for the oldest one and swaps it in. Full write buffers are queued
+ * as SQEs and recycled when their completion arrives; the caller only
+ * waits when none is free. SQEs are submitted in batches, all buffers are
+ * registered with the ring when the kernel allows it.
+ */
+struct _s_bufrw_uring {
+    int fd;
+    unsigned entries;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_sz, cq_sz;
+    struct io_uring_sqe *sqes;
+    size_t sqes_sz;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    unsigned depth;
+    unsigned batch;                 // SQEs collected before io_uring_enter
+    unsigned unsubmitted;
+
+    int registered;
+    struct iovec *regs;             // every buffer in rotation
+    unsigned nregs;
+
+    uring_slot_t *rd;               // read ring, oldest first from rd_head
+    unsigned rd_head;
+    unsigned rd_count;              // slots in flight or done
+    long rd_next;                   // offset of the next read to submit
+
+    uring_slot_t *wr;               // in-flight writes
+    char **wr_free;                 // write buffers ready to be filled
+    unsigned wr_nfree;
+
+    int err;                        // sticky write error
+};
+
+static int uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_unmap(bufrw_uring_t *ur) {
+    if (ur->sqes && ur->sqes != MAP_FAILED) {
+        munmap(ur->sqes, ur->sqes_sz);
+    }
+    if (ur->cq_ptr && ur->cq_ptr != MAP_FAILED && ur->cq_ptr != ur->sq_ptr) {
+        munmap(ur->cq_ptr, ur->cq_sz);
+    }
+    if (ur->sq_ptr && ur->sq_ptr != MAP_FAILED) {
+        munmap(ur->sq_ptr, ur->sq_sz);
+    }
+}
+
+static int uring_map(bufrw_uring_t *ur, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ur->fd = uring_setup(entries, &p);
+    if (ur->fd < 0) {
+        return -1;
+    }
+    ur->entries = p.sq_entries;
+
+    ur->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ur->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ur->cq_sz > ur->sq_sz) {
+            ur->sq_sz = ur->cq_sz;
+        }
+        ur->cq_sz = ur->sq_sz;
+    }
+
+    ur->sq_ptr = mmap(NULL, ur->sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ur->fd, IORING_OFF_SQ_RING);
+    if (ur->sq_ptr == MAP_FAILED) {
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ur->cq_ptr = ur->sq_ptr;
+    } else {
+        ur->cq_ptr = mmap(NULL, ur->cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ur->fd, IORING_OFF_CQ_RING);
+        if (ur->cq_ptr == MAP_FAILED) {
+            return -1;
+        }
+    }
+    ur->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    ur->sqes = (struct io_uring_sqe *)mmap(NULL, ur->sqes_sz, PROT_READ | PROT_WRITE,
+                                           MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQES);
+    if (ur->sqes == MAP_FAILED) {
+        return -1;
+    }
+
+    char *sq = (char *)ur->sq_ptr;
+    char *cq = (char *)ur->cq_ptr;
+    ur->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ur->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ur->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ur->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ur->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ur->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ur->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ur->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+/*
+ * Whether the kernel behind ring fd supports the plain read and write
+ * opcodes, which came after the ring itself.
+ */
+static int uring_probe(int fd) {
+    enum { PROBE_OPS = 256 };
+    struct io_uring_probe *probe = (struct io_uring_probe *)calloc(1, sizeof(*probe) + PROBE_OPS * sizeof(struct io_uring_probe_op));
+    if (!probe) {
+        return 0;
+    }
+    int ok = uring_register(fd, IORING_REGISTER_PROBE, probe, PROBE_OPS) == 0;
+    const unsigned ops[] = { IORING_OP_READ, IORING_OP_WRITE };
+    for (size_t i = 0; ok && i < sizeof(ops) / sizeof(ops[0]); i++) {
+        ok = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return ok;
+}
+
+static int uring_reg_index(const bufrw_uring_t *ur, const char *buf) {
+    for (unsigned i = 0; i < ur->nregs; i++) {
+        if (ur->regs[i].iov_base == buf) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Hand every collected SQE to the kernel.
+ */
+static int uring_submit(bufrw_uring_t *ur) {
+    while (ur->unsubmitted > 0) {
+        int ret = uring_enter(ur->fd, ur->unsubmitted, 0, 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        ur->unsubmitted -= (unsigned)ret;
+    }
+    return 0;
+}
+
+/*
+ * Queue a read or write of slot into the SQ ring. It reaches the kernel
+ * with the next batch.
+ */
+static void uring_queue(bufrw_uring_t *ur, bufrw_t *ctx, uring_slot_t *slot, int is_write, unsigned index) {
+    unsigned tail = *ur->sq_tail;
+    unsigned idx = tail & *ur->sq_mask;
+    struct io_uring_sqe *sqe = &ur->sqes[idx];
+    int reg = ur->registered ? uring_reg_index(ur, slot->buf) : -1;
+
+    memset(sqe, 0, sizeof(*sqe));
+    if (reg >= 0) {
+        sqe->opcode = is_write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->buf_index = (unsigned short)reg;
+    } else {
+        sqe->opcode = is_write ? IORING_OP_WRITE : IORING_OP_READ;
+    }
+    sqe->fd = ctx->fd;
+    sqe->off = (unsigned long long)slot->off;
+    sqe->addr = (unsigned long long)(uintptr_t)slot->buf;
+    sqe->len = (unsigned)slot->len;
+    sqe->user_data = (is_write ? URING_WRITE_TAG : 0) | index;
+
+    ur->sq_array[idx] = idx;
+    __atomic_store_n(ur->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    slot->state = URING_INFLIGHT;
+    ur->unsubmitted++;
+}
+
+/*
+ * Finish a write completion: write any short remainder synchronously and
+ * recycle the buffer.
+ */
+static void uring_complete_write(bufrw_uring_t *ur, bufrw_t *ctx, uring_slot_t *slot, int res) {
+    if (res < 0) {
+        ur->err = 1;
+    } else {
+        size_t done = (size_t)res;
+        while (done < slot->len) {
+            ssize_t put = pwrite(ctx->fd, slot->buf + done, slot->len - done, slot->off + (long)done);
+            if (put < 0 && errno == EINTR) {
+                continue;
+            }
+            if (put <= 0) {
+                ur->err = 1;
+                break;
+            }
+            done += (size_t)put;
+        }
+    }
+    ur->wr_free[ur->wr_nfree++] = slot->buf;
+    slot->state = URING_IDLE;
+}
+
+/*
+ * Reap every available completion.
+ */
+static void uring_reap(bufrw_uring_t *ur, bufrw_t *ctx) {
+    unsigned head = *ur->cq_head;
+    unsigned tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &ur->cqes[head & *ur->cq_mask];
+        unsigned index = (unsigned)(cqe->user_data & 0xffffffffu);
+        if (cqe->user_data & URING_WRITE_TAG) {
+            uring_complete_write(ur, ctx, &ur->wr[index], cqe->res);
+        } else {
+            ur->rd[index].res = cqe->res;
+            ur->rd[index].state = URING_DONE;
+        }
+        head++;
+    }
+    __atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/*
+ * Submit pending SQEs and block for at least one completion.
+ */
+static int uring_wait_one(bufrw_uring_t *ur, bufrw_t *ctx) {
+    if (uring_submit(ur) != 0) {
+        return -1;
+    }
+    for (;;) {
+        int ret = uring_enter(ur->fd, 0, 1, IORING_ENTER_GETEVENTS);
+        if (ret >= 0) {
+            break;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    uring_reap(ur, ctx);
+    return 0;
+}
+
+static int uring_writes_inflight(const bufrw_uring_t *ur) {
+    for (unsigned i = 0; i < ur->depth; i++) {
+        if (ur->wr[i].state != URING_IDLE) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Wait for every in-flight read of ctx and forget the blocks read ahead.
+ */
+static void uring_drop_reads(bufrw_uring_t *ur, bufrw_t *ctx) {
+    for (;;) {
+        int inflight = 0;
+        for (unsigned i = 0; i < ur->depth; i++) {
+            inflight |= ur->rd[i].state == URING_INFLIGHT;
+        }
+        if (!inflight || uring_wait_one(ur, ctx) != 0) {
+            break;
+        }
+    }
+    for (unsigned i = 0; i < ur->depth; i++) {
+        ur->rd[i].state = URING_IDLE;
+    }
+    ur->rd_head = 0;
+    ur->rd_count = 0;
+}
+
+/* Keep the descriptor's own offset in step for non-positional contexts. */
+static void uring_sync_offset(bufrw_t *ctx) {
+    if (!ctx->positional) {
+        lseek(ctx->fd, ctx->offset, SEEK_SET);
+    }
+}
+
+/*
+ * Refill the read buffer of ctx from the read ring, topping the ring up
+ * with reads of the following blocks.
+ *
+ * Returns the number of bytes now in the read buffer, 0 at end of file
+ * or -1 on error.
+ */
+BUFRW_INTERNAL_FUNC ssize_t bufrw_uring_refill(bufrw_t *ctx) {
+    bufrw_uring_t *ur = ctx->uring;
+
+    if (ur->rd_count == 0) {
+        ur->rd_next = ctx->offset;
+    }
+    while (ur->rd_count < ur->depth) {
+        unsigned i = (ur->rd_head + ur->rd_count) % ur->depth;
+        ur->rd[i].off = ur->rd_next;
+        ur->rd[i].len = ctx->read_buffer_sz;
+        uring_queue(ur, ctx, &ur->rd[i], 0, i);
+        ur->rd_next += (long)ctx->read_buffer_sz;
+        ur->rd_count++;
+    }
+
+    uring_slot_t *slot = &ur->rd[ur->rd_head];
+    while (slot->state != URING_DONE) {
+        if (uring_wait_one(ur, ctx) != 0) {
+            return -1;
+        }
+    }
+
+    // Swap the drained read buffer for the completed block.
+    int res = slot->res;
+    char *buf = slot->buf;
+    slot->buf = ctx->read_buffer;
+    slot->state = URING_IDLE;
+    ctx->read_buffer = buf;
+    ur->rd_head = (ur->rd_head + 1) % ur->depth;
+    ur->rd_count--;
+
+    if (res < 0) {
+        errno = -res;
+        uring_drop_reads(ur, ctx);
+        return -1;
+    }
+    ctx->offset = slot->off + res;
+    if ((size_t)res < slot->len) {
+        // End of file or a short read: what was queued behind is stale.
+        uring_drop_reads(ur, ctx);
+    }
+    return res;
+}
+
+/*
+ * Queue the filled write buffer of ctx and continue in a free one,
+ * waiting for a completion if all are in flight.
+ *
+ * Returns 0 on success, or -1 if a write has failed.
+ */
+BUFRW_INTERNAL_FUNC int bufrw_uring_submit(bufrw_t *ctx) {
+    bufrw_uring_t *ur = ctx->uring;
+
+    if (ur->err) {
+        return -1;
+    }
+
+    unsigned i = 0;
+    while (ur->wr[i].state != URING_IDLE) {
+        i++;
+    }
+    uring_slot_t *slot = &ur->wr[i];
+    slot->buf = ctx->write_buffer;
+    slot->off = ctx->offset;
+    slot->len = ctx->write_buffer_pos;
+    uring_queue(ur, ctx, slot, 1, i);
+    ctx->offset += (long)ctx->write_buffer_pos;
+
+    if (ur->unsubmitted >= ur->batch && uring_submit(ur) != 0) {
+        ur->err = 1;
+    }
+    while (ur->wr_nfree == 0) {
+        if (uring_wait_one(ur, ctx) != 0) {
+            ur->err = 1;
+            return -1;
+        }
+    }
+    uring_reap(ur, ctx);
+
+    ctx->write_buffer = ur->wr_free[--ur->wr_nfree];
+    ctx->write_buffer_pos = 0;
+    return ur->err ? -1 : 0;
+}
+
+/*
+ * Queue whatever is pending in the write buffer of ctx and wait for all
+ * writes to complete.
+ *
+ * Returns 0 on success, or -1 if any write has failed.
+ */
+BUFRW_INTERNAL_FUNC int bufrw_uring_flush(bufrw_t *ctx) {
+    bufrw_uring_t *ur = ctx->uring;
+
+    if (ctx->write_buffer_pos > 0 && bufrw_uring_submit(ctx) != 0) {
+        return -1;
+    }
+    while (uring_writes_inflight(ur)) {
+        if (uring_wait_one(ur, ctx) != 0) {
+            ur->err = 1;
+            break;
+        }
+    }
+    uring_sync_offset(ctx);
+    return ur->err ? -1 : 0;
+}
+
+/*
+ * Stop reading ahead on ctx before the stream is repositioned.
+ *
+ * The context offset only ever covers blocks swapped into the read
+ * buffer, so nothing has to be given back. Returns 0.
+ */
+BUFRW_INTERNAL_FUNC size_t bufrw_uring_pause(bufrw_t *ctx) {
+    uring_drop_reads(ctx->uring, ctx);
+    uring_sync_offset(ctx);
+    return 0;
+}
+
+/*
+ * Drain and release the ring of ctx and every buffer except the current
+ * read and write buffers, which stay with the context.
+ *
+ * Returns the result of the final flush.
+ */
+BUFRW_INTERNAL_FUNC int bufrw_uring_teardown(bufrw_t *ctx) {
+    bufrw_uring_t *ur = ctx->uring;
+    int ret = 0;
+
+    if (ur->fd >= 0) {
+        ret = bufrw_uring_flush(ctx);
+        bufrw_uring_pause(ctx);
+        close(ur->fd);
+    }
+    uring_unmap(ur);
+
+    if (ur->rd) {
+        for (unsigned i = 0; i < ur->depth; i++) {
+            bufrw_buf_free(ctx, ur->rd[i].buf, ctx->read_buffer_sz);
+        }
+    }
+    if (ur->wr_free) {
+        for (unsigned i = 0; i < ur->wr_nfree; i++) {
+            bufrw_buf_free(ctx, ur->wr_free[i], ctx->write_buffer_sz);
+        }
+    }
+    free(ur->regs);
+    free(ur->wr_free);
+    free(ur->wr);
+    free(ur->rd);
+    free(ur);
+    ctx->uring = NULL;
+    return ret;
+}
+
+/*
+ * bfseturing: run the refills and flushes of a context on io_uring.
+ *
+ * ctx must be a seekable file descriptor context. Reads keep depth blocks
+ * of the read buffer size in flight ahead of the consumer, and up to
+ * depth - 1 full write buffers are written while the caller keeps
+ * filling; SQEs are submitted in batches from buffers registered with the
+ * ring. The calls on ctx keep their synchronous semantics, bfcflush waits
+ * for all writes. Large requests go through the ring buffers instead of
+ * the direct path. A depth of 0 drains and returns to plain system calls.
+ *
+ * Returns 0 on success, or -1 on error; errno is ENOSYS when io_uring, or
+ * its plain read and write operations, are not available.
+ */
+BUFRW_PUBLIC_FUNC int bfseturing(bufrw_t *ctx, unsigned depth) {
+    if (!ctx || ctx->shared || ctx->async || ctx->readahead || ctx->map || ctx->dio || ctx->cache || ctx->coder || ctx->digest || ctx->nonblock || ctx->wb || ctx->limit >= 0 || depth == 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (ctx->uring) {
+        if (bufrw_uring_teardown(ctx) != 0) {
+            return -1;
+        }
+    }
+    if (depth == 0) {
+        return 0;
+    }
+    if (ctx->fd < 0 || ctx->offset < 0) {
+        errno = ESPIPE;
+        return -1;
+    }
+
+    // Unread and unwritten bytes have to settle before offsets are ours.
+    if (bufrw_ctx_settle(ctx) != 0) {
+        return -1;
+    }
+    if (!ctx->read_buffer && bufrw_ctx_alloc_read(ctx, ctx->rd_sz) != 0) {
+        return -1;
+    }
+    if (!ctx->write_buffer && bufrw_ctx_alloc_write(ctx, ctx->wr_sz) != 0) {
+        return -1;
+    }
+    // Buffers rotate through the ring, so each side has one size.
+    if (bufrw_ctx_fit(ctx) != 0) {
+        return -1;
+    }
+
+    bufrw_uring_t *ur = (bufrw_uring_t *)calloc(1, sizeof(*ur));
+    if (!ur) {
+        return -1;
+    }
+    ur->fd = -1;
+    ur->depth = depth;
+    ur->batch = depth / 2 ? depth / 2 : 1;
+    ctx->uring = ur;
+
+    ur->rd = (uring_slot_t *)calloc(depth, sizeof(uring_slot_t));
+    ur->wr = (uring_slot_t *)calloc(depth, sizeof(uring_slot_t));
+    ur->wr_free = (char **)calloc(depth, sizeof(char *));
+    ur->regs = (struct iovec *)calloc(2 * (size_t)depth + 1, sizeof(struct iovec));
+    if (!ur->rd || !ur->wr || !ur->wr_free || !ur->regs) {
+        goto fail;
+    }
+    for (unsigned i = 0; i < depth; i++) {
+        if (!(ur->rd[i].buf = (char *)bufrw_buf_alloc(ctx, ctx->read_buffer_sz))) {
+            goto fail;
+        }
+    }
+    // The current write buffer is one of the depth write buffers.
+    for (unsigned i = 1; i < depth; i++) {
+        char *buf = (char *)bufrw_buf_alloc(ctx, ctx->write_buffer_sz);
+        if (!buf) {
+            goto fail;
+        }
+        ur->wr_free[ur->wr_nfree++] = buf;
+    }
+
+    if (uring_map(ur, 2 * depth) != 0) {
+        if (errno == EPERM || errno == EINVAL) {
+            errno = ENOSYS;
+        }
+        goto fail;
+    }
+    // Kernels without the probe lack the opcodes too, and would fail every transfer.
+    if (!uring_probe(ur->fd)) {
+        errno = ENOSYS;
+        goto fail;
+    }
+
+    // Register every buffer in rotation; plain reads and writes are used
+    // when the memlock limit does not allow it.
+    ur->regs[ur->nregs++] = (struct iovec){ .iov_base = ctx->read_buffer, .iov_len = ctx->read_buffer_sz };
+    for (unsigned i = 0; i < depth; i++) {
+        ur->regs[ur->nregs++] = (struct iovec){ .iov_base = ur->rd[i].buf, .iov_len = ctx->read_buffer_sz };
+    }
+    ur->regs[ur->nregs++] = (struct iovec){ .iov_base = ctx->write_buffer, .iov_len = ctx->write_buffer_sz };
+    for (unsigned i = 0; i < ur->wr_nfree; i++) {
+        ur->regs[ur->nregs++] = (struct iovec){ .iov_base = ur->wr_free[i], .iov_len = ctx->write_buffer_sz };
+    }
+    ur->registered = uring_register(ur->fd, IORING_REGISTER_BUFFERS, ur->regs, ur->nregs) == 0;
+    return 0;
+
+fail:
+    {
+        int saved = errno;
+        bufrw_uring_teardown(ctx);
+        errno = saved ? saved : ENOMEM;
+    }
+    return -1;
+}
+
+#else // BUFRW_HAVE_URING
+
+BUFRW_INTERNAL_FUNC ssize_t bufrw_uring_refill(bufrw_t *ctx) {
+    (void)ctx;
+    errno = ENOSYS;
+    return -1;
+}
+
+BUFRW_INTERNAL_FUNC int bufrw_uring_submit(bufrw_t *ctx) {
+    (void)ctx;
+    errno = ENOSYS;
+    return -1;
+}
+
+BUFRW_INTERNAL_FUNC int bufrw_uring_flush(bufrw_t *ctx) {
+    (void)ctx;
+    return 0;
+}
+
+BUFRW_INTERNAL_FUNC size_t bufrw_uring_pause(bufrw_t *ctx) {
+    (void)ctx;
+    return 0;
+}
+
+BUFRW_INTERNAL_FUNC int bufrw_uring_teardown(bufrw_t *ctx) {
+    (void)ctx;
+    return 0;
+}
+
+BUFRW_PUBLIC_FUNC int bfseturing(bufrw_t *ctx, unsigned depth) {
+    (void)ctx;
+    (void)depth;
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif // BUFRW_HAVE_URING
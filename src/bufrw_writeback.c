@@ -0,0 +1,344 @@
+#define BUFRW_LIBRARY_BUILD
+
+#include "bufrw_internal.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Upper bound on the pages handed to a single pwritev call. */
+#define WB_IOV_BATCH 64
+
+/* Bytes lo to hi of a page that are dirty; lo == hi when it is clean. */
+typedef struct {
+    size_t lo;
+    size_t hi;
+} wb_range_t;
+
+/*
+ * Write-back window of a context.
+ *
+ * Covers span bytes of the file from base, an aligned multiple of span,
+ * in npages pages of page_sz bytes, each buffered only once it is written
+ * to. Each page keeps a single dirty range; writes that leave a gap in it
+ * fill the gap from the file.
+ */
+struct _s_bufrw_wb {
+    size_t page_sz;
+    size_t npages;
+    size_t span;            // npages * page_sz
+    long base;              // file offset of the window, -1 before the first write
+    long end;               // offset past the last dirty byte, -1 if clean
+    size_t ndirty;          // pages with a dirty range
+    char **pages;           // page buffers, NULL until written to
+    wb_range_t *dirty;      // dirty range of each page
+    int was_positional;     // positional mode of ctx before the window
+};
+
+/*
+ * Read n bytes at off of the file of ctx into buf, zeroing whatever lies
+ * past its end. Returns 0 on success, or -1 on error.
+ */
+static int wb_fill(bufrw_t *ctx, char *buf, size_t n, long off) {
+    size_t done = 0;
+    while (done < n) {
+        ssize_t got = pread(ctx->fd, buf + done, n - done, (off_t)off + (off_t)done);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got < 0) {
+            return -1;
+        }
+        if (got == 0) {
+            memset(buf + done, 0, n - done);
+            break;
+        }
+        done += (size_t)got;
+    }
+    return 0;
+}
+
+/*
+ * Make bytes lo to hi of page pg of the window of ctx part of its dirty
+ * range, buffering the page first. Returns 0 on success, or -1 on error.
+ */
+static int wb_touch(bufrw_t *ctx, size_t pg, size_t lo, size_t hi) {
+    bufrw_wb_t *wb = ctx->wb;
+    if (!wb->pages[pg]) {
+        wb->pages[pg] = (char *)bufrw_buf_alloc(ctx, wb->page_sz);
+        if (!wb->pages[pg]) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    wb_range_t *r = &wb->dirty[pg];
+    long at = wb->base + (long)(pg * wb->page_sz);
+    if (r->lo == r->hi) {
+        r->lo = lo;
+        r->hi = hi;
+        wb->ndirty++;
+        return 0;
+    }
+    // Bytes between the ranges come from the file, so that one range holds both.
+    if (lo > r->hi && wb_fill(ctx, wb->pages[pg] + r->hi, lo - r->hi, at + (long)r->hi) != 0) {
+        return -1;
+    }
+    if (hi < r->lo && wb_fill(ctx, wb->pages[pg] + hi, r->lo - hi, at + (long)hi) != 0) {
+        return -1;
+    }
+    r->lo = lo < r->lo ? lo : r->lo;
+    r->hi = hi > r->hi ? hi : r->hi;
+    return 0;
+}
+
+/*
+ * Write the iovcnt segments of iov, len bytes in all, at off of the file
+ * of ctx. Returns 0 on success, or -1 on error.
+ */
+static int wb_pwritev(bufrw_t *ctx, struct iovec *iov, int iovcnt, size_t len, long off) {
+    uint64_t start = bufrw_stats_clock();
+    size_t done = 0;
+    while (done < len) {
+        ssize_t put = pwritev(ctx->fd, iov, iovcnt, (off_t)off + (off_t)done);
+        if (put < 0 && errno == EINTR) {
+            continue;
+        }
+        if (put == 0) {
+            errno = EIO;
+        }
+        if (put <= 0) {
+            break;
+        }
+        done += (size_t)put;
+        // Skip what went out and retry the rest.
+        while (iovcnt > 0 && (size_t)put >= iov->iov_len) {
+            put -= (ssize_t)iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + put;
+            iov->iov_len -= (size_t)put;
+        }
+    }
+    bufrw_stats_io(ctx, BUFRW_IO_FLUSH, start, len, done == len ? (ssize_t)done : -1);
+    return done == len ? 0 : -1;
+}
+
+/*
+ * Write out the dirty ranges of the window of ctx, in order of offset,
+ * with one pwritev call for each run of them that is contiguous in the
+ * file. Ranges that could not be written stay dirty. Returns 0 on
+ * success, or -1 on error.
+ */
+BUFRW_INTERNAL_FUNC int bufrw_wb_flush(bufrw_t *ctx) {
+    bufrw_wb_t *wb = ctx->wb;
+    if (wb->ndirty == 0) {
+        return 0;
+    }
+
+    struct iovec iov[WB_IOV_BATCH];
+    int cnt = 0;
+    size_t first = 0, len = 0;
+    long run_at = 0;
+    for (size_t pg = 0; pg <= wb->npages; pg++) {
+        wb_range_t *r = pg < wb->npages ? &wb->dirty[pg] : NULL;
+        if (r && r->lo == r->hi) {
+            continue;
+        }
+        long at = r ? wb->base + (long)(pg * wb->page_sz + r->lo) : -1;
+
+        // A range that does not continue the run, or the end, writes it.
+        if (cnt > 0 && (at != run_at + (long)len || cnt == WB_IOV_BATCH)) {
+            if (wb_pwritev(ctx, iov, cnt, len, run_at) != 0) {
+                return -1;
+            }
+            for (size_t i = first; i < pg; i++) {
+                wb->ndirty -= wb->dirty[i].lo != wb->dirty[i].hi;
+                wb->dirty[i].lo = wb->dirty[i].hi = 0;
+            }
+            cnt = 0;
+        }
+        if (!r) {
+            break;
+        }
+        if (cnt == 0) {
+            first = pg;
+            run_at = at;
+            len = 0;
+        }
+        iov[cnt].iov_base = wb->pages[pg] + r->lo;
+        iov[cnt].iov_len = r->hi - r->lo;
+        len += iov[cnt].iov_len;
+        cnt++;
+    }
+    wb->end = -1;
+    return 0;
+}
+
+/*
+ * Absorb the iovcnt segments of iov into the window of ctx at its
+ * position, which they advance, moving the window when they leave it.
+ * Returns the number of bytes taken, less than asked only on error.
+ */
+BUFRW_INTERNAL_FUNC size_t bufrw_wb_write(bufrw_t *ctx, const struct iovec *iov, int iovcnt) {
+    bufrw_wb_t *wb = ctx->wb;
+    size_t done = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        const char *p = (const char *)iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+        while (len > 0) {
+            long pos = ctx->offset;
+            if (wb->base < 0 || pos < wb->base || pos >= wb->base + (long)wb->span) {
+                // Eviction: the window moves to the block of the file holding pos.
+                if (bufrw_wb_flush(ctx) != 0) {
+                    return done;
+                }
+                wb->base = pos - pos % (long)wb->span;
+            }
+
+            size_t rel = (size_t)(pos - wb->base);
+            size_t pg = rel / wb->page_sz, off = rel % wb->page_sz;
+            size_t k = len < wb->page_sz - off ? len : wb->page_sz - off;
+            if (wb_touch(ctx, pg, off, off + k) != 0) {
+                return done;
+            }
+            memcpy(wb->pages[pg] + off, p, k);
+            if (pos + (long)k > wb->end) {
+                wb->end = pos + (long)k;
+            }
+            ctx->offset += (long)k;
+            p += k;
+            len -= k;
+            done += k;
+        }
+    }
+    return done;
+}
+
+/*
+ * Lay the pending bytes in the window of ctx over the got bytes read into
+ * buf at off, extending them with pending bytes past the end of the file,
+ * and the zeros before those, up to n. Returns the new number of bytes.
+ */
+BUFRW_INTERNAL_FUNC ssize_t bufrw_wb_overlay(bufrw_t *ctx, void *buf, size_t n, long off, ssize_t got) {
+    bufrw_wb_t *wb = ctx->wb;
+    if (got < 0 || wb->ndirty == 0) {
+        return got;
+    }
+    char *dst = (char *)buf;
+    if ((size_t)got < n && off + got < wb->end) {
+        size_t ext = (size_t)(wb->end - off) < n ? (size_t)(wb->end - off) : n;
+        memset(dst + got, 0, ext - (size_t)got);
+        got = (ssize_t)ext;
+    }
+
+    long lo = off > wb->base ? off : wb->base;
+    long hi = off + got < wb->base + (long)wb->span ? off + got : wb->base + (long)wb->span;
+    for (long at = lo - (lo - wb->base) % (long)wb->page_sz; at < hi; at += (long)wb->page_sz) {
+        size_t pg = (size_t)(at - wb->base) / wb->page_sz;
+        wb_range_t *r = &wb->dirty[pg];
+        long a = at + (long)r->lo > lo ? at + (long)r->lo : lo;
+        long b = at + (long)r->hi < hi ? at + (long)r->hi : hi;
+        if (r->lo != r->hi && a < b) {
+            memcpy(dst + (a - off), wb->pages[pg] + (a - at), (size_t)(b - a));
+        }
+    }
+    return got;
+}
+
+/*
+ * Offset past the last pending byte of ctx, or -1 if none is pending.
+ */
+BUFRW_INTERNAL_FUNC long bufrw_wb_end(const bufrw_t *ctx) {
+    return ctx->wb->ndirty ? ctx->wb->end : -1;
+}
+
+/*
+ * Write out the window of ctx, whose other buffers must have settled, and
+ * end write-back mode, even if that fails. Returns 0 on success, or -1 on
+ * error.
+ */
+BUFRW_INTERNAL_FUNC int bufrw_wb_teardown(bufrw_t *ctx) {
+    bufrw_wb_t *wb = ctx->wb;
+    int ret = bufrw_wb_flush(ctx);
+    for (size_t i = 0; i < wb->npages; i++) {
+        bufrw_buf_free(ctx, wb->pages[i], wb->page_sz);
+    }
+    // The descriptor's own offset catches up with what was written.
+    if (!wb->was_positional) {
+        ctx->positional = 0;
+        if (lseek(ctx->fd, (off_t)ctx->offset, SEEK_SET) < 0) {
+            ret = -1;
+        }
+    }
+    free(wb->pages);
+    free(wb->dirty);
+    free(wb);
+    ctx->wb = NULL;
+    return ret;
+}
+
+/*
+ * bfsetwriteback: absorb scattered writes in a write-back window.
+ *
+ * Writes to ctx, which must be a bfopen_fd or bfopen_fd_at context on a
+ * seekable file, then go to a window of window_sz bytes of the file,
+ * rounded up to whole pages, instead of the write buffer: they may land
+ * anywhere in it, and bfcseek moves the position without flushing them.
+ * Only the pages written to are buffered, each with the range of its
+ * bytes that is dirty; a write that leaves a gap in the range of a page
+ * fills it from the file. bfcflush, and a write outside the window, which
+ * moves it there, write the dirty ranges out in order of offset, one
+ * pwritev(2) for each run of them that is contiguous in the file. Reads,
+ * bfpread and SEEK_END see the pending bytes. The descriptor's own offset
+ * is left alone until the mode ends. A window_sz of 0 ends it after
+ * flushing, as bfclose does. Not available with engines, stages, records,
+ * non-blocking mode, split parts or in shared mode.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+BUFRW_PUBLIC_FUNC int bfsetwriteback(bufrw_t *ctx, size_t window_sz) {
+    if (!ctx || (!ctx->wb && bufrw_ctx_plain_fd(ctx) < 0) || ctx->offset < 0 || ctx->map || ctx->dio || ctx->cache || ctx->coder || ctx->digest || ctx->rec_sz || ctx->nonblock || ctx->limit >= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (bufrw_ctx_settle(ctx) != 0) {
+        return -1;
+    }
+    if (ctx->wb && (bufrw_wb_flush(ctx) != 0 || bufrw_wb_teardown(ctx) != 0)) {
+        return -1;
+    }
+    if (window_sz == 0) {
+        return 0;
+    }
+
+    long page = sysconf(_SC_PAGESIZE);
+    bufrw_wb_t *wb = (bufrw_wb_t *)calloc(1, sizeof(*wb));
+    if (!wb) {
+        errno = ENOMEM;
+        return -1;
+    }
+    wb->page_sz = page > 0 ? (size_t)page : 4096;
+    wb->npages = (window_sz + wb->page_sz - 1) / wb->page_sz;
+    wb->span = wb->npages * wb->page_sz;
+    wb->base = -1;
+    wb->end = -1;
+    wb->pages = (char **)calloc(wb->npages, sizeof(*wb->pages));
+    wb->dirty = (wb_range_t *)calloc(wb->npages, sizeof(*wb->dirty));
+    if (!wb->pages || !wb->dirty) {
+        free(wb->pages);
+        free(wb->dirty);
+        free(wb);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    // Writes land at offsets of their own: reads must not rely on the descriptor's.
+    wb->was_positional = ctx->positional;
+    ctx->positional = 1;
+    ctx->wb = wb;
+    return 0;
+}
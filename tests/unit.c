@@ -1,6 +1,16 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <poll.h>
 
 #include "../include/bufrw.h"
 
@@ -49,6 +59,2224 @@ void test_bfseek_bftell() {
     printf("test_bfseek_bftell passed.\n");
 }
 
+void test_bfcseek_window() {
+    int ret;
+    size_t got, put;
+    ssize_t io;
+    off_t pos;
+    int fd = open("test.bin", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    for (unsigned i = 0; i < 20000; i++) {
+        io = write(fd, &i, sizeof(i));
+        assert(io == sizeof(i));
+    }
+    pos = lseek(fd, 0, SEEK_SET);
+    assert(pos == 0);
+
+    /* Hops within the buffered block leave the descriptor alone. */
+    bufrw_t *ctx = bfopen_fd(fd, 4096, 64);
+    assert(ctx);
+    unsigned v;
+    got = bfcread(ctx, &v, sizeof(v), 1);
+    assert(got == 1 && v == 0);
+    pos = lseek(fd, 0, SEEK_CUR);
+    assert(pos == 4096);
+    ret = bfcseek(ctx, 500 * sizeof(v), SEEK_SET);
+    assert(ret == 0);
+    got = bfcread(ctx, &v, sizeof(v), 1);
+    assert(got == 1 && v == 500);
+    ret = bfcseek(ctx, -101 * (long)sizeof(v), SEEK_CUR);
+    assert(ret == 0);
+    got = bfcread(ctx, &v, sizeof(v), 1);
+    assert(got == 1 && v == 400);
+    ret = bfcseek(ctx, 1024 * sizeof(v), SEEK_SET);
+    assert(ret == 0);
+    assert(bfctell(ctx) == 4096);
+    pos = lseek(fd, 0, SEEK_CUR);
+    assert(pos == 4096);
+
+    /* Leaving the window repositions the stream; writes land where expected. */
+    ret = bfcseek(ctx, 5000 * sizeof(v), SEEK_SET);
+    assert(ret == 0);
+    got = bfcread(ctx, &v, sizeof(v), 1);
+    assert(got == 1 && v == 5000);
+    ret = bfcseek(ctx, 10 * sizeof(v), SEEK_CUR);
+    assert(ret == 0);
+    v = 0xdeadbeef;
+    put = bfcwrite(ctx, &v, sizeof(v), 1);
+    assert(put == 1);
+    ret = bfclose(ctx);
+    assert(ret == 0);
+    io = pread(fd, &v, sizeof(v), 5011 * sizeof(v));
+    assert(io == sizeof(v) && v == 0xdeadbeef);
+
+    /* Same through the read-ahead ring and through stdio. */
+    pos = lseek(fd, 0, SEEK_SET);
+    assert(pos == 0);
+    ctx = bfopen_fd(fd, 4096, 64);
+    assert(ctx);
+    ret = bfsetreadahead(ctx, 2);
+    assert(ret == 0);
+    got = bfcread(ctx, &v, sizeof(v), 1);
+    assert(got == 1 && v == 0);
+    ret = bfcseek(ctx, 900 * sizeof(v), SEEK_SET);
+    assert(ret == 0);
+    got = bfcread(ctx, &v, sizeof(v), 1);
+    assert(got == 1 && v == 900);
+    ret = bfcseek(ctx, 3000 * sizeof(v), SEEK_SET);
+    assert(ret == 0);
+    got = bfcread(ctx, &v, sizeof(v), 1);
+    assert(got == 1 && v == 3000);
+    assert(bfctell(ctx) == 3001 * (long)sizeof(v));
+    ret = bfclose(ctx);
+    assert(ret == 0);
+
+    FILE *file = fdopen(dup(fd), "rb");
+    assert(file);
+    ctx = bfopen(file, 4096, 64);
+    assert(ctx);
+    ret = bfcseek(ctx, 100 * sizeof(v), SEEK_SET);
+    assert(ret == 0);
+    got = bfcread(ctx, &v, sizeof(v), 1);
+    assert(got == 1 && v == 100);
+    ret = bfcseek(ctx, 50 * sizeof(v), SEEK_SET);
+    assert(ret == 0);
+    got = bfcread(ctx, &v, sizeof(v), 1);
+    assert(got == 1 && v == 50);
+    assert(bfctell(ctx) == 51 * (long)sizeof(v));
+    ret = bfclose(ctx);
+    assert(ret == 0);
+    fclose(file);
+
+    close(fd);
+    remove("test.bin");
+    printf("test_bfcseek_window passed.\n");
+}
+
+void test_bfopen_interleaved() {
+    int ret;
+    size_t got, put;
+    FILE *fa = fopen("test_a.bin", "wb+");
+    FILE *fb = fopen("test_b.bin", "wb+");
+    assert(fa && fb);
+
+    bufrw_t *a = bfopen(fa, 8, 8);
+    bufrw_t *b = bfopen(fb, 8, 8);
+    assert(a && b);
+
+    put = bfcwrite(a, "aaaaabbbbbccccc", 1, 15);
+    assert(put == 15);
+    put = bfcwrite(b, "0000011111", 1, 10);
+    assert(put == 10);
+    ret = bfcseek(a, 0, SEEK_SET);
+    assert(ret == 0);
+    ret = bfcseek(b, 0, SEEK_SET);
+    assert(ret == 0);
+
+    char chunk[6] = {0};
+    got = bfcread(a, chunk, 1, 5);
+    assert(got == 5 && memcmp(chunk, "aaaaa", 5) == 0);
+    got = bfcread(b, chunk, 1, 5);
+    assert(got == 5 && memcmp(chunk, "00000", 5) == 0);
+    got = bfcread(a, chunk, 1, 5);
+    assert(got == 5 && memcmp(chunk, "bbbbb", 5) == 0);
+    assert(bfctell(a) == 10);
+    got = bfcread(b, chunk, 1, 5);
+    assert(got == 5 && memcmp(chunk, "11111", 5) == 0);
+    got = bfcread(b, chunk, 1, 5);
+    assert(got == 0);
+
+    /* Writing after a partial read continues at the caller's position. */
+    put = bfcwrite(a, "XX", 1, 2);
+    assert(put == 2);
+    assert(bfctell(a) == 12);
+    ret = bfcseek(a, -4, SEEK_CUR);
+    assert(ret == 0);
+    got = bfcread(a, chunk, 1, 5);
+    assert(got == 5 && memcmp(chunk, "bbXXc", 5) == 0);
+
+    ret = bfclose(a);
+    assert(ret == 0);
+    ret = bfclose(b);
+    assert(ret == 0);
+    fclose(fa);
+    fclose(fb);
+    remove("test_a.bin");
+    remove("test_b.bin");
+    printf("test_bfopen_interleaved passed.\n");
+}
+
+void test_bfsetdirect() {
+    int ret;
+    size_t got, put;
+    // back has room for the read asking past the end of the file.
+    static char data[10000], back[6008 + 5000];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (char)(i * 7 + i / 251);
+    }
+
+    size_t thresholds[] = { 0, 100, SIZE_MAX };
+    for (size_t t = 0; t < sizeof(thresholds) / sizeof(thresholds[0]); t++) {
+        FILE *file = fopen("test.bin", "wb+");
+        assert(file);
+        bufrw_t *ctx = bfopen(file, 64, 64);
+        assert(ctx);
+        ret = bfsetdirect(ctx, thresholds[t]);
+        assert(ret == 0);
+
+        /* Small writes stay buffered around large direct ones. */
+        put = bfcwrite(ctx, data, 1, 10);
+        assert(put == 10);
+        put = bfcwrite(ctx, data + 10, 1, 5000);
+        assert(put == 5000);
+        put = bfcwrite(ctx, data + 5010, 1, 3);
+        assert(put == 3);
+        put = bfcwrite(ctx, data + 5013, 1, 4987);
+        assert(put == 4987);
+        assert(bfctell(ctx) == 10000);
+        ret = bfcseek(ctx, 0, SEEK_SET);
+        assert(ret == 0);
+
+        memset(back, 0, sizeof(back));
+        got = bfcread(ctx, back, 1, 7);
+        assert(got == 7);
+        got = bfcread(ctx, back + 7, 1, 6000);
+        assert(got == 6000);
+        got = bfcread(ctx, back + 6007, 1, 1);
+        assert(got == 1);
+        assert(bfctell(ctx) == 6008);
+        got = bfcread(ctx, back + 6008, 1, 5000);
+        assert(got == 3992);
+        assert(memcmp(data, back, sizeof(data)) == 0);
+
+        ret = bfclose(ctx);
+        assert(ret == 0);
+        fclose(file);
+    }
+
+    remove("test.bin");
+    printf("test_bfsetdirect passed.\n");
+}
+
+void test_bfopen_fd() {
+    int ret;
+    size_t got, put;
+    off_t pos;
+    int fd = open("test.bin", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+
+    bufrw_t *ctx = bfopen_fd(fd, 8, 8);
+    assert(ctx);
+    put = bfcwrite(ctx, "0123456789abcdef", 1, 16);
+    assert(put == 16);
+    assert(bfctell(ctx) == 16);
+    ret = bfcseek(ctx, 4, SEEK_SET);
+    assert(ret == 0);
+
+    char chunk[8] = {0};
+    got = bfcread(ctx, chunk, 1, 3);
+    assert(got == 3 && memcmp(chunk, "456", 3) == 0);
+    assert(bfctell(ctx) == 7);
+    ret = bfclose(ctx);
+    assert(ret == 0);
+    /* Closing gives back the pre-fetched bytes. */
+    pos = lseek(fd, 0, SEEK_CUR);
+    assert(pos == 7);
+
+    /* Positional contexts share the descriptor without moving it. */
+    bufrw_t *lo = bfopen_fd_at(fd, 0, 4, 4);
+    bufrw_t *hi = bfopen_fd_at(fd, 10, 4, 4);
+    assert(lo && hi);
+    got = bfcread(hi, chunk, 1, 3);
+    assert(got == 3 && memcmp(chunk, "abc", 3) == 0);
+    got = bfcread(lo, chunk, 1, 3);
+    assert(got == 3 && memcmp(chunk, "012", 3) == 0);
+    got = bfcread(hi, chunk, 1, 8);
+    assert(got == 3 && memcmp(chunk, "def", 3) == 0);
+    ret = bfcseek(lo, -2, SEEK_END);
+    assert(ret == 0 && bfctell(lo) == 14);
+    ret = bfclose(lo);
+    assert(ret == 0);
+    ret = bfclose(hi);
+    assert(ret == 0);
+    pos = lseek(fd, 0, SEEK_CUR);
+    assert(pos == 7);
+    close(fd);
+
+    /* Pipes work too, they just cannot tell or seek. */
+    int pfd[2];
+    ret = pipe(pfd);
+    assert(ret == 0);
+    bufrw_t *w = bfopen_fd(pfd[1], 0, 4);
+    bufrw_t *r = bfopen_fd(pfd[0], 4, 0);
+    assert(w && r);
+    put = bfcwrite(w, "piped data", 1, 10);
+    assert(put == 10);
+    ret = bfclose(w);
+    assert(ret == 0);
+    close(pfd[1]);
+    assert(bfctell(r) == -1);
+    got = bfcread(r, chunk, 1, 8);
+    assert(got == 8 && memcmp(chunk, "piped da", 8) == 0);
+    got = bfcread(r, chunk, 1, 8);
+    assert(got == 2 && memcmp(chunk, "ta", 2) == 0);
+    ret = bfclose(r);
+    assert(ret == 0);
+    close(pfd[0]);
+
+    remove("test.bin");
+    printf("test_bfopen_fd passed.\n");
+}
+
+void test_bfwritev() {
+    int ret;
+    size_t put;
+    ssize_t io;
+    static char payload[5000], back[3 + 3 * (5000 + 8) + 4];
+    for (size_t i = 0; i < sizeof(payload); i++) {
+        payload[i] = (char)('a' + i % 26);
+    }
+
+    int fd = open("test.bin", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    bufrw_t *ctx = bfopen_fd(fd, 64, 64);
+    assert(ctx);
+
+    /* Header and payload go out with the pending bytes, the trailer is buffered. */
+    put = bfcwrite(ctx, "pre", 1, 3);
+    assert(put == 3);
+    for (int i = 0; i < 3; i++) {
+        struct iovec rec[3] = {
+            { .iov_base = "HDR:", .iov_len = 4 },
+            { .iov_base = payload, .iov_len = sizeof(payload) },
+            { .iov_base = ":END", .iov_len = 4 },
+        };
+        put = bfwritev(ctx, rec, 3);
+        assert(put == sizeof(payload) + 8);
+    }
+    struct iovec small[2] = { { .iov_base = "p", .iov_len = 1 }, { .iov_base = "ost", .iov_len = 3 } };
+    put = bfwritev(ctx, small, 2);
+    assert(put == 4);
+    put = bfwritev(ctx, NULL, 0);
+    assert(put == 0);
+    assert(bfctell(ctx) == (long)sizeof(back));
+    ret = bfclose(ctx);
+    assert(ret == 0);
+
+    io = pread(fd, back, sizeof(back), 0);
+    assert(io == (ssize_t)sizeof(back));
+    assert(memcmp(back, "pre", 3) == 0);
+    for (int i = 0; i < 3; i++) {
+        const char *rec = back + 3 + i * (sizeof(payload) + 8);
+        assert(memcmp(rec, "HDR:", 4) == 0);
+        assert(memcmp(rec + 4, payload, sizeof(payload)) == 0);
+        assert(memcmp(rec + 4 + sizeof(payload), ":END", 4) == 0);
+    }
+    assert(memcmp(back + 3 + 3 * (sizeof(payload) + 8), "post", 4) == 0);
+
+    close(fd);
+    remove("test.bin");
+    printf("test_bfwritev passed.\n");
+}
+
+void test_bfsetasync() {
+    int ret;
+    size_t got, put;
+    int fd = open("test.bin", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    bufrw_t *ctx = bfopen_fd(fd, 64, 64);
+    assert(ctx);
+    ret = bfsetasync(ctx, 1);
+    assert(ret == -1);
+    ret = bfsetasync(ctx, 3);
+    assert(ret == 0);
+
+    for (unsigned i = 0; i < 10000; i++) {
+        put = bfcwrite(ctx, &i, sizeof(i), 1);
+        assert(put == 1);
+    }
+    /* Large writes are copied through the rotating buffers as well. */
+    static unsigned big[1000];
+    for (unsigned i = 0; i < 1000; i++) {
+        big[i] = 10000 + i;
+    }
+    put = bfcwrite(ctx, big, sizeof(big[0]), 1000);
+    assert(put == 1000);
+
+    bufrw_async_stats_t st;
+    assert(bfasyncstats(ctx, &st) == 0);
+    assert(st.nbufs == 3 && st.submitted == 11000 * sizeof(unsigned) / 64);
+    assert(st.max_depth >= 1 && st.max_depth <= 3);
+
+    ret = bfcflush(ctx);
+    assert(ret == 0);
+    assert(bfasyncstats(ctx, &st) == 0 && st.depth == 0);
+    assert(bfctell(ctx) == 11000 * (long)sizeof(unsigned));
+
+    /* Reading waits for the flusher, then sees everything. */
+    ret = bfcseek(ctx, 0, SEEK_SET);
+    assert(ret == 0);
+    for (unsigned i = 0; i < 11000; i++) {
+        unsigned v;
+        got = bfcread(ctx, &v, sizeof(v), 1);
+        assert(got == 1 && v == i);
+    }
+
+    ret = bfsetasync(ctx, 0);
+    assert(ret == 0);
+    assert(bfasyncstats(ctx, &st) == -1);
+    ret = bfclose(ctx);
+    assert(ret == 0);
+    close(fd);
+    remove("test.bin");
+    printf("test_bfsetasync passed.\n");
+}
+
+void test_bfsetreadahead() {
+    int ret;
+    size_t got, put;
+    ssize_t io;
+    off_t pos;
+    int fd = open("test.bin", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    for (unsigned i = 0; i < 20000; i++) {
+        io = write(fd, &i, sizeof(i));
+        assert(io == sizeof(i));
+    }
+    pos = lseek(fd, 0, SEEK_SET);
+    assert(pos == 0);
+
+    bufrw_t *ctx = bfopen_fd(fd, 64, 64);
+    assert(ctx);
+    ret = bfsetreadahead(ctx, 3);
+    assert(ret == 0);
+
+    unsigned v;
+    for (unsigned i = 0; i < 10000; i++) {
+        got = bfcread(ctx, &v, sizeof(v), 1);
+        assert(got == 1 && v == i);
+        assert(i % 1000 || bfctell(ctx) == (long)((i + 1) * sizeof(v)));
+    }
+
+    /* Seeking drops the blocks read ahead and restarts detection. */
+    ret = bfcseek(ctx, -4 * (long)sizeof(v), SEEK_CUR);
+    assert(ret == 0);
+    assert(bfctell(ctx) == 9996 * (long)sizeof(v));
+    static unsigned big[4000];
+    got = bfcread(ctx, big, sizeof(v), 4000);
+    assert(got == 4000);
+    for (unsigned i = 0; i < 4000; i++) {
+        assert(big[i] == 9996 + i);
+    }
+
+    /* Writing continues right after the last item read. */
+    v = 0xdeadbeef;
+    put = bfcwrite(ctx, &v, sizeof(v), 1);
+    assert(put == 1);
+    assert(bfctell(ctx) == 13997 * (long)sizeof(v));
+    ret = bfclose(ctx);
+    assert(ret == 0);
+    pos = lseek(fd, 0, SEEK_CUR);
+    assert(pos == 13997 * (long)sizeof(v));
+    io = pread(fd, &v, sizeof(v), 13996 * sizeof(v));
+    assert(io == sizeof(v) && v == 0xdeadbeef);
+    io = pread(fd, &v, sizeof(v), 13997 * sizeof(v));
+    assert(io == sizeof(v) && v == 13997);
+
+    /* Reading to the end through the ring reports EOF. */
+    pos = lseek(fd, 0, SEEK_SET);
+    assert(pos == 0);
+    ctx = bfopen_fd(fd, 128, 0);
+    assert(ctx);
+    ret = bfsetreadahead(ctx, 2);
+    assert(ret == 0);
+    static unsigned all[20001];
+    got = bfcread(ctx, all, sizeof(v), 20001);
+    assert(got == 20000);
+    assert(all[0] == 0 && all[19999] == 19999 && all[13996] == 0xdeadbeef);
+    got = bfcread(ctx, &v, sizeof(v), 1);
+    assert(got == 0);
+    ret = bfclose(ctx);
+    assert(ret == 0);
+
+    close(fd);
+    remove("test.bin");
+    printf("test_bfsetreadahead passed.\n");
+}
+
+void test_bfseturing() {
+    int ret;
+    size_t got, put;
+    off_t pos;
+    int fd = open("test.bin", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    bufrw_t *ctx = bfopen_fd(fd, 64, 64);
+    assert(ctx);
+    if (bfseturing(ctx, 4) != 0) {
+        assert(errno == ENOSYS);
+        bfclose(ctx);
+        close(fd);
+        remove("test.bin");
+        printf("test_bfseturing skipped (no io_uring).\n");
+        return;
+    }
+
+    for (unsigned i = 0; i < 10000; i++) {
+        put = bfcwrite(ctx, &i, sizeof(i), 1);
+        assert(put == 1);
+    }
+    ret = bfcflush(ctx);
+    assert(ret == 0);
+    assert(bfctell(ctx) == 10000 * (long)sizeof(unsigned));
+    pos = lseek(fd, 0, SEEK_CUR);
+    assert(pos == 10000 * (long)sizeof(unsigned));
+
+    ret = bfcseek(ctx, 100 * sizeof(unsigned), SEEK_SET);
+    assert(ret == 0);
+    unsigned v;
+    for (unsigned i = 100; i < 5000; i++) {
+        got = bfcread(ctx, &v, sizeof(v), 1);
+        assert(got == 1 && v == i);
+    }
+    assert(bfctell(ctx) == 5000 * (long)sizeof(v));
+
+    /* Overwrite in the middle, then read on through the end of file. */
+    v = 0xfeedface;
+    put = bfcwrite(ctx, &v, sizeof(v), 1);
+    assert(put == 1);
+    static unsigned rest[6000];
+    got = bfcread(ctx, rest, sizeof(v), 6000);
+    assert(got == 4999);
+    assert(rest[0] == 5001 && rest[4998] == 9999);
+    got = bfcread(ctx, &v, sizeof(v), 1);
+    assert(got == 0);
+
+    ret = bfseturing(ctx, 0);
+    assert(ret == 0);
+    ret = bfcseek(ctx, 5000 * sizeof(unsigned), SEEK_SET);
+    assert(ret == 0);
+    got = bfcread(ctx, &v, sizeof(v), 1);
+    assert(got == 1 && v == 0xfeedface);
+    ret = bfclose(ctx);
+    assert(ret == 0);
+
+    close(fd);
+    remove("test.bin");
+    printf("test_bfseturing passed.\n");
+}
+
+#define SHARE_THREADS 4
+#define SHARE_RECORDS 2000
+
+static void *share_producer(void *arg) {
+    size_t put;
+    bufrw_t *ctx = (bufrw_t *)((void **)arg)[0];
+    int id = (int)(size_t)((void **)arg)[1];
+    char rec[32];
+    for (int i = 0; i < SHARE_RECORDS; i++) {
+        int len = snprintf(rec, sizeof(rec), "%d:%05d\n", id, i);
+        assert(len == 8);
+        put = bfcwrite(ctx, rec, 1, 8);
+        assert(put == 8);
+    }
+    return NULL;
+}
+
+void test_bfopen_map() {
+    int ret;
+    size_t got, put;
+    ssize_t io;
+    off_t pos;
+    int fd = open("test.bin", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    for (unsigned i = 0; i < 10000; i++) {
+        io = write(fd, &i, sizeof(i));
+        assert(io == sizeof(i));
+    }
+    pos = lseek(fd, 10 * sizeof(unsigned), SEEK_SET);
+    assert(pos == 10 * (long)sizeof(unsigned));
+
+    bufrw_t *ctx = bfopen_map(fd);
+    assert(ctx);
+    assert(bfctell(ctx) == 10 * (long)sizeof(unsigned));
+
+    /* Views point into the mapping and consume, peeks do not. */
+    const void *p, *q;
+    got = bfpeek(ctx, 4 * sizeof(unsigned), &p);
+    assert(got == 4 * sizeof(unsigned));
+    got = bfview(ctx, 4 * sizeof(unsigned), &q);
+    assert(got == 4 * sizeof(unsigned));
+    assert(p == q && ((const unsigned *)q)[0] == 10 && ((const unsigned *)q)[3] == 13);
+    unsigned v;
+    got = bfcread(ctx, &v, sizeof(v), 1);
+    assert(got == 1 && v == 14);
+    assert(bfctell(ctx) == 15 * (long)sizeof(v));
+
+    /* Far jumps back and forth, then SEEK_CUR and SEEK_END. */
+    for (unsigned i = 0; i < 4; i++) {
+        unsigned at = (i % 2) ? 9000 : 100 + i;
+        ret = bfcseek(ctx, at * sizeof(v), SEEK_SET);
+        assert(ret == 0);
+        got = bfcread(ctx, &v, sizeof(v), 1);
+        assert(got == 1 && v == at);
+    }
+    ret = bfcseek(ctx, -2 * (long)sizeof(v), SEEK_CUR);
+    assert(ret == 0);
+    got = bfcread(ctx, &v, sizeof(v), 1);
+    assert(got == 1 && v == 8999);
+    ret = bfcseek(ctx, -(long)sizeof(v), SEEK_END);
+    assert(ret == 0);
+    got = bfview(ctx, 100, &p);
+    assert(got == sizeof(v) && *(const unsigned *)p == 9999);
+    got = bfview(ctx, 100, &p);
+    assert(got == 0);
+    ret = bfcseek(ctx, 1, SEEK_END);
+    assert(ret == -1);
+
+    /* The mapping is read-only and the descriptor's offset is untouched. */
+    put = bfcwrite(ctx, &v, sizeof(v), 1);
+    assert(put == 0 && errno == EBADF);
+    ret = bfclose(ctx);
+    assert(ret == 0);
+    pos = lseek(fd, 0, SEEK_CUR);
+    assert(pos == 10 * (long)sizeof(unsigned));
+
+    /* Without a mapping, a view that straddles a refill is made contiguous. */
+    pos = lseek(fd, 0, SEEK_SET);
+    assert(pos == 0);
+    ctx = bfopen_fd(fd, 64, 64);
+    assert(ctx);
+    unsigned head[15];
+    got = bfcread(ctx, head, sizeof(v), 15);
+    assert(got == 15);
+    got = bfview(ctx, 4 * sizeof(v), &p);
+    assert(got == 4 * sizeof(v));
+    assert(((const unsigned *)p)[0] == 15 && ((const unsigned *)p)[3] == 18);
+    got = bfpeek(ctx, 1000, &p);
+    assert(got == 64 && *(const unsigned *)p == 19);
+    assert(bfctell(ctx) == 19 * (long)sizeof(v));
+    ret = bfclose(ctx);
+    assert(ret == 0);
+    pos = lseek(fd, 0, SEEK_CUR);
+    assert(pos == 19 * (long)sizeof(v));
+
+    close(fd);
+    remove("test.bin");
+    printf("test_bfopen_map passed.\n");
+}
+
+void test_bfopen_map_empty() {
+    int ret;
+    size_t got;
+    int fd = open("test.bin", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+
+    /* An empty file maps to an empty buffer that is at its end right away. */
+    bufrw_t *ctx = bfopen_map(fd);
+    assert(ctx);
+    char buf[16];
+    const void *p;
+    got = bfcread(ctx, buf, 1, sizeof(buf));
+    assert(got == 0);
+    got = bfcread(ctx, buf, 1, 1);
+    assert(got == 0);
+    got = bfview(ctx, sizeof(buf), &p);
+    assert(got == 0);
+    got = bfpeek(ctx, sizeof(buf), &p);
+    assert(got == 0);
+    assert(bfctell(ctx) == 0);
+    ret = bfclose(ctx);
+    assert(ret == 0);
+
+    close(fd);
+    remove("test.bin");
+    printf("test_bfopen_map_empty passed.\n");
+}
+
+static size_t getline_expect(unsigned i, char *line) {
+    size_t len = i == 200 ? 5000 : i % 150;
+    memset(line, 'a' + i % 26, len);
+    line[len] = '\n';
+    return len + 1;
+}
+
+static void getline_check(bufrw_t *ctx) {
+    size_t got;
+    static char want[5001];
+    const char *line;
+    for (unsigned i = 0; i < 400; i++) {
+        size_t len = getline_expect(i, want);
+        got = bfgetline(ctx, &line);
+        assert(got == len && memcmp(line, want, len) == 0);
+    }
+    got = bfgetline(ctx, &line);
+    assert(got == 4 && memcmp(line, "tail", 4) == 0);
+    got = bfgetline(ctx, &line);
+    assert(got == 0);
+}
+
+void test_bfreaduntil() {
+    int ret;
+    size_t got;
+    ssize_t io;
+    off_t pos;
+    int fd = open("test.bin", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    static char line[5001];
+    for (unsigned i = 0; i < 400; i++) {
+        size_t len = getline_expect(i, line);
+        io = write(fd, line, len);
+        assert(io == (ssize_t)len);
+    }
+    io = write(fd, "tail", 4);
+    assert(io == 4);
+
+    /* Lines straddling refills and lines longer than the buffer. */
+    pos = lseek(fd, 0, SEEK_SET);
+    assert(pos == 0);
+    bufrw_t *ctx = bfopen_fd(fd, 256, 64);
+    assert(ctx);
+    getline_check(ctx);
+    ret = bfclose(ctx);
+    assert(ret == 0);
+
+    /* Through the read-ahead ring, and straight out of a mapping. */
+    pos = lseek(fd, 0, SEEK_SET);
+    assert(pos == 0);
+    ctx = bfopen_fd(fd, 256, 64);
+    assert(ctx);
+    ret = bfsetreadahead(ctx, 2);
+    assert(ret == 0);
+    getline_check(ctx);
+    ret = bfclose(ctx);
+    assert(ret == 0);
+    pos = lseek(fd, 0, SEEK_SET);
+    assert(pos == 0);
+    ctx = bfopen_map(fd);
+    assert(ctx);
+    getline_check(ctx);
+    ret = bfclose(ctx);
+    assert(ret == 0);
+
+    /* Short records are views into the read buffer; reads pick up after them. */
+    pos = lseek(fd, 0, SEEK_SET);
+    assert(pos == 0);
+    ctx = bfopen_fd(fd, 4096, 64);
+    assert(ctx);
+    const void *p, *q;
+    got = bfreaduntil(ctx, 'b', &p);
+    assert(got == 2);
+    got = bfreaduntil(ctx, '\n', &q);
+    assert(got == 1 && (const char *)q == (const char *)p + 2);
+    got = bfcread(ctx, line, 1, 3);
+    assert(got == 3 && memcmp(line, "cc\n", 3) == 0);
+    assert(bfctell(ctx) == 6);
+    ret = bfclose(ctx);
+    assert(ret == 0);
+
+    close(fd);
+    remove("test.bin");
+    printf("test_bfreaduntil passed.\n");
+}
+
+void test_bfread_ints() {
+    int ret;
+    size_t got, put;
+    ssize_t io;
+    off_t pos;
+    int fd = open("test.bin", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+
+    /* Small buffers so that values straddle refills and flushes. */
+    bufrw_t *ctx = bfopen_fd(fd, 13, 13);
+    assert(ctx);
+    for (uint64_t i = 0; i < 1000; i++) {
+        ret = bfwrite_u16le(ctx, (uint16_t)i);
+        assert(ret == 0);
+        ret = bfwrite_u32be(ctx, (uint32_t)(i * 0x01020304));
+        assert(ret == 0);
+        ret = bfwrite_u64le(ctx, i << 40 | i);
+        assert(ret == 0);
+        ret = bfwrite_varint(ctx, i * i * i * 0x9e3779b9ULL);
+        assert(ret == 0);
+    }
+    ret = bfwrite_varint(ctx, UINT64_MAX);
+    assert(ret == 0);
+    static uint32_t arr[3000];
+    for (unsigned i = 0; i < 3000; i++) {
+        arr[i] = i * 2654435761U;
+    }
+    put = bfwrite_u32be_n(ctx, arr, 3000);
+    assert(put == 3000);
+    ret = bfwrite_u64be(ctx, 0x0102030405060708ULL);
+    assert(ret == 0);
+    ret = bfclose(ctx);
+    assert(ret == 0);
+
+    unsigned char raw[8];
+    io = pread(fd, raw, 4, 2);
+    assert(io == 4 && raw[0] == 0 && raw[3] == 0);
+    io = pread(fd, raw, 8, lseek(fd, 0, SEEK_END) - 8);
+    assert(io == 8 && raw[0] == 1 && raw[7] == 8);
+
+    pos = lseek(fd, 0, SEEK_SET);
+    assert(pos == 0);
+    ctx = bfopen_fd(fd, 13, 13);
+    assert(ctx);
+    for (uint64_t i = 0; i < 1000; i++) {
+        uint16_t a;
+        uint32_t b;
+        uint64_t c, d;
+        ret = bfread_u16le(ctx, &a);
+        assert(ret == 0 && a == (uint16_t)i);
+        ret = bfread_u32be(ctx, &b);
+        assert(ret == 0 && b == (uint32_t)(i * 0x01020304));
+        ret = bfread_u64le(ctx, &c);
+        assert(ret == 0 && c == (i << 40 | i));
+        ret = bfread_varint(ctx, &d);
+        assert(ret == 0 && d == i * i * i * 0x9e3779b9ULL);
+    }
+    uint64_t v;
+    ret = bfread_varint(ctx, &v);
+    assert(ret == 0 && v == UINT64_MAX);
+    static uint32_t back[3000];
+    got = bfread_u32be_n(ctx, back, 3000);
+    assert(got == 3000 && memcmp(arr, back, sizeof(arr)) == 0);
+    ret = bfread_u64be(ctx, &v);
+    assert(ret == 0 && v == 0x0102030405060708ULL);
+    ret = bfread_u64be(ctx, &v);
+    assert(ret == -1);
+    ret = bfclose(ctx);
+    assert(ret == 0);
+
+    /* An encoding running past 64 bits is rejected. */
+    static const unsigned char bad[11] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x7f, 0 };
+    io = pwrite(fd, bad, sizeof(bad), 0);
+    assert(io == sizeof(bad));
+    pos = lseek(fd, 0, SEEK_SET);
+    assert(pos == 0);
+    ctx = bfopen_fd(fd, 64, 64);
+    assert(ctx);
+    errno = 0;
+    ret = bfread_varint(ctx, &v);
+    assert(ret == -1 && errno == EILSEQ);
+    ret = bfread_varint(ctx, &v);
+    assert(ret == 0 && v == 0);
+    ret = bfclose(ctx);
+    assert(ret == 0);
+
+    close(fd);
+    remove("test.bin");
+    printf("test_bfread_ints passed.\n");
+}
+
+static void *cache_reader(void *arg) {
+    size_t got;
+    bufrw_t *ctx = (bufrw_t *)arg;
+    unsigned seed = (unsigned)(uintptr_t)arg, v;
+    for (unsigned i = 0; i < 2000; i++) {
+        seed = seed * 1103515245U + 12345U;
+        unsigned at = (seed >> 8) % 20000;
+        got = bfpread(ctx, &v, sizeof(v), at * (long)sizeof(v));
+        assert(got == sizeof(v) && v == at);
+    }
+    return NULL;
+}
+
+void test_bfsetcache() {
+    int ret;
+    size_t got, put;
+    ssize_t io;
+    off_t pos;
+    int fd = open("test.bin", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    for (unsigned i = 0; i < 20000; i++) {
+        io = write(fd, &i, sizeof(i));
+        assert(io == sizeof(i));
+    }
+    pos = lseek(fd, 0, SEEK_SET);
+    assert(pos == 0);
+    int fd2 = open("test.bin", O_RDONLY);
+    assert(fd2 >= 0);
+
+    bufrw_cache_t *cache = bfcache_new(4096, 4);
+    assert(cache);
+    bufrw_t *a = bfopen_fd(fd, 256, 64);
+    bufrw_t *b = bfopen_fd_at(fd2, 0, 256, 64);
+    assert(a && b);
+    ret = bfsetcache(a, cache);
+    assert(ret == 0);
+    ret = bfsetcache(b, cache);
+    assert(ret == 0);
+    bfcache_free(cache);
+
+    /* Both descriptors of the file share its blocks. */
+    bufrw_cache_stats_t st;
+    unsigned v;
+    got = bfpread(a, &v, sizeof(v), 100 * sizeof(v));
+    assert(got == sizeof(v) && v == 100);
+    got = bfpread(b, &v, sizeof(v), 200 * sizeof(v));
+    assert(got == sizeof(v) && v == 200);
+    assert(bfcache_stats(cache, &st) == 0 && st.hits == 1 && st.misses == 1);
+
+    /* Seeks and buffered reads go through the cache, across blocks too. */
+    ret = bfcseek(a, 1020 * sizeof(v), SEEK_SET);
+    assert(ret == 0);
+    unsigned run[8];
+    got = bfcread(a, run, sizeof(v), 8);
+    assert(got == 8 && run[0] == 1020 && run[7] == 1027);
+    assert(bfctell(a) == 1028 * (long)sizeof(v));
+    got = bfpread(a, &v, sizeof(v), 20000 * sizeof(v));
+    assert(got == 0);
+    put = bfcwrite(a, &v, sizeof(v), 1);
+    assert(put == 0 && errno == EBADF);
+
+    /* More blocks than slots evict; concurrent readers stay consistent. */
+    pthread_t th[4];
+    bufrw_t *rd[4];
+    for (int i = 0; i < 4; i++) {
+        rd[i] = bfopen_fd_at(fd2, 0, 256, 64);
+        assert(rd[i]);
+        ret = bfsetcache(rd[i], cache);
+        assert(ret == 0);
+        ret = pthread_create(&th[i], NULL, cache_reader, rd[i]);
+        assert(ret == 0);
+    }
+    for (int i = 0; i < 4; i++) {
+        ret = pthread_join(th[i], NULL);
+        assert(ret == 0);
+        ret = bfclose(rd[i]);
+        assert(ret == 0);
+    }
+    assert(bfcache_stats(cache, &st) == 0 && st.evictions > 0);
+    assert(st.hits + st.misses >= 8000);
+
+    /* Detaching restores the descriptor's offset; the cache outlives bfcache_free. */
+    ret = bfsetcache(a, NULL);
+    assert(ret == 0);
+    pos = lseek(fd, 0, SEEK_CUR);
+    assert(pos == 1028 * (long)sizeof(v));
+    got = bfcread(b, &v, sizeof(v), 1);
+    assert(got == 1 && v == 0);
+    ret = bfclose(a);
+    assert(ret == 0);
+    ret = bfclose(b);
+    assert(ret == 0);
+
+    /* Mapped contexts serve positional reads from the mapping. */
+    a = bfopen_map(fd);
+    assert(a);
+    got = bfpread(a, &v, sizeof(v), 300 * sizeof(v));
+    assert(got == sizeof(v) && v == 300);
+    got = bfpread(a, &v, sizeof(v), 20000 * sizeof(v));
+    assert(got == 0);
+    got = bfpread(a, &v, sizeof(v), 30000 * sizeof(v));
+    assert(got == 0);
+    ret = bfclose(a);
+    assert(ret == 0);
+
+    close(fd2);
+    close(fd);
+    remove("test.bin");
+    printf("test_bfsetcache passed.\n");
+}
+
+/* Run-length test codec: (count, byte) pairs. */
+static size_t rle_bound(void *arg, size_t n) {
+    (void)arg;
+    return 2 * n;
+}
+
+static ssize_t rle_encode(void *arg, void *dst, size_t cap, const void *src, size_t n) {
+    const unsigned char *in = (const unsigned char *)src;
+    unsigned char *out = (unsigned char *)dst;
+    size_t o = 0;
+    (*(int *)arg)++;
+    for (size_t i = 0; i < n;) {
+        size_t run = 1;
+        while (i + run < n && run < 255 && in[i + run] == in[i]) {
+            run++;
+        }
+        if (o + 2 > cap) {
+            return -1;
+        }
+        out[o++] = (unsigned char)run;
+        out[o++] = in[i];
+        i += run;
+    }
+    return (ssize_t)o;
+}
+
+static ssize_t rle_decode(void *arg, void *dst, size_t cap, const void *src, size_t n) {
+    const unsigned char *in = (const unsigned char *)src;
+    unsigned char *out = (unsigned char *)dst;
+    size_t o = 0;
+    (void)arg;
+    for (size_t i = 0; i + 1 < n; i += 2) {
+        if (o + in[i] > cap) {
+            return -1;
+        }
+        memset(out + o, in[i + 1], in[i]);
+        o += in[i];
+    }
+    return (ssize_t)o;
+}
+
+static unsigned char codec_byte(size_t i) {
+    return i < 150000 ? (unsigned char)(i / 100) : (unsigned char)(i * 2654435761U >> 13);
+}
+
+static void codec_check(int fd, size_t rd_sz, size_t chunk, const bufrw_codec_t *codec) {
+    int ret;
+    off_t pos;
+    pos = lseek(fd, 0, SEEK_SET);
+    assert(pos == 0);
+    bufrw_t *ctx = bfopen_fd(fd, rd_sz, 64);
+    assert(ctx);
+    ret = bfsetcodec(ctx, codec);
+    assert(ret == 0);
+    static unsigned char buf[200000];
+    size_t total = 0, got;
+    while ((got = bfcread(ctx, buf, 1, chunk)) > 0) {
+        for (size_t i = 0; i < got; i++) {
+            assert(buf[i] == codec_byte(total + i));
+        }
+        total += got;
+    }
+    assert(total == 200000 && bfctell(ctx) == 200000);
+    ret = bfclose(ctx);
+    assert(ret == 0);
+}
+
+void test_bfsetcodec() {
+    int ret;
+    size_t got, put;
+    off_t pos;
+    int fd = open("test.bin", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    int frames = 0;
+    bufrw_codec_t rle = { .bound = rle_bound, .encode = rle_encode, .decode = rle_decode, .arg = &frames };
+
+    /* Each flush becomes a frame; the flusher thread does the encoding. */
+    bufrw_t *ctx = bfopen_fd(fd, 64, 16384);
+    assert(ctx);
+    ret = bfsetcodec(ctx, &rle);
+    assert(ret == 0);
+    ret = bfsetasync(ctx, 2);
+    assert(ret == 0);
+    static unsigned char data[200000];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = codec_byte(i);
+    }
+    for (size_t i = 0; i < 100000; i += 1000) {
+        put = bfcwrite(ctx, data + i, 1, 1000);
+        assert(put == 1000);
+    }
+    put = bfcwrite(ctx, data + 100000, 1, 100000);
+    assert(put == 100000);
+    assert(bfctell(ctx) == 200000);
+    ret = bfclose(ctx);
+    assert(ret == 0);
+    assert(frames > 0);
+    struct stat st;
+    assert(fstat(fd, &st) == 0 && st.st_size < 200000);
+
+    /* Frames larger than the read buffer, small buffers and direct reads. */
+    codec_check(fd, 4096, 1000, &rle);
+    codec_check(fd, 65536, 7, &rle);
+    codec_check(fd, 4096, 200000, &rle);
+
+    /* Only seeks within the read buffer work. */
+    pos = lseek(fd, 0, SEEK_SET);
+    assert(pos == 0);
+    ctx = bfopen_fd(fd, 65536, 64);
+    assert(ctx);
+    ret = bfsetcodec(ctx, &rle);
+    assert(ret == 0);
+    unsigned char b;
+    got = bfcread(ctx, &b, 1, 1);
+    assert(got == 1 && b == codec_byte(0));
+    ret = bfcseek(ctx, 1000, SEEK_SET);
+    assert(ret == 0);
+    got = bfcread(ctx, &b, 1, 1);
+    assert(got == 1 && b == codec_byte(1000));
+    ret = bfcseek(ctx, 190000, SEEK_SET);
+    assert(ret == -1 && errno == ESPIPE);
+    ret = bfclose(ctx);
+    assert(ret == 0);
+
+    bufrw_codec_t z;
+    ret = bfcodec_zstd(&z, 3);
+    assert(ret == 0 || errno == ENOSYS);
+    close(fd);
+    remove("test.bin");
+    printf("test_bfsetcodec passed.\n");
+}
+
+/* Digest of the n bytes at p written through a fresh context in steps of step. */
+static uint64_t digest_of(int algo, const void *p, size_t n, size_t step) {
+    int ret;
+    size_t put;
+    int fd = open("test.bin", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    bufrw_t *ctx = bfopen_fd(fd, 64, 64);
+    assert(ctx);
+    ret = bfsetdigest(ctx, algo);
+    assert(ret == 0);
+    for (size_t i = 0; i < n; i += step) {
+        size_t k = n - i < step ? n - i : step;
+        put = bfcwrite(ctx, (const char *)p + i, 1, k);
+        assert(put == k);
+    }
+    uint64_t h;
+    ret = bfdigest(ctx, &h);
+    assert(ret == 0);
+    ret = bfclose(ctx);
+    assert(ret == 0);
+    close(fd);
+    return h;
+}
+
+void test_bfsetdigest() {
+    int ret;
+    size_t nread, put;
+    uint64_t hash;
+    /* Check values. */
+    hash = digest_of(BUFRW_DIGEST_CRC32C, "123456789", 9, 9);
+    assert(hash == 0xe3069283);
+    hash = digest_of(BUFRW_DIGEST_XXH64, "", 0, 1);
+    assert(hash == 0xef46db3751d8e999ULL);
+    hash = digest_of(BUFRW_DIGEST_XXH64, "abc", 3, 3);
+    assert(hash == 0x44bc2cf5ad770999ULL);
+
+    /* Split writes, buffered or direct, digest the same bytes. */
+    static unsigned char data[100000];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (unsigned char)(i * 2654435761u >> 13);
+    }
+    uint64_t crc = digest_of(BUFRW_DIGEST_CRC32C, data, sizeof(data), sizeof(data));
+    uint64_t xxh = digest_of(BUFRW_DIGEST_XXH64, data, sizeof(data), sizeof(data));
+    hash = digest_of(BUFRW_DIGEST_CRC32C, data, sizeof(data), 7);
+    assert(hash == crc);
+    hash = digest_of(BUFRW_DIGEST_XXH64, data, sizeof(data), 7);
+    assert(hash == xxh);
+    hash = digest_of(BUFRW_DIGEST_XXH64, data, sizeof(data), 33);
+    assert(hash == xxh);
+
+    /* Reading the file back through a stdio context gives the same digest. */
+    FILE *f = fopen("test.bin", "rb");
+    assert(f);
+    bufrw_t *ctx = bfopen(f, 4096, 16);
+    assert(ctx);
+    ret = bfsetdigest(ctx, BUFRW_DIGEST_XXH64);
+    assert(ret == 0);
+    unsigned char buf[1000];
+    size_t total = 0, got;
+    while ((got = bfcread(ctx, buf, 1, sizeof(buf))) > 0) {
+        total += got;
+    }
+    uint64_t h;
+    assert(total == sizeof(data));
+    ret = bfdigest(ctx, &h);
+    assert(ret == 0 && h == xxh);
+
+    /* Restarting resets it; stages that would slip under it are refused. */
+    ret = bfcseek(ctx, 0, SEEK_SET);
+    assert(ret == 0);
+    ret = bfsetdigest(ctx, BUFRW_DIGEST_CRC32C);
+    assert(ret == 0);
+    nread = bfcread(ctx, buf, 1, 10);
+    assert(nread == 10);
+    ret = bfsetreadahead(ctx, 2);
+    assert(ret == -1 && errno == EINVAL);
+    ret = bfsetdigest(ctx, BUFRW_DIGEST_NONE);
+    assert(ret == 0);
+    ret = bfdigest(ctx, &h);
+    assert(ret == -1 && errno == EINVAL);
+    ret = bfsetdigest(ctx, 7);
+    assert(ret == -1 && errno == EINVAL);
+    ret = bfclose(ctx);
+    assert(ret == 0);
+    fclose(f);
+
+    /* Write-behind: the flusher thread hashes, bfdigest waits for it. */
+    int fd = open("test.bin", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    ctx = bfopen_fd(fd, 64, 4096);
+    assert(ctx);
+    ret = bfsetasync(ctx, 2);
+    assert(ret == 0);
+    ret = bfsetdigest(ctx, BUFRW_DIGEST_CRC32C);
+    assert(ret == 0);
+    for (size_t i = 0; i < sizeof(data); i += 100) {
+        put = bfcwrite(ctx, data + i, 1, 100);
+        assert(put == 100);
+    }
+    ret = bfdigest(ctx, &h);
+    assert(ret == 0 && h == crc);
+    ret = bfclose(ctx);
+    assert(ret == 0);
+    close(fd);
+    remove("test.bin");
+    printf("test_bfsetdigest passed.\n");
+}
+
+void test_bfstats() {
+    int ret;
+    int fd = open("test.bin", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    bufrw_t *ctx = bfopen_fd(fd, 64, 64);
+    assert(ctx);
+    char data[200];
+    memset(data, 'x', sizeof(data));
+
+    /* Two buffers fill up, a half full one is flushed, a large write goes
+       direct but for a tail left in the buffer. The library calls are made
+       directly, as inline buffer hits would not be counted. */
+    for (int i = 0; i < 10; i++) {
+        assert((bfcwrite)(ctx, data, 1, 16) == 16);
+    }
+    ret = bfcflush(ctx);
+    assert(ret == 0);
+    assert((bfcwrite)(ctx, data, 1, 200) == 200);
+    bufrw_stats_t st;
+    assert(bfstats(ctx, &st) == 0);
+    assert(st.writes == 11 && st.bytes_written == 360 && st.bytes_copied == 168);
+    assert(st.flushes == 3 && st.direct_writes == 1 && st.stream_written == 352);
+
+    /* One refill, a seek within it, then a direct read cut short by the end. */
+    ret = bfcseek(ctx, 0, SEEK_SET);
+    assert(ret == 0);
+    char buf[1000];
+    assert((bfcread)(ctx, buf, 1, 10) == 10);
+    ret = bfcseek(ctx, 20, SEEK_SET);
+    assert(ret == 0);
+    assert((bfcread)(ctx, buf, 1, sizeof(buf)) == 340);
+    assert(bfstats(ctx, &st) == 0);
+    assert(st.reads == 2 && st.bytes_read == 350 && st.stream_read == 360);
+    assert(st.refills == 1 && st.direct_reads == 1 && st.short_reads == 1);
+    assert(st.seeks == 2 && st.seeks_in_buffer == 1 && st.reallocs == 0);
+
+    unsigned long long refilled = 0, flushed = 0;
+    for (int i = 0; i < BUFRW_STATS_BUCKETS; i++) {
+        refilled += st.refill_hist[i];
+        flushed += st.flush_hist[i];
+    }
+#if defined(BUFRW_WITH_HISTOGRAMS)
+    assert(refilled == st.refills && flushed == st.flushes);
+#else
+    assert(refilled == 0 && flushed == 0);
+#endif
+
+    /* Closing the context adds its counters to the global ones. */
+    bufrw_stats_t before, after;
+    assert(bfstats_global(&before) == 0);
+    ret = bfclose(ctx);
+    assert(ret == 0);
+    assert(bfstats_global(&after) == 0);
+    assert(after.writes - before.writes == 11 && after.stream_read - before.stream_read == 360);
+    assert(bfstats(NULL, &st) == -1 && errno == EINVAL);
+    close(fd);
+    remove("test.bin");
+    printf("test_bfstats passed.\n");
+}
+
+void test_bfcread_inline() {
+    int ret;
+    size_t nread, put;
+    int fd = open("test.bin", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    bufrw_t *ctx = bfopen_fd(fd, 64, 64);
+    assert(ctx);
+
+    /* Once the library has started a buffer, hits stay in the caller. */
+    bufrw_stats_t st;
+    uint32_t v = 0;
+    for (int i = 0; i < 40; i++, v++) {
+        put = bfcwrite(ctx, &v, sizeof(v), 1);
+        assert(put == 1);
+    }
+    assert(bfstats(ctx, &st) == 0);
+    assert(st.writes > 0 && st.writes < 40 && st.flushes == 2);
+    put = bfcwrite(ctx, &v, 0, 1);
+    assert(put == 0);
+    put = bfcwrite(NULL, &v, 1, 1);
+    assert(put == 0);
+
+    ret = bfcseek(ctx, 0, SEEK_SET);
+    assert(ret == 0);
+    uint32_t got[40];
+    for (int i = 0; i < 40; i++) {
+        nread = bfcread(ctx, &got[i], sizeof(got[i]), 1);
+        assert(nread == 1 && got[i] == (uint32_t)i);
+    }
+    nread = bfcread(ctx, got, sizeof(got[0]), 1);
+    assert(nread == 0);
+    assert(bfstats(ctx, &st) == 0);
+    assert(st.reads > 0 && st.reads < 40);
+
+    /* The library functions are there by address too. */
+    size_t (*lib_read)(bufrw_t *, void *, size_t, size_t) = bfcread;
+    ret = bfcseek(ctx, 4, SEEK_SET);
+    assert(ret == 0);
+    nread = lib_read(ctx, got, sizeof(got[0]), 2);
+    assert(nread == 2 && got[1] == 2);
+    ret = bfclose(ctx);
+    assert(ret == 0);
+    close(fd);
+    remove("test.bin");
+    printf("test_bfcread_inline passed.\n");
+}
+
+/* A 32-byte record. */
+typedef struct {
+    uint64_t ts;
+    double px;
+    uint32_t qty;
+    char sym[12];
+} tick_t;
+
+BUFRW_DEFINE_RECORD_STREAM(tick_t)
+
+static tick_t tick_make(unsigned i) {
+    tick_t t = { .ts = 1000 + i, .px = i * 0.5, .qty = i * 3 };
+    snprintf(t.sym, sizeof(t.sym), "S%u", i);
+    return t;
+}
+
+/* Feeds the ticks to a pipe in 7-byte dribbles. */
+static void *tick_feeder(void *arg) {
+    ssize_t io;
+    int fd = *(int *)arg;
+    tick_t ticks[20];
+    for (unsigned i = 0; i < 20; i++) {
+        ticks[i] = tick_make(i);
+    }
+    const char *p = (const char *)ticks;
+    for (size_t off = 0; off < sizeof(ticks); off += 7) {
+        size_t k = sizeof(ticks) - off < 7 ? sizeof(ticks) - off : 7;
+        io = write(fd, p + off, k);
+        assert(io == (ssize_t)k);
+        usleep(50);
+    }
+    close(fd);
+    return NULL;
+}
+
+void test_record_stream() {
+    int ret;
+    size_t got, put;
+    int fd = open("test.bin", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    bufrw_t *ctx = bfopen_fd(fd, 100, 100);
+    assert(ctx);
+    ret = bfsetrecord_tick_t(ctx);
+    assert(ret == 0);
+
+    /* Buffers hold whole records, so every flush ends on one. */
+    tick_t ticks[50];
+    for (unsigned i = 0; i < 50; i++) {
+        ticks[i] = tick_make(i);
+    }
+    for (unsigned i = 0; i < 10; i++) {
+        ret = bfwrite_tick_t(ctx, &ticks[i]);
+        assert(ret == 0);
+    }
+    put = bfwrite_tick_t_n(ctx, ticks + 10, 40);
+    assert(put == 40);
+    bufrw_stats_t st;
+    assert(bfstats(ctx, &st) == 0 && st.stream_written % sizeof(tick_t) == 0);
+    assert(((bufrw_head_t *)ctx)->write_buffer_sz == 96);
+
+    ret = bfcseek(ctx, 0, SEEK_SET);
+    assert(ret == 0);
+    tick_t t, back[50];
+    ret = bfread_tick_t(ctx, &t);
+    assert(ret == 0 && t.ts == 1000 && strcmp(t.sym, "S0") == 0);
+    got = bfread_tick_t_n(ctx, back, 50);
+    assert(got == 49);
+    assert(memcmp(back, ticks + 1, 49 * sizeof(tick_t)) == 0);
+    ret = bfread_tick_t(ctx, &t);
+    assert(ret == -1);
+    ret = bfsetrecord(ctx, 0);
+    assert(ret == 0);
+    ret = bfclose(ctx);
+    assert(ret == 0);
+    close(fd);
+    remove("test.bin");
+
+    /* Short reads from a pipe are topped up to whole records. */
+    int pfd[2];
+    ret = pipe(pfd);
+    assert(ret == 0);
+    pthread_t feeder;
+    ret = pthread_create(&feeder, NULL, tick_feeder, &pfd[1]);
+    assert(ret == 0);
+    ctx = bfopen_fd(pfd[0], 4096, 64);
+    assert(ctx);
+    ret = bfsetrecord_tick_t(ctx);
+    assert(ret == 0);
+    for (unsigned i = 0; i < 20; i++) {
+        ret = bfread_tick_t(ctx, &t);
+        assert(ret == 0 && t.ts == 1000 + i && t.qty == i * 3);
+        assert(((bufrw_head_t *)ctx)->read_buffer_len % sizeof(tick_t) == 0);
+    }
+    ret = bfread_tick_t(ctx, &t);
+    assert(ret == -1);
+    ret = pthread_join(feeder, NULL);
+    assert(ret == 0);
+    ret = bfclose(ctx);
+    assert(ret == 0);
+    close(pfd[0]);
+    printf("test_record_stream passed.\n");
+}
+
+void test_bfflushall() {
+    int ret;
+    size_t put;
+    const char *names[] = {"test.bin", "test2.bin", "test3.bin"};
+    int fds[3];
+    bufrw_t *ctxs[4];
+    char data[100];
+    memset(data, 'f', sizeof(data));
+    for (int i = 0; i < 3; i++) {
+        fds[i] = open(names[i], O_RDWR | O_CREAT | O_TRUNC, 0644);
+        assert(fds[i] >= 0);
+        ctxs[i] = bfopen_fd(fds[i], 4096, 4096);
+        assert(ctxs[i]);
+        put = bfcwrite(ctxs[i], data, 1, 10 * (i + 1));
+        assert(put == (size_t)(10 * (i + 1)));
+    }
+    FILE *file = fopen("test4.bin", "wb");
+    assert(file);
+    ctxs[3] = bfopen(file, 4096, 4096);
+    assert(ctxs[3]);
+    put = bfcwrite(ctxs[3], data, 1, 40);
+    assert(put == 40);
+
+    /* Everything pending reaches the files, stdio buffers included. */
+    struct stat st;
+    assert(fstat(fds[2], &st) == 0 && st.st_size == 0);
+    ret = bfflushall(BUFRW_FLUSH_DATASYNC);
+    assert(ret == 0);
+    for (int i = 0; i < 3; i++) {
+        assert(fstat(fds[i], &st) == 0 && st.st_size == 10 * (i + 1));
+    }
+    assert(fstat(fileno(file), &st) == 0 && st.st_size == 40);
+
+    /* A batch only touches the contexts it is given. */
+    put = bfcwrite(ctxs[0], data, 1, 5);
+    assert(put == 5);
+    put = bfcwrite(ctxs[1], data, 1, 5);
+    assert(put == 5);
+    ret = bfflush_batch(ctxs, 1, 0);
+    assert(ret == 0);
+    assert(fstat(fds[0], &st) == 0 && st.st_size == 15);
+    assert(fstat(fds[1], &st) == 0 && st.st_size == 20);
+    ret = bfflush_batch(ctxs, 0, 0);
+    assert(ret == 0);
+    ret = bfflush_batch(NULL, 1, 0);
+    assert(ret == -1 && errno == EINVAL);
+    ret = bfflush_batch(ctxs, 1, 0x100);
+    assert(ret == -1 && errno == EINVAL);
+
+    /* Closed contexts leave the registry. */
+    for (int i = 0; i < 4; i++) {
+        ret = bfclose(ctxs[i]);
+        assert(ret == 0);
+    }
+    ret = bfflushall(0);
+    assert(ret == 0);
+    const off_t sizes[] = {15, 25, 30};
+    for (int i = 0; i < 3; i++) {
+        assert(fstat(fds[i], &st) == 0 && st.st_size == sizes[i]);
+        close(fds[i]);
+        remove(names[i]);
+    }
+    fclose(file);
+    remove("test4.bin");
+
+    printf("test_bfflushall passed.\n");
+}
+
+typedef struct {
+    bufrw_t *ctx;
+    int commits;
+} committer_t;
+
+static void *durable_committer(void *arg) {
+    int ret;
+    size_t put;
+    committer_t *c = (committer_t *)arg;
+    char rec[32];
+    memset(rec, 'w', sizeof(rec));
+    for (int i = 0; i < c->commits; i++) {
+        put = bfcwrite(c->ctx, rec, 1, sizeof(rec));
+        assert(put == sizeof(rec));
+        ret = bfcflush(c->ctx);
+        assert(ret == 0);
+    }
+    return NULL;
+}
+
+void test_bfsetdurability() {
+    int ret;
+    size_t put;
+    /* Without a mode a flush leaves the data in stdio; with one it is not. */
+    FILE *file = fopen("test.bin", "wb");
+    assert(file);
+    bufrw_t *ctx = bfopen(file, 64, 64);
+    assert(ctx);
+    struct stat st;
+    put = bfcwrite(ctx, "commit", 1, 6);
+    assert(put == 6);
+    ret = bfcflush(ctx);
+    assert(ret == 0);
+    assert(fstat(fileno(file), &st) == 0 && st.st_size == 0);
+    ret = bfsetdurability(ctx, BUFRW_DURABLE_FLUSH, 0);
+    assert(ret == 0);
+    ret = bfcflush(ctx);
+    assert(ret == 0);
+    assert(fstat(fileno(file), &st) == 0 && st.st_size == 6);
+
+    /* Every datasync commit syncs, and so does closing. */
+    ret = bfsetdurability(ctx, BUFRW_DURABLE_DATASYNC, 0);
+    assert(ret == 0);
+    put = bfcwrite(ctx, "commit", 1, 6);
+    assert(put == 6);
+    ret = bfcflush(ctx);
+    assert(ret == 0);
+    ret = bfcflush(ctx);
+    assert(ret == 0);
+    bufrw_stats_t stats;
+    assert(bfstats(ctx, &stats) == 0 && stats.syncs == 2);
+    ret = bfsetdurability(ctx, 4, 0);
+    assert(ret == -1 && errno == EINVAL);
+    ret = bfclose(ctx);
+    assert(ret == 0);
+    assert(fstat(fileno(file), &st) == 0 && st.st_size == 12);
+    fclose(file);
+
+    /* Group commit: concurrent committers share syncs. */
+    int fd = open("test.bin", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    ctx = bfopen_fd(fd, 4096, 4096);
+    assert(ctx);
+    ret = bfshare(ctx);
+    assert(ret == 0);
+    ret = bfsetdurability(ctx, BUFRW_DURABLE_GROUP, 2000);
+    assert(ret == 0);
+    enum { COMMITTERS = 4, COMMITS = 10 };
+    pthread_t threads[COMMITTERS];
+    committer_t c = {ctx, COMMITS};
+    for (int i = 0; i < COMMITTERS; i++) {
+        ret = pthread_create(&threads[i], NULL, durable_committer, &c);
+        assert(ret == 0);
+    }
+    for (int i = 0; i < COMMITTERS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    assert(fstat(fd, &st) == 0 && st.st_size == COMMITTERS * COMMITS * 32);
+    assert(bfstats(ctx, &stats) == 0);
+    assert(stats.syncs > 0 && stats.syncs < COMMITTERS * COMMITS);
+    ret = bfsetdurability(ctx, BUFRW_DURABLE_NONE, 0);
+    assert(ret == 0);
+    ret = bfclose(ctx);
+    assert(ret == 0);
+    close(fd);
+    remove("test.bin");
+
+    printf("test_bfsetdurability passed.\n");
+}
+
+void test_bfcopy() {
+    int ret;
+    size_t got, put;
+    ssize_t io;
+    off_t pos;
+    enum { SIZE = 100000 };
+    char *data = malloc(SIZE), *back = malloc(SIZE + 16);
+    assert(data && back);
+    for (int i = 0; i < SIZE; i++) {
+        data[i] = (char)(i * 7 + i / 251);
+    }
+    int sfd = open("test.bin", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    int dfd = open("test2.bin", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(sfd >= 0 && dfd >= 0);
+    io = write(sfd, data, SIZE);
+    assert(io == SIZE);
+    pos = lseek(sfd, 0, SEEK_SET);
+    assert(pos == 0);
+
+    /* Buffered bytes go first, the rest is copied by the kernel, after
+       what dst had pending. */
+    bufrw_t *src = bfopen_fd(sfd, 4096, 4096);
+    bufrw_t *dst = bfopen_fd(dfd, 4096, 4096);
+    assert(src && dst);
+    got = bfcread(src, back, 1, 10);
+    assert(got == 10);
+    put = bfcwrite(dst, "hdr", 1, 3);
+    assert(put == 3);
+    put = bfcopy(dst, src, 50000);
+    assert(put == 50000);
+    assert(bfctell(src) == 50010 && bfctell(dst) == 50003);
+    put = bfcopy(dst, src, SIZE_MAX);
+    assert(put == SIZE - 50010);
+    put = bfcopy(dst, src, SIZE_MAX);
+    assert(put == 0);
+    bufrw_stats_t st;
+    /* Past the first refill, only the checks for the end read into the buffer. */
+    assert(bfstats(src, &st) == 0 && st.stream_read == SIZE && st.refills == 3);
+    ret = bfclose(src);
+    assert(ret == 0);
+    ret = bfclose(dst);
+    assert(ret == 0);
+    io = pread(dfd, back, SIZE + 16, 0);
+    assert(io == SIZE - 7);
+    assert(memcmp(back, "hdr", 3) == 0 && memcmp(back + 3, data + 10, SIZE - 10) == 0);
+
+    /* Positional contexts keep their offsets; a stdio destination takes
+       the buffered path. */
+    src = bfopen_fd_at(sfd, 1000, 4096, 4096);
+    dst = bfopen_fd_at(dfd, 0, 4096, 4096);
+    assert(src && dst);
+    put = bfcopy(dst, src, 2000);
+    assert(put == 2000);
+    assert(bfctell(src) == 3000 && bfctell(dst) == 2000);
+    ret = bfclose(src);
+    assert(ret == 0);
+    ret = bfclose(dst);
+    assert(ret == 0);
+    io = pread(dfd, back, 2000, 0);
+    assert(io == 2000 && memcmp(back, data + 1000, 2000) == 0);
+    FILE *file = fopen("test3.bin", "wb+");
+    assert(file);
+    src = bfopen_fd_at(sfd, 0, 4096, 4096);
+    dst = bfopen(file, 4096, 4096);
+    assert(src && dst);
+    put = bfcopy(dst, src, SIZE_MAX);
+    assert(put == SIZE);
+    ret = bfclose(src);
+    assert(ret == 0);
+    ret = bfclose(dst);
+    assert(ret == 0);
+    rewind(file);
+    got = fread(back, 1, SIZE + 16, file);
+    assert(got == SIZE && memcmp(back, data, SIZE) == 0);
+    fclose(file);
+
+    /* From a pipe the kernel splices. */
+    int fds[2];
+    ret = pipe(fds);
+    assert(ret == 0);
+    io = write(fds[1], data, 30000);
+    assert(io == 30000);
+    close(fds[1]);
+    src = bfopen_fd(fds[0], 4096, 4096);
+    dst = bfopen_fd_at(dfd, 0, 4096, 4096);
+    assert(src && dst);
+    put = bfcopy(dst, src, SIZE_MAX);
+    assert(put == 30000);
+    assert(bfstats(src, &st) == 0 && st.stream_read == 30000 && st.refills == 1);
+    ret = bfclose(src);
+    assert(ret == 0);
+    ret = bfclose(dst);
+    assert(ret == 0);
+    io = pread(dfd, back, 30000, 0);
+    assert(io == 30000 && memcmp(back, data, 30000) == 0);
+    put = bfcopy(NULL, src, 1);
+    assert(put == 0 && errno == EINVAL);
+
+    close(fds[0]);
+    close(sfd);
+    close(dfd);
+    remove("test.bin");
+    remove("test2.bin");
+    remove("test3.bin");
+    free(data);
+    free(back);
+
+    printf("test_bfcopy passed.\n");
+}
+
+void test_bfsetnonblock() {
+    int ret;
+    size_t got, put;
+    ssize_t io;
+    int sv[2];
+    ret = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    assert(ret == 0);
+    bufrw_t *ctx = bfopen_fd(sv[0], 16, 4096);
+    assert(ctx);
+    ret = bfsetnonblock(ctx, 1);
+    assert(ret == 0);
+    ret = fcntl(sv[0], F_GETFL);
+    assert(ret & O_NONBLOCK);
+    ret = bfsetasync(ctx, 2);
+    assert(ret == -1 && errno == EINVAL);
+
+    /* Nothing has arrived: reads come back empty and ask for POLLIN. */
+    char buf[64];
+    int events;
+    got = bfcread(ctx, buf, 1, sizeof(buf));
+    assert(got == 0 && errno == EAGAIN);
+    assert(bfpollfd(ctx, &events) == sv[0] && events == POLLIN);
+
+    /* Lines are only handed out once complete, even past the buffer. */
+    const char *line;
+    io = write(sv[1], "hello\nwor", 9);
+    assert(io == 9);
+    got = bfgetline(ctx, &line);
+    assert(got == 6 && memcmp(line, "hello\n", 6) == 0);
+    got = bfgetline(ctx, &line);
+    assert(got == 0 && errno == EAGAIN);
+    io = write(sv[1], "ld, this line is longer than the buffer", 39);
+    assert(io == 39);
+    got = bfgetline(ctx, &line);
+    assert(got == 0 && errno == EAGAIN);
+    io = write(sv[1], "\n", 1);
+    assert(io == 1);
+    got = bfgetline(ctx, &line);
+    assert(got == 43 && memcmp(line, "world, this", 11) == 0);
+
+    /* Writes queue whatever the socket cannot take yet. */
+    enum { SIZE = 1 << 20 };
+    char *data = malloc(SIZE), *back = malloc(SIZE);
+    assert(data && back);
+    for (int i = 0; i < SIZE; i++) {
+        data[i] = (char)(i % 253);
+    }
+    put = bfcwrite(ctx, data, 1, SIZE);
+    assert(put == SIZE);
+    assert(bfpollfd(ctx, &events) == sv[0] && (events & POLLOUT));
+    ret = bfcflush(ctx);
+    assert(ret == -1 && errno == EAGAIN);
+    got = 0;
+    while (bfcflush(ctx) != 0) {
+        assert(errno == EAGAIN);
+        ssize_t n = read(sv[1], back + got, SIZE - got);
+        assert(n > 0);
+        got += (size_t)n;
+    }
+    assert(bfpollfd(ctx, &events) == sv[0] && !(events & POLLOUT));
+    while (got < SIZE) {
+        ssize_t n = read(sv[1], back + got, SIZE - got);
+        assert(n > 0);
+        got += (size_t)n;
+    }
+    assert(memcmp(back, data, SIZE) == 0);
+
+    /* The end of the stream is not a wait. */
+    shutdown(sv[1], SHUT_WR);
+    got = bfcread(ctx, buf, 1, sizeof(buf));
+    assert(got == 0);
+    assert(bfpollfd(ctx, &events) == sv[0] && events == 0);
+
+    /* Closing restores the descriptor. */
+    ret = bfclose(ctx);
+    assert(ret == 0);
+    ret = fcntl(sv[0], F_GETFL);
+    assert(!(ret & O_NONBLOCK));
+    FILE *file = tmpfile();
+    assert(file);
+    ctx = bfopen(file, 0, 0);
+    ret = bfsetnonblock(ctx, 1);
+    assert(ret == -1 && errno == EINVAL);
+    ret = bfclose(ctx);
+    assert(ret == 0);
+    fclose(file);
+    close(sv[0]);
+    close(sv[1]);
+    free(data);
+    free(back);
+
+    printf("test_bfsetnonblock passed.\n");
+}
+
+typedef struct {
+    bufrw_t *ctx;
+    size_t bytes;
+    size_t lines;
+    int cut;  // whether a line lacked its newline
+} split_part_t;
+
+static void *split_worker(void *arg) {
+    split_part_t *p = (split_part_t *)arg;
+    const char *line;
+    size_t len;
+    while ((len = bfgetline(p->ctx, &line)) > 0) {
+        p->bytes += len;
+        p->lines++;
+        p->cut |= line[len - 1] != '\n';
+    }
+    return NULL;
+}
+
+void test_bfsplit() {
+    int ret;
+    size_t put;
+    ssize_t io;
+    int fd = open("test.bin", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    bufrw_t *w = bfopen_fd(fd, 4096, 4096);
+    assert(w);
+    long total = 0;
+    char line[64];
+    for (int i = 0; i < 5000; i++) {
+        int len = snprintf(line, sizeof(line), "%d %.*s\n", i, i % 37, "abcdefghijklmnopqrstuvwxyzabcdefghijk");
+        put = bfcwrite(w, line, 1, (size_t)len);
+        assert(put == (size_t)len);
+        total += len;
+    }
+    ret = bfclose(w);
+    assert(ret == 0);
+
+    /* Line-aligned ranges follow each other and start after a newline. */
+    enum { PARTS = 4 };
+    bufrw_t *parts[PARTS];
+    ret = bfsplit(fd, PARTS, '\n', 512, parts);
+    assert(ret == 0);
+    long start = 0, ends[PARTS];
+    for (int i = 0; i < PARTS; i++) {
+        char c;
+        assert(bfctell(parts[i]) == start);
+        if (start > 0) {
+            io = pread(fd, &c, 1, start - 1);
+            assert(io == 1 && c == '\n');
+        }
+        ret = bfcseek(parts[i], 0, SEEK_END);
+        assert(ret == 0);
+        long end = bfctell(parts[i]);
+        assert(end > start && end - start < total / 2);
+        ret = bfcseek(parts[i], start, SEEK_SET);
+        assert(ret == 0);
+        start = ends[i] = end;
+    }
+    assert(start == total);
+
+    /* Scanned on a thread each, they cover every line once. */
+    split_part_t work[PARTS] = {0};
+    pthread_t threads[PARTS];
+    for (int i = 0; i < PARTS; i++) {
+        work[i].ctx = parts[i];
+        ret = pthread_create(&threads[i], NULL, split_worker, &work[i]);
+        assert(ret == 0);
+    }
+    size_t lines = 0;
+    for (int i = 0; i < PARTS; i++) {
+        pthread_join(threads[i], NULL);
+        assert(!work[i].cut);
+        lines += work[i].lines;
+        assert(bfctell(parts[i]) == ends[i] && work[i].bytes == (size_t)(ends[i] - (i ? ends[i - 1] : 0)));
+        ret = bfclose(parts[i]);
+        assert(ret == 0);
+    }
+    assert(lines == 5000);
+
+    /* Without a delimiter ranges split at plain offsets. */
+    ret = bfsplit(fd, 3, -1, 0, parts);
+    assert(ret == 0);
+    char buf[4096];
+    for (int i = 0; i < 3; i++) {
+        long want = total * (i + 1) / 3 - total * i / 3;
+        long got = 0;
+        size_t n;
+        while ((n = bfcread(parts[i], buf, 1, sizeof(buf))) > 0) {
+            got += (long)n;
+        }
+        assert(got == want && bfctell(parts[i]) == total * (i + 1) / 3);
+        ret = bfclose(parts[i]);
+        assert(ret == 0);
+    }
+
+    /* Copying out of a part stops at the end of its range. */
+    ret = bfsplit(fd, 2, -1, 0, parts);
+    assert(ret == 0);
+    int out = open("test2.bin", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(out >= 0);
+    bufrw_t *dst = bfopen_fd(out, 0, 0);
+    assert(dst);
+    size_t copied = bfcopy(dst, parts[0], SIZE_MAX);
+    assert(copied == (size_t)(total / 2));
+    ret = bfclose(dst);
+    assert(ret == 0);
+    struct stat st;
+    ret = fstat(out, &st);
+    assert(ret == 0 && st.st_size == total / 2);
+    for (int i = 0; i < 2; i++) {
+        ret = bfclose(parts[i]);
+        assert(ret == 0);
+    }
+    close(out);
+    remove("test2.bin");
+
+    /* Direct I/O would read past the ranges. */
+    int dfd = open("test.bin", O_RDONLY | O_DIRECT);
+    if (dfd >= 0) {
+        ret = bfsplit(dfd, 2, -1, 0, parts);
+        assert(ret == -1 && errno == EINVAL);
+        close(dfd);
+    }
+
+    int fds[2];
+    ret = pipe(fds);
+    assert(ret == 0);
+    ret = bfsplit(fds[0], 2, -1, 0, parts);
+    assert(ret == -1 && errno == EINVAL);
+    ret = bfsplit(fd, 0, -1, 0, parts);
+    assert(ret == -1 && errno == EINVAL);
+    close(fds[0]);
+    close(fds[1]);
+    close(fd);
+    remove("test.bin");
+
+    printf("test_bfsplit passed.\n");
+}
+
+void test_bfsetwriteback() {
+    int ret;
+    size_t got, put;
+    ssize_t io;
+    off_t pos;
+    enum { SIZE = 65536 };
+    static char mirror[SIZE], disk[SIZE];
+    for (int i = 0; i < SIZE; i++) {
+        mirror[i] = (char)(i % 251);
+    }
+    int fd = open("test.bin", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    io = write(fd, mirror, SIZE);
+    assert(io == SIZE);
+    pos = lseek(fd, 0, SEEK_SET);
+    assert(pos == 0);
+
+    bufrw_t *ctx = bfopen_fd(fd, 4096, 4096);
+    assert(ctx);
+    ret = bfsetwriteback(ctx, SIZE);
+    assert(ret == 0);
+
+    /* Small writes in shuffled order stay pending... */
+    char rec[16];
+    for (int i = 0; i < 2048; i++) {
+        long at = (long)(i * 7919 % 2048) * 16;
+        memset(rec, 'a' + i % 26, sizeof(rec));
+        memcpy(mirror + at, rec, sizeof(rec));
+        ret = bfcseek(ctx, at, SEEK_SET);
+        assert(ret == 0);
+        put = bfcwrite(ctx, rec, 1, sizeof(rec));
+        assert(put == sizeof(rec));
+    }
+    bufrw_stats_t st;
+    assert(bfstats(ctx, &st) == 0 && st.flushes == 0);
+    io = pread(fd, disk, SIZE, 0);
+    assert(io == SIZE && memcmp(disk, mirror, 32768) != 0);
+
+    /* ...yet reads see them. */
+    char buf[SIZE];
+    ret = bfcseek(ctx, 1000, SEEK_SET);
+    assert(ret == 0);
+    got = bfcread(ctx, buf, 1, 5000);
+    assert(got == 5000 && memcmp(buf, mirror + 1000, 5000) == 0);
+    got = bfpread(ctx, buf, SIZE, 0);
+    assert(got == SIZE && memcmp(buf, mirror, SIZE) == 0);
+
+    /* Together they cover one range, written with one call. */
+    ret = bfcflush(ctx);
+    assert(ret == 0);
+    assert(bfstats(ctx, &st) == 0 && st.flushes == 1);
+    io = pread(fd, disk, SIZE, 0);
+    assert(io == SIZE && memcmp(disk, mirror, SIZE) == 0);
+
+    /* Ranges apart are written one run each, gaps within a page from the file. */
+    const long spots[] = { 40000, 40100, 50000, 40020 };
+    for (int i = 0; i < 4; i++) {
+        memset(mirror + spots[i], 'z', 8);
+        ret = bfcseek(ctx, spots[i], SEEK_SET);
+        assert(ret == 0);
+        put = bfcwrite(ctx, "zzzzzzzz", 1, 8);
+        assert(put == 8);
+    }
+    ret = bfcflush(ctx);
+    assert(ret == 0);
+    assert(bfstats(ctx, &st) == 0 && st.flushes == 3);
+    io = pread(fd, disk, SIZE, 0);
+    assert(io == SIZE && memcmp(disk, mirror, SIZE) == 0);
+
+    /* A write past the window evicts it; pending bytes past the end read as written. */
+    ret = bfcseek(ctx, 100, SEEK_SET);
+    assert(ret == 0);
+    put = bfcwrite(ctx, "x", 1, 1);
+    assert(put == 1);
+    ret = bfcseek(ctx, 200000, SEEK_SET);
+    assert(ret == 0);
+    put = bfcwrite(ctx, "12345678", 1, 8);
+    assert(put == 8);
+    assert(bfstats(ctx, &st) == 0 && st.flushes == 4);
+    io = pread(fd, buf, 1, 100);
+    assert(io == 1 && buf[0] == 'x');
+    ret = bfcseek(ctx, 0, SEEK_END);
+    assert(ret == 0 && bfctell(ctx) == 200008);
+    got = bfpread(ctx, buf, 16, 199996);
+    assert(got == 12 && memcmp(buf, "\0\0\0\0" "12345678", 12) == 0);
+
+    /* Closing writes the rest and leaves the descriptor at the position. */
+    ret = bfclose(ctx);
+    assert(ret == 0);
+    pos = lseek(fd, 0, SEEK_CUR);
+    assert(pos == 200008);
+    io = pread(fd, buf, 8, 200000);
+    assert(io == 8 && memcmp(buf, "12345678", 8) == 0);
+
+    int fds[2];
+    ret = pipe(fds);
+    assert(ret == 0);
+    ctx = bfopen_fd(fds[1], 0, 0);
+    assert(ctx);
+    ret = bfsetwriteback(ctx, SIZE);
+    assert(ret == -1 && errno == EINVAL);
+    ret = bfclose(ctx);
+    assert(ret == 0);
+    close(fds[0]);
+    close(fds[1]);
+    close(fd);
+    remove("test.bin");
+
+    printf("test_bfsetwriteback passed.\n");
+}
+
+void test_bfsetadaptive() {
+    int ret;
+    size_t put;
+    ssize_t io;
+    off_t pos;
+    int pfd[2];
+    ret = pipe(pfd);
+    assert(ret == 0);
+    assert(bfbestbufsz_fd(pfd[0], SIZE_MAX) == 4096);
+    close(pfd[0]);
+    close(pfd[1]);
+
+    int fd = open("test.bin", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    io = write(fd, "0123456789", 10);
+    assert(io == 10);
+    assert(bfbestbufsz_fd(fd, SIZE_MAX) == 4096);
+    ret = bfsetbufszlimits(8, 0);
+    assert(ret == 0);
+    assert(bfbestbufsz_fd(fd, SIZE_MAX) == 16);
+    ret = bfsetbufszlimits(0, 0);
+    assert(ret == 0);
+    ret = bfsetbufszlimits(2, 1);
+    assert(ret == -1 && errno == EINVAL);
+    ret = ftruncate(fd, 0);
+    assert(ret == 0);
+    pos = lseek(fd, 0, SEEK_SET);
+    assert(pos == 0);
+
+    /* Buffers resize between refills and flushes without losing bytes. */
+    bufrw_t *ctx = bfopen_fd(fd, 0, 0);
+    assert(ctx);
+    ret = bfsetadaptive(ctx, 1024, 1 << 18);
+    assert(ret == 0);
+    ret = bfsetadaptive(ctx, 4096, 1024);
+    assert(ret == -1 && errno == EINVAL);
+    for (unsigned i = 0; i < 200000; i++) {
+        put = bfcwrite(ctx, &i, sizeof(i), 1);
+        assert(put == 1);
+    }
+    ret = bfcflush(ctx);
+    assert(ret == 0);
+    assert(bfctell(ctx) == 200000 * (long)sizeof(unsigned));
+
+    ret = bfcseek(ctx, 0, SEEK_SET);
+    assert(ret == 0);
+    static unsigned chunk[333];
+    unsigned next = 0;
+    size_t got;
+    while ((got = bfcread(ctx, chunk, sizeof(unsigned), 1 + next % 333)) > 0) {
+        for (size_t i = 0; i < got; i++) {
+            assert(chunk[i] == next + i);
+        }
+        next += got;
+        if (next == 100000) {
+            assert(bfctell(ctx) == 100000 * (long)sizeof(unsigned));
+        }
+    }
+    assert(next == 200000);
+    ret = bfclose(ctx);
+    assert(ret == 0);
+
+    close(fd);
+    remove("test.bin");
+    printf("test_bfsetadaptive passed.\n");
+}
+
+void test_bfsetodirect() {
+    int ret;
+    size_t got, put;
+    ssize_t io;
+    off_t pos;
+    int fd = open("test.bin", O_RDWR | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    if (fd < 0) {
+        assert(errno == EINVAL);
+        printf("test_bfsetodirect skipped (no O_DIRECT).\n");
+        return;
+    }
+
+    /* Descriptors opened with O_DIRECT are picked up; the tail is exact. */
+    bufrw_t *ctx = bfopen_fd(fd, 0, 0);
+    assert(ctx);
+    ret = bfsetodirect(ctx, 1);
+    assert(ret == 0);
+    for (unsigned i = 0; i < 10000; i++) {
+        put = bfcwrite(ctx, &i, sizeof(i), 1);
+        assert(put == 1);
+    }
+    ret = bfcflush(ctx);
+    assert(ret == 0);
+    struct stat st;
+    assert(fstat(fd, &st) == 0 && st.st_size == 10000 * (off_t)sizeof(unsigned));
+    assert(bfctell(ctx) == 10000 * (long)sizeof(unsigned));
+
+    /* Misaligned seeks, reads and overwrites. */
+    unsigned v;
+    ret = bfcseek(ctx, 1001 * sizeof(v), SEEK_SET);
+    assert(ret == 0);
+    for (unsigned i = 1001; i < 3000; i++) {
+        got = bfcread(ctx, &v, sizeof(v), 1);
+        assert(got == 1 && v == i);
+    }
+    ret = bfcseek(ctx, 777 * sizeof(v), SEEK_SET);
+    assert(ret == 0);
+    unsigned patch[3] = { 0xa, 0xb, 0xc };
+    put = bfcwrite(ctx, patch, sizeof(v), 3);
+    assert(put == 3);
+    assert(bfctell(ctx) == 780 * (long)sizeof(v));
+    got = bfcread(ctx, &v, sizeof(v), 1);
+    assert(got == 1 && v == 780);
+    ret = bfcseek(ctx, -(long)sizeof(v), SEEK_END);
+    assert(ret == 0);
+    got = bfcread(ctx, &v, sizeof(v), 1);
+    assert(got == 1 && v == 9999);
+    put = bfcwrite(ctx, &v, sizeof(v), 1);
+    assert(put == 1);
+    ret = bfsetodirect(ctx, 0);
+    assert(ret == 0);
+    pos = lseek(fd, 0, SEEK_CUR);
+    assert(pos == 10001 * (long)sizeof(v));
+    ret = fcntl(fd, F_GETFL);
+    assert((ret & O_DIRECT) == 0);
+    ret = bfclose(ctx);
+    assert(ret == 0);
+
+    assert(fstat(fd, &st) == 0 && st.st_size == 10001 * (off_t)sizeof(unsigned));
+    static unsigned back[10001];
+    io = pread(fd, back, sizeof(back), 0);
+    assert(io == (ssize_t)sizeof(back));
+    assert(back[776] == 776 && back[777] == 0xa && back[779] == 0xc && back[780] == 780);
+    assert(back[9999] == 9999 && back[10000] == 9999);
+    close(fd);
+
+    int pfd[2];
+    ret = pipe(pfd);
+    assert(ret == 0);
+    ctx = bfopen_fd(pfd[0], 64, 64);
+    ret = bfsetodirect(ctx, 1);
+    assert(ret == -1);
+    ret = bfclose(ctx);
+    assert(ret == 0);
+    close(pfd[0]);
+    close(pfd[1]);
+
+    remove("test.bin");
+    printf("test_bfsetodirect passed.\n");
+}
+
+void test_bfshare_threads() {
+    int ret;
+    FILE *file = fopen("test.bin", "wb+");
+    assert(file);
+
+    bufrw_t *ctx = bfopen(file, 0, 100);
+    assert(ctx);
+    ret = bfshare(ctx);
+    assert(ret == 0);
+
+    pthread_t th[SHARE_THREADS];
+    void *args[SHARE_THREADS][2];
+    for (int t = 0; t < SHARE_THREADS; t++) {
+        args[t][0] = ctx;
+        args[t][1] = (void *)(size_t)t;
+        ret = pthread_create(&th[t], NULL, share_producer, args[t]);
+        assert(ret == 0);
+    }
+    for (int t = 0; t < SHARE_THREADS; t++) {
+        pthread_join(th[t], NULL);
+    }
+    assert(bfctell(ctx) == SHARE_THREADS * SHARE_RECORDS * 8);
+    ret = bfclose(ctx);
+    assert(ret == 0);
+
+    /* Every record arrives whole and in per-producer order. */
+    int next[SHARE_THREADS] = {0};
+    char rec[9] = {0};
+    fseek(file, 0, SEEK_SET);
+    while (fread(rec, 1, 8, file) == 8) {
+        int id, seq;
+        assert(sscanf(rec, "%d:%05d\n", &id, &seq) == 2 && rec[7] == '\n');
+        assert(id >= 0 && id < SHARE_THREADS && seq == next[id]);
+        next[id]++;
+    }
+    for (int t = 0; t < SHARE_THREADS; t++) {
+        assert(next[t] == SHARE_RECORDS);
+    }
+
+    fclose(file);
+    remove("test.bin");
+    printf("test_bfshare_threads passed.\n");
+}
+
+static void *legacy_reader(void *arg) {
+    size_t got;
+    FILE *file = (FILE *)arg;
+    char c, first;
+    got = bfread(&first, 1, 1, 4, file);
+    assert(got == 1);
+    for (int i = 1; i < 1000; i++) {
+        got = bfread(&c, 1, 1, 4, file);
+        assert(got == 1 && c == first);
+    }
+    return NULL;
+}
+
+void test_bfread_threads() {
+    int ret;
+    FILE *fa = fopen("test_a.bin", "wb+");
+    FILE *fb = fopen("test_b.bin", "wb+");
+    assert(fa && fb);
+    for (int i = 0; i < 1000; i++) {
+        fputc('a', fa);
+        fputc('b', fb);
+    }
+    rewind(fa);
+    rewind(fb);
+
+    /* Each thread has its own legacy buffer, so the streams never mix. */
+    pthread_t ta, tb;
+    ret = pthread_create(&ta, NULL, legacy_reader, fa);
+    assert(ret == 0);
+    ret = pthread_create(&tb, NULL, legacy_reader, fb);
+    assert(ret == 0);
+    pthread_join(ta, NULL);
+    pthread_join(tb, NULL);
+
+    fclose(fa);
+    fclose(fb);
+    remove("test_a.bin");
+    remove("test_b.bin");
+    printf("test_bfread_threads passed.\n");
+}
+
 #if 0
 void bfbestbufsz_print(size_t sz) {
     printf("bestbufsz of %zu: %zu\n", sz, bfbestbufsz(sz));
@@ -71,6 +2299,148 @@ void test_bfbestbufsz() {
     printf("test_bfbestbufsz passed.\n");
 }
 
+static size_t count_allocs, count_frees;
+
+static void *count_alloc(void *arg, size_t size) {
+    (void)arg;
+    count_allocs++;
+    return malloc(size);
+}
+
+static void count_free(void *arg, void *ptr, size_t size) {
+    (void)arg;
+    (void)size;
+    count_frees++;
+    free(ptr);
+}
+
+void test_bfsetallocator() {
+    int ret;
+    size_t got, put;
+    const bufrw_allocator_t counting = { .alloc = count_alloc, .free = count_free };
+    bfcleanup();
+    ret = bfsetallocator(&counting);
+    assert(ret == 0);
+
+    FILE *file = fopen("test.bin", "wb+");
+    assert(file);
+    static const size_t sizes[] = { 4096, 512, 2048, 1024, 4096 };
+    for (unsigned i = 0; i < 20000; i++) {
+        put = bfwrite(&i, sizeof(i), 1, sizes[i % 5], file);
+        assert(put == 1);
+    }
+    bfflush(file);
+    assert(count_allocs == 1);
+
+    /* Shrinking and growing back neither reallocates nor drops read-ahead. */
+    fseek(file, 0, SEEK_SET);
+    unsigned v;
+    for (unsigned i = 0; i < 20000; i++) {
+        got = bfread(&v, sizeof(v), 1, sizes[i % 5], file);
+        assert(got == 1 && v == i);
+    }
+    assert(count_allocs == 2);
+    got = bfread(&v, sizeof(v), 1, 8192, file);
+    assert(got == 0);
+    assert(count_allocs == 3 && count_frees == 1);
+    fclose(file);
+    bfcleanup();
+    assert(count_frees == 3);
+
+    /* Contexts take the allocator they were opened with. */
+    int fd = open("test.bin", O_RDWR);
+    assert(fd >= 0);
+    bufrw_t *ctx = bfopen_fd(fd, 256, 256);
+    assert(ctx);
+    ret = bfsetallocator(NULL);
+    assert(ret == 0);
+    got = bfcread(ctx, &v, sizeof(v), 1);
+    assert(got == 1 && v == 0);
+    ret = bfsetreadahead(ctx, 2);
+    assert(ret == 0);
+    for (unsigned i = 1; i < 20000; i++) {
+        got = bfcread(ctx, &v, sizeof(v), 1);
+        assert(got == 1 && v == i);
+    }
+    ret = bfclose(ctx);
+    assert(ret == 0);
+    assert(count_allocs == 6 && count_frees == 6);
+
+    bufrw_allocator_t broken = { .alloc = count_alloc };
+    ret = bfsetallocator(&broken);
+    assert(ret == -1 && errno == EINVAL);
+    close(fd);
+    remove("test.bin");
+    printf("test_bfsetallocator passed.\n");
+}
+
+void test_bfcsetallocator() {
+    int ret;
+    size_t got;
+    ssize_t io;
+    off_t pos;
+    int fd = open("test.bin", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    for (unsigned i = 0; i < (1U << 20); i++) {
+        io = write(fd, &i, sizeof(i));
+        assert(io == sizeof(i));
+    }
+    pos = lseek(fd, 0, SEEK_SET);
+    assert(pos == 0);
+
+    /* Buffers moved to an aligned allocator keep their unread bytes. */
+    bufrw_t *ctx = bfopen_fd(fd, 8192, 8192);
+    assert(ctx);
+    unsigned v;
+    got = bfcread(ctx, &v, sizeof(v), 1);
+    assert(got == 1 && v == 0);
+    const bufrw_allocator_t aligned = { .align = 4096 };
+    ret = bfcsetallocator(ctx, &aligned);
+    assert(ret == 0);
+    const void *p;
+    got = bfpeek(ctx, sizeof(v), &p);
+    assert(got == sizeof(v) && *(const unsigned *)p == 1);
+    for (unsigned i = 1; i < 4096; i++) {
+        got = bfcread(ctx, &v, sizeof(v), 1);
+        assert(got == 1 && v == i);
+    }
+    got = bfpeek(ctx, sizeof(v), &p);
+    assert(got == sizeof(v) && (uintptr_t)p % 4096 == 0);
+    const bufrw_allocator_t odd = { .align = 3 };
+    ret = bfcsetallocator(ctx, &odd);
+    assert(ret == -1 && errno == EINVAL);
+    ret = bfclose(ctx);
+    assert(ret == 0);
+
+    /* Huge-page and NUMA-local buffers, spares of an engine included. */
+    const bufrw_allocator_t huge = { .flags = BUFRW_ALLOC_HUGEPAGE | BUFRW_ALLOC_NUMA_LOCAL };
+    pos = lseek(fd, 0, SEEK_SET);
+    assert(pos == 0);
+    ctx = bfopen_fd(fd, 2U << 20, 4096);
+    assert(ctx);
+    ret = bfcsetallocator(ctx, &huge);
+    assert(ret == 0);
+    ret = bfsetreadahead(ctx, 2);
+    assert(ret == 0);
+    ret = bfcsetallocator(ctx, NULL);
+    assert(ret == -1);
+    for (unsigned i = 0; i < (1U << 20); i++) {
+        got = bfcread(ctx, &v, sizeof(v), 1);
+        assert(got == 1 && v == i);
+        if ((i + 1) % (1U << 19) == 0 && i + 1 < (1U << 20)) {
+            // The next block starts a buffer of its own.
+            got = bfpeek(ctx, sizeof(v), &p);
+            assert(got == sizeof(v) && (uintptr_t)p % (2U << 20) == 0);
+        }
+    }
+    ret = bfclose(ctx);
+    assert(ret == 0);
+
+    close(fd);
+    remove("test.bin");
+    printf("test_bfcsetallocator passed.\n");
+}
+
 void test_bfcleanup() {
     bfcleanup();
     printf("test_bfcleanup passed.\n");
@@ -79,6 +2449,36 @@ void test_bfcleanup() {
 void rununit(void) {
     test_bfwrite_bfread();
     test_bfseek_bftell();
+    test_bfcseek_window();
+    test_bfopen_interleaved();
+    test_bfsetdirect();
+    test_bfopen_fd();
+    test_bfwritev();
+    test_bfsetasync();
+    test_bfsetreadahead();
+    test_bfseturing();
+    test_bfopen_map();
+    test_bfopen_map_empty();
+    test_bfreaduntil();
+    test_bfread_ints();
+    test_bfcread_inline();
+    test_record_stream();
+    test_bfsetcache();
+    test_bfsetcodec();
+    test_bfsetdigest();
+    test_bfstats();
+    test_bfflushall();
+    test_bfsetdurability();
+    test_bfcopy();
+    test_bfsetnonblock();
+    test_bfsplit();
+    test_bfsetwriteback();
+    test_bfsetadaptive();
+    test_bfsetodirect();
+    test_bfshare_threads();
+    test_bfread_threads();
     test_bfbestbufsz();
+    test_bfsetallocator();
+    test_bfcsetallocator();
     test_bfcleanup();
 }
\ No newline at end of file
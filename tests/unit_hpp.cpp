@@ -0,0 +1,142 @@
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../include/bufrw.hpp"
+
+/* A coroutine nobody awaits, run until its first suspension. */
+struct detached {
+    struct promise_type {
+        detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+/* Counts the times coroutines had to park. */
+struct counting_reactor : bufrw::poll_reactor {
+    int waits = 0;
+    void wait(int fd, int events, bufrw::waiter *w) override {
+        waits++;
+        poll_reactor::wait(fd, events, w);
+    }
+};
+
+static detached echo(int fd, bufrw::stream &s) {
+    std::byte buf[1000];
+    for (;;) {
+        size_t n = co_await s.read(buf);
+        if (n == 0) {
+            break;
+        }
+        co_await s.write(std::span(buf, n));
+        co_await s.flush();
+    }
+    shutdown(fd, SHUT_WR);
+}
+
+static detached sender(int fd, bufrw::stream &s, const std::vector<std::byte> &data) {
+    co_await s.write(data);
+    co_await s.flush();
+    shutdown(fd, SHUT_WR);
+}
+
+static detached receiver(bufrw::stream &s, std::vector<std::byte> &back, size_t want) {
+    back.resize(want + 1);
+    size_t got = 0;
+    for (;;) {
+        size_t n = co_await s.read(std::span(back).subspan(got));
+        if (n == 0) {
+            break;
+        }
+        got += n;
+    }
+    back.resize(got);
+}
+
+void test_stream_echo() {
+    int sv[2];
+    int ret = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    assert(ret == 0);
+    counting_reactor r;
+    std::vector<std::byte> data(1 << 20), back;
+    for (size_t i = 0; i < data.size(); i++) {
+        data[i] = std::byte(i % 251);
+    }
+
+    {
+        bufrw::stream server(sv[0], r, 4096, 4096);
+        bufrw::stream peer(sv[1], r, 4096, 4096);
+        echo(sv[0], server);
+        sender(sv[1], peer, data);
+        receiver(peer, back, data.size());
+        r.run();
+    }
+    assert(back == data);
+    assert(r.waits > 0);
+    close(sv[0]);
+    close(sv[1]);
+
+    printf("test_stream_echo passed.\n");
+}
+
+static detached lines(bufrw::stream &s, std::vector<std::string> &out) {
+    std::string_view line;
+    while (co_await s.getline(line) > 0) {
+        out.emplace_back(line);
+    }
+}
+
+void test_stream_buffer_hits() {
+    int sv[2];
+    int ret = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    assert(ret == 0);
+    counting_reactor r;
+    std::vector<std::string> got;
+    {
+        bufrw::stream s(sv[0], r, 4096, 4096);
+
+        // Nothing has arrived: the coroutine parks once.
+        lines(s, got);
+        assert(r.waits == 1 && got.empty());
+
+        // All lines arrive at once and are served from the buffer.
+        const char text[] = "one\ntwo\nthree\n";
+        ssize_t put = write(sv[1], text, strlen(text));
+        assert(put == (ssize_t)strlen(text));
+        bool ran = r.run_once();
+        assert(ran);
+        assert(r.waits == 2 && got.size() == 3 && got[2] == "three\n");
+
+        shutdown(sv[1], SHUT_WR);
+        r.run();
+        assert(r.empty());
+    }
+    close(sv[0]);
+    close(sv[1]);
+
+    bool threw = false;
+    try {
+        bufrw::stream bad(-1, r);
+    } catch (const std::system_error &e) {
+        threw = e.code().value() == EBADF;
+    }
+    assert(threw);
+
+    printf("test_stream_buffer_hits passed.\n");
+}
+
+int main() {
+    test_stream_echo();
+    test_stream_buffer_hits();
+    printf("All tests passed!\n");
+    return 0;
+}